@@ -1,5 +1,6 @@
 /* vim: set ts=4 sw=4 tw=0 et ai :*/
 
+#include <string.h>
 #include <libapp/lowlevel/util.h>
 
 int main(int argc, char *argv[])
@@ -10,19 +11,31 @@ int main(int argc, char *argv[])
 #endif
 
     // Check arguments.
-    if (argc != 2)
+    uint32_t features = 0;
+    const char* filename = NULL;
+    bool valid = true;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--directory-lists") == 0)
+            features |= FEATURE_DIRECTORY_LISTS;
+        else if (filename == NULL)
+            filename = argv[i];
+        else
+            valid = false;
+    }
+    if (!valid || filename == NULL)
     {
         AppLib::Logging::showErrorW("Invalid arguments provided.");
-        AppLib::Logging::showErrorO("Usage: appcreate <filename>");
+        AppLib::Logging::showErrorO("Usage: appcreate [--directory-lists] <filename>");
         return 1;
     }
 
-    std::cout << "Attempting to create '" << argv[1] << "' ... " << std::endl;
+    std::cout << "Attempting to create '" << filename << "' ... " << std::endl;
 
     // Create the file.
-    if (!AppLib::LowLevel::Util::createPackage(argv[1], "Test Application", "1.0.0", "A test package.", "AppTools"))
+    if (!AppLib::LowLevel::Util::createPackage(filename, "Test Application", "1.0.0", "A test package.", "AppTools", features))
     {
-        std::cout << "Unable to create blank AppFS package '" << argv[1] << "'." << std::endl;
+        std::cout << "Unable to create blank AppFS package '" << filename << "'." << std::endl;
         return 1;
     }
 
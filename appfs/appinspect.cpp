@@ -87,7 +87,7 @@ int main(int argc, char *argv[])
 
     // Package is now open.  Show the initial filesystem information and
     // start the main application loop.
-    AppLib::LowLevel::INode node = Program::FS->getINodeByPosition(OFFSET_FSINFO);
+    AppLib::LowLevel::FSInfo node = Program::FS->getFSInfo();
     AppLib::Logging::showInfoW("INode ID: %i", node.inodeid);
     AppLib::Logging::showInfoO("INode Type: %i", node.type);
     AppLib::Logging::showInfoO("Filesystem Name: %s", node.fs_name);
@@ -142,7 +142,7 @@ void DoHelp(std::vector<std::string> cmd)
     printf("children <inode id> - List the children of the specified INode by ID.  Use 0 for the root INode.\n");
     printf("show <block num>    - Shows the binary representation of a block.\n");
     printf("segments            - Displays a representation of the types of each block in the package.\n");
-    printf("clean               - Removes any temporary or invalid blocks in the package.\n");
+    printf("clean               - Removes any temporary, invalid or unowned blocks in the package.\n");
 }
 
 /// <summary>
@@ -173,7 +173,7 @@ void DoSegments(std::vector<std::string> cmd)
 {
     if (!CheckArguments("segments", cmd, 0)) return;
 
-    std::pair<std::vector<uint32_t>, std::vector<uint32_t> > p = GetDataBlocks(Program::FS->getINodeByPosition(OFFSET_FSINFO).pos_root);
+    std::pair<std::vector<uint32_t>, std::vector<uint32_t> > p = GetDataBlocks(Program::FS->getFSInfo().pos_root);
     std::vector<uint32_t> datablocks = p.first;
     std::vector<uint32_t> headerblocks = p.second;
 
@@ -262,7 +262,15 @@ void DoClean(std::vector<std::string> cmd)
 {
     if (!CheckArguments("clean", cmd, 0)) return;
 
-    std::pair<std::vector<uint32_t>, std::vector<uint32_t> > p = GetDataBlocks(Program::FS->getINodeByPosition(OFFSET_FSINFO).pos_root);
+    // Free the blocks that nothing owns first (such as those that were
+    // reserved past the end of a file when the package wasn't unmounted
+    // cleanly), so the headers freed below aren't reported as conflicts.
+    uint32_t unowned = 0;
+    uint32_t conflicts = 0;
+    if (Program::FS->freeUnownedBlocks(unowned, conflicts) != AppLib::LowLevel::FSResult::E_SUCCESS)
+        printf("Unable to check the owners of blocks in the package.\n");
+
+    std::pair<std::vector<uint32_t>, std::vector<uint32_t> > p = GetDataBlocks(Program::FS->getFSInfo().pos_root);
     std::vector<uint32_t> datablocks = p.first;
     std::vector<uint32_t> headerblocks = p.second;
 
@@ -274,7 +282,7 @@ void DoClean(std::vector<std::string> cmd)
     int cleaned_files = 0;
     int cleaned_directories = 0;
     int i = 0;
-    while (true)
+    while (pos < Program::FSStream->size())
     {
         try
         {
@@ -351,13 +359,16 @@ void DoClean(std::vector<std::string> cmd)
         {
             // End-of-file.
             Program::FSStream->clear();
-            printf("Cleaned %i blocks (%i temporary, %i invalid, %i files, %i directories).\n",
-                cleaned, cleaned_temporary, cleaned_invalid, cleaned_files, cleaned_directories);
-            if (failed > 0)
-                printf("%i blocks could not be freed during cleaning.\n", failed);
-            return;
+            break;
         }
     }
+
+    printf("Cleaned %i blocks (%i temporary, %i invalid, %i files, %i directories, %u unowned).\n",
+        cleaned + unowned, cleaned_temporary, cleaned_invalid, cleaned_files, cleaned_directories, unowned);
+    if (failed > 0)
+        printf("%i blocks could not be freed during cleaning.\n", failed);
+    if (conflicts > 0)
+        printf("%u blocks have more than one owner or are owned but free, and were left alone.\n", conflicts);
 }
 
 /// <summary>
@@ -382,8 +393,7 @@ void DoShow(std::vector<std::string> cmd)
     for (int i = 0; i < BSIZE_FILE; i++)
     {
         char hd;
-        Program::FSStream->seekg(pos + i);
-        AppLib::LowLevel::Endian::doR(Program::FSStream, &hd, 1);
+        AppLib::LowLevel::Endian::doRAt(Program::FSStream, pos + i, &hd, 1);
         printf("%02X ", (unsigned char)hd);
         if (hd < 32 || hd == 127)
             charcache << "  ";
@@ -426,8 +436,7 @@ std::pair<std::vector<uint32_t>, std::vector<uint32_t> > GetDataBlocks(uint32_t
     std::vector<AppLib::LowLevel::INode> children = Program::FS->getChildrenOfDirectory(node.inodeid);
     std::pair<std::vector<uint32_t>, std::vector<uint32_t> > accessible;
     std::vector<uint32_t> headers;
-    std::vector<uint32_t> result1;
-    std::vector<uint32_t> result2;
+    std::vector<uint32_t> blocks;
     uint32_t spos;
     uint32_t bpos;
     headers.insert(headers.begin(), pos);
@@ -439,28 +448,14 @@ std::pair<std::vector<uint32_t>, std::vector<uint32_t> > GetDataBlocks(uint32_t
         case AppLib::LowLevel::INodeType::INT_DIRECTORY:
             spos = Program::FS->getINodePositionByID(children[i].inodeid);
             accessible = GetDataBlocks(spos);
-            std::merge(positions.begin(), positions.end(), accessible.first.begin(), accessible.first.end(), result1.begin());
-            std::merge(headers.begin(), headers.end(), accessible.second.begin(), accessible.second.end(), result2.begin());
-            positions = result1;
-            headers = result2;
+            positions.insert(positions.end(), accessible.first.begin(), accessible.first.end());
+            headers.insert(headers.end(), accessible.second.begin(), accessible.second.end());
             break;
         case AppLib::LowLevel::INodeType::INT_FILEINFO:
             bpos = Program::FS->getINodePositionByID(children[i].inodeid);
             headers.insert(headers.begin(), bpos);
-            int spos;
-            for (int a = HSIZE_FILE; a < BSIZE_FILE; a += 4)
-            {
-                Program::FSStream->seekg(bpos + a);
-                spos = 0;
-                AppLib::LowLevel::Endian::doR(Program::FSStream, reinterpret_cast<char *>(&spos), 4);
-
-                if (spos == 0)				
-                    break;
-                else
-                {
-                    positions.insert(positions.begin(), spos);
-                }
-            }
+            blocks = Program::FS->getFileBlockPositions(children[i].inodeid);
+            positions.insert(positions.begin(), blocks.rbegin(), blocks.rend());
             break;
         default:
             // Do nothing.
@@ -596,6 +591,7 @@ void SetTypeNames()
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_DIRECTORY] = "directory";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_SYMLINK] = "symbolic link";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_DEVICE] = "device";
+    Program::TypeNames[AppLib::LowLevel::INodeType::INT_DIRLIST] = "directory list";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_TEMPORARY] = "temporary data";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_FREELIST] = "freelist block";
     Program::TypeNames[AppLib::LowLevel::INodeType::INT_FSINFO] = "filesystem info";
@@ -609,6 +605,7 @@ void SetTypeNames()
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_DIRECTORY] = 'D';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_SYMLINK] = 'L';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_DEVICE] = 'D';
+    Program::TypeChars[AppLib::LowLevel::INodeType::INT_DIRLIST] = 'd';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_TEMPORARY] = 'T';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_FREELIST] = '%';
     Program::TypeChars[AppLib::LowLevel::INodeType::INT_FSINFO] = 'I';
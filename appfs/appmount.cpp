@@ -19,14 +19,20 @@ int appmount_start(int argc, char *argv[])
     struct arg_lit *is_readonly = arg_lit0("r", "read-only", "mount the file readonly");
     struct arg_lit *is_debug = arg_lit0("d", "debug", "show debugging information");
     struct arg_lit *is_allow_other = arg_lit0("o", "allow-other", "allow other users to access mounted application");
+    struct arg_str *atime_policy = arg_str0("a", "atime", "policy", "when to update access times: strict, relatime (default), noatime or lazytime");
+    struct arg_lit *is_multithreaded = arg_lit0("m", "multithreaded", "serve requests from multiple threads");
+    struct arg_lit *is_lowlevel = arg_lit0("l", "low-level", "serve requests by inode number using the FUSE low-level API");
+    struct arg_lit *is_uring = arg_lit0("u", "uring", "read directories and files in batches through io_uring");
+    struct arg_dbl *attr_timeout = arg_dbl0(NULL, "attr-timeout", "seconds", "how long the kernel may cache file attributes");
+    struct arg_dbl *entry_timeout = arg_dbl0(NULL, "entry-timeout", "seconds", "how long the kernel may cache directory entries");
     struct arg_file *disk_image = arg_file1(NULL, NULL, "diskimage", "the image to read the data from");
     struct arg_file *mount_point = arg_file1(NULL, NULL, "mountpoint", "the directory to mount the image to");
     struct arg_lit *show_help = arg_lit0("h", "help", "show the help message");
     struct arg_end *end = arg_end(20);
 #ifdef DEBUG
-    void *argtable[] = { is_debug, is_allow_other, disk_image, mount_point, show_help, end };
+    void *argtable[] = { is_readonly, is_debug, is_allow_other, atime_policy, is_multithreaded, is_lowlevel, is_uring, attr_timeout, entry_timeout, disk_image, mount_point, show_help, end };
 #else
-    void *argtable[] = { is_allow_other, disk_image, mount_point, show_help, end };
+    void *argtable[] = { is_readonly, is_allow_other, atime_policy, is_multithreaded, is_lowlevel, is_uring, attr_timeout, entry_timeout, disk_image, mount_point, show_help, end };
 #endif
 
     // Check to see if the argument definitions were allocated
@@ -68,6 +74,39 @@ int appmount_start(int argc, char *argv[])
     global_mount_path = mount_path;
     AppLib::Logging::debug = is_debug->count;
 
+    // Work out the access time policy.
+    AppLib::ATimePolicy::ATimePolicy atime = AppLib::ATimePolicy::ATP_RELATIME;
+    if (atime_policy->count == 1)
+    {
+        std::string policy = atime_policy->sval[0];
+        if (policy == "strict")
+            atime = AppLib::ATimePolicy::ATP_STRICT;
+        else if (policy == "relatime")
+            atime = AppLib::ATimePolicy::ATP_RELATIME;
+        else if (policy == "noatime")
+            atime = AppLib::ATimePolicy::ATP_NOATIME;
+        else if (policy == "lazytime")
+            atime = AppLib::ATimePolicy::ATP_LAZYTIME;
+        else
+        {
+            AppLib::Logging::showErrorW("Unknown access time policy '%s'.", policy.c_str());
+            return 1;
+        }
+    }
+
+    // Work out how long the kernel may cache attributes and entries for.
+    double attr = FUSE_ATTR_TIMEOUT;
+    double entry = FUSE_ENTRY_TIMEOUT;
+    if (attr_timeout->count == 1)
+        attr = attr_timeout->dval[0];
+    if (entry_timeout->count == 1)
+        entry = entry_timeout->dval[0];
+    if (attr < 0 || entry < 0)
+    {
+        AppLib::Logging::showErrorW("Timeouts must not be negative.");
+        return 1;
+    }
+
     // Open the file for our lock checks / sets.
     /*int lockedfd = open(disk_image->filename[0], O_RDWR);
      * bool locksuccess = true;
@@ -100,7 +139,7 @@ int appmount_start(int argc, char *argv[])
     AppLib::Logging::showInfoO("while mounted and that no other operations can be performed");
     AppLib::Logging::showInfoO("on it while this is the case.");
 
-    AppLib::FUSE::Mounter * mnt = new AppLib::FUSE::Mounter(disk_path, mount_path, true, is_allow_other->count, appmount_continue);
+    AppLib::FUSE::Mounter * mnt = new AppLib::FUSE::Mounter(disk_path, mount_path, true, is_allow_other->count, appmount_continue, is_readonly->count, atime, is_multithreaded->count, is_lowlevel->count, attr, entry, is_uring->count);
     int ret = mnt->getResult();
 
     if (ret != 0)
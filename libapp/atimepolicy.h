@@ -0,0 +1,31 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_ATIMEPOLICY
+#define CLASS_ATIMEPOLICY
+
+#include <libapp/config.h>
+
+namespace AppLib
+{
+    namespace ATimePolicy
+    {
+        enum ATimePolicy
+        {
+            // Update the access time on every read.
+            ATP_STRICT,
+
+            // Only update the access time if it is older than the
+            // modification or change time, or more than a day old.
+            ATP_RELATIME,
+
+            // Never update the access time on reads.
+            ATP_NOATIME,
+
+            // Update all times as in ATP_STRICT, but keep the changes in
+            // memory and write them to the package in batches.
+            ATP_LAZYTIME
+        };
+    }
+}
+
+#endif
@@ -40,17 +40,87 @@
 // integer limit).
 #define MSIZE_FILE (0xFFFFFFFF - OFFSET_DATA - (1024 * 1024 * 10))
 
-// Define the sizes of each of the header types.
+// Define the sizes of each of the header types.  These are checked
+// against the layouts in libapp/lowlevel/inodelayout.h.
 #define HSIZE_FILE       308
 #define HSIZE_SEGINFO    8
 #define HSIZE_FREELIST   8
 #define HSIZE_FSINFO     1614
 #define HSIZE_DIRECTORY  294
+#define HSIZE_HARDLINK   262
+#define HSIZE_DIRLIST    10
+
+// Define the sizes of the records that make up a file's segment
+// list.  Packages before format version 0.2 store the position of
+// every data block; later versions store extents (the position of
+// the first block and the number of blocks).
+#define RSIZE_SEGMENT    4
+#define RSIZE_EXTENT     8
+
+// Feature flags stored in the FSInfo block.  Packages with
+// FEATURE_DIRECTORY_LISTS keep the children of each directory in a
+// chain of list blocks, ordered by a hash of their names, instead
+// of the fixed table in the directory block (so directories are not
+// limited to DIRECTORY_CHILDREN_MAX children).  Each list entry is
+// the name hash followed by the child's inode ID.
+#define FEATURE_DIRECTORY_LISTS 0x1
+#define RSIZE_DIRENT     6
+
+// The default number of blocks held in memory by the block
+// cache that sits between the filesystem and the package
+// image (4096 blocks is 16MB).  A value of 0 disables caching.
+#define BCACHE_BLOCKS 4096
+
+// The number of reads that a package opened with BSM_READWRITE_URING
+// keeps in flight at once when it reads a batch through io_uring.
+#define URING_QUEUE_DEPTH 64
+
+// The default number of bytes of memory that the cache of resolved
+// paths may use (about 10,000 paths of average length).
+#define DCACHE_BYTES (1024 * 1024)
+
+// The default number of decoded inodes that the filesystem keeps
+// in memory (each uses about 400 bytes).
+#define ICACHE_INODES 4096
+
+// The largest number of blocks that are reserved past the end of a
+// file that is being written past its end (2048 blocks is 8MB).  The
+// reservation doubles with the file up to this size, so appending to a
+// file allocates contiguous runs a few times rather than a block at a
+// time.  Blocks that are still reserved when the file is closed are
+// freed.
+#define PREALLOC_BLOCKS_MAX 2048
+
+// The number of bytes of file data that AppLib::FS holds in memory
+// before writing it to the package.  Data is only given blocks when
+// it is written out, so that small files are allocated in one go.
+#define WBUF_BYTES (16 * 1024 * 1024)
+
+// The largest number of bytes that are read ahead of a file handle
+// that is reading sequentially.  The window starts at a few reads and
+// doubles each time it is used up, so random access is unaffected.
+#define READAHEAD_BYTES (2 * 1024 * 1024)
+
+// The number of seconds that time updates made under the lazytime
+// access time policy may be held in memory before they are written
+// to the package.
+#define LAZYTIME_INTERVAL 60
+
+// The number of locks that file data access is spread across when
+// the package is served from multiple threads.  Inodes whose IDs
+// are equal modulo this value share a lock.
+#define INODE_LOCK_STRIPES 64
+
+// The default number of seconds that the kernel may cache the
+// attributes of files and the entries of directories for when a
+// package is mounted with appmount.
+#define FUSE_ATTR_TIMEOUT  1.0
+#define FUSE_ENTRY_TIMEOUT 1.0
 
 /************ End Configuration **************/
 
 #define LIBRARY_VERSION_MAJOR 0
-#define LIBRARY_VERSION_MINOR 1
+#define LIBRARY_VERSION_MINOR 2
 #define LIBRARY_VERSION_REVISION 0
 
 #if defined(_MSC_VER)
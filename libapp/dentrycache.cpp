@@ -0,0 +1,152 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libapp/config.h>
+
+#include <libapp/dentrycache.h>
+#include <libapp/lowlevel/util.h>
+
+namespace AppLib
+{
+    DentryCache::DentryCache(size_t budget)
+    {
+        this->budget = budget;
+        this->used = 0;
+        this->hits = 0;
+        this->misses = 0;
+    }
+
+    std::string DentryCache::getKey(const std::string& path)
+    {
+        std::string key;
+        key.reserve(path.length() + 1);
+        size_t offset = 0, start, length;
+        while (LowLevel::Util::nextPathComponent(path, offset, start, length))
+        {
+            key += '/';
+            key.append(path, start, length);
+        }
+        return key;
+    }
+
+    bool DentryCache::lookup(const std::string& key, int32_t& id)
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        std::map<std::string, Entry>::iterator i = this->entries.find(key);
+        if (i == this->entries.end())
+        {
+            this->misses += 1;
+            return false;
+        }
+        this->hits += 1;
+        this->lru.splice(this->lru.begin(), this->lru, i->second.lru);
+        id = i->second.id;
+        return true;
+    }
+
+    void DentryCache::insert(const std::string& key, int32_t id)
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (this->budget == 0)
+            return;
+        std::map<std::string, Entry>::iterator i = this->entries.find(key);
+        if (i != this->entries.end())
+        {
+            i->second.id = id;
+            this->lru.splice(this->lru.begin(), this->lru, i->second.lru);
+            return;
+        }
+
+        Entry& entry = this->entries[key];
+        entry.id = id;
+        entry.lru = this->lru.insert(this->lru.begin(), key);
+        this->used += DentryCache::getCost(key);
+        this->evict();
+    }
+
+    void DentryCache::invalidate(const std::string& path)
+    {
+        std::string key = DentryCache::getKey(path);
+        std::lock_guard<std::mutex> guard(this->lock);
+        std::map<std::string, Entry>::iterator i = this->entries.find(key);
+        if (i != this->entries.end())
+            this->erase(i);
+
+        // Everything underneath sorts between "key/" and "key0" (as
+        // '0' follows '/').
+        i = this->entries.lower_bound(key + '/');
+        std::map<std::string, Entry>::iterator end = this->entries.lower_bound(key + '0');
+        while (i != end)
+            this->erase(i++);
+    }
+
+    void DentryCache::clear()
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->entries.clear();
+        this->lru.clear();
+        this->used = 0;
+    }
+
+    void DentryCache::setBudget(size_t budget)
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->budget = budget;
+        this->evict();
+    }
+
+    size_t DentryCache::getBudget()
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        return this->budget;
+    }
+
+    uint64_t DentryCache::getHits()
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        return this->hits;
+    }
+
+    uint64_t DentryCache::getMisses()
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        return this->misses;
+    }
+
+    void DentryCache::resetStatistics()
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->hits = 0;
+        this->misses = 0;
+    }
+
+    size_t DentryCache::getCost(const std::string& key)
+    {
+        // The key is held twice (in the map and the list), along with
+        // the nodes of both containers.
+        return sizeof(std::map<std::string, Entry>::value_type) + sizeof(std::string) +
+               2 * key.length() + 64;
+    }
+
+    void DentryCache::erase(std::map<std::string, Entry>::iterator i)
+    {
+        this->used -= DentryCache::getCost(i->first);
+        this->lru.erase(i->second.lru);
+        this->entries.erase(i);
+    }
+
+    void DentryCache::evict()
+    {
+        while (this->used > this->budget && !this->lru.empty())
+            this->erase(this->entries.find(this->lru.back()));
+    }
+
+    DentryGuard::DentryGuard(DentryCache & cache, std::string path)
+        : cache(cache), path(path)
+    {
+    }
+
+    DentryGuard::~DentryGuard()
+    {
+        this->cache.invalidate(this->path);
+    }
+}
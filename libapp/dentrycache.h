@@ -0,0 +1,113 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_DENTRYCACHE
+#define CLASS_DENTRYCACHE
+
+#include <libapp/config.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+
+namespace AppLib
+{
+    //! Caches the inode IDs that paths resolve to.
+    /*!
+     * Each entry maps a path (its components joined by '/', with
+     * a leading '/') to the inode ID stored in its directory, or
+     * to -1 if the path was looked up and did not exist.  Entries
+     * are evicted in least-recently-used order once they use more
+     * than the memory budget.
+     *
+     * The cache knows nothing about the package; whoever changes
+     * the package must invalidate the paths it changes.  All
+     * operations are serialized by an internal mutex, so the cache
+     * may be shared between threads.
+     */
+    class DentryCache
+    {
+    public:
+        DentryCache(size_t budget = DCACHE_BYTES);
+
+        //! Returns the key for a path.
+        static std::string getKey(const std::string& path);
+
+        //! Looks up a path, returning whether it was cached and
+        //! storing its inode ID (or -1 if it doesn't exist) in id.
+        bool lookup(const std::string& key, int32_t& id);
+
+        //! Caches the inode ID (or -1) that a path resolved to.
+        void insert(const std::string& key, int32_t id);
+
+        //! Discards the entry for a path and the entries for every
+        //! path underneath it.
+        void invalidate(const std::string& path);
+
+        //! Discards all entries.
+        void clear();
+
+        //! Changes the number of bytes the entries may use, evicting
+        //! entries if the cache shrinks.  A budget of 0 disables
+        //! caching.
+        void setBudget(size_t budget);
+        size_t getBudget();
+
+        //! Returns the number of lookups that were found in the cache.
+        uint64_t getHits();
+        //! Returns the number of lookups that were not.
+        uint64_t getMisses();
+        void resetStatistics();
+
+    private:
+        DentryCache(const DentryCache &);
+        DentryCache & operator=(const DentryCache &);
+
+        struct Entry
+        {
+            int32_t id;
+            std::list<std::string>::iterator lru;
+        };
+
+        std::mutex lock;
+        size_t budget;
+        size_t used;
+        uint64_t hits;
+        uint64_t misses;
+
+        // The entries keyed by path, so the paths under a directory
+        // are next to each other, and the paths ordered from most to
+        // least recently used.
+        std::map<std::string, Entry> entries;
+        std::list<std::string> lru;
+
+        // Returns the approximate number of bytes an entry uses.
+        static size_t getCost(const std::string& key);
+
+        // Removes an entry.  The caller must hold the lock.
+        void erase(std::map<std::string, Entry>::iterator i);
+
+        // Evicts entries until they fit in the budget.  The caller
+        // must hold the lock.
+        void evict();
+    };
+
+    //! Invalidates a path in a DentryCache when it goes out of scope,
+    //! so the path is dropped however the change to it finishes.
+    class DentryGuard
+    {
+    public:
+        DentryGuard(DentryCache & cache, std::string path);
+        ~DentryGuard();
+
+    private:
+        DentryGuard(const DentryGuard &);
+        DentryGuard & operator=(const DentryGuard &);
+
+        DentryCache & cache;
+        std::string path;
+    };
+}
+
+#endif
@@ -61,6 +61,11 @@ namespace AppLib
         {
             return "The specified file can not be increased to the required size.";
         }
+
+        const char* PackageReadOnly::what() const throw()
+        {
+            return "The package was opened read-only and can not be modified.";
+        }
     }
 }
 
@@ -63,6 +63,11 @@ namespace AppLib
         {
             virtual const char* what() const throw();
         };
+
+        class PackageReadOnly : public std::exception
+        {
+            virtual const char* what() const throw();
+        };
     }
 }
 
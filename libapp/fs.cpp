@@ -2,38 +2,98 @@
 
 #include <exception>
 #include <cstdlib>
+#include <algorithm>
+#include <stdint.h>
 #include <libapp/fs.h>
 #include <libapp/exception/package.h>
 #include <libapp/lowlevel/util.h>
+#include <libapp/lowlevel/blockcache.h>
 #include <linux/kdev_t.h>
 
 namespace AppLib
 {
-    FS::FS(std::string path, uid_t uid, gid_t gid)
-        : uid(uid), gid(gid)
+    namespace
     {
-        this->stream = new LowLevel::BlockStream(path.c_str());
+        //! The context user and group IDs set by setuid and setgid
+        //! are kept per thread, since each thread may be serving a
+        //! different user.
+        struct Context
+        {
+            const FS * owner;
+            uid_t uid;
+            gid_t gid;
+        };
+        thread_local Context context = { NULL, 0, 0 };
+    }
+
+    FS::FS(std::string path, uid_t uid, gid_t gid, LowLevel::BlockStreamMode::BlockStreamMode mode)
+        : uid(uid), gid(gid), atimePolicy(ATimePolicy::ATP_RELATIME), pendingSince(0)
+    {
+        this->stream = LowLevel::BlockStream::open(path.c_str(), mode);
         if (!this->stream->is_open())
         {
             delete this->stream;
             throw Exception::PackageNotFound();
         }
         this->filesystem = new LowLevel::FS(this->stream);
-        if (!this->filesystem->isValid())
+
+        // A package with features we don't support could be broken
+        // by any change we make to it, so it may only be read.
+        if (!this->filesystem->isValid() ||
+            (!this->stream->isReadOnly() && this->filesystem->hasUnsupportedFeatures()))
         {
             this->stream->close();
             delete this->stream;
             delete this->filesystem;
             throw Exception::PackageNotValid();
         }
+        if (!this->isReadOnly())
+            this->filesystem->setWriteBehindLimit(WBUF_BYTES);
+    }
+
+    FS::~FS()
+    {
+        this->flushPendingTimes();
+        if (!this->isReadOnly())
+        {
+            // Inodes that were unlinked while held can't be reached
+            // once the package is closed.
+            for (std::set<uint16_t>::iterator i = this->orphans.begin(); i != this->orphans.end(); i++)
+            {
+                try
+                {
+                    this->freeINode(*i);
+                }
+                catch (std::exception& e)
+                {
+                }
+            }
+            this->filesystem->flushBufferedData();
+            this->filesystem->releasePreallocations();
+        }
+        this->filesystem->close();
+        delete this->filesystem;
+        delete this->stream;
     }
 
     void FS::getattr(std::string path, struct stat& stbufOut) const
     {
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
+        this->statINode(buf, stbufOut);
+    }
+
+    void FS::getattr(uint16_t id, struct stat& stbufOut) const
+    {
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
+        LowLevel::INode buf = this->filesystem->getINodeByID(id);
+        this->statINode(buf, stbufOut);
+    }
 
+    void FS::statINode(LowLevel::INode& buf, struct stat& stbufOut) const
+    {
         // Ensure that the inode is also one of the
         // accepted types.
         if (buf.type != LowLevel::INodeType::INT_DIRECTORY &&
@@ -46,6 +106,7 @@ namespace AppLib
         // Resolve hardlink if needed.
         if (buf.type == LowLevel::INodeType::INT_HARDLINK)
             buf = buf.resolve(this->filesystem);
+        this->applyPendingTimes(buf);
 
         // Set the values into the stat structure.
         stbufOut.st_ino = buf.inodeid;
@@ -68,6 +129,14 @@ namespace AppLib
             stbufOut.st_blksize = BSIZE_FILE;
             stbufOut.st_blocks = buf.blocks;
 
+            // Data that is held in memory counts towards the size.
+            uint32_t len;
+            if (this->filesystem->getBufferedFileLength(buf.inodeid, len))
+            {
+                stbufOut.st_size = len;
+                stbufOut.st_blocks = (len + BSIZE_FILE - 1) / BSIZE_FILE;
+            }
+
             if (buf.type == LowLevel::INodeType::INT_FILEINFO)
                 stbufOut.st_mode = S_IFREG | stbufOut.st_mode;
             else if (buf.type == LowLevel::INodeType::INT_SYMLINK)
@@ -86,17 +155,31 @@ namespace AppLib
 
     std::string FS::readlink(std::string path) const
     {
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
+        return this->readSymlink(buf);
+    }
+
+    std::string FS::readlink(uint16_t id) const
+    {
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
+        LowLevel::INode buf = this->filesystem->getINodeByID(id);
+        if (buf.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        return this->readSymlink(buf);
+    }
 
+    std::string FS::readSymlink(LowLevel::INode& buf) const
+    {
         if (buf.type == LowLevel::INodeType::INT_SYMLINK)
         {
             // Read the link information out of the file.
-            FSFile* file = new FSFile(this->filesystem, this->stream, buf.inodeid);
-            file->open(std::ios_base::in);
+            FSFile file = this->filesystem->getFile(buf.inodeid);
+            file.open(std::ios_base::in);
             char* buffer = (char*)malloc(buf.dat_len + 1);
-            std::streamsize count = file->read(buffer, buf.dat_len);
+            std::streamsize count = file.read(buffer, buf.dat_len);
             if (count < buf.dat_len)
                 buffer[count] = '\0';
             else
@@ -134,10 +217,15 @@ namespace AppLib
 
     void FS::unlink(std::string path)
     {
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        DentryGuard dentry(this->dentries, path);
+        PathResolution target;
+        this->resolvePath(path, target);
         LowLevel::INode child, parent;
-        if (!this->retrievePathToINode(path, child))
+        if (!this->retrieveINode(target.leaf, child))
             throw Exception::FileNotFound();
-        if (!this->retrieveParentPathToINode(path, parent))
+        if (!this->retrieveINode(target.parent, parent))
             throw Exception::FileNotFound();
         
         // Ensure the inode is the correct type.
@@ -175,35 +263,36 @@ namespace AppLib
                 throw Exception::InternalInconsistency();
             if (this->filesystem->setINodePositionByID(real.inodeid, 0) != LowLevel::FSResult::E_SUCCESS)
                 throw Exception::InternalInconsistency();
+            this->clearPendingTimes(real.inodeid);
         }
 
-        // Now reduce the nlink value by 1.
+        // Now reduce the nlink value by 1, freeing the inode once
+        // nothing can reach it any more.
         child.nlink -= 1;
         child.ctime = this->getTime();
-        if (child.nlink == 0)
-        {
-            // Erase all of the file segments first.
-            this->filesystem->truncateFile(child.inodeid, 0);
-
-            // Now reset the block and release the inode ID.
-            if (this->filesystem->resetBlock(pos) != LowLevel::FSResult::E_SUCCESS)
-                throw Exception::InternalInconsistency();
-            if (this->filesystem->setINodePositionByID(child.inodeid, 0) != LowLevel::FSResult::E_SUCCESS)
-                throw Exception::InternalInconsistency();
-        }
+        if (child.nlink == 0 && !this->orphanIfHeld(child.inodeid))
+            this->freeINode(child.inodeid);
         else
         {
             // Otherwise just save the new nlink value.
             this->saveINode(child);
+            this->notifyINodeChanged(child.inodeid);
         }
+        this->notifyEntryChanged(parent.inodeid, target.getBasename());
+        this->notifyINodeChanged(parent.inodeid);
     }
 
     void FS::rmdir(std::string path)
     {
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        DentryGuard dentry(this->dentries, path);
+        PathResolution target;
+        this->resolvePath(path, target);
         LowLevel::INode child, parent;
-        if (!this->retrievePathToINode(path, child))
+        if (!this->retrieveINode(target.leaf, child))
             throw Exception::FileNotFound();
-        if (!this->retrieveParentPathToINode(path, parent))
+        if (!this->retrieveINode(target.parent, parent))
             throw Exception::FileNotFound();
         
         // Ensure the inode is the correct type.
@@ -228,26 +317,23 @@ namespace AppLib
         else if (res != LowLevel::FSResult::E_SUCCESS)
             throw Exception::InternalInconsistency();
 
-        // Now reset the block and release the inode ID.
-        if (this->filesystem->resetBlock(pos) != LowLevel::FSResult::E_SUCCESS)
-            throw Exception::InternalInconsistency();
-        if (this->filesystem->setINodePositionByID(child.inodeid, 0) != LowLevel::FSResult::E_SUCCESS)
-            throw Exception::InternalInconsistency();
+        // Now free the directory, unless it is still held.
+        if (!this->orphanIfHeld(child.inodeid))
+            this->freeINode(child.inodeid);
+        this->notifyEntryChanged(parent.inodeid, target.getBasename());
+        this->notifyINodeChanged(parent.inodeid);
     }
 
     void FS::symlink(std::string linkPath, std::string targetPath)
     {
+        // Hold the lock across creating and writing the link so that
+        // it is never seen without its target.
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
         auto configuration = [&](LowLevel::INode& buf)
         {
         };
-        this->performCreation(LowLevel::INodeType::INT_SYMLINK, linkPath, 0755, configuration);
+        LowLevel::INode buf = this->performCreation(LowLevel::INodeType::INT_SYMLINK, linkPath, 0755, configuration);
 
-        // We just created the file, so if this fails then
-        // it's an internal inconsistency.
-        LowLevel::INode buf;
-        if (!this->retrievePathToINode(linkPath, buf))
-            throw Exception::FileNotFound();
-       
         try
         {
             FSFile f = this->filesystem->getFile(buf.inodeid);
@@ -269,22 +355,29 @@ namespace AppLib
 
     void FS::rename(std::string srcPath, std::string destPath)
     {
-        this->ensurePathRenamability(destPath, this->uid);
-        this->ensurePathExists(srcPath);
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        DentryGuard srcDentry(this->dentries, srcPath);
+        DentryGuard destDentry(this->dentries, destPath);
+        PathResolution src, dest;
+        this->resolvePath(destPath, dest);
+        this->ensurePathRenamability(dest, this->getContextUID());
+        this->resolvePath(srcPath, src);
+        this->ensurePathExists(src);
 
         LowLevel::INode child, srcParent, destParent;
-        if (!this->retrievePathToINode(srcPath, child))
+        if (!this->retrieveINode(src.leaf, child))
             throw Exception::FileNotFound();
-        if (!this->retrieveParentPathToINode(srcPath, srcParent))
+        if (!this->retrieveINode(src.parent, srcParent))
             throw Exception::FileNotFound();
-        if (!this->retrieveParentPathToINode(destPath, destParent))
+        if (!this->retrieveINode(dest.parent, destParent))
             throw Exception::FileNotFound();
 
         // If the destination exists, then we are permitted
         // to rename (due to ensurePathRenamability), but we
         // must unlink or rmdir first.
         LowLevel::INode prev;
-        if (this->retrievePathToINode(destPath, prev))
+        if (this->retrieveINode(dest.leaf, prev))
         {
             if (prev.type == LowLevel::INodeType::INT_DIRECTORY)
                 this->rmdir(destPath);
@@ -317,20 +410,49 @@ namespace AppLib
         }
         
         // Change the filename.
-        child.setFilename(LowLevel::Util::extractBasenameFromPath(destPath).c_str());
+        child.setFilename(dest.getBasename().c_str());
         this->touchINode(child, "c");
         this->saveINode(child);
+        this->notifyEntryChanged(srcParent.inodeid, src.getBasename());
+        this->notifyEntryChanged(destParent.inodeid, dest.getBasename());
+        this->notifyINodeChanged(child.inodeid);
+        this->notifyINodeChanged(srcParent.inodeid);
+        if (destParent.inodeid != srcParent.inodeid)
+            this->notifyINodeChanged(destParent.inodeid);
     }
 
     void FS::link(std::string linkPath, std::string targetPath)
     {
-        this->ensurePathIsAvailable(linkPath);
-        this->ensurePathExists(targetPath);
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        PathResolution link, target;
+        this->resolvePath(linkPath, link);
+        this->ensurePathIsAvailable(link);
+        this->resolvePath(targetPath, target);
+        this->ensurePathExists(target);
 
         LowLevel::INode child;
-        if (!this->retrievePathToINode(targetPath, child))
+        if (!this->retrieveINode(target.leaf, child))
             throw Exception::FileNotFound();
-        
+        this->createHardlink(link, child);
+    }
+
+    void FS::link(std::string linkPath, uint16_t id)
+    {
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        PathResolution link;
+        this->resolvePath(linkPath, link);
+        this->ensurePathIsAvailable(link);
+
+        LowLevel::INode child;
+        if (!this->retrieveINode(id, child))
+            throw Exception::FileNotFound();
+        this->createHardlink(link, child);
+    }
+
+    void FS::createHardlink(const PathResolution& link, LowLevel::INode& child)
+    {
         // Ensure the target is a plain old file.
         if (child.type == LowLevel::INodeType::INT_DIRECTORY)
             throw Exception::IsADirectory();
@@ -338,53 +460,85 @@ namespace AppLib
                 child.type != LowLevel::INodeType::INT_DEVICE)
             throw Exception::NotSupported();
 
-        // Retrieve inode of link's parent.
-        LowLevel::INode parent;
-        if (!this->retrieveParentPathToINode(linkPath, parent))
-            throw Exception::FileNotFound();
-
         // Create the new hardlink.
         auto configuration = [&](LowLevel::INode& buf)
         {
             buf.realid = child.inodeid;
         };
-        this->performCreation(LowLevel::INodeType::INT_HARDLINK, linkPath, 0000, configuration);
+        this->performCreation(LowLevel::INodeType::INT_HARDLINK, link, 0000, configuration);
         
         // Increase the nlink and save.
         child.nlink += 1;
         this->touchINode(child, "c");
         this->saveINode(child);
+        this->notifyINodeChanged(child.inodeid);
     }
 
     void FS::chmod(std::string path, mode_t mode)
     {
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
         LowLevel::INode child;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
+        this->changeMode(child, mode);
+    }
+
+    void FS::chmod(uint16_t id, mode_t mode)
+    {
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        LowLevel::INode child;
+        if (!this->retrieveINode(id, child))
+            throw Exception::FileNotFound();
+        this->changeMode(child, mode);
+    }
+
+    void FS::changeMode(LowLevel::INode& child, mode_t mode)
+    {
         child.mask = this->extractMaskFromMode(mode);
         this->touchINode(child, "ca");
         this->saveINode(child);
+        this->notifyINodeChanged(child.inodeid);
     }
 
     void FS::chown(std::string path, uid_t uid, gid_t gid)
     {
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
         LowLevel::INode child;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
+        this->changeOwner(child, uid, gid);
+    }
+
+    void FS::chown(uint16_t id, uid_t uid, gid_t gid)
+    {
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        LowLevel::INode child;
+        if (!this->retrieveINode(id, child))
+            throw Exception::FileNotFound();
+        this->changeOwner(child, uid, gid);
+    }
+
+    void FS::changeOwner(LowLevel::INode& child, uid_t uid, gid_t gid)
+    {
         if (uid != -1)
             child.uid = uid;
         if (gid != -1)
             child.gid = gid;
         this->touchINode(child, "ca");
         this->saveINode(child);
+        this->notifyINodeChanged(child.inodeid);
     }
 
     void FS::truncate(std::string path, off_t size)
     {
+        this->ensureWritable();
         if (size > MSIZE_FILE)
             throw Exception::FileTooBig();
-        this->ensurePathExists(path);
-
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
@@ -398,12 +552,12 @@ namespace AppLib
         file.close();
         if (file.fail() || file.bad())
             throw Exception::InternalInconsistency();
+        this->notifyINodeChanged(buf.inodeid);
     }
 
     FSFile FS::open(std::string path)
     {
-        this->ensurePathExists(path);
-
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
@@ -414,10 +568,98 @@ namespace AppLib
         return file;
     }
 
-    std::vector<std::string> FS::readdir(std::string path)
+    FSFile FS::open(uint16_t id)
     {
-        this->ensurePathExists(path);
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
+        LowLevel::INode buf = this->filesystem->getINodeByID(id);
+        if (buf.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
 
+        FSFile file = this->filesystem->getFile(buf.inodeid);
+        file.open();
+        if (file.fail() || file.bad())
+            throw Exception::IsADirectory();
+        return file;
+    }
+
+    uint16_t FS::lookup(uint16_t parent, std::string name) const
+    {
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
+        return this->findChild(parent, name);
+    }
+
+    uint16_t FS::lookup(uint16_t parent, std::string name, bool hold)
+    {
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
+        uint16_t id = this->findChild(parent, name);
+        if (hold)
+        {
+            std::lock_guard<std::mutex> holding(this->holdsLock);
+            this->holds[id] += 1;
+        }
+        return id;
+    }
+
+    void FS::hold(uint16_t id)
+    {
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
+        if (this->filesystem->getINodePositionByID(id) == 0)
+            throw Exception::FileNotFound();
+        std::lock_guard<std::mutex> holding(this->holdsLock);
+        this->holds[id] += 1;
+    }
+
+    void FS::release(uint16_t id, uint64_t count)
+    {
+        {
+            std::lock_guard<std::mutex> holding(this->holdsLock);
+            std::map<uint16_t, uint64_t>::iterator i = this->holds.find(id);
+            if (i == this->holds.end())
+                return;
+            if (i->second > count)
+            {
+                i->second -= count;
+                return;
+            }
+            this->holds.erase(i);
+            if (this->orphans.find(id) == this->orphans.end())
+                return;
+        }
+
+        // That was the last reference to an inode that has already
+        // been unlinked, so free it now.  It may have been held again
+        // before we got the lock.
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        {
+            std::lock_guard<std::mutex> holding(this->holdsLock);
+            if (this->holds.find(id) != this->holds.end() || this->orphans.erase(id) == 0)
+                return;
+        }
+        this->freeINode(id);
+    }
+
+    uint16_t FS::findChild(uint16_t parent, const std::string& name) const
+    {
+        if (name.length() > 255)
+            throw Exception::FilenameTooLong();
+        LowLevel::INode buf = this->filesystem->getINodeByID(parent);
+        if (buf.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        if (buf.type != LowLevel::INodeType::INT_DIRECTORY)
+            throw Exception::NotADirectory();
+
+        // Hardlinks are reported as the inode they link to.
+        LowLevel::INode child = this->filesystem->getChildOfDirectory(parent, name);
+        if (child.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        if (child.type == LowLevel::INodeType::INT_HARDLINK)
+            return child.realid;
+        return child.inodeid;
+    }
+
+    std::vector<std::string> FS::readdir(std::string path)
+    {
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
@@ -428,11 +670,134 @@ namespace AppLib
         std::vector<std::string> result;
         std::vector<LowLevel::INode> children =
             this->filesystem->getChildrenOfDirectory(buf.inodeid);
-        for (int i = 0; i < children.size(); i++)
+        for (size_t i = 0; i < children.size(); i++)
             result.insert(result.end(), children[i].filename);
         return result;
     }
 
+    std::vector<std::pair<std::string, uint16_t> > FS::readdir(uint16_t id)
+    {
+        std::vector<uint64_t> offsets;
+        return this->readdir(id, 0, SIZE_MAX, offsets);
+    }
+
+    std::vector<std::pair<std::string, uint16_t> > FS::readdir(uint16_t id, uint64_t offset, size_t count, std::vector<uint64_t>& offsets)
+    {
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
+        LowLevel::INode buf = this->filesystem->getINodeByID(id, false);
+        if (buf.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        if (buf.type != LowLevel::INodeType::INT_DIRECTORY)
+            throw Exception::NotADirectory();
+
+        // Hardlinks are reported as the inode they link to.
+        std::vector<std::pair<std::string, uint16_t> > result;
+        std::vector<LowLevel::INode> children =
+            this->filesystem->getChildrenOfDirectory(buf.inodeid, offset, count, offsets);
+        for (size_t i = 0; i < children.size(); i++)
+        {
+            uint16_t child = children[i].inodeid;
+            if (children[i].type == LowLevel::INodeType::INT_HARDLINK)
+                child = children[i].realid;
+            result.insert(result.end(), std::pair<std::string, uint16_t>(children[i].filename, child));
+        }
+        return result;
+    }
+
+    std::streamsize FS::read(FSFile& file, char* out, std::streamsize count, off_t offset)
+    {
+        LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
+        LowLevel::ReadGuard data(this->filesystem->getINodeLock(file.getINodeID()));
+
+        // Work on a copy so that other threads using the same
+        // FSFile don't move our position.
+        FSFile local = file;
+        local.clear();
+        local.seekg(offset);
+        std::streamsize result = local.read(out, count);
+        if (local.bad())
+            throw Exception::InternalInconsistency();
+        return result;
+    }
+
+    void FS::write(FSFile& file, const char* data, std::streamsize count, off_t offset)
+    {
+        this->ensureWritable();
+        if (offset + count > MSIZE_FILE)
+            throw Exception::FileTooBig();
+
+        FSFile local = file;
+        local.clear();
+        while (true)
+        {
+            // Writes that can be held in memory, or that are within
+            // the file, only need the file's own lock, so writes to
+            // different files can proceed in parallel.
+            {
+                LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
+                LowLevel::WriteGuard data_guard(this->filesystem->getINodeLock(file.getINodeID()));
+                if (this->filesystem->bufferFileData(file.getINodeID(), offset, data, count))
+                    return;
+                uint32_t len;
+                if (!this->filesystem->getBufferedFileLength(file.getINodeID(), len) &&
+                        local.size() >= offset + count)
+                {
+                    local.seekp(offset);
+                    local.write(data, count);
+                    if (local.fail() || local.bad())
+                        throw Exception::InternalInconsistency();
+                    return;
+                }
+            }
+
+            // Otherwise the buffers are full (or the file has data in
+            // them that this write has to go after), so write them all
+            // out, or the file needs to grow first.  Both change segment
+            // lists.  Things may have changed again by the time we retake
+            // the read lock, so loop around.
+            LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+            if (this->filesystem->flushBufferedData() != LowLevel::FSResult::E_SUCCESS)
+                throw Exception::InternalInconsistency();
+            if (local.size() < offset + count && !local.extend(offset + count))
+                throw Exception::InternalInconsistency();
+        }
+    }
+
+    void FS::truncate(FSFile& file, off_t size)
+    {
+        this->ensureWritable();
+        if (size > MSIZE_FILE)
+            throw Exception::FileTooBig();
+
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        FSFile local = file;
+        local.clear();
+        if (!local.truncate(size))
+            throw Exception::InternalInconsistency();
+        this->notifyINodeChanged(file.getINodeID());
+    }
+
+    void FS::close(FSFile& file)
+    {
+        if (!this->isReadOnly())
+        {
+            LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+            if (this->filesystem->flushBufferedData(file.getINodeID()) != LowLevel::FSResult::E_SUCCESS)
+                throw Exception::InternalInconsistency();
+            this->filesystem->releasePreallocation(file.getINodeID());
+        }
+        file.close();
+    }
+
+    void FS::flush(FSFile& file)
+    {
+        if (this->isReadOnly())
+            return;
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        if (this->filesystem->flushBufferedData(file.getINodeID()) != LowLevel::FSResult::E_SUCCESS)
+            throw Exception::InternalInconsistency();
+    }
+
     void FS::create(std::string path, mode_t mode)
     {
         auto configuration = [&](LowLevel::INode& buf)
@@ -443,33 +808,227 @@ namespace AppLib
 
     void FS::utimens(std::string path, time_t access, time_t modification)
     {
-        this->ensurePathExists(path);
-
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
         LowLevel::INode buf;
         if (!this->retrievePathToINode(path, buf))
             throw Exception::FileNotFound();
+        this->changeTimes(buf, access, modification);
+    }
+
+    void FS::utimens(uint16_t id, time_t access, time_t modification)
+    {
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        LowLevel::INode buf;
+        if (!this->retrieveINode(id, buf))
+            throw Exception::FileNotFound();
+        this->changeTimes(buf, access, modification);
+    }
+
+    void FS::changeTimes(LowLevel::INode& buf, time_t access, time_t modification)
+    {
+        // Explicitly set times replace any pending ones.
+        {
+            std::lock_guard<std::mutex> pending(this->pendingLock);
+            std::map<uint16_t, PendingTimes>::iterator i = this->pendingTimes.find(buf.inodeid);
+            if (i != this->pendingTimes.end())
+            {
+                i->second.atime = 0;
+                i->second.mtime = 0;
+            }
+        }
         buf.atime = access;
         buf.mtime = modification;
         this->saveINode(buf);
+        this->notifyINodeChanged(buf.inodeid);
     }
 
     void FS::setuid(uid_t uid)
     {
-        this->uid = uid;
+        if (context.owner != this)
+            context.gid = this->gid;
+        context.owner = this;
+        context.uid = uid;
     }
 
     void FS::setgid(gid_t gid)
     {
-        this->gid = gid;
+        if (context.owner != this)
+            context.uid = this->uid;
+        context.owner = this;
+        context.gid = gid;
+    }
+
+    void FS::setATimePolicy(ATimePolicy::ATimePolicy policy)
+    {
+        if (policy != ATimePolicy::ATP_LAZYTIME)
+        {
+            LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+            this->flushPendingTimes();
+        }
+        this->atimePolicy = policy;
+    }
+
+    ATimePolicy::ATimePolicy FS::getATimePolicy() const
+    {
+        return this->atimePolicy;
+    }
+
+    void FS::setChangeCallbacks(std::function<void(uint16_t)> inode,
+            std::function<void(uint16_t, std::string)> entry)
+    {
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        this->inodeChanged = inode;
+        this->entryChanged = entry;
+    }
+
+    bool FS::isReadOnly() const
+    {
+        return this->stream->isReadOnly();
+    }
+
+    void FS::flush()
+    {
+        {
+            LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+            this->flushPendingTimes();
+            if (!this->isReadOnly())
+            {
+                if (this->filesystem->flushBufferedData() != LowLevel::FSResult::E_SUCCESS)
+                    throw Exception::InternalInconsistency();
+                this->filesystem->releasePreallocations();
+            }
+        }
+        if (!this->stream->flush())
+            throw Exception::InternalInconsistency();
+    }
+
+    void FS::setCacheSize(uint32_t blocks)
+    {
+        LowLevel::BlockCache * cache = dynamic_cast<LowLevel::BlockCache *>(this->stream);
+        if (cache != NULL && !cache->setCapacity(blocks))
+            throw Exception::InternalInconsistency();
+    }
+
+    void FS::getCacheStatistics(uint64_t& hits, uint64_t& misses) const
+    {
+        LowLevel::BlockCache * cache = dynamic_cast<LowLevel::BlockCache *>(this->stream);
+        hits = (cache != NULL) ? cache->getHits() : 0;
+        misses = (cache != NULL) ? cache->getMisses() : 0;
+    }
+
+    void FS::setDentryCacheSize(size_t bytes)
+    {
+        this->dentries.setBudget(bytes);
+    }
+
+    void FS::getDentryCacheStatistics(uint64_t& hits, uint64_t& misses) const
+    {
+        hits = this->dentries.getHits();
+        misses = this->dentries.getMisses();
+    }
+
+    void FS::setINodeCacheSize(uint32_t count)
+    {
+        this->filesystem->setINodeCacheSize(count);
+    }
+
+    void FS::setPreallocationLimit(uint32_t blocks)
+    {
+        this->filesystem->setPreallocationLimit(blocks);
+    }
+
+    void FS::setWriteBehindSize(size_t bytes)
+    {
+        if (this->isReadOnly())
+            return;
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        if (this->filesystem->flushBufferedData() != LowLevel::FSResult::E_SUCCESS)
+            throw Exception::InternalInconsistency();
+        this->filesystem->setWriteBehindLimit(bytes);
+    }
+
+    void FS::setReadaheadSize(uint32_t bytes)
+    {
+        this->filesystem->setReadaheadLimit(bytes);
     }
 
     void FS::touch(std::string path, std::string modes)
     {
+        if (this->isReadOnly())
+            return;
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
         LowLevel::INode child;
         if (!this->retrievePathToINode(path, child))
             throw Exception::FileNotFound();
         this->touchINode(child, modes);
         this->saveINode(child);
+        this->notifyINodeChanged(child.inodeid);
+    }
+
+    void FS::touch(FSFile& file, std::string modes)
+    {
+        if (this->isReadOnly())
+            return;
+
+        // Check whether the access time needs to be updated.
+        bool atime = (modes.find('a') != std::string::npos);
+        if (this->atimePolicy == ATimePolicy::ATP_NOATIME)
+            atime = false;
+        if (atime && this->atimePolicy == ATimePolicy::ATP_RELATIME &&
+                modes.find('m') == std::string::npos && modes.find('c') == std::string::npos)
+        {
+            LowLevel::ReadGuard guard(this->filesystem->getMetadataLock());
+            LowLevel::INode child = this->filesystem->getINodeByID(file.getINodeID());
+            if (child.type == LowLevel::INodeType::INT_INVALID)
+                throw Exception::FileNotFound();
+            atime = (child.atime <= child.mtime || child.atime <= child.ctime ||
+                     child.atime + 24 * 60 * 60 <= (uint64_t) this->getTime());
+        }
+        std::string update = "";
+        if (atime)
+            update += "a";
+        if (modes.find('m') != std::string::npos)
+            update += "m";
+        if (modes.find('c') != std::string::npos)
+            update += "c";
+        if (update.length() == 0)
+            return;
+
+        if (this->atimePolicy == ATimePolicy::ATP_LAZYTIME)
+        {
+            // Hold the new times in memory, writing them out once
+            // the oldest has been pending for long enough.
+            time_t now = this->getTime();
+            bool due;
+            {
+                std::lock_guard<std::mutex> guard(this->pendingLock);
+                if (this->pendingTimes.size() == 0)
+                    this->pendingSince = now;
+                PendingTimes& pending = this->pendingTimes[file.getINodeID()];
+                if (atime)
+                    pending.atime = now;
+                if (update.find('m') != std::string::npos)
+                    pending.mtime = now;
+                if (update.find('c') != std::string::npos)
+                    pending.ctime = now;
+                due = (now - this->pendingSince >= LAZYTIME_INTERVAL);
+            }
+            if (due)
+            {
+                LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+                this->flushPendingTimes();
+            }
+            return;
+        }
+
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        LowLevel::INode child = this->filesystem->getINodeByID(file.getINodeID());
+        if (child.type == LowLevel::INodeType::INT_INVALID)
+            throw Exception::FileNotFound();
+        this->touchINode(child, update);
+        this->saveINode(child);
     }
 
     /****
@@ -478,10 +1037,15 @@ namespace AppLib
      *
      ****/
 
-    void FS::ensurePathIsValid(std::string path) const
+    void FS::ensureWritable() const
+    {
+        if (this->stream->isReadOnly())
+            throw Exception::PackageReadOnly();
+    }
+
+    void FS::ensurePathIsValid(const std::string& path) const
     {
-        std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
-        LowLevel::FSResult::FSResult res = LowLevel::Util::verifyPath(path, components);
+        LowLevel::FSResult::FSResult res = LowLevel::Util::verifyPath(path);
         if (res == LowLevel::FSResult::E_FAILURE_INVALID_PATH)
             throw Exception::PathNotValid();
         else if (res == LowLevel::FSResult::E_FAILURE_INVALID_FILENAME)
@@ -490,45 +1054,30 @@ namespace AppLib
             throw Exception::InternalInconsistency();
     }
 
-    void FS::ensurePathExists(std::string path) const
+    void FS::ensurePathExists(const PathResolution& target) const
     {
-        this->ensurePathIsValid(path);
-        std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
-        LowLevel::INode buf = this->filesystem->getINodeByID(0);
-        for (unsigned int i = 0; i < components.size(); i++)
-        {
-            buf = this->filesystem->getChildOfDirectory(buf.inodeid, components[i]);
-            if (buf.type == LowLevel::INodeType::INT_INVALID)
-                throw Exception::FileNotFound();
-        }
+        if (target.leaf < 0)
+            throw Exception::FileNotFound();
     }
 
-    void FS::ensurePathIsAvailable(std::string path) const
+    void FS::ensurePathIsAvailable(const PathResolution& target) const
     {
-        this->ensurePathIsValid(path);
-        std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
-        LowLevel::INode buf = this->filesystem->getINodeByID(0);
-        for (unsigned int i = 0; i < components.size() - 1; i++)
-        {
-            buf = this->filesystem->getChildOfDirectory(buf.inodeid, components[i]);
-            if (buf.type == LowLevel::INodeType::INT_INVALID)
-                throw Exception::FileNotFound();
-        }
-        if (components.size() != 0)
-            buf = this->filesystem->getChildOfDirectory(buf.inodeid,
-                    components[components.size() - 1].c_str());
-        if (buf.type == LowLevel::INodeType::INT_INVALID)
+        if (target.components == 0)
+            throw Exception::FileExists();
+        if (target.parent < 0)
+            throw Exception::FileNotFound();
+        if (target.leaf < 0)
             return;
         throw Exception::FileExists();
     }
 
-    void FS::ensurePathRenamability(std::string path, uid_t uid) const
+    void FS::ensurePathRenamability(const PathResolution& target, uid_t uid) const
     {
         // If the path doesn't exist, we don't need to check the special
         // sticky conditions.
         try
         {
-            this->ensurePathIsAvailable(path);
+            this->ensurePathIsAvailable(target);
             return;
         }
         catch (Exception::FileExists& e)
@@ -540,9 +1089,9 @@ namespace AppLib
         // So the path does exist, and we need to check the modes on the
         // owning directory and the file.
         LowLevel::INode child, parent;
-        if (!this->retrievePathToINode(path, child))
+        if (!this->retrieveINode(target.leaf, child))
             throw Exception::FileNotFound();
-        if (!this->retrieveParentPathToINode(path, parent))
+        if (!this->retrieveINode(target.parent, parent))
             throw Exception::FileNotFound();
         if ((parent.mask & S_ISVTX) && !(child.uid == uid || parent.uid == uid))
             throw Exception::AccessDenied();
@@ -557,17 +1106,56 @@ namespace AppLib
         return true;
     }
 
-    bool FS::retrievePathToINode(std::string path, LowLevel::INode& out, int limit) const
+    uid_t FS::getContextUID() const
     {
-        this->ensurePathIsValid(path);
-        std::vector<std::string> components = LowLevel::Util::splitPathBySeperators(path);
-        out = this->filesystem->getINodeByID(0);
-        for (unsigned int i = 0; i < (limit <= 0 ? components.size() - (-limit) : limit); i++)
-        {
-            out = this->filesystem->getChildOfDirectory(out.inodeid, components[i]);
-            if (out.type == LowLevel::INodeType::INT_INVALID)
-                return false;
-        }
+        return (context.owner == this) ? context.uid : this->uid;
+    }
+
+    gid_t FS::getContextGID() const
+    {
+        return (context.owner == this) ? context.gid : this->gid;
+    }
+
+    bool FS::retrievePathToINode(const std::string& path, LowLevel::INode& out) const
+    {
+        PathResolution target;
+        this->resolvePath(path, target);
+        return this->retrieveINode(target.leaf, out);
+    }
+
+    bool FS::orphanIfHeld(uint16_t id)
+    {
+        std::lock_guard<std::mutex> holding(this->holdsLock);
+        if (this->holds.find(id) == this->holds.end())
+            return false;
+        this->orphans.insert(id);
+        return true;
+    }
+
+    void FS::freeINode(uint16_t id)
+    {
+        uint32_t pos = this->filesystem->getINodePositionByID(id);
+        if (pos == 0)
+            throw Exception::InternalInconsistency();
+
+        // Erase all of the file segments first.
+        LowLevel::INode node = this->filesystem->getINodeByID(id, false);
+        if (node.type != LowLevel::INodeType::INT_DIRECTORY)
+            this->filesystem->truncateFile(id, 0);
+
+        // Now reset the block and release the inode ID.
+        if (this->filesystem->resetBlock(pos) != LowLevel::FSResult::E_SUCCESS)
+            throw Exception::InternalInconsistency();
+        if (this->filesystem->setINodePositionByID(id, 0) != LowLevel::FSResult::E_SUCCESS)
+            throw Exception::InternalInconsistency();
+        this->clearPendingTimes(id);
+    }
+
+    bool FS::retrieveINode(int32_t id, LowLevel::INode& out) const
+    {
+        if (id < 0)
+            return false;
+        out = this->filesystem->getINodeByID(id, false);
         if (out.type == LowLevel::INodeType::INT_INVALID)
             return false;
         if (out.type == LowLevel::INodeType::INT_HARDLINK)
@@ -575,9 +1163,47 @@ namespace AppLib
         return true;
     }
 
-    bool FS::retrieveParentPathToINode(std::string path, LowLevel::INode& out) const
+    void FS::resolvePath(const std::string& path, PathResolution& out) const
+    {
+        if (path.length() >= 4096 || path.find('\0') != std::string::npos)
+            throw Exception::PathNotValid();
+
+        // Walk down from the root, taking each step from the cache
+        // if it can and otherwise searching the directory and
+        // caching what was (or wasn't) found.  The key for each step
+        // is the path so far, which is built up in the result.  The
+        // rest of the path is still checked once a step is missing.
+        out.path.clear();
+        out.path.reserve(path.length() + 1);
+        out.basename = 0;
+        out.components = 0;
+        out.parent = -1;
+        out.leaf = 0;
+        size_t offset = 0, start, length;
+        while (LowLevel::Util::nextPathComponent(path, offset, start, length))
+        {
+            if (length >= 256)
+                throw Exception::FilenameTooLong();
+            out.path += '/';
+            out.basename = out.path.length();
+            out.path.append(path, start, length);
+            out.components += 1;
+            out.parent = out.leaf;
+            if (out.parent < 0)
+                continue;
+            if (!this->dentries.lookup(out.path, out.leaf))
+            {
+                out.leaf = this->filesystem->getChildIDOfDirectory(out.parent, out.getBasename());
+                if (out.leaf < 0)
+                    out.leaf = -1;
+                this->dentries.insert(out.path, out.leaf);
+            }
+        }
+    }
+
+    std::string FS::PathResolution::getBasename() const
     {
-        return this->retrievePathToINode(path, out, -1);
+        return this->path.substr(this->basename);
     }
 
     void FS::saveINode(LowLevel::INode& buf)
@@ -585,6 +1211,21 @@ namespace AppLib
         if (buf.type == LowLevel::INodeType::INT_INVALID ||
                 buf.type == LowLevel::INodeType::INT_UNSET)
             throw Exception::INodeSaveInvalid();
+
+        // Any pending times are written out with the inode, unless the
+        // caller has just set a newer time (such as touchINode setting
+        // ctime when the mode changes).
+        {
+            std::lock_guard<std::mutex> guard(this->pendingLock);
+            std::map<uint16_t, PendingTimes>::iterator i = this->pendingTimes.find(buf.inodeid);
+            if (i != this->pendingTimes.end())
+            {
+                buf.atime = std::max<uint64_t>(buf.atime, i->second.atime);
+                buf.mtime = std::max<uint64_t>(buf.mtime, i->second.mtime);
+                buf.ctime = std::max<uint64_t>(buf.ctime, i->second.ctime);
+                this->pendingTimes.erase(i);
+            }
+        }
         if (this->filesystem->updateINode(buf) != LowLevel::FSResult::E_SUCCESS)
             throw Exception::INodeSaveFailed();
     }
@@ -659,22 +1300,90 @@ namespace AppLib
 
     void FS::touchINode(LowLevel::INode& node, std::string modes)
     {
-        if (modes.find('a') != -1)
+        if (modes.find('a') != std::string::npos)
             node.atime = this->getTime();
-        if (modes.find('m') != -1)
+        if (modes.find('m') != std::string::npos)
             node.mtime = this->getTime();
-        if (modes.find('c') != -1)
+        if (modes.find('c') != std::string::npos)
             node.ctime = this->getTime();
     }
 
+    void FS::applyPendingTimes(LowLevel::INode& node) const
+    {
+        std::lock_guard<std::mutex> guard(this->pendingLock);
+        std::map<uint16_t, PendingTimes>::const_iterator i = this->pendingTimes.find(node.inodeid);
+        if (i == this->pendingTimes.end())
+            return;
+        node.atime = std::max<uint64_t>(node.atime, i->second.atime);
+        node.mtime = std::max<uint64_t>(node.mtime, i->second.mtime);
+        node.ctime = std::max<uint64_t>(node.ctime, i->second.ctime);
+    }
+
+    void FS::notifyINodeChanged(uint16_t id)
+    {
+        if (this->inodeChanged)
+            this->inodeChanged(id);
+    }
+
+    void FS::notifyEntryChanged(uint16_t parent, std::string name)
+    {
+        if (this->entryChanged)
+            this->entryChanged(parent, name);
+    }
+
+    void FS::clearPendingTimes(uint16_t id)
+    {
+        std::lock_guard<std::mutex> guard(this->pendingLock);
+        this->pendingTimes.erase(id);
+    }
+
+    void FS::flushPendingTimes()
+    {
+        if (this->isReadOnly())
+            return;
+
+        // Take the pending times so saveINode doesn't modify the
+        // map while we iterate over it.
+        std::map<uint16_t, PendingTimes> pending;
+        {
+            std::lock_guard<std::mutex> guard(this->pendingLock);
+            pending.swap(this->pendingTimes);
+        }
+        for (std::map<uint16_t, PendingTimes>::iterator i = pending.begin(); i != pending.end(); i++)
+        {
+            LowLevel::INode node = this->filesystem->getINodeByID(i->first);
+            if (node.type == LowLevel::INodeType::INT_INVALID)
+                continue;
+            {
+                // Times touched again since the swap are newer, so
+                // don't replace them.
+                std::lock_guard<std::mutex> guard(this->pendingLock);
+                this->pendingTimes.insert(*i);
+            }
+            this->saveINode(node);
+        }
+    }
+
     LowLevel::INode FS::performCreation(LowLevel::INodeType::INodeType type,
             std::string path, mode_t mode,
             std::function<void(LowLevel::INode&)> configuration)
     {
-        this->ensurePathIsAvailable(path);
+        this->ensureWritable();
+        LowLevel::WriteGuard guard(this->filesystem->getMetadataLock());
+        PathResolution target;
+        this->resolvePath(path, target);
+        return this->performCreation(type, target, mode, configuration);
+    }
+
+    LowLevel::INode FS::performCreation(LowLevel::INodeType::INodeType type,
+            const PathResolution& target, mode_t mode,
+            std::function<void(LowLevel::INode&)> configuration)
+    {
+        DentryGuard dentry(this->dentries, target.path);
+        this->ensurePathIsAvailable(target);
 
         LowLevel::INode parent;
-        if (!this->retrieveParentPathToINode(path, parent))
+        if (!this->retrieveINode(target.parent, parent))
             throw Exception::FileNotFound();
 
         uint32_t pos;
@@ -685,10 +1394,10 @@ namespace AppLib
             child.ctime = this->getTime();
             child.mtime = this->getTime();
             child.atime = this->getTime();
-            child.uid = this->uid;
-            child.gid = this->gid;
+            child.uid = this->getContextUID();
+            child.gid = this->getContextGID();
             configuration(child);
-            child.setFilename(LowLevel::Util::extractBasenameFromPath(path).c_str());
+            child.setFilename(target.getBasename().c_str());
             this->saveNewINode(pos, child);
         }
         catch (...)
@@ -716,6 +1425,8 @@ namespace AppLib
             throw;
         }
 
+        this->notifyEntryChanged(parent.inodeid, target.getBasename());
+        this->notifyINodeChanged(parent.inodeid);
         return child;
     }
 }
@@ -8,6 +8,11 @@
 #include <string>
 #include <cstdio>
 #include <functional>
+#include <map>
+#include <set>
+#include <mutex>
+#include <libapp/atimepolicy.h>
+#include <libapp/dentrycache.h>
 #include <libapp/fsfile.h>
 #include <libapp/lowlevel/blockstream.h>
 #include <libapp/lowlevel/fs.h>
@@ -25,8 +30,62 @@ namespace AppLib
     private:
         AppLib::LowLevel::BlockStream * stream;
         AppLib::LowLevel::FS * filesystem;
+        //! The context user and group IDs for threads that have
+        //! not called setuid or setgid.
         uid_t uid;
         gid_t gid;
+        ATimePolicy::ATimePolicy atimePolicy;
+
+        //! Times that have been updated under the lazytime policy
+        //! but not yet written out.  A value of 0 means the time
+        //! has not changed.
+        struct PendingTimes
+        {
+            time_t atime;
+            time_t mtime;
+            time_t ctime;
+        };
+        std::map<uint16_t, PendingTimes> pendingTimes;
+        time_t pendingSince;
+        mutable std::mutex pendingLock;
+
+        //! The number of references held on each inode from outside
+        //! the package (such as by the kernel when it is mounted), and
+        //! the held inodes that have since been unlinked or removed.
+        //! Those keep their ID and data until the last reference is
+        //! released, so that the ID is not given to a new file while
+        //! it can still be used to reach the old one.
+        std::map<uint16_t, uint64_t> holds;
+        std::set<uint16_t> orphans;
+        std::mutex holdsLock;
+
+        std::function<void(uint16_t)> inodeChanged;
+        std::function<void(uint16_t, std::string)> entryChanged;
+
+        //! The inode IDs that paths have resolved to.  Operations
+        //! that add, remove or move entries invalidate the paths
+        //! they change with a DentryGuard.
+        mutable DentryCache dentries;
+
+        //! Where a path leads, as found by resolvePath.  The inode IDs
+        //! are those stored in the directories (so hardlinks are not
+        //! resolved), and are -1 if they don't exist.
+        struct PathResolution
+        {
+            //! The path with redundant separators removed, which is
+            //! also its key in the dentry cache.
+            std::string path;
+            //! The offset of the last component in path.
+            size_t basename;
+            //! The number of components in the path.
+            size_t components;
+            //! The directory the last component is in.
+            int32_t parent;
+            //! The last component itself (the root for "/").
+            int32_t leaf;
+
+            std::string getBasename() const;
+        };
 
     public:
         //! Opens an existing package.
@@ -35,14 +94,43 @@ namespace AppLib
          * optional uid and gid parameters effectively perform
          * setuid and setgid for you.
          *
+         * @note A package may be used from multiple threads at
+         *       once.  Operations that change the structure of the
+         *       package are serialized, while lookups and reads or
+         *       writes of existing file data run in parallel.
+         *
+         * @note Opening with BSM_MAPPED_READONLY maps the whole
+         *       package into memory for fast lookups and reads, but
+         *       any operation that would modify the package throws
+         *       Exception::PackageReadOnly.
+         *
+         * @note A package that uses features this version does not
+         *       support can only be opened with BSM_MAPPED_READONLY;
+         *       opening it for writing throws
+         *       Exception::PackageNotValid.
+         *
+         * @note Opening with BSM_READWRITE_URING reads the inodes
+         *       of a directory and the scattered parts of a file in
+         *       batches through io_uring, which keeps fast storage
+         *       busy.  It falls back to pread where io_uring is not
+         *       available.
+         *
          * @param path The path to open the package at.
          * @param uid The context user ID to set for package operations.
          * @param gid The context group ID to set for package operations.
+         * @param mode The access mode to open the package image with.
          *
          * @throw Exception::PackageNotFound
          * @throw Exception::PackageNotValid
          */
-        FS(std::string packagePath, uid_t uid = 0, gid_t gid = 0);
+        FS(std::string packagePath, uid_t uid = 0, gid_t gid = 0,
+                LowLevel::BlockStreamMode::BlockStreamMode mode = LowLevel::BlockStreamMode::BSM_READWRITE);
+        //! Closes the package.
+        /*!
+         * Writes any cached changes to disk and closes the
+         * package image.
+         */
+        ~FS();
         //! Retrieves attributes on a file or directory.
         /*!
          * Retrieves attributes on a file, directory, device or
@@ -57,6 +145,73 @@ namespace AppLib
          * @throw Exception::InternalInconsistency
          */
         void getattr(std::string path, struct stat& stbufOut) const;
+        //! Retrieves attributes on a file or directory by inode ID.
+        /*!
+         * As getattr(path, stbufOut), but for an inode ID that
+         * was returned from lookup or readdir.
+         *
+         * @param id The inode ID to get attributes of.
+         * @param stbufOut The structure to store the result in.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::InternalInconsistency
+         */
+        void getattr(uint16_t id, struct stat& stbufOut) const;
+        //! Looks up an entry in a directory by name.
+        /*!
+         * Finds the entry with the specified name in the directory
+         * with the specified inode ID, without resolving a full
+         * path.  Hardlinks are resolved to the inode they link to.
+         *
+         * @param parent The inode ID of the directory.
+         * @param name The name of the entry.
+         *
+         * @return The inode ID of the entry.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         * @throw Exception::FilenameTooLong
+         */
+        uint16_t lookup(uint16_t parent, std::string name) const;
+        //! Looks up an entry in a directory and holds its inode.
+        /*!
+         * As lookup(parent, name), but if hold is true the inode is
+         * also held (see hold) before anything else can unlink it.
+         *
+         * @param parent The inode ID of the directory.
+         * @param name The name of the entry.
+         * @param hold Whether to hold the inode that is found.
+         *
+         * @return The inode ID of the entry.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         * @throw Exception::FilenameTooLong
+         */
+        uint16_t lookup(uint16_t parent, std::string name, bool hold);
+        //! Holds a reference to an inode.
+        /*!
+         * While an inode is held, unlinking or removing its last
+         * name only removes the entry; the inode keeps its ID and
+         * data (and can still be used by ID) until it is released
+         * as many times as it was held.
+         *
+         * @param id The inode ID to hold.
+         *
+         * @throw Exception::FileNotFound
+         */
+        void hold(uint16_t id);
+        //! Releases references to an inode.
+        /*!
+         * Releases count references taken with hold or lookup, and
+         * frees the inode if it was unlinked while it was held.
+         *
+         * @param id The inode ID to release.
+         * @param count The number of references to release.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void release(uint16_t id, uint64_t count = 1);
         //! Returns the target of a symbolic link.
         /*!
          * Returns the target of a symbolic link. The equivalent
@@ -71,6 +226,15 @@ namespace AppLib
          * @throw Exception::InternalInconsistency
          */
         std::string readlink(std::string path) const;
+        //! Returns the target of a symbolic link by inode ID.
+        /*!
+         * @param id The inode ID of the symlink to read.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotSupported
+         * @throw Exception::InternalInconsistency
+         */
+        std::string readlink(uint16_t id) const;
         //! Creates a device node in the package.
         /*!
          * Creates a new device node in the package.  The equivalent
@@ -107,7 +271,7 @@ namespace AppLib
          *       not actually free the disk space if there are other
          *       hard links to the file data.  Only when nlink reaches
          *       0 due to an unlink will the associated file data be
-         *       freed.
+         *       freed (or when it is released, if it is held).
          *
          * @param path The path to unlink.
          *
@@ -181,6 +345,17 @@ namespace AppLib
          * @throw Exception::NotSupported
          */
         void link(std::string linkPath, std::string targetPath);
+        //! Creates a hard link to the file with the specified inode ID.
+        /*!
+         * @param linkPath The link to be created.
+         * @param id The inode ID of the target of the link.
+         *
+         * @throw Exception::FileExists
+         * @throw Exception::FileNotFound
+         * @throw Exception::IsADirectory
+         * @throw Exception::NotSupported
+         */
+        void link(std::string linkPath, uint16_t id);
         //! Changes the permissions on a file in the package.
         /*!
          * Changes the permission mask on a file, directory,
@@ -193,6 +368,14 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void chmod(std::string path, mode_t mask);
+        //! Changes the permissions on a file by inode ID.
+        /*!
+         * @param id The inode ID of the file to change.
+         * @param mask The permissions mask to set.
+         *
+         * @throw Exception::FileNotFound
+         */
+        void chmod(uint16_t id, mode_t mask);
         //! Changes the ownership of a file in the package.
         /*!
          * Changes the ownership of a file, directory, device
@@ -206,6 +389,15 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void chown(std::string path, uid_t uid = -1, gid_t gid = -1);
+        //! Changes the ownership of a file by inode ID.
+        /*!
+         * @param id The inode ID of the file to change.
+         * @param uid The user ID to set, or -1 to leave as-is.
+         * @param gid The group ID to set, or -1 to leave as-is.
+         *
+         * @throw Exception::FileNotFound
+         */
+        void chown(uint16_t id, uid_t uid = -1, gid_t gid = -1);
         //! Truncates a file in the package to a specified size.
         /*!
          * Truncates a file in the package to a specified size.
@@ -238,6 +430,14 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         FSFile open(std::string path);
+        //! Opens the file with the specified inode ID.
+        /*!
+         * @param id The inode ID of the file to open.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::IsADirectory
+         */
+        FSFile open(uint16_t id);
         //! Lists the entries in a directory.
         /*!
          * Lists all of the entries in a directory excluding
@@ -249,6 +449,109 @@ namespace AppLib
          * @throw Exception::NotADirectory
          */
         std::vector<std::string> readdir(std::string path);
+        //! Lists the entries in a directory by inode ID.
+        /*!
+         * Lists the name and inode ID of all of the entries in a
+         * directory excluding '.' and '..' entries.  Hardlinks are
+         * resolved to the inode they link to.
+         *
+         * @param id The inode ID of the directory.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         */
+        std::vector<std::pair<std::string, uint16_t> > readdir(uint16_t id);
+        //! Lists some of the entries in a directory by inode ID.
+        /*!
+         * Lists up to count entries, in the same way as readdir(id),
+         * starting after the entry at the specified offset.  The
+         * offset of each entry is stored in offsets and stays the same
+         * while the entry exists, so the listing can be continued from
+         * it even if the directory changes in the meantime.
+         *
+         * @param id The inode ID of the directory.
+         * @param offset The offset of the last entry already listed,
+         *        or 0 to start at the first entry.
+         * @param count The maximum number of entries to list.
+         * @param offsets Set to the offset of each entry listed.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         */
+        std::vector<std::pair<std::string, uint16_t> > readdir(uint16_t id, uint64_t offset, size_t count, std::vector<uint64_t>& offsets);
+        //! Reads data from an open file.
+        /*!
+         * Reads up to count bytes from the specified offset of an
+         * open file.  The FSFile's own position and state are not
+         * used or changed, so a single FSFile may be read and
+         * written by multiple threads at once.
+         *
+         * @param file The open file to read from.
+         * @param out The buffer to store the data in.
+         * @param count The maximum number of bytes to read.
+         * @param offset The offset in the file to read from.
+         *
+         * @return The number of bytes read, which is less than count
+         *         only if the end of the file was reached.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        std::streamsize read(FSFile& file, char* out, std::streamsize count, off_t offset);
+        //! Writes data to an open file.
+        /*!
+         * Writes count bytes at the specified offset of an open
+         * file, extending the file if required.  As with read, the
+         * FSFile's own position and state are not used or changed.
+         *
+         * @param file The open file to write to.
+         * @param data The data to write.
+         * @param count The number of bytes to write.
+         * @param offset The offset in the file to write at.
+         *
+         * @throw Exception::PackageReadOnly
+         * @throw Exception::FileTooBig
+         * @throw Exception::InternalInconsistency
+         */
+        void write(FSFile& file, const char* data, std::streamsize count, off_t offset);
+        //! Truncates an open file to a specified size.
+        /*!
+         * Truncates an open file without resolving its path
+         * again.  Unlike truncate(path, size), this does not
+         * touch the file.
+         *
+         * @param file The open file to truncate.
+         * @param size The new size of the file.
+         *
+         * @throw Exception::PackageReadOnly
+         * @throw Exception::FileTooBig
+         * @throw Exception::InternalInconsistency
+         */
+        void truncate(FSFile& file, off_t size);
+        //! Closes an open file.
+        /*!
+         * Writes out any data held in memory for the file and frees
+         * any blocks that were reserved past its end while it was
+         * written to, then closes the FSFile.  Files that were
+         * written through write() should be closed with this rather
+         * than FSFile::close().
+         *
+         * @param file The open file to close.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void close(FSFile& file);
+        //! Writes out the data held in memory for an open file.
+        /*!
+         * Gives blocks to any data that write() has held in memory
+         * for the file and writes it to the package, without closing
+         * the file.  Since held data is only written out later, this
+         * is where errors in writing it are reported.
+         *
+         * @param file The open file to write out.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void flush(FSFile& file);
         //! Creates an empty file in the package.
         /*!
          * Creates a new normal, empty file.  The equivalent
@@ -275,22 +578,131 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void utimens(std::string path, time_t access, time_t modification);
+        //! Sets the access and modification times by inode ID.
+        /*!
+         * @param id The inode ID to set times on.
+         * @param access The access time to set (in seconds).
+         * @param modification The modification time to set (in seconds).
+         *
+         * @throw Exception::FileNotFound
+         */
+        void utimens(uint16_t id, time_t access, time_t modification);
 
         /*!
-         * Sets the current context UID for package operations.
+         * Sets the current context UID for package operations
+         * made by the calling thread.
          */
         void setuid(uid_t uid);
         /*!
-         * Sets the current context GID for package operations.
+         * Sets the current context GID for package operations
+         * made by the calling thread.
          */
         void setgid(gid_t gid);
 
+        /*!
+         * Sets when access times are updated by reads through
+         * touch(FSFile&, ...).  Defaults to ATP_RELATIME.
+         */
+        void setATimePolicy(ATimePolicy::ATimePolicy policy);
+        /*!
+         * Returns the current access time policy.
+         */
+        ATimePolicy::ATimePolicy getATimePolicy() const;
+
+        /*!
+         * Sets the functions to call when the package is changed,
+         * so that anything caching its contents (such as the kernel
+         * when the package is mounted) can discard them.
+         *
+         * @note The functions are called with the package locked,
+         *       so they must not call back into this FS.
+         *
+         * @param inode Called with the inode ID of an inode whose
+         *        attributes have changed.
+         * @param entry Called with the inode ID of a directory and
+         *        the name of an entry in it that has been added,
+         *        removed or renamed.
+         */
+        void setChangeCallbacks(std::function<void(uint16_t)> inode,
+                std::function<void(uint16_t, std::string)> entry);
+
+        /*!
+         * Returns whether the package was opened read-only.
+         */
+        bool isReadOnly() const;
+
+        /*!
+         * Writes any pending time updates, any file data held in
+         * memory and any blocks held in the block cache out to the
+         * package image, freeing any blocks reserved past the end
+         * of files first, then waits for the image to reach the
+         * disk.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void flush();
+        /*!
+         * Sets the number of blocks the block cache may hold
+         * in memory.  A value of 0 disables the cache.  Has no
+         * effect if the package was not opened with a cache.
+         *
+         * @throw Exception::InternalInconsistency if blocks that
+         *        had to be evicted couldn't be written back.  They
+         *        stay cached until they can be.
+         */
+        void setCacheSize(uint32_t blocks);
+        /*!
+         * Retrieves the number of block lookups that were served
+         * from the block cache and the number that had to read from
+         * the package image.  Both are 0 if the package was not
+         * opened with a cache.
+         */
+        void getCacheStatistics(uint64_t& hits, uint64_t& misses) const;
+        /*!
+         * Sets the number of bytes of memory that the cache of
+         * resolved paths may use.  A value of 0 disables the cache.
+         */
+        void setDentryCacheSize(size_t bytes);
+        /*!
+         * Retrieves the number of path component lookups that were
+         * served from the cache of resolved paths and the number
+         * that had to search a directory.
+         */
+        void getDentryCacheStatistics(uint64_t& hits, uint64_t& misses) const;
+        /*!
+         * Sets the number of decoded inodes that are kept in memory
+         * by the underlying filesystem.  A value of 0 disables the
+         * inode cache.
+         */
+        void setINodeCacheSize(uint32_t count);
+        /*!
+         * Sets the maximum number of blocks that are reserved past
+         * the end of a file when it grows through write().  A value
+         * of 0 disables preallocation.
+         */
+        void setPreallocationLimit(uint32_t blocks);
+        /*!
+         * Sets the number of bytes of file data that write() may
+         * hold in memory before it is written out to the package.
+         * Held data is given blocks when the file is closed, when
+         * the package is flushed or when the buffers fill up.  A
+         * value of 0 disables write-behind.
+         */
+        void setWriteBehindSize(size_t bytes);
+        /*!
+         * Sets the largest number of bytes that read() reads ahead
+         * of a file handle that is reading sequentially.  A value of
+         * 0 disables readahead.
+         */
+        void setReadaheadSize(uint32_t bytes);
+
         /*!
          * Touches the specified file, updating each of the
          * specified times to the current time on the local
          * machine.
          *
-         * @note This function saves the new times to disk.
+         * @note This function saves the new times to disk.  On
+         *       a read-only package it does nothing.
          *
          * @param path The path to touch.
          * @param modes A string containing one or more of 'a', 'm' or 'c'.
@@ -298,23 +710,43 @@ namespace AppLib
          * @throw Exception::FileNotFound
          */
         void touch(std::string path, std::string modes);
+        /*!
+         * Touches the file that the specified FSFile was opened
+         * on, without resolving its path again.
+         *
+         * @note Unlike touch(path, modes), this follows the access
+         *       time policy; the access time may not be updated,
+         *       and under ATP_LAZYTIME the new times are only held
+         *       in memory until the next flush.  On a read-only
+         *       package it does nothing.
+         *
+         * @param file The open file to touch.
+         * @param modes A string containing one or more of 'a', 'm' or 'c'.
+         *
+         * @throw Exception::FileNotFound
+         */
+        void touch(FSFile& file, std::string modes);
 
     private:
+        /*!
+         * Ensures the package can be modified.
+         *
+         * @throw Exception::PackageReadOnly
+         */
+        void ensureWritable() const;
         /*!
          * Ensures the specified path is valid.
          *
          * @throw Exception::PathNotValid
          * @throw Exception::FilenameTooLong
          */
-        void ensurePathIsValid(std::string path) const;
+        void ensurePathIsValid(const std::string& path) const;
         /*!
          * Ensures the specified path exists.
          *
          * @throw Exception::FileNotFound
-         * @throw Exception::PathNotValid
-         * @throw Exception::FilenameTooLong
          */
-        void ensurePathExists(std::string path) const;
+        void ensurePathExists(const PathResolution& target) const;
         /*!
          * Ensures the specified path is available, that is
          * all required parent directories exist, but the
@@ -322,39 +754,91 @@ namespace AppLib
          *
          * @throw Exception::FileNotFound
          * @throw Exception::FileExists
-         * @throw Exception::PathNotValid
-         * @throw Exception::FilenameTooLong
          */
-        void ensurePathIsAvailable(std::string path) const;
+        void ensurePathIsAvailable(const PathResolution& target) const;
         /*!
          * Ensures the specified path can be renamed by the
          * specified user.
          *
          * @throw Exception::FileNotFound
          * @throw Exception::FileExists
-         * @throw Exception::PathNotValid
-         * @throw Exception::FilenameTooLong
          * @throw Exception::AccessDenied
          */
-        void ensurePathRenamability(std::string path, uid_t uid) const;
+        void ensurePathRenamability(const PathResolution& target, uid_t uid) const;
         /*!
          * Checks if the specified path can have the specified
          * operation performed on it by the specified user and
          * group.
          */
         bool checkPermission(std::string path, char op, uid_t uid, gid_t gid) const;
+        /*!
+         * Retrieves the context UID and GID of the calling thread.
+         */
+        uid_t getContextUID() const;
+        gid_t getContextGID() const;
         /*!
          * Retrieves the inode represented by the path, storing
-         * the result in out.  The optional limit parameter
-         * indicates the number of path components to evaluate,
-         * with negative values counting back from the end.
+         * the result in out.
+         *
+         * @throw Exception::PathNotValid
+         * @throw Exception::FilenameTooLong
+         */
+        bool retrievePathToINode(const std::string& path, LowLevel::INode& out) const;
+        /*!
+         * Finds an entry in a directory by name, as lookup does.
+         * The caller must hold the metadata lock.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         * @throw Exception::FilenameTooLong
+         */
+        uint16_t findChild(uint16_t parent, const std::string& name) const;
+        /*!
+         * Marks an inode whose last name has been removed as orphaned
+         * if it is held, returning false if it isn't held and so can
+         * be freed straight away.
+         */
+        bool orphanIfHeld(uint16_t id);
+        /*!
+         * Erases the data of an inode, then frees its block and ID.
+         * The caller must hold the metadata lock for writing.
+         *
+         * @throw Exception::InternalInconsistency
+         */
+        void freeINode(uint16_t id);
+        /*!
+         * Retrieves the inode with the specified ID (as found by
+         * resolvePath), resolving it if it is a hardlink.  Returns
+         * false if the ID is -1 or the inode isn't valid.
+         */
+        bool retrieveINode(int32_t id, LowLevel::INode& out) const;
+        /*!
+         * Validates a path and walks it once from the root, using
+         * and filling the dentry cache, to find the inode IDs of
+         * its last component and the directory that holds it.
+         * Components are not copied, so resolving into the same
+         * result again doesn't allocate memory unless a directory
+         * has to be searched.
+         *
+         * @throw Exception::PathNotValid
+         * @throw Exception::FilenameTooLong
+         */
+        void resolvePath(const std::string& path, PathResolution& out) const;
+        /*!
+         * Fills in a stat structure from an inode, resolving it
+         * first if it is a hardlink.
+         *
+         * @throw Exception::FileNotFound
+         * @throw Exception::InternalInconsistency
          */
-        bool retrievePathToINode(std::string path, LowLevel::INode& out, int limit = 0) const;
+        void statINode(LowLevel::INode& buf, struct stat& stbufOut) const;
         /*!
-         * Retrieves the parent inode to the inode represented
-         * by the path, storing the result in out.
+         * Reads the target of a symlink inode.
+         *
+         * @throw Exception::NotSupported
+         * @throw Exception::InternalInconsistency
          */
-        bool retrieveParentPathToINode(std::string path, LowLevel::INode& out) const;
+        std::string readSymlink(LowLevel::INode& buf) const;
         /*!
          * Saves an existing inode to disk.
          * 
@@ -369,6 +853,15 @@ namespace AppLib
          * @throw Exception::INodeSaveFailed
          */
         void saveNewINode(uint32_t pos, LowLevel::INode& buf);
+        /*!
+         * Apply chmod, chown, utimens and link to an inode that has
+         * already been retrieved.  The caller must hold the metadata
+         * lock for writing.
+         */
+        void changeMode(LowLevel::INode& child, mode_t mode);
+        void changeOwner(LowLevel::INode& child, uid_t uid, gid_t gid);
+        void changeTimes(LowLevel::INode& buf, time_t access, time_t modification);
+        void createHardlink(const PathResolution& link, LowLevel::INode& child);
         /*!
          * Extracts the permissions mask from the full mode
          * information.
@@ -400,6 +893,26 @@ namespace AppLib
          * @param modes A string containing one or more of 'a', 'm' or 'c'.
          */
         void touchINode(LowLevel::INode& node, std::string modes);
+        /*!
+         * Applies any pending lazytime updates for the inode to
+         * the in-memory copy.
+         */
+        void applyPendingTimes(LowLevel::INode& node) const;
+        /*!
+         * Calls the change callbacks (if set).
+         */
+        void notifyINodeChanged(uint16_t id);
+        void notifyEntryChanged(uint16_t parent, std::string name);
+        /*!
+         * Discards any pending lazytime updates for the inode.
+         */
+        void clearPendingTimes(uint16_t id);
+        /*!
+         * Writes all pending lazytime updates to the package.
+         *
+         * @note The caller must hold the metadata lock for writing.
+         */
+        void flushPendingTimes();
 
         /*!
          * Creates a new inode with the specified type at the
@@ -422,6 +935,19 @@ namespace AppLib
         LowLevel::INode performCreation(LowLevel::INodeType::INodeType type,
                 std::string path, mode_t mode,
                 std::function<void(LowLevel::INode&)> configuration);
+        /*!
+         * Creates an inode at a path that has already been resolved.
+         * The caller must hold the metadata lock for writing.
+         *
+         * @throw Exception::FileExists
+         * @throw Exception::FileNotFound
+         * @throw Exception::NotADirectory
+         * @throw Exception::DirectoryChildLimitReached
+         * @throw Exception::InternalInconsistency
+         */
+        LowLevel::INode performCreation(LowLevel::INodeType::INodeType type,
+                const PathResolution& target, mode_t mode,
+                std::function<void(LowLevel::INode&)> configuration);
     };
 }
 
@@ -8,6 +8,7 @@
 #include <map>
 #include <math.h>
 #include <stdarg.h>
+#include <string.h>
 #include <algorithm>
 
 using namespace AppLib::LowLevel;
@@ -24,6 +25,7 @@ namespace AppLib
         this->posg = 0;
         this->posp = 0;
         this->state = std::ios::goodbit;
+        this->readahead = std::make_shared<Readahead>();
     }
 
     void FSFile::open(std::ios_base::openmode mode)
@@ -70,12 +72,23 @@ namespace AppLib
             return;
         }
 
-        // Store the current positions.
-        std::streampos oldg = this->fd->tellg();
-        std::streampos oldp = this->fd->tellp();
+        // Hold the data in memory if we can; blocks are allocated for
+        // it when it is written out.
+        if (this->filesystem->bufferFileData(this->inodeid, this->posp, data, count))
+        {
+            this->posp += count;
+            if (this->posp == this->size())
+                this->clear(std::ios::eofbit);
+            return;
+        }
 
-        // Get the base position of the specified inode.
-        uint32_t bpos = this->filesystem->getINodePositionByID(this->inodeid);
+        // Otherwise any data that is still held for the file has to be
+        // written out first, so that it doesn't replace this data later.
+        if (this->filesystem->flushBufferedData(this->inodeid) != FSResult::E_SUCCESS)
+        {
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return;
+        }
 
         // Get the total size of the file (for detected when to EOF).
         uint32_t fsize = this->size();
@@ -83,7 +96,7 @@ namespace AppLib
         // If we need to truncate the file to a new size, do so.
         if (fsize < this->posp + count)
         {
-            if (!this->truncate(this->posp + count))
+            if (!this->extend(this->posp + count))
             {
                 this->clear(std::ios::badbit | std::ios::failbit);
                 return;
@@ -93,144 +106,25 @@ namespace AppLib
             fsize = this->size();
         }
 
-        // Calculate the number of blocks we will have to write.
-        uint32_t bstart = (this->posp / 4096);
-        uint32_t bend = ((this->posp + count - 1) / 4096);
-
-        // Loop through all of the blocks in the file
-        // First we get a list of all of the segments to write, starting
-        // at this->posp until this->posp + count.
-        uint32_t bcount = 0;
-        uint32_t doff = 0;
-        uint32_t spos = 0;
-        uint32_t ipos = bpos;
-        uint32_t hsize = HSIZE_FILE;
-        while (ipos != 0)
+        // Write the data through the filesystem's segment map.
+        uint32_t stotal = std::min < uint32_t > (count, fsize - this->posp);
+        FSResult::FSResult fres = this->filesystem->writeFileData(this->inodeid, this->posp, data, stotal);
+        if (fres == FSResult::E_FAILURE_INVALID_POSITION)
         {
-            for (int i = hsize; i < BSIZE_FILE; i += 4)
-            {
-                this->fd->seekg(bpos + i);
-                spos = 0;
-                Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-
-                if (fsize - this->posp == 0)
-                {
-                    // We've hit EOF.  Return.
-                    this->fd->seekg(oldg);
-                    this->fd->seekp(oldp);
-                    this->clear(std::ios::eofbit);
-                    return;
-                }
-
-                if (spos == 0)
-                {
-                    // We've run out of segments to write to (this shouldn't
-                    // happen because we truncated the file).
-                    ipos = 0;	// Make it jump out of the while() loop.
-                    this->clear(std::ios::eofbit | std::ios::failbit);
-                    return;
-                }
-
-                if (bcount < bstart)
-                {
-                    // Before the data needs to be read.
-                    bcount += 1;
-                    continue;
-                }
-                else if (bcount == bstart)
-                {
-                    // First block to read.  Calculate how many
-                    // bytes to read (as it may not be the full block).
-                    uint32_t soff = this->posp - ((this->posp / 4096) * 4096);
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > (BSIZE_FILE - soff, fsize - this->posp));
-
-                    // Seek the correct position.
-                    this->fd->seekp(spos + soff);
-
-                    // Write the selected number of bytes.
-                    this->fd->write(data + doff, stotal);
-
-                    // Increase the counters.
-                    doff += stotal;
-                    this->posp += stotal;
-
-                    if (bcount == bend)
-                    {
-                        // We're going to finish writing on this block too.
-                        this->fd->seekg(oldg);
-                        this->fd->seekp(oldp);
-                        if (this->posg == fsize)
-                            this->clear(std::ios::eofbit);
-                        return;
-                    }
-                }
-                else if (bcount > bstart && bcount < bend)
-                {
-                    // A block in the middle which must be completely
-                    // written to.
-
-                    // Calculate how many bytes to write.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posp));
-
-                    // Seek the correct position.
-                    this->fd->seekp(spos);
-
-                    // Write the selected number of bytes.
-                    this->fd->write(data + doff, stotal);
-
-                    // Increase the counters.
-                    doff += stotal;
-                    this->posp += stotal;
-                }
-                else if (bcount > bstart && bcount == bend)
-                {
-                    // Last block to write to.  Calculate how many bytes
-                    // to write in the last block.
-                    uint32_t srem = count - doff;
-
-                    // Calculate how many bytes to write.
-                    uint32_t stotal = std::min < uint32_t > (srem, std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posp)));
-
-                    // Seek the correct position.
-                    this->fd->seekp(spos);
-
-                    // Write the selected number of bytes.
-                    this->fd->write(data + doff, stotal);
-
-                    // Increase the counters.
-                    doff += stotal;
-                    this->posp += stotal;
-
-                    // Now that we've reached the last block, we've
-                    // written all the data and can now return.
-                    this->fd->seekg(oldg);
-                    this->fd->seekp(oldp);
-                    if (this->posp == fsize)
-                        this->clear(std::ios::eofbit);
-                    return;
-                }
-                else
-                {
-                    // End of writing..  Return.
-                    this->fd->seekg(oldg);
-                    this->fd->seekp(oldp);
-                    if (this->posp == fsize)
-                        this->clear(std::ios::eofbit);
-                    return;
-                }
-
-                bcount += 1;
-            }
-            hsize = HSIZE_SEGINFO;
-            INode inode = this->filesystem->getINodeByPosition(ipos);
-            ipos = inode.info_next;
+            // We've run out of segments to write to (this shouldn't
+            // happen because we truncated the file).
+            this->clear(std::ios::eofbit | std::ios::failbit);
+            return;
         }
+        else if (fres != FSResult::E_SUCCESS)
+        {
+            this->clear(std::ios::badbit | std::ios::failbit);
+            return;
+        }
+        this->posp += stotal;
 
-        // Set the fail bit if we get here, because we shouldn't.
-        this->clear(std::ios::badbit | std::ios::failbit);
-        return;
+        if (this->posp == fsize)
+            this->clear(std::ios::eofbit);
     }
 
     std::streamsize FSFile::read(char *out, std::streamsize count)
@@ -244,173 +138,44 @@ namespace AppLib
             return 0;
         }
 
-        // Store the current positions.
-        std::streampos oldg = this->fd->tellg();
-        std::streampos oldp = this->fd->tellp();
-
-        // Get the base position of the specified inode.
-        uint32_t bpos = this->filesystem->getINodePositionByID(this->inodeid);
-
-        // Calculate the number of blocks we will have to read.
-        uint32_t bstart = (this->posg / 4096);
-        uint32_t bend = ((this->posg + count - 1) / 4096);
-
-        // Get the total size of the file (for detected when to EOF).
+        // Get the total size of the file (for detected when to EOF),
+        // and how much of it is in the package rather than held in
+        // memory.
         uint32_t fsize = this->size();
-
-        // First we get a list of all of the segments to read, starting
-        // at this->posg until this->posg + count.
-        uint32_t bcount = 0;
+        uint32_t dsize = this->filesystem->getINodeByID(this->inodeid).dat_len;
+        uint32_t start = this->posg;
+
+        // If the handle is reading sequentially, ask for the data after
+        // this read now so that it's in memory by the time it's wanted.
+        uint32_t rstart, rlength;
+        if (this->readahead->advance(this->posg, std::min < std::streamsize > (count, MSIZE_FILE),
+                                     this->filesystem->getReadaheadLimit(), rstart, rlength) && rstart < dsize)
+            this->filesystem->prefetchFileData(this->inodeid, rstart, std::min < uint32_t > (rlength, dsize - rstart));
+
+        // Read the data through the filesystem's segment map, which
+        // reads each run of blocks that are next to each other in the
+        // package with a single call.
         uint32_t doff = 0;
-        uint32_t spos = 0;
-        uint32_t ipos = bpos;
-        uint32_t hsize = HSIZE_FILE;
-        while (ipos != 0)
+        if (this->posg < dsize)
         {
-            for (int i = hsize; i < BSIZE_FILE; i += 4)
-            {
-                this->fd->seekg(bpos + i);
-                spos = 0;
-                Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-
-                if (fsize - this->posg == 0)
-                {
-                    // We've hit EOF.  Return.
-                    this->fd->seekg(oldg);
-                    this->clear(std::ios::eofbit);
-                    return doff;
-                }
-
-                if (spos == 0)
-                {
-                    // We've run out of segments to read.
-                    ipos = 0;	// Make it jump out of the while() loop.
-                    this->clear(std::ios::eofbit);
-                    return doff;
-                }
-
-                if (bcount < bstart)
-                {
-                    // Before the data needs to be read.
-                    bcount += 1;
-                    continue;
-                }
-                else if (bcount == bstart)
-                {
-                    // First block to read.  Calculate how many
-                    // bytes to read (as it may not be the full block).
-                    uint32_t soff = this->posg - ((this->posg / 4096) * 4096);
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE - soff, fsize - this->posg));
-
-                    // Seek the correct position.
-                    this->fd->seekg(spos + soff);
-
-                    // Read the selected number of bytes.
-                    uint32_t bread = this->fd->read(out + doff, stotal);
-
-                    // Increase the counters.
-                    if (this->posg + bread > fsize)
-                    {
-                        doff += fsize - this->posg;
-                        this->posg = fsize;
-                    }
-                    else
-                    {
-                        doff += bread;
-                        this->posg += bread;
-                    }
-
-                    if (bcount == bend)
-                    {
-                        // We're going to finish reading on this block too.
-                        this->fd->seekg(oldg);
-                        if (this->posg == fsize)
-                            this->clear(std::ios::eofbit);
-                        return doff;
-                    }
-                }
-                else if (bcount > bstart && bcount < bend)
-                {
-                    // A block in the middle which must be completely
-                    // read (up to EOF of course).
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posg));
-
-                    // Seek the correct position.
-                    this->fd->seekg(spos);
-
-                    // Read the selected number of bytes.
-                    uint32_t bread = this->fd->read(out + doff, stotal);
-
-                    // Increase the counters.
-                    if (this->posg + bread > fsize)
-                    {
-                        doff += fsize - this->posg;
-                        this->posg = fsize;
-                    }
-                    else
-                    {
-                        doff += bread;
-                        this->posg += bread;
-                    }
-                }
-                else if (bcount > bstart && bcount == bend)
-                {
-                    // Last block to read.  Calculate how many bytes
-                    // to read in the last block.
-                    uint32_t srem = count - doff;
-
-                    // Calculate how many bytes to read.
-                    uint32_t stotal = std::min < uint32_t > (srem, std::min < uint32_t > (count - doff, std::min < uint32_t > ((uint32_t) BSIZE_FILE, fsize - this->posg)));
-
-                    // Seek the correct position.
-                    this->fd->seekg(spos);
-
-                    // Read the selected number of bytes.
-                    uint32_t bread = this->fd->read(out + doff, stotal);
-
-                    // Increase the counters.
-                    if (this->posg + bread > fsize)
-                    {
-                        doff += fsize - this->posg;
-                        this->posg = fsize;
-                    }
-                    else
-                    {
-                        doff += bread;
-                        this->posg += bread;
-                    }
-
-                    // Now that we've reached the last block, we've
-                    // read all the data and can now return.
-                    this->fd->seekg(oldg);
-                    if (this->posg == fsize)
-                        this->clear(std::ios::eofbit);
-                    return doff;
-                }
-                else
-                {
-                    // End of reading..  Return.
-                    this->fd->seekg(oldg);
-                    if (this->posg == fsize)
-                        this->clear(std::ios::eofbit);
-                    return doff;
-                }
-
-                bcount += 1;
-            }
-            hsize = HSIZE_SEGINFO;
-            INode inode = this->filesystem->getINodeByPosition(ipos);
-            ipos = inode.info_next;
+            doff = this->filesystem->readFileData(this->inodeid, this->posg, out, std::min < uint32_t > (count, dsize - this->posg));
+            this->posg += doff;
         }
 
-        // If we get here, then there wasn't any blocks to read or the original
-        // request to grab the inode based on ID failed, so we return 0 (for no
-        // data read).
-        return 0;
+        // Anything past the end of the file in the package has only
+        // been written to memory (or is a gap, which reads as zeros).
+        if (this->posg >= dsize && this->posg < fsize && doff < count)
+        {
+            uint32_t ztotal = std::min < uint32_t > (count - doff, fsize - this->posg);
+            memset(out + doff, 0, ztotal);
+            doff += ztotal;
+            this->posg += ztotal;
+        }
+        this->filesystem->readBufferedFileData(this->inodeid, start, out, doff);
+
+        if (this->posg >= fsize || doff < count)
+            this->clear(std::ios::eofbit);
+        return doff;
     }
 
     bool FSFile::truncate(std::streamsize len)
@@ -422,14 +187,38 @@ namespace AppLib
         return (fres == FSResult::E_SUCCESS);
     }
 
+    bool FSFile::extend(std::streamsize len)
+    {
+        if (this->bad() || this->fail())
+            return false;
+
+        // Reserve blocks past the new end of the file, since a
+        // file that is being written to will probably grow again.
+        FSResult::FSResult fres = this->filesystem->truncateFile(this->inodeid, len, true);
+        return (fres == FSResult::E_SUCCESS);
+    }
+
     uint32_t FSFile::size()
     {
+        uint32_t len;
+        if (this->filesystem->getBufferedFileLength(this->inodeid, len))
+            return len;
         INode fnode = this->filesystem->getINodeByID(this->inodeid);
         return fnode.dat_len;
     }
 
+    uint16_t FSFile::getINodeID()
+    {
+        return this->inodeid;
+    }
+
     void FSFile::close()
     {
+        // Data held in memory for the file is only given blocks now,
+        // so this is where writing it can fail.
+        if (this->opened && !this->invalid &&
+                this->filesystem->flushBufferedData(this->inodeid) != FSResult::E_SUCCESS)
+            this->clear(this->state | std::ios::failbit);
         this->opened = false;
     }
 
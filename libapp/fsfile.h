@@ -6,6 +6,8 @@
 #include <libapp/config.h>
 
 #include <iostream>
+#include <memory>
+#include <libapp/readahead.h>
 #include <libapp/lowlevel/blockstream.h>
 
 namespace AppLib
@@ -24,12 +26,14 @@ namespace AppLib
         void write(const char *data, std::streamsize count);
         std::streamsize read(char *out, std::streamsize count);
         bool truncate(std::streamsize len);
+        bool extend(std::streamsize len);
         void close();
         void seekp(std::streampos pos);
         void seekg(std::streampos pos);
         std::streampos tellp();
         std::streampos tellg();
         uint32_t size();
+        uint16_t getINodeID();
 
         // State functions.
         std::ios::iostate rdstate();
@@ -49,6 +53,10 @@ namespace AppLib
         uint32_t posp;
         uint32_t posg;
         std::ios::iostate state;
+
+        // Shared by the copies of this handle, so that reads made
+        // through any of them count towards the same pattern.
+        std::shared_ptr<Readahead> readahead;
     };
 }
 
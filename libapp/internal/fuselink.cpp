@@ -2,6 +2,7 @@
 
 #include <libapp/config.h>
 #include <libapp/internal/fuselink.h>
+#include <libapp/internal/fuselowlevel.h>
 #include <libapp/logging.h>
 #include <string>
 #include <time.h>
@@ -15,7 +16,9 @@ namespace AppLib
         void (*FuseLink::continuefunc) (void) = NULL;
 
         Mounter::Mounter(std::string image, std::string mount,
-                bool foreground, bool allow_other, void (*continuefunc) (void))
+                bool foreground, bool allow_other, void (*continuefunc) (void),
+                bool readonly, ATimePolicy::ATimePolicy atime, bool multithreaded, bool lowlevel,
+                double attrTimeout, double entryTimeout, bool uring)
         {
             this->mountResult = -EALREADY;
 
@@ -37,9 +40,9 @@ namespace AppLib
             ops.read = &FuseLink::read;
             ops.write = &FuseLink::write;
             ops.statfs = NULL;
-            ops.flush = NULL;
-            ops.release = NULL;
-            ops.fsync = NULL;
+            ops.flush = &FuseLink::flush;
+            ops.release = &FuseLink::release;
+            ops.fsync = &FuseLink::fsync;
             ops.setxattr = NULL;
             ops.getxattr = NULL;
             ops.listxattr = NULL;
@@ -52,7 +55,7 @@ namespace AppLib
             ops.destroy = &FuseLink::destroy;
             ops.access = NULL;
             ops.create = &FuseLink::create;
-            ops.ftruncate = NULL;
+            ops.ftruncate = &FuseLink::ftruncate;
             ops.fgetattr = NULL;
             ops.lock = NULL;
             ops.utimens = &FuseLink::utimens;
@@ -61,9 +64,37 @@ namespace AppLib
             ops.poll = NULL;
 
             // Attempt to open the package and set
-            // continuation function.
-            FuseLink::filesystem = new FS(image);
+            // continuation function.  Read-only packages are
+            // memory-mapped since they will never be written to.
+            try
+            {
+                if (readonly)
+                    FuseLink::filesystem = new FS(image, 0, 0, LowLevel::BlockStreamMode::BSM_MAPPED_READONLY);
+                else if (uring)
+                    FuseLink::filesystem = new FS(image, 0, 0, LowLevel::BlockStreamMode::BSM_READWRITE_URING);
+                else
+                    FuseLink::filesystem = new FS(image);
+            }
+            catch (Exception::PackageNotFound& e)
+            {
+                Logging::showErrorW("Unable to open the package.");
+                this->mountResult = -ENOENT;
+                return;
+            }
+            catch (Exception::PackageNotValid& e)
+            {
+                // This includes packages that can only be mounted
+                // read-only.
+                Logging::showErrorW("The package is not valid, or can only be mounted read-only.");
+                this->mountResult = -EINVAL;
+                return;
+            }
+            FuseLink::filesystem->setATimePolicy(atime);
             FuseLink::continuefunc = continuefunc;
+            FuseLowLevel::filesystem = FuseLink::filesystem;
+            FuseLowLevel::continuefunc = continuefunc;
+            FuseLowLevel::attrTimeout = attrTimeout;
+            FuseLowLevel::entryTimeout = entryTimeout;
 
             // Mounts the specified disk image at the
             // specified mount path using FUSE.
@@ -92,18 +123,38 @@ namespace AppLib
                 }
             }
 
-            const char *normal_opts = "default_permissions,use_ino,attr_timeout=0,entry_timeout=0";
-            const char *allow_opts = "allow_other,default_permissions,use_ino,attr_timeout=0,entry_timeout=0";
-            const char *opts = NULL;
+            // The low-level engine reports inode numbers and timeouts
+            // itself, and rejects the high-level options for them.
+            // Only it can invalidate the kernel's caches when the
+            // package changes, so with the high-level engine changes
+            // not made through the mount may take up to the timeouts
+            // to be seen.
+            std::string opts = "default_permissions";
+            if (!lowlevel)
+            {
+                char timeouts[64];
+                snprintf(timeouts, sizeof(timeouts), ",attr_timeout=%g,entry_timeout=%g", attrTimeout, entryTimeout);
+                opts += ",use_ino";
+                opts += timeouts;
+            }
             if (allow_other)
             {
                 Logging::showInfoW("Allowing other users access to filesystem.");
-                opts = allow_opts;
+                opts = "allow_other," + opts;
+            }
+            if (readonly)
+                opts = "ro," + opts;
+
+            // Unless requested, serve requests from a single thread.
+            if (!multithreaded && fuse_opt_add_arg(&fargs, "-s") == -1)
+            {
+                Logging::showErrorW("Unable to set FUSE options.");
+                fuse_opt_free_args(&fargs);
+                this->mountResult = -5;
+                return;
             }
-            else
-                opts = normal_opts;
 
-            if (fuse_opt_add_arg(&fargs, "-s") == -1 || fuse_opt_add_arg(&fargs, "-o") || fuse_opt_add_arg(&fargs, opts) == -1 || fuse_opt_add_arg(&fargs, mount.c_str()) == -1)
+            if (fuse_opt_add_arg(&fargs, "-o") || fuse_opt_add_arg(&fargs, opts.c_str()) == -1 || fuse_opt_add_arg(&fargs, mount.c_str()) == -1)
             {
                 Logging::showErrorW("Unable to set FUSE options.");
                 fuse_opt_free_args(&fargs);
@@ -113,11 +164,17 @@ namespace AppLib
 
             FUSEData appfs_status;
             appfs_status.filesystem = FuseLink::filesystem;
-            appfs_status.readonly = false;
+            appfs_status.readonly = readonly;
             appfs_status.mount = mount;
             appfs_status.image = image;
 
-            this->mountResult = fuse_main(fargs.argc, fargs.argv, &ops, &appfs_status);
+            if (lowlevel)
+            {
+                this->mountResult = FuseLowLevel::main(&fargs);
+                fuse_opt_free_args(&fargs);
+            }
+            else
+                this->mountResult = fuse_main(fargs.argc, fargs.argv, &ops, &appfs_status);
         }
 
         int Mounter::getResult()
@@ -361,11 +418,13 @@ namespace AppLib
             FuseLink::filesystem->setuid(fuse_get_context()->uid);
             FuseLink::filesystem->setgid(fuse_get_context()->gid);
 
-            // Open the file to see whether it exists.
+            // Open the file and keep it as the handle for subsequent
+            // reads and writes, so they don't need to resolve the
+            // path again.
             try
             {
                 FSFile file = FuseLink::filesystem->open(path);
-                file.close();
+                options->fh = (uint64_t) new FSFile(file);
                 return 0;
             }
             catch (std::exception& e)
@@ -385,13 +444,9 @@ namespace AppLib
             {
                 if (offset > MSIZE_FILE || ((uint64_t) offset + (uint64_t) length) > MSIZE_FILE)
                     return -EFBIG;
-                FuseLink::filesystem->touch(path, "a");
-                FSFile file = FuseLink::filesystem->open(path);
-                file.seekg(offset);
-                uint32_t read = file.read(out, length);
-                file.close();
-                if (file.fail() || file.bad())
-                    return -EIO;
+                FSFile * file = FuseLink::getHandle(options);
+                uint32_t read = FuseLink::filesystem->read(*file, out, length, offset);
+                FuseLink::filesystem->touch(*file, "a");
                 return read;
             }
             catch (std::exception& e)
@@ -411,13 +466,9 @@ namespace AppLib
             {
                 if (offset > MSIZE_FILE || ((uint64_t) offset + (uint64_t) length) > MSIZE_FILE)
                     return -EFBIG;
-                FuseLink::filesystem->touch(path, "cma");
-                FSFile file = FuseLink::filesystem->open(path);
-                file.seekp(offset);
-                file.write(in, length);
-                file.close();
-                if (file.fail() || file.bad())
-                    return -EIO;
+                FSFile * file = FuseLink::getHandle(options);
+                FuseLink::filesystem->write(*file, in, length, offset);
+                FuseLink::filesystem->touch(*file, "cma");
                 return length;
             }
             catch (std::exception& e)
@@ -426,6 +477,83 @@ namespace AppLib
             }
         }
 
+        int FuseLink::flush(const char *path, struct fuse_file_info *options)
+        {
+            // Write out any data that is held for the file, since
+            // close(2) reports the result of this but not of release.
+            FSFile * file = FuseLink::getHandle(options);
+            if (file == NULL)
+                return 0;
+            try
+            {
+                FuseLink::filesystem->flush(*file);
+                return 0;
+            }
+            catch (std::exception& e)
+            {
+                return FuseLink::handleException(e, "flush");
+            }
+        }
+
+        int FuseLink::release(const char *path, struct fuse_file_info *options)
+        {
+            // Free the handle that was allocated on open, writing out
+            // any data that is still held for the file.
+            FSFile * file = FuseLink::getHandle(options);
+            if (file == NULL)
+                return 0;
+            options->fh = 0;
+            try
+            {
+                FuseLink::filesystem->close(*file);
+                delete file;
+                return 0;
+            }
+            catch (std::exception& e)
+            {
+                delete file;
+                return FuseLink::handleException(e, "release");
+            }
+        }
+
+        int FuseLink::fsync(const char *path, int datasync, struct fuse_file_info *options)
+        {
+            // Write out pending time updates along with any cached
+            // blocks, and wait for them to reach the disk.
+            try
+            {
+                FuseLink::filesystem->flush();
+                return 0;
+            }
+            catch (std::exception& e)
+            {
+                return FuseLink::handleException(e, "fsync");
+            }
+        }
+
+        int FuseLink::ftruncate(const char *path, off_t size, struct fuse_file_info *options)
+        {
+            FuseLink::filesystem->setuid(fuse_get_context()->uid);
+            FuseLink::filesystem->setgid(fuse_get_context()->gid);
+
+            // Attempt to truncate the open file.
+            try
+            {
+                if (size > MSIZE_FILE)
+                    return -EFBIG;
+                if (FuseLink::filesystem->isReadOnly())
+                    return -EROFS;
+                FSFile * file = FuseLink::getHandle(options);
+                FuseLink::filesystem->truncate(*file, size);
+                FuseLink::filesystem->touch(*file, "cm");
+                return 0;
+            }
+            catch (std::exception& e)
+            {
+                return FuseLink::handleException(e, "ftruncate");
+            }
+        }
+
         int FuseLink::readdir(const char *path, void *dbuf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
         {
             FuseLink::filesystem->setuid(fuse_get_context()->uid);
@@ -463,7 +591,16 @@ namespace AppLib
 
         void FuseLink::destroy(void *)
         {
-            return;
+            // Make sure everything in the block cache reaches the
+            // package before we are unmounted.
+            try
+            {
+                FuseLink::filesystem->flush();
+            }
+            catch (std::exception& e)
+            {
+                FuseLink::handleException(e, "destroy");
+            }
         }
 
         int FuseLink::create(const char *path, mode_t mode, struct fuse_file_info *options)
@@ -471,10 +608,12 @@ namespace AppLib
             FuseLink::filesystem->setuid(fuse_get_context()->uid);
             FuseLink::filesystem->setgid(fuse_get_context()->gid);
 
-            // Attempt to create normal file.
+            // Attempt to create normal file, then open it.
             try
             {
                 FuseLink::filesystem->create(path, mode);
+                FSFile file = FuseLink::filesystem->open(path);
+                options->fh = (uint64_t) new FSFile(file);
                 return 0;
             }
             catch (std::exception& e)
@@ -500,6 +639,11 @@ namespace AppLib
             }
         }
 
+        FSFile * FuseLink::getHandle(struct fuse_file_info *options)
+        {
+            return (FSFile *) options->fh;
+        }
+
         int FuseLink::handleException(std::exception& e, std::string function)
         {
             if (typeid(e) == typeid(Exception::PathNotValid&))
@@ -522,6 +666,8 @@ namespace AppLib
                 return -ENOTEMPTY;
             if (typeid(e) == typeid(Exception::FileTooBig&))
                 return -EFBIG;
+            if (typeid(e) == typeid(Exception::PackageReadOnly&))
+                return -EROFS;
             if (typeid(e) == typeid(Exception::NotSupported&))
                 return -ENOTSUP;
             if (typeid(e) == typeid(Exception::FilenameTooLong&))
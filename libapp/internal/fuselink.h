@@ -32,7 +32,11 @@ namespace AppLib
             static int chmod(const char *path, mode_t mode);
             static int chown(const char *path, uid_t user, gid_t group);
             static int truncate(const char *path, off_t size);
+            static int ftruncate(const char *path, off_t size, struct fuse_file_info *options);
             static int open(const char *path, struct fuse_file_info *options);
+            static int flush(const char *path, struct fuse_file_info *options);
+            static int release(const char *path, struct fuse_file_info *options);
+            static int fsync(const char *path, int datasync, struct fuse_file_info *options);
             static int read(const char *path, char *out, size_t length,
                             off_t offset, struct fuse_file_info *options);
             static int write(const char *, const char *, size_t, off_t, struct fuse_file_info *);
@@ -41,15 +45,24 @@ namespace AppLib
             static void destroy(void *);
             static int create(const char *, mode_t, struct fuse_file_info *);
             static int utimens(const char *, const struct timespec tv[2]);
-        private:
+
+            //! Converts an exception thrown by FS into a negated
+            //! errno value to return to FUSE.
             static int handleException(std::exception& e, std::string function);
+        private:
+            static FSFile * getHandle(struct fuse_file_info *options);
         };
 
         class Mounter
         {
         public:
             Mounter(std::string image, std::string mount,
-                    bool foreground, bool allowOther, void (*continue_func) (void));
+                    bool foreground, bool allowOther, void (*continue_func) (void),
+                    bool readonly = false,
+                    ATimePolicy::ATimePolicy atime = ATimePolicy::ATP_RELATIME,
+                    bool multithreaded = false, bool lowlevel = false,
+                    double attrTimeout = 0, double entryTimeout = 0,
+                    bool uring = false);
             int getResult();
 
         private:
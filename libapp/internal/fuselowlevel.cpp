@@ -0,0 +1,788 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libapp/config.h>
+#include <libapp/internal/fuselowlevel.h>
+#include <libapp/internal/fuselink.h>
+#include <libapp/logging.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+namespace AppLib
+{
+    namespace FUSE
+    {
+        FS * FuseLowLevel::filesystem = NULL;
+        void (*FuseLowLevel::continuefunc) (void) = NULL;
+        double FuseLowLevel::attrTimeout = 0;
+        double FuseLowLevel::entryTimeout = 0;
+        std::map<fuse_ino_t, FuseLowLevel::Node> FuseLowLevel::nodes;
+        std::mutex FuseLowLevel::nodesLock;
+        struct fuse_chan * FuseLowLevel::channel = NULL;
+        std::deque<FuseLowLevel::Invalidation> FuseLowLevel::invalidations;
+        std::mutex FuseLowLevel::invalidationsLock;
+        std::condition_variable FuseLowLevel::invalidationsReady;
+        bool FuseLowLevel::stopping = false;
+
+        int FuseLowLevel::main(struct fuse_args * args)
+        {
+            // Define the fuse_lowlevel_ops structure.
+            static fuse_lowlevel_ops ops;
+            ops.init = &FuseLowLevel::init;
+            ops.destroy = &FuseLowLevel::destroy;
+            ops.lookup = &FuseLowLevel::lookup;
+            ops.forget = &FuseLowLevel::forget;
+            ops.getattr = &FuseLowLevel::getattr;
+            ops.setattr = &FuseLowLevel::setattr;
+            ops.readlink = &FuseLowLevel::readlink;
+            ops.mknod = &FuseLowLevel::mknod;
+            ops.mkdir = &FuseLowLevel::mkdir;
+            ops.unlink = &FuseLowLevel::unlink;
+            ops.rmdir = &FuseLowLevel::rmdir;
+            ops.symlink = &FuseLowLevel::symlink;
+            ops.rename = &FuseLowLevel::rename;
+            ops.link = &FuseLowLevel::link;
+            ops.open = &FuseLowLevel::open;
+            ops.read = &FuseLowLevel::read;
+            ops.write = &FuseLowLevel::write;
+            ops.flush = &FuseLowLevel::flush;
+            ops.release = &FuseLowLevel::release;
+            ops.fsync = &FuseLowLevel::fsync;
+            ops.opendir = NULL;
+            ops.readdir = &FuseLowLevel::readdir;
+            ops.releasedir = NULL;
+            ops.fsyncdir = NULL;
+            ops.statfs = NULL;
+            ops.create = &FuseLowLevel::create;
+
+            // Parse the same command line options as fuse_main() so
+            // the mounter can build the arguments the same way for
+            // either engine.
+            char * mountpoint = NULL;
+            int multithreaded = 0;
+            int foreground = 0;
+            if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+                return 1;
+
+            int result = 1;
+            struct fuse_chan * ch = fuse_mount(mountpoint, args);
+            if (ch != NULL)
+            {
+                struct fuse_session * se = fuse_lowlevel_new(args, &ops, sizeof(ops), NULL);
+                if (se != NULL)
+                {
+                    if (fuse_set_signal_handlers(se) != -1)
+                    {
+                        fuse_session_add_chan(se, ch);
+                        if (fuse_daemonize(foreground) != -1)
+                        {
+                            // Start sending invalidations once we are
+                            // running in the process that will serve.
+                            FuseLowLevel::channel = ch;
+                            FuseLowLevel::stopping = false;
+                            std::thread notifier(&FuseLowLevel::sendInvalidations);
+                            FuseLowLevel::filesystem->setChangeCallbacks(&FuseLowLevel::queueINode,
+                                    &FuseLowLevel::queueEntry);
+
+                            if (multithreaded)
+                                result = fuse_session_loop_mt(se);
+                            else
+                                result = fuse_session_loop(se);
+                            result = (result == -1) ? 1 : 0;
+
+                            FuseLowLevel::filesystem->setChangeCallbacks(nullptr, nullptr);
+                            {
+                                std::lock_guard<std::mutex> guard(FuseLowLevel::invalidationsLock);
+                                FuseLowLevel::stopping = true;
+                            }
+                            FuseLowLevel::invalidationsReady.notify_one();
+                            notifier.join();
+                            FuseLowLevel::channel = NULL;
+                        }
+                        fuse_remove_signal_handlers(se);
+                        fuse_session_remove_chan(ch);
+                    }
+                    fuse_session_destroy(se);
+                }
+                fuse_unmount(mountpoint, ch);
+            }
+            free(mountpoint);
+            return result;
+        }
+
+        void FuseLowLevel::init(void *userdata, struct fuse_conn_info *conn)
+        {
+            if (FuseLowLevel::continuefunc != NULL)
+            {
+                FuseLowLevel::continuefunc();
+            }
+        }
+
+        void FuseLowLevel::destroy(void *userdata)
+        {
+            // Make sure everything in the block cache reaches the
+            // package before we are unmounted.
+            try
+            {
+                FuseLowLevel::filesystem->flush();
+            }
+            catch (std::exception& e)
+            {
+                FuseLink::handleException(e, "destroy");
+            }
+        }
+
+        void FuseLowLevel::lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Look up the single name in the parent directory.
+            try
+            {
+                FuseLowLevel::replyEntry(req, parent, name);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "lookup");
+            }
+        }
+
+        void FuseLowLevel::forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+        {
+            // There is no reply to a forget, so errors (from freeing
+            // an unlinked inode) can only be logged.
+            try
+            {
+                FuseLowLevel::forgetNode(ino, nlookup);
+            }
+            catch (std::exception& e)
+            {
+                FuseLink::handleException(e, "forget");
+            }
+            fuse_reply_none(req);
+        }
+
+        void FuseLowLevel::getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Attempt to get attributes.
+            try
+            {
+                struct stat stbuf;
+                memset(&stbuf, 0, sizeof(struct stat));
+                FuseLowLevel::filesystem->getattr((uint16_t) (ino - 1), stbuf);
+                fuse_reply_attr(req, &stbuf, FuseLowLevel::attrTimeout);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "getattr");
+            }
+        }
+
+        void FuseLowLevel::setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Apply each of the requested changes in turn.  These are
+            // made by inode ID, since a hardlinked file may have been
+            // looked up by a name that has since been removed.
+            try
+            {
+                uint16_t id = (uint16_t) (ino - 1);
+                if (to_set & FUSE_SET_ATTR_MODE)
+                    FuseLowLevel::filesystem->chmod(id, attr->st_mode);
+                if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+                    FuseLowLevel::filesystem->chown(id,
+                            (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : -1,
+                            (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : -1);
+                if (to_set & FUSE_SET_ATTR_SIZE)
+                {
+                    if (attr->st_size > MSIZE_FILE)
+                        throw Exception::FileTooBig();
+                    FSFile * file = FuseLowLevel::getHandle(fi);
+                    if (file != NULL)
+                    {
+                        FuseLowLevel::filesystem->truncate(*file, attr->st_size);
+                        FuseLowLevel::filesystem->touch(*file, "cm");
+                    }
+                    else
+                    {
+                        FSFile opened = FuseLowLevel::filesystem->open(id);
+                        FuseLowLevel::filesystem->truncate(opened, attr->st_size);
+                        FuseLowLevel::filesystem->touch(opened, "cm");
+                    }
+                }
+                if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+                              FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))
+                {
+                    // Times that aren't being set keep their current value.
+                    struct stat current;
+                    memset(&current, 0, sizeof(struct stat));
+                    FuseLowLevel::filesystem->getattr(id, current);
+                    time_t now = time(NULL);
+                    time_t access = current.st_atime;
+                    time_t modification = current.st_mtime;
+                    if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                        access = now;
+                    else if (to_set & FUSE_SET_ATTR_ATIME)
+                        access = attr->st_atime;
+                    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                        modification = now;
+                    else if (to_set & FUSE_SET_ATTR_MTIME)
+                        modification = attr->st_mtime;
+                    FuseLowLevel::filesystem->utimens(id, access, modification);
+                }
+
+                struct stat stbuf;
+                memset(&stbuf, 0, sizeof(struct stat));
+                FuseLowLevel::filesystem->getattr(id, stbuf);
+                fuse_reply_attr(req, &stbuf, FuseLowLevel::attrTimeout);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "setattr");
+            }
+        }
+
+        void FuseLowLevel::readlink(fuse_req_t req, fuse_ino_t ino)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Attempt to read link information.
+            try
+            {
+                std::string result = FuseLowLevel::filesystem->readlink((uint16_t) (ino - 1));
+                fuse_reply_readlink(req, result.c_str());
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "readlink");
+            }
+        }
+
+        void FuseLowLevel::mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Attempt to create device node.
+            try
+            {
+                FuseLowLevel::filesystem->mknod(FuseLowLevel::getPath(parent, name), mode, rdev);
+                FuseLowLevel::replyEntry(req, parent, name);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "mknod");
+            }
+        }
+
+        void FuseLowLevel::mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Attempt to create directory.
+            try
+            {
+                FuseLowLevel::filesystem->mkdir(FuseLowLevel::getPath(parent, name), mode);
+                FuseLowLevel::replyEntry(req, parent, name);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "mkdir");
+            }
+        }
+
+        void FuseLowLevel::unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Attempt to unlink file.
+            try
+            {
+                FuseLowLevel::filesystem->unlink(FuseLowLevel::getPath(parent, name));
+                FuseLowLevel::renameNode(parent, name, 0, "");
+                fuse_reply_err(req, 0);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "unlink");
+            }
+        }
+
+        void FuseLowLevel::rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Attempt to remove directory.
+            try
+            {
+                FuseLowLevel::filesystem->rmdir(FuseLowLevel::getPath(parent, name));
+                FuseLowLevel::renameNode(parent, name, 0, "");
+                fuse_reply_err(req, 0);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "rmdir");
+            }
+        }
+
+        void FuseLowLevel::symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Attempt to create symlink.
+            try
+            {
+                FuseLowLevel::filesystem->symlink(FuseLowLevel::getPath(parent, name), link);
+                FuseLowLevel::replyEntry(req, parent, name);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "symlink");
+            }
+        }
+
+        void FuseLowLevel::rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Attempt to rename file, replacing any existing
+            // destination.
+            try
+            {
+                FuseLowLevel::filesystem->rename(FuseLowLevel::getPath(parent, name),
+                        FuseLowLevel::getPath(newparent, newname));
+                FuseLowLevel::renameNode(newparent, newname, 0, "");
+                FuseLowLevel::renameNode(parent, name, newparent, newname);
+                fuse_reply_err(req, 0);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "rename");
+            }
+        }
+
+        void FuseLowLevel::link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Attempt to create hardlink.
+            try
+            {
+                FuseLowLevel::filesystem->link(FuseLowLevel::getPath(newparent, newname),
+                        (uint16_t) (ino - 1));
+                FuseLowLevel::replyEntry(req, newparent, newname);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "link");
+            }
+        }
+
+        void FuseLowLevel::open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Open the file and keep it as the handle for subsequent
+            // reads and writes.
+            try
+            {
+                FSFile file = FuseLowLevel::filesystem->open((uint16_t) (ino - 1));
+                FuseLowLevel::filesystem->hold((uint16_t) (ino - 1));
+                fi->fh = (uint64_t) new FSFile(file);
+                if (fuse_reply_open(req, fi) != 0)
+                {
+                    // The open was interrupted, so there will be no
+                    // release for this handle.
+                    delete FuseLowLevel::getHandle(fi);
+                    FuseLowLevel::filesystem->release((uint16_t) (ino - 1));
+                }
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "open");
+            }
+        }
+
+        void FuseLowLevel::read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Read data from the file.
+            try
+            {
+                if (off > MSIZE_FILE || ((uint64_t) off + (uint64_t) size) > MSIZE_FILE)
+                    throw Exception::FileTooBig();
+                FSFile * file = FuseLowLevel::getHandle(fi);
+                std::vector<char> buffer(size);
+                std::streamsize read = FuseLowLevel::filesystem->read(*file, buffer.data(), size, off);
+                FuseLowLevel::filesystem->touch(*file, "a");
+                fuse_reply_buf(req, buffer.data(), read);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "read");
+            }
+        }
+
+        void FuseLowLevel::write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Write data to the file.
+            try
+            {
+                if (off > MSIZE_FILE || ((uint64_t) off + (uint64_t) size) > MSIZE_FILE)
+                    throw Exception::FileTooBig();
+                FSFile * file = FuseLowLevel::getHandle(fi);
+                FuseLowLevel::filesystem->write(*file, buf, size, off);
+                FuseLowLevel::filesystem->touch(*file, "cma");
+                fuse_reply_write(req, size);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "write");
+            }
+        }
+
+        void FuseLowLevel::flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+        {
+            // Write out any data that is held for the file, since
+            // close(2) reports the result of this but not of release.
+            try
+            {
+                FSFile * file = FuseLowLevel::getHandle(fi);
+                if (file != NULL)
+                    FuseLowLevel::filesystem->flush(*file);
+                fuse_reply_err(req, 0);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "flush");
+            }
+        }
+
+        void FuseLowLevel::release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+        {
+            // Free the handle that was allocated on open, writing out
+            // any data that is still held for the file, then release
+            // the inode (which frees it if it was unlinked while open).
+            FSFile * file = FuseLowLevel::getHandle(fi);
+            if (file == NULL)
+            {
+                fuse_reply_err(req, 0);
+                return;
+            }
+            fi->fh = 0;
+            int result = 0;
+            try
+            {
+                FuseLowLevel::filesystem->close(*file);
+            }
+            catch (std::exception& e)
+            {
+                result = FuseLink::handleException(e, "release");
+            }
+            delete file;
+            try
+            {
+                FuseLowLevel::filesystem->release((uint16_t) (ino - 1));
+            }
+            catch (std::exception& e)
+            {
+                int error = FuseLink::handleException(e, "release");
+                if (result == 0)
+                    result = error;
+            }
+            fuse_reply_err(req, -result);
+        }
+
+        void FuseLowLevel::fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+        {
+            // Write out pending time updates along with any cached
+            // blocks, and wait for them to reach the disk.
+            try
+            {
+                FuseLowLevel::filesystem->flush();
+                fuse_reply_err(req, 0);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "fsync");
+            }
+        }
+
+        void FuseLowLevel::readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+        {
+            FuseLowLevel::setContext(req);
+
+            // List the children in a directory, starting after the
+            // entry at the specified offset.  '.' and '..' are at
+            // offsets 1 and 2, and the offsets of the other entries
+            // come from the package (shifted past those two) so that
+            // they stay valid while the directory changes.
+            try
+            {
+                std::vector<char> buffer(size);
+                size_t used = 0;
+                struct stat stbuf;
+                memset(&stbuf, 0, sizeof(struct stat));
+                if (off < 2)
+                {
+                    fuse_ino_t parent = FUSE_ROOT_ID;
+                    {
+                        std::lock_guard<std::mutex> guard(FuseLowLevel::nodesLock);
+                        std::map<fuse_ino_t, Node>::iterator i = FuseLowLevel::nodes.find(ino);
+                        if (i != FuseLowLevel::nodes.end() && i->second.parent != 0)
+                            parent = i->second.parent;
+                    }
+                    for (off_t i = off; i < 2; i++)
+                    {
+                        stbuf.st_ino = (i == 0) ? ino - 1 : parent - 1;
+                        size_t length = fuse_add_direntry(req, buffer.data() + used, size - used,
+                                (i == 0) ? "." : "..", &stbuf, i + 1);
+                        if (length > size - used)
+                        {
+                            fuse_reply_buf(req, buffer.data(), used);
+                            return;
+                        }
+                        used += length;
+                    }
+                    off = 2;
+                }
+
+                // Fetch the rest a page at a time until the buffer is full.
+                uint64_t offset = off - 2;
+                std::vector<uint64_t> offsets;
+                bool full = false;
+                while (!full)
+                {
+                    std::vector<std::pair<std::string, uint16_t> > children =
+                        FuseLowLevel::filesystem->readdir((uint16_t) (ino - 1), offset, 64, offsets);
+                    if (children.size() == 0)
+                        break;
+                    for (size_t i = 0; i < children.size(); i++)
+                    {
+                        stbuf.st_ino = children[i].second;
+                        size_t length = fuse_add_direntry(req, buffer.data() + used, size - used,
+                                children[i].first.c_str(), &stbuf, offsets[i] + 2);
+                        if (length > size - used)
+                        {
+                            full = true;
+                            break;
+                        }
+                        used += length;
+                    }
+                    offset = offsets.back();
+                }
+                fuse_reply_buf(req, buffer.data(), used);
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "readdir");
+            }
+        }
+
+        void FuseLowLevel::create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+        {
+            FuseLowLevel::setContext(req);
+
+            // Attempt to create normal file, then open it.
+            try
+            {
+                FuseLowLevel::filesystem->create(FuseLowLevel::getPath(parent, name), mode);
+                struct fuse_entry_param e;
+                FuseLowLevel::lookupEntry(parent, name, e);
+                FSFile file = FuseLowLevel::filesystem->open((uint16_t) (e.ino - 1));
+                FuseLowLevel::filesystem->hold((uint16_t) (e.ino - 1));
+                fi->fh = (uint64_t) new FSFile(file);
+                if (fuse_reply_create(req, &e, fi) != 0)
+                {
+                    delete FuseLowLevel::getHandle(fi);
+                    FuseLowLevel::filesystem->release((uint16_t) (e.ino - 1));
+                    FuseLowLevel::forgetNode(e.ino, 1);
+                }
+            }
+            catch (std::exception& e)
+            {
+                FuseLowLevel::handleException(req, e, "create");
+            }
+        }
+
+        void FuseLowLevel::lookupEntry(fuse_ino_t parent, std::string name, struct fuse_entry_param& e)
+        {
+            // Every lookup holds the inode until the kernel forgets
+            // it, so its ID isn't reused while the kernel can still
+            // use it.
+            uint16_t id = FuseLowLevel::filesystem->lookup((uint16_t) (parent - 1), name, true);
+            memset(&e, 0, sizeof(struct fuse_entry_param));
+            e.ino = (fuse_ino_t) id + 1;
+            e.attr_timeout = FuseLowLevel::attrTimeout;
+            e.entry_timeout = FuseLowLevel::entryTimeout;
+            try
+            {
+                FuseLowLevel::filesystem->getattr(id, e.attr);
+            }
+            catch (...)
+            {
+                FuseLowLevel::filesystem->release(id);
+                throw;
+            }
+
+            // Every successful entry reply counts as a lookup that the
+            // kernel will later forget.
+            std::lock_guard<std::mutex> guard(FuseLowLevel::nodesLock);
+            Node& node = FuseLowLevel::nodes[e.ino];
+            node.parent = parent;
+            node.name = name;
+            node.nlookup += 1;
+        }
+
+        void FuseLowLevel::forgetNode(fuse_ino_t ino, uint64_t nlookup)
+        {
+            // Drop our record of the node once the kernel holds no
+            // more lookups on it.
+            uint64_t released = 0;
+            {
+                std::lock_guard<std::mutex> guard(FuseLowLevel::nodesLock);
+                std::map<fuse_ino_t, Node>::iterator i = FuseLowLevel::nodes.find(ino);
+                if (i != FuseLowLevel::nodes.end())
+                {
+                    released = std::min<uint64_t>(i->second.nlookup, nlookup);
+                    if (i->second.nlookup <= nlookup)
+                        FuseLowLevel::nodes.erase(i);
+                    else
+                        i->second.nlookup -= nlookup;
+                }
+            }
+            if (released > 0)
+                FuseLowLevel::filesystem->release((uint16_t) (ino - 1), released);
+        }
+
+        std::string FuseLowLevel::getPath(fuse_ino_t ino)
+        {
+            std::lock_guard<std::mutex> guard(FuseLowLevel::nodesLock);
+            std::string path = "";
+            for (size_t depth = 0; ino != FUSE_ROOT_ID; depth++)
+            {
+                std::map<fuse_ino_t, Node>::iterator i = FuseLowLevel::nodes.find(ino);
+                if (i == FuseLowLevel::nodes.end() || depth > FuseLowLevel::nodes.size())
+                    throw Exception::FileNotFound();
+                path = "/" + i->second.name + path;
+                ino = i->second.parent;
+            }
+            if (path == "")
+                return "/";
+            return path;
+        }
+
+        std::string FuseLowLevel::getPath(fuse_ino_t parent, std::string name)
+        {
+            std::string path = FuseLowLevel::getPath(parent);
+            if (path == "/")
+                return "/" + name;
+            return path + "/" + name;
+        }
+
+        void FuseLowLevel::renameNode(fuse_ino_t parent, std::string name, fuse_ino_t newparent, std::string newname)
+        {
+            // A parent of 0 leaves the node without a path, so that
+            // path-based operations on it fail rather than reaching
+            // whatever is later created with the same name.
+            std::lock_guard<std::mutex> guard(FuseLowLevel::nodesLock);
+            for (std::map<fuse_ino_t, Node>::iterator i = FuseLowLevel::nodes.begin(); i != FuseLowLevel::nodes.end(); i++)
+            {
+                if (i->second.parent == parent && i->second.name == name)
+                {
+                    i->second.parent = newparent;
+                    i->second.name = newname;
+                }
+            }
+        }
+
+        void FuseLowLevel::queueINode(uint16_t id)
+        {
+            Invalidation invalidation;
+            invalidation.ino = (fuse_ino_t) id + 1;
+            {
+                std::lock_guard<std::mutex> guard(FuseLowLevel::invalidationsLock);
+                FuseLowLevel::invalidations.push_back(invalidation);
+            }
+            FuseLowLevel::invalidationsReady.notify_one();
+        }
+
+        void FuseLowLevel::queueEntry(uint16_t parent, std::string name)
+        {
+            Invalidation invalidation;
+            invalidation.ino = (fuse_ino_t) parent + 1;
+            invalidation.name = name;
+            {
+                std::lock_guard<std::mutex> guard(FuseLowLevel::invalidationsLock);
+                FuseLowLevel::invalidations.push_back(invalidation);
+            }
+            FuseLowLevel::invalidationsReady.notify_one();
+        }
+
+        void FuseLowLevel::sendInvalidations()
+        {
+            std::unique_lock<std::mutex> lock(FuseLowLevel::invalidationsLock);
+            while (true)
+            {
+                while (FuseLowLevel::invalidations.empty() && !FuseLowLevel::stopping)
+                    FuseLowLevel::invalidationsReady.wait(lock);
+                if (FuseLowLevel::invalidations.empty())
+                    return;
+                Invalidation invalidation = FuseLowLevel::invalidations.front();
+                FuseLowLevel::invalidations.pop_front();
+                lock.unlock();
+
+                // Errors (such as the kernel not knowing about the
+                // inode) mean there is nothing to invalidate.  Only
+                // attributes are invalidated for inodes; the kernel
+                // drops cached data past the end of a file when it
+                // sees the new size.
+                if (invalidation.name.empty())
+                    fuse_lowlevel_notify_inval_inode(FuseLowLevel::channel, invalidation.ino, -1, 0);
+                else
+                    fuse_lowlevel_notify_inval_entry(FuseLowLevel::channel, invalidation.ino,
+                            invalidation.name.c_str(), invalidation.name.length());
+                lock.lock();
+            }
+        }
+
+        void FuseLowLevel::setContext(fuse_req_t req)
+        {
+            const struct fuse_ctx * ctx = fuse_req_ctx(req);
+            FuseLowLevel::filesystem->setuid(ctx->uid);
+            FuseLowLevel::filesystem->setgid(ctx->gid);
+        }
+
+        void FuseLowLevel::replyEntry(fuse_req_t req, fuse_ino_t parent, std::string name)
+        {
+            struct fuse_entry_param e;
+            FuseLowLevel::lookupEntry(parent, name, e);
+            if (fuse_reply_entry(req, &e) != 0)
+            {
+                // The kernel didn't get the entry, so it won't forget it.
+                FuseLowLevel::forgetNode(e.ino, 1);
+            }
+        }
+
+        void FuseLowLevel::handleException(fuse_req_t req, std::exception& e, std::string function)
+        {
+            fuse_reply_err(req, -FuseLink::handleException(e, function));
+        }
+
+        FSFile * FuseLowLevel::getHandle(struct fuse_file_info *fi)
+        {
+            if (fi == NULL)
+                return NULL;
+            return (FSFile *) fi->fh;
+        }
+    }
+}
@@ -0,0 +1,134 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_FUSELOWLEVEL
+#define CLASS_FUSELOWLEVEL
+
+#include <libapp/config.h>
+
+#include <exception>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <errno.h>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <libapp/fs.h>
+
+namespace AppLib
+{
+    namespace FUSE
+    {
+        //! Serves a package through the FUSE low-level API.
+        /*!
+         * Unlike FuseLink, the kernel addresses files here by node ID
+         * rather than by path, so each name is looked up once (in the
+         * directory it belongs to) instead of on every operation.  Node
+         * IDs are AppFS inode IDs plus one, since FUSE reserves 1 for
+         * the root.
+         *
+         * Operations that add, remove or rename entries are still made
+         * through the path-based AppLib::FS interface, with the path of
+         * the directory rebuilt from the names that it and its parents
+         * were looked up by.  Directories can't be hardlinked, so each
+         * has only one name.  Everything else is done by inode ID, since
+         * a file may have several names and we only record the last.
+         *
+         * Each lookup the kernel holds on a node and each open handle
+         * holds the inode, so an inode that is unlinked while the
+         * kernel still knows about it keeps its ID (and data) until
+         * it is forgotten and closed.  IDs are therefore never reused
+         * while the kernel can still send them.
+         *
+         * The kernel may cache attributes and entries for attrTimeout
+         * and entryTimeout seconds.  Whenever the package changes, the
+         * affected inodes and entries are invalidated in the kernel so
+         * the caches stay correct.
+         */
+        class FuseLowLevel
+        {
+        public:
+            static FS * filesystem;
+            static void (*continuefunc) (void);
+            static double attrTimeout;
+            static double entryTimeout;
+
+            //! Mounts and serves the package, parsing the same
+            //! arguments as fuse_main().
+            static int main(struct fuse_args * args);
+
+            static void init(void *userdata, struct fuse_conn_info *conn);
+            static void destroy(void *userdata);
+            static void lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+            static void forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+            static void getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
+            static void readlink(fuse_req_t req, fuse_ino_t ino);
+            static void mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev);
+            static void mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+            static void unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+            static void rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+            static void symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name);
+            static void rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname);
+            static void link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname);
+            static void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+            static void write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
+            static void flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+            static void fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+            static void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+            static void create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
+
+        private:
+            //! The name a node was last looked up by and the number of
+            //! lookups the kernel holds on it.
+            struct Node
+            {
+                fuse_ino_t parent;
+                std::string name;
+                uint64_t nlookup;
+            };
+            static std::map<fuse_ino_t, Node> nodes;
+            static std::mutex nodesLock;
+
+            //! An inode (when name is empty) or directory entry to
+            //! invalidate in the kernel.
+            struct Invalidation
+            {
+                fuse_ino_t ino;
+                std::string name;
+            };
+
+            //! Invalidations are sent from their own thread, since the
+            //! kernel may be waiting on the operation that caused them
+            //! while holding the locks they need.
+            static struct fuse_chan * channel;
+            static std::deque<Invalidation> invalidations;
+            static std::mutex invalidationsLock;
+            static std::condition_variable invalidationsReady;
+            static bool stopping;
+            static void queueINode(uint16_t id);
+            static void queueEntry(uint16_t parent, std::string name);
+            static void sendInvalidations();
+
+            //! Looks up a name in a directory, records the lookup
+            //! against the node and fills in the entry to reply with.
+            static void lookupEntry(fuse_ino_t parent, std::string name, struct fuse_entry_param& e);
+            //! Drops lookups on a node, releasing them on the inode.
+            static void forgetNode(fuse_ino_t ino, uint64_t nlookup);
+            //! Rebuilds the path of a directory from the names it was
+            //! looked up by.
+            static std::string getPath(fuse_ino_t ino);
+            static std::string getPath(fuse_ino_t parent, std::string name);
+            //! Moves or removes the recorded name of the node that
+            //! was at the specified location.
+            static void renameNode(fuse_ino_t parent, std::string name, fuse_ino_t newparent, std::string newname);
+            static void setContext(fuse_req_t req);
+            static void replyEntry(fuse_req_t req, fuse_ino_t parent, std::string name);
+            static void handleException(fuse_req_t req, std::exception& e, std::string function);
+            static FSFile * getHandle(struct fuse_file_info *fi);
+        };
+    }
+}
+#endif
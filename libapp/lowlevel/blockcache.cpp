@@ -0,0 +1,576 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libapp/config.h>
+
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <libapp/logging.h>
+#include <libapp/lowlevel/blockcache.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        BlockCache::BlockCache(BlockStream * backing, uint32_t capacity)
+        {
+            this->backing = backing;
+            this->capacity = capacity;
+            this->length = 0;
+            this->hits = 0;
+            this->misses = 0;
+
+            if (this->backing == NULL || !this->backing->is_open())
+            {
+                this->invalid = true;
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return;
+            }
+
+            this->length = this->backing->size();
+            this->opened = true;
+        }
+
+        BlockCache::~BlockCache()
+        {
+            if (this->opened)
+                this->close();
+            if (this->backing != NULL)
+                delete this->backing;
+        }
+
+        std::streamsize BlockCache::readAt(std::streampos pos, char *out, std::streamsize count)
+        {
+            std::unique_lock < std::mutex > guard(this->lock);
+            if (this->invalid || !this->opened)
+            {
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return -1;
+            }
+            if (this->capacity == 0)
+            {
+                // Nothing is cached, so nothing needs to be copied over
+                // what is read.
+                std::streamsize res = this->readUncached(guard, pos, out, count);
+                this->propagateState();
+                return res;
+            }
+
+            // Reads never extend past the end of the image.
+            std::streamsize start = pos;
+            if (start >= this->length)
+                return 0;
+            if (count > this->length - start)
+                count = this->length - start;
+
+            std::streamsize total = 0;
+            while (total < count)
+            {
+                uint64_t index = (start + total) / BSIZE_FILE;
+                std::streamsize boff = (start + total) % BSIZE_FILE;
+                std::streamsize amount = std::min < std::streamsize > (BSIZE_FILE - boff, count - total);
+
+                // Runs of several whole blocks that aren't cached are read
+                // straight into the caller's buffer with a single call,
+                // rather than one block at a time through the cache (which
+                // would also evict the blocks that are worth keeping).
+                uint64_t run = boff == 0 ? this->getUncachedRun(index, (count - total) / BSIZE_FILE) : 0;
+                if (run > 1)
+                {
+                    this->misses += run;
+                    std::streamsize bread = this->readUncached(guard, start + total, out + total, run * BSIZE_FILE);
+                    if (bread < 0)
+                        return -1;
+                    total += bread;
+                    if (bread < (std::streamsize) run * BSIZE_FILE)
+                        break;
+                    continue;
+                }
+
+                Entry *entry = this->fetch(guard, index, false);
+                if (entry == NULL)
+                    return -1;
+                memcpy(out + total, entry->data + boff, amount);
+                total += amount;
+            }
+
+            return total;
+        }
+
+        void BlockCache::readBatch(std::vector<ReadRequest> & reads)
+        {
+            {
+                std::unique_lock < std::mutex > guard(this->lock);
+                if (!this->invalid && this->opened && this->capacity == 0)
+                {
+                    Transfer transfer = { 0, 0, false };
+                    std::list < Transfer >::iterator t = this->transfers.insert(this->transfers.end(), transfer);
+                    guard.unlock();
+                    this->backing->readBatch(reads);
+                    guard.lock();
+                    this->transfers.erase(t);
+                    this->transferred.notify_all();
+                    this->propagateState();
+                    return;
+                }
+
+                // Reads of one or two blocks would each fetch their blocks
+                // separately, so load all of those blocks together first.
+                // Larger reads go straight to the underlying stream anyway.
+                std::vector < uint64_t > indexes;
+                for (std::vector < ReadRequest >::iterator i = reads.begin(); i != reads.end(); i++)
+                {
+                    std::streamsize start = i->pos;
+                    std::streamsize end = std::min < std::streamsize > (start + i->count, this->length);
+                    if (end <= start || (end - 1) / BSIZE_FILE - start / BSIZE_FILE > 1)
+                        continue;
+                    for (uint64_t index = start / BSIZE_FILE; index <= (uint64_t) (end - 1) / BSIZE_FILE; index += 1)
+                        indexes.insert(indexes.end(), index);
+                }
+                if (!this->invalid && this->opened)
+                    this->fetchBatch(indexes);
+            }
+
+            for (std::vector < ReadRequest >::iterator i = reads.begin(); i != reads.end(); i++)
+                i->result = this->readAt(i->pos, i->out, i->count);
+        }
+
+        std::streamsize BlockCache::writeAt(std::streampos pos, const char *data, std::streamsize count)
+        {
+            std::unique_lock < std::mutex > guard(this->lock);
+            if (this->invalid || !this->opened)
+            {
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return -1;
+            }
+            if (this->capacity == 0)
+            {
+                std::streamsize res = this->writeUncached(guard, pos, data, count);
+                this->propagateState();
+                if (res > 0 && this->length < (std::streamsize) pos + res)
+                    this->length = (std::streamsize) pos + res;
+                return res;
+            }
+
+            std::streamsize start = pos;
+            std::streamsize total = 0;
+            bool failed = false;
+            while (total < count)
+            {
+                uint64_t index = (start + total) / BSIZE_FILE;
+                std::streamsize boff = (start + total) % BSIZE_FILE;
+                std::streamsize amount = std::min < std::streamsize > (BSIZE_FILE - boff, count - total);
+
+                // Likewise runs of whole blocks that aren't cached are
+                // written straight through.
+                uint64_t run = boff == 0 ? this->getUncachedRun(index, (count - total) / BSIZE_FILE) : 0;
+                if (run > 1)
+                {
+                    this->misses += run;
+                    std::streamsize bwritten = this->writeUncached(guard, start + total, data + total, run * BSIZE_FILE);
+                    if (bwritten < 0)
+                    {
+                        failed = true;
+                        break;
+                    }
+                    total += bwritten;
+                    continue;
+                }
+
+                // A block that is about to be entirely overwritten does
+                // not need to be read in first.
+                Entry *entry = this->fetch(guard, index, amount == BSIZE_FILE);
+                if (entry == NULL)
+                {
+                    failed = true;
+                    break;
+                }
+                memcpy(entry->data + boff, data + total, amount);
+                entry->dirty = true;
+                total += amount;
+            }
+
+            // Writing past the end of the image extends it, even if only
+            // part of the data could be written.
+            if (this->length < start + total)
+                this->length = start + total;
+
+            return failed ? -1 : total;
+        }
+
+        bool BlockCache::zeroAt(std::streampos pos, std::streamsize count)
+        {
+            std::lock_guard < std::mutex > guard(this->lock);
+            if (this->invalid || !this->opened)
+            {
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return false;
+            }
+            if (count <= 0)
+                return true;
+
+            // The range is zeroed in the underlying stream, so any cached
+            // blocks only need the same bytes cleared.  A dirty block stays
+            // dirty; writing it back writes the same zeros again.
+            std::streamsize start = pos;
+            for (uint64_t index = start / BSIZE_FILE; index <= (uint64_t) (start + count - 1) / BSIZE_FILE; index += 1)
+            {
+                std::unordered_map < uint64_t, Entry * >::iterator i = this->blocks.find(index);
+                if (i == this->blocks.end())
+                    continue;
+                std::streamsize from = std::max < std::streamsize > (start, index * BSIZE_FILE);
+                std::streamsize to = std::min < std::streamsize > (start + count, (index + 1) * BSIZE_FILE);
+                memset(i->second->data + (from - index * BSIZE_FILE), 0, to - from);
+            }
+
+            bool zeroed = this->backing->zeroAt(pos, count);
+            this->propagateState();
+            if (zeroed && this->length < start + count)
+                this->length = start + count;
+            return zeroed;
+        }
+
+        std::streampos BlockCache::size()
+        {
+            std::lock_guard < std::mutex > guard(this->lock);
+            if (this->invalid || !this->opened)
+            {
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return 0;
+            }
+            return this->length;
+        }
+
+        bool BlockCache::isReadOnly()
+        {
+            return this->backing->isReadOnly();
+        }
+
+        bool BlockCache::flush()
+        {
+            std::unique_lock < std::mutex > guard(this->lock);
+            if (this->invalid || !this->opened)
+                return true;
+
+            // Writes that were started before the flush must reach the
+            // disk with it.  Waiting for the disk doesn't need the mutex.
+            this->transferred.wait(guard, [this]
+            {
+                for (std::list < Transfer >::iterator i = this->transfers.begin(); i != this->transfers.end(); i++)
+                {
+                    if (i->write)
+                        return false;
+                }
+                return true;
+            });
+            bool written = this->writeBackAll();
+            guard.unlock();
+            bool synced = this->backing->flush();
+            guard.lock();
+            this->propagateState();
+            return written && synced;
+        }
+
+        void BlockCache::prefetch(std::streampos pos, std::streamsize count)
+        {
+            // Large reads of blocks that aren't cached go straight to
+            // the underlying stream, so that is where to read ahead.
+            this->backing->prefetch(pos, count);
+        }
+
+        void BlockCache::close()
+        {
+            std::unique_lock < std::mutex > guard(this->lock);
+            this->transferred.wait(guard, [this] { return this->transfers.empty(); });
+            if (this->opened)
+            {
+                if (!this->invalid)
+                {
+                    this->writeBackAll();
+                    this->backing->flush();
+                    this->propagateState();
+                }
+                if (!this->shrink(0))
+                {
+                    // The underlying stream is going away, so there is
+                    // nowhere left to keep the blocks that couldn't be
+                    // written back.
+                    Logging::showErrorW("Discarding cached blocks that couldn't be written back to disk.");
+                    this->clear(std::ios::badbit);
+                    this->discard();
+                }
+                this->backing->close();
+            }
+            this->opened = false;
+        }
+
+        bool BlockCache::setCapacity(uint32_t capacity)
+        {
+            std::lock_guard < std::mutex > guard(this->lock);
+            this->capacity = capacity;
+            return this->shrink(capacity);
+        }
+
+        uint32_t BlockCache::getCapacity()
+        {
+            std::lock_guard < std::mutex > guard(this->lock);
+            return this->capacity;
+        }
+
+        uint64_t BlockCache::getHits()
+        {
+            std::lock_guard < std::mutex > guard(this->lock);
+            return this->hits;
+        }
+
+        uint64_t BlockCache::getMisses()
+        {
+            std::lock_guard < std::mutex > guard(this->lock);
+            return this->misses;
+        }
+
+        void BlockCache::resetStatistics()
+        {
+            std::lock_guard < std::mutex > guard(this->lock);
+            this->hits = 0;
+            this->misses = 0;
+        }
+
+        BlockCache::Entry * BlockCache::fetch(std::unique_lock < std::mutex > & guard, uint64_t index, bool overwrite)
+        {
+            // Loading a block that is being written straight to the
+            // underlying stream would cache what was there before.
+            this->transferred.wait(guard, [this, index] { return !this->isBeingWritten(index, 1); });
+
+            std::unordered_map < uint64_t, Entry * >::iterator i = this->blocks.find(index);
+            if (i != this->blocks.end())
+            {
+                // Move the block to the front of the LRU list.
+                this->hits += 1;
+                this->lru.splice(this->lru.begin(), this->lru, i->second->lru);
+                return i->second;
+            }
+
+            // Make room for the new block.
+            this->misses += 1;
+            if (!this->shrink(this->capacity - 1))
+                return NULL;
+
+            Entry *entry = new Entry();
+            entry->dirty = false;
+            if (overwrite)
+                memset(entry->data, 0, BSIZE_FILE);
+            else
+            {
+                // Blocks which straddle the end of the image read short;
+                // the remainder of the buffer reads as zeros.
+                std::streamsize bread = this->backing->readAt(index * BSIZE_FILE, entry->data, BSIZE_FILE);
+                if (bread < 0)
+                {
+                    this->propagateState();
+                    delete entry;
+                    return NULL;
+                }
+                memset(entry->data + bread, 0, BSIZE_FILE - bread);
+            }
+
+            this->lru.push_front(index);
+            entry->lru = this->lru.begin();
+            this->blocks.insert(std::unordered_map < uint64_t, Entry * >::value_type(index, entry));
+            return entry;
+        }
+
+        void BlockCache::fetchBatch(std::vector<uint64_t> & indexes)
+        {
+            std::sort(indexes.begin(), indexes.end());
+            indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+            indexes.erase(std::remove_if(indexes.begin(), indexes.end(), [this](uint64_t index)
+                        { return this->blocks.find(index) != this->blocks.end() || this->isBeingWritten(index, 1); }), indexes.end());
+
+            // Don't load more than the cache can hold, or the first
+            // blocks would be evicted before they are used.
+            if (indexes.size() > this->capacity)
+                indexes.resize(this->capacity);
+            if (indexes.size() < 2)
+                return;
+
+            std::vector < Entry * > entries;
+            std::vector < ReadRequest > batch;
+            for (std::vector < uint64_t >::iterator i = indexes.begin(); i != indexes.end(); i++)
+            {
+                Entry *entry = new Entry();
+                entry->dirty = false;
+                ReadRequest read = { (std::streamoff) (*i * BSIZE_FILE), entry->data, BSIZE_FILE, 0 };
+                entries.insert(entries.end(), entry);
+                batch.insert(batch.end(), read);
+            }
+            this->backing->readBatch(batch);
+            bool failed = false;
+            for (std::vector < ReadRequest >::iterator i = batch.begin(); i != batch.end(); i++)
+            {
+                if (i->result < 0)
+                    failed = true;
+            }
+            if (failed)
+            {
+                // Leave the blocks to be fetched one at a time, which
+                // reports the error for the read that hits it.
+                this->propagateState();
+                for (std::vector < Entry * >::iterator i = entries.begin(); i != entries.end(); i++)
+                    delete *i;
+                return;
+            }
+
+            if (!this->shrink(this->capacity - indexes.size()))
+            {
+                // Leave the blocks to be fetched one at a time, which
+                // reports the failure to the caller.
+                for (std::vector < Entry * >::iterator i = entries.begin(); i != entries.end(); i++)
+                    delete *i;
+                return;
+            }
+            this->misses += indexes.size();
+            for (size_t i = 0; i < indexes.size(); i += 1)
+            {
+                // Blocks which straddle the end of the image read short;
+                // the remainder of the buffer reads as zeros.
+                memset(entries[i]->data + batch[i].result, 0, BSIZE_FILE - batch[i].result);
+                this->lru.push_front(indexes[i]);
+                entries[i]->lru = this->lru.begin();
+                this->blocks.insert(std::unordered_map < uint64_t, Entry * >::value_type(indexes[i], entries[i]));
+            }
+        }
+
+        uint64_t BlockCache::getUncachedRun(uint64_t index, uint64_t limit)
+        {
+            uint64_t run = 0;
+            while (run < limit && this->blocks.find(index + run) == this->blocks.end())
+                run += 1;
+            return run;
+        }
+
+        std::streamsize BlockCache::readUncached(std::unique_lock < std::mutex > & guard, std::streamsize pos, char *out, std::streamsize count)
+        {
+            Transfer transfer = { (uint64_t) pos / BSIZE_FILE, (uint64_t) (pos + count + BSIZE_FILE - 1) / BSIZE_FILE - pos / BSIZE_FILE, false };
+            std::list < Transfer >::iterator t = this->transfers.insert(this->transfers.end(), transfer);
+            guard.unlock();
+            std::streamsize bread = this->backing->readAt(pos, out, count);
+            guard.lock();
+            this->transfers.erase(t);
+            this->transferred.notify_all();
+            if (bread < 0)
+            {
+                this->propagateState();
+                return -1;
+            }
+
+            for (uint64_t n = 0; n < transfer.count && (std::streamsize) (n * BSIZE_FILE) < bread; n += 1)
+            {
+                std::unordered_map < uint64_t, Entry * >::iterator i = this->blocks.find(transfer.first + n);
+                if (i != this->blocks.end())
+                    memcpy(out + n * BSIZE_FILE, i->second->data, std::min < std::streamsize > (BSIZE_FILE, bread - n * BSIZE_FILE));
+            }
+            return bread;
+        }
+
+        std::streamsize BlockCache::writeUncached(std::unique_lock < std::mutex > & guard, std::streamsize pos, const char *data, std::streamsize count)
+        {
+            Transfer transfer = { (uint64_t) pos / BSIZE_FILE, (uint64_t) (pos + count + BSIZE_FILE - 1) / BSIZE_FILE - pos / BSIZE_FILE, true };
+            std::list < Transfer >::iterator t = this->transfers.insert(this->transfers.end(), transfer);
+            guard.unlock();
+            std::streamsize bwritten = this->backing->writeAt(pos, data, count);
+            guard.lock();
+            this->transfers.erase(t);
+            this->transferred.notify_all();
+            if (bwritten < 0)
+                this->propagateState();
+            return bwritten;
+        }
+
+        bool BlockCache::isBeingWritten(uint64_t first, uint64_t count)
+        {
+            for (std::list < Transfer >::iterator i = this->transfers.begin(); i != this->transfers.end(); i++)
+            {
+                if (i->write && i->first < first + count && first < i->first + i->count)
+                    return true;
+            }
+            return false;
+        }
+
+        bool BlockCache::writeBack(uint64_t index, Entry * entry)
+        {
+            if (!entry->dirty)
+                return true;
+
+            // Don't write the padding of the final block out, so the
+            // image size matches what was actually written.
+            std::streamsize bstart = index * BSIZE_FILE;
+            std::streamsize amount = std::min < std::streamsize > (BSIZE_FILE, this->length - bstart);
+            if (amount > 0 && this->backing->writeAt(bstart, entry->data, amount) < 0)
+            {
+                Logging::showErrorW("Unable to write cached block at %u back to disk.", (uint32_t) bstart);
+                this->propagateState();
+                return false;
+            }
+            entry->dirty = false;
+            return true;
+        }
+
+        bool BlockCache::writeBackAll()
+        {
+            // Write back in block order so the underlying writes are
+            // sequential where possible.
+            std::vector < uint64_t > dirty;
+            for (std::unordered_map < uint64_t, Entry * >::iterator i = this->blocks.begin(); i != this->blocks.end(); i++)
+            {
+                if (i->second->dirty)
+                    dirty.insert(dirty.end(), i->first);
+            }
+            std::sort(dirty.begin(), dirty.end());
+            bool written = true;
+            for (std::vector < uint64_t >::iterator i = dirty.begin(); i != dirty.end(); i++)
+            {
+                if (!this->writeBack(*i, this->blocks[*i]))
+                    written = false;
+            }
+            return written;
+        }
+
+        bool BlockCache::shrink(uint32_t limit)
+        {
+            // Blocks that can't be written back stay cached (and dirty)
+            // so their data isn't lost; the next least-recently-used
+            // block is evicted in their place.
+            std::list < uint64_t >::iterator i = this->lru.end();
+            while (this->blocks.size() > limit && i != this->lru.begin())
+            {
+                i--;
+                uint64_t index = *i;
+                Entry *entry = this->blocks[index];
+                if (!this->writeBack(index, entry))
+                    continue;
+                i = this->lru.erase(i);
+                this->blocks.erase(index);
+                delete entry;
+            }
+            return this->blocks.size() <= limit;
+        }
+
+        void BlockCache::discard()
+        {
+            for (std::unordered_map < uint64_t, Entry * >::iterator i = this->blocks.begin(); i != this->blocks.end(); i++)
+                delete i->second;
+            this->blocks.clear();
+            this->lru.clear();
+        }
+
+        void BlockCache::propagateState()
+        {
+            if (this->backing->fail() || this->backing->bad())
+            {
+                this->clear(this->state | this->backing->rdstate());
+                this->backing->clear();
+            }
+        }
+    }
+}
@@ -0,0 +1,152 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_BLOCKCACHE
+#define CLASS_BLOCKCACHE
+
+#include <libapp/config.h>
+
+#include <string>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <libapp/lowlevel/blockstream.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! Caches the blocks of another BlockStream in memory.
+        /*!
+         * Reads and writes are served from a fixed number of
+         * BSIZE_FILE sized buffers, evicted in least-recently-used
+         * order.  Writes only mark a buffer dirty; dirty buffers are
+         * written to the underlying stream when they are evicted,
+         * when flush() is called or when the cache is closed.  Runs
+         * of several whole blocks that aren't cached are read from or
+         * written to the underlying stream directly instead.  The
+         * blocks that a batch of small reads needs are loaded with a
+         * single batch from the underlying stream.
+         *
+         * The cache takes ownership of the underlying stream and
+         * deletes it when the cache is deleted.  The cached blocks
+         * are protected by an internal mutex, so the cache may be
+         * shared between threads.  Reads and writes that go straight
+         * to the underlying stream are made without the mutex held,
+         * so that they run in parallel; blocks being written that
+         * way can't be loaded into the cache until the write ends.
+         */
+        class BlockCache : public BlockStream
+        {
+              public:
+            BlockCache(BlockStream * backing, uint32_t capacity = BCACHE_BLOCKS);
+            virtual ~BlockCache();
+
+            virtual std::streamsize readAt(std::streampos pos, char *out, std::streamsize count);
+            virtual void readBatch(std::vector<ReadRequest> & reads);
+            virtual std::streamsize writeAt(std::streampos pos, const char *data, std::streamsize count);
+            virtual bool zeroAt(std::streampos pos, std::streamsize count);
+            virtual std::streampos size();
+            virtual bool isReadOnly();
+            virtual bool flush();
+            virtual void prefetch(std::streampos pos, std::streamsize count);
+            virtual void close();
+
+            //! Changes the number of blocks held in memory, evicting
+            //! (and writing back) blocks if the cache shrinks.  A
+            //! capacity of 0 passes all I/O straight through.  Returns
+            //! false if dirty blocks couldn't be written back, in which
+            //! case they stay cached until they can be.
+            bool setCapacity(uint32_t capacity);
+            uint32_t getCapacity();
+
+            //! Returns the number of block lookups served from memory.
+            uint64_t getHits();
+            //! Returns the number of block lookups that had to read
+            //! from the underlying stream.
+            uint64_t getMisses();
+            void resetStatistics();
+
+              private:
+            struct Entry
+            {
+                char data[BSIZE_FILE];
+                bool dirty;
+                std::list < uint64_t >::iterator lru;
+            };
+
+            BlockStream * backing;
+            std::mutex lock;
+            uint32_t capacity;
+            std::streamsize length;
+            uint64_t hits;
+            uint64_t misses;
+
+            // The cached blocks keyed by block index, and the block
+            // indexes ordered from most to least recently used.
+            std::unordered_map < uint64_t, Entry * > blocks;
+            std::list < uint64_t > lru;
+
+            // A run of blocks being read from or written to the
+            // underlying stream without the mutex held.
+            struct Transfer
+            {
+                uint64_t first;
+                uint64_t count;
+                bool write;
+            };
+            std::list < Transfer > transfers;
+            std::condition_variable transferred;
+
+            // Returns the cached entry for the block at the specified
+            // index, loading it from the underlying stream unless the
+            // caller is about to overwrite the whole block.  Waits
+            // (releasing the mutex) while the block is being written
+            // straight to the underlying stream.
+            Entry * fetch(std::unique_lock < std::mutex > & guard, uint64_t index, bool overwrite);
+
+            // Loads the blocks with the specified indexes that aren't
+            // cached with a single batch from the underlying stream.
+            void fetchBatch(std::vector<uint64_t> & indexes);
+
+            // Returns how many of the blocks starting at the specified
+            // index (up to limit) are not cached.
+            uint64_t getUncachedRun(uint64_t index, uint64_t limit);
+
+            // Reads or writes count bytes of uncached blocks at pos
+            // straight from or to the underlying stream, releasing the
+            // mutex while it does so.  Blocks that were loaded into the
+            // cache during a read are copied over what was read, since
+            // the cache may hold newer data for them.
+            std::streamsize readUncached(std::unique_lock < std::mutex > & guard, std::streamsize pos, char *out, std::streamsize count);
+            std::streamsize writeUncached(std::unique_lock < std::mutex > & guard, std::streamsize pos, const char *data, std::streamsize count);
+
+            // Returns whether any of count blocks from first are being
+            // written straight to the underlying stream.
+            bool isBeingWritten(uint64_t first, uint64_t count);
+
+            // Writes a dirty entry back to the underlying stream,
+            // returning false if it couldn't be written.
+            bool writeBack(uint64_t index, Entry * entry);
+
+            // Writes all dirty entries back to the underlying stream,
+            // returning false if any of them couldn't be written.
+            bool writeBackAll();
+
+            // Evicts least-recently-used blocks until there are at
+            // most limit blocks cached.  Dirty blocks that can't be
+            // written back are kept, and false is returned if that
+            // leaves more than limit blocks cached.
+            bool shrink(uint32_t limit);
+
+            // Drops every cached block without writing it back.
+            void discard();
+
+            // Copies any error state from the underlying stream.
+            void propagateState();
+        };
+    }
+}
+
+#endif
@@ -4,34 +4,19 @@
 
 #include <string>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 #include <libapp/logging.h>
 #include <libapp/lowlevel/endian.h>
 #include <libapp/lowlevel/blockstream.h>
+#include <libapp/lowlevel/mappedblockstream.h>
+#include <libapp/lowlevel/blockcache.h>
+#include <libapp/lowlevel/uringblockstream.h>
 #include <errno.h>
-#ifndef WIN32
-#define _open ::open
-#define _tell ::tell
-#define _lseek ::lseek
-#define _write ::write
-#define _read ::read
-#define _close ::close
-#else
-#include <io.h>
-#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-
-#ifndef WIN32
-#define CREATE_CRITICAL() this->mutex = new pthread_mutex_t; pthread_mutex_init(this->mutex, NULL);
-#define ENTER_CRITICAL() pthread_mutex_lock(this->mutex);
-#define LEAVE_CRITICAL() pthread_mutex_unlock(this->mutex);
-#else
-#pragma message ("No support for critical locking in BlockStream on Windows yet.")
-#define CREATE_CRITICAL() ;
-#define ENTER_CRITICAL() ;
-#define LEAVE_CRITICAL() ;
-#endif
+#include <unistd.h>
 
 namespace AppLib
 {
@@ -39,15 +24,12 @@ namespace AppLib
     {
         BlockStream::BlockStream(std::string filename)
         {
-            CREATE_CRITICAL();
-
-            ENTER_CRITICAL();
-
             this->opened = false;
             this->invalid = false;
+            this->state = std::ios::goodbit;
 
-            this->fd = new std::fstream(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-            if (!this->fd->is_open())
+            this->fd = ::open(filename.c_str(), O_RDWR);
+            if (this->fd < 0)
             {
                 Logging::showErrorW("Unable to open specified file as BlockStream.");
                 this->invalid = true;
@@ -55,167 +37,252 @@ namespace AppLib
                 this->clear(std::ios::badbit | std::ios::failbit);
                 return;
             }
-            else
-            {
-                this->fd->exceptions(std::ifstream::badbit | std::ios::failbit | std::ios::eofbit);
-                this->invalid = false;
-                this->opened = true;
-            }
 
-            LEAVE_CRITICAL();
+            this->opened = true;
         }
 
-        void BlockStream::write(const char *data, std::streamsize count)
+        BlockStream::BlockStream()
         {
-            ENTER_CRITICAL();
+            this->fd = -1;
+            this->opened = false;
+            this->invalid = false;
+            this->state = std::ios::goodbit;
+        }
 
-            if (this->invalid || !this->opened || this->fail())
+        BlockStream * BlockStream::open(std::string filename, BlockStreamMode::BlockStreamMode mode)
+        {
+            switch (mode)
             {
-                if (!this->fail())
-                    this->clear(std::ios::badbit | std::ios::failbit);
-                return;
+                case BlockStreamMode::BSM_MAPPED_READONLY:
+                    return new MappedBlockStream(filename);
+                case BlockStreamMode::BSM_READWRITE_UNCACHED:
+                    return new BlockStream(filename);
+                case BlockStreamMode::BSM_READWRITE_URING:
+                    return new BlockCache(new UringBlockStream(filename));
+                case BlockStreamMode::BSM_READWRITE:
+                default:
+                    return new BlockCache(new BlockStream(filename));
             }
-
-            this->fd->write(data, count);
-
-            LEAVE_CRITICAL();
         }
 
-        std::streamsize BlockStream::read(char *out, std::streamsize count)
+        BlockStream::~BlockStream()
         {
-            ENTER_CRITICAL();
+            if (this->opened)
+                this->close();
+        }
 
-            if (this->invalid || !this->opened || this->fail())
+        std::streamsize BlockStream::readAt(std::streampos pos, char *out, std::streamsize count)
+        {
+            if (this->invalid || !this->opened)
             {
-                if (!this->fail())
-                    this->clear(std::ios::badbit | std::ios::failbit);
-                return 0;
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return -1;
             }
 
-            this->fd->readsome(out, count);
-            std::streamsize total = this->fd->gcount();
-
-            LEAVE_CRITICAL();
+            // pread may return less than requested if interrupted, so
+            // keep reading until we either have everything or hit the
+            // end of the image.
+            std::streamsize total = 0;
+            while (total < count)
+            {
+                ssize_t res = ::pread(this->fd, out + total, count - total, (off_t) pos + total);
+                if (res < 0 && errno == EINTR)
+                    continue;
+                if (res < 0)
+                {
+                    Logging::showErrorW("I/O error occurred while reading from file.");
+                    this->clear(this->state | std::ios::badbit | std::ios::failbit);
+                    return -1;
+                }
+                if (res == 0)
+                    break;
+                total += res;
+            }
 
             return total;
         }
 
-        void BlockStream::close()
+        void BlockStream::readBatch(std::vector<ReadRequest> & reads)
         {
-            ENTER_CRITICAL();
-
-            this->fd->close();
-            this->opened = false;
-
-            LEAVE_CRITICAL();
+            for (std::vector < ReadRequest >::iterator i = reads.begin(); i != reads.end(); i++)
+                i->result = this->readAt(i->pos, i->out, i->count);
         }
 
-        void BlockStream::seekp(std::streampos pos, std::ios_base::seekdir dir)
+        std::streamsize BlockStream::writeAt(std::streampos pos, const char *data, std::streamsize count)
         {
-            ENTER_CRITICAL();
-
-            if (this->invalid || !this->opened || this->fail())
+            if (this->invalid || !this->opened)
             {
-                if (!this->fail())
-                    this->clear(std::ios::badbit | std::ios::failbit);
-                return;
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return -1;
             }
 
-            this->fd->seekp(pos, dir);
+            std::streamsize total = 0;
+            while (total < count)
+            {
+                ssize_t res = ::pwrite(this->fd, data + total, count - total, (off_t) pos + total);
+                if (res < 0 && errno == EINTR)
+                    continue;
+                if (res <= 0)
+                {
+                    Logging::showErrorW("I/O error occurred while writing to file.");
+                    this->clear(this->state | std::ios::badbit | std::ios::failbit);
+                    return -1;
+                }
+                total += res;
+            }
 
-            LEAVE_CRITICAL();
+            return total;
         }
 
-        void BlockStream::seekg(std::streampos pos, std::ios_base::seekdir dir)
+        bool BlockStream::zeroAt(std::streampos pos, std::streamsize count)
         {
-            ENTER_CRITICAL();
-
-            if (this->invalid || !this->opened || this->fail())
+            if (this->invalid || !this->opened)
             {
-                if (!this->fail())
-                    this->clear(std::ios::badbit | std::ios::failbit);
-                return;
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return false;
             }
+            if (count <= 0)
+                return true;
+
+#ifdef FALLOC_FL_ZERO_RANGE
+            // Ask the filesystem to zero the range (extending the image if
+            // needed) without us writing anything.  The fallbacks are
+            // only for filesystems that can't; if the disk is full they
+            // would fail too, or extend the image without space behind it.
+            if (::fallocate(this->fd, FALLOC_FL_ZERO_RANGE, (off_t) pos, (off_t) count) == 0)
+                return true;
+            if (errno == ENOSPC)
+            {
+                this->clear(this->state | std::ios::badbit | std::ios::failbit);
+                return false;
+            }
+#endif
 
-            this->fd->seekg(pos, dir);
+            // Ranges past the end of the image only have to be allocated,
+            // or failing that the image can just be extended over them.
+            if ((std::streamsize) pos >= (std::streamsize) this->size())
+            {
+#ifdef __linux__
+                if (::fallocate(this->fd, 0, (off_t) pos, (off_t) count) == 0)
+                    return true;
+                if (errno == ENOSPC)
+                {
+                    this->clear(this->state | std::ios::badbit | std::ios::failbit);
+                    return false;
+                }
+#endif
+                if (::ftruncate(this->fd, (off_t) pos + count) == 0)
+                    return true;
+            }
 
-            LEAVE_CRITICAL();
+            // Otherwise write the zeros out from one large buffer.
+            std::vector < char > zero(std::min < std::streamsize > (count, 1024 * 1024), 0);
+            std::streamsize total = 0;
+            while (total < count)
+            {
+                std::streamsize res = this->writeAt((std::streamsize) pos + total, &zero[0], std::min < std::streamsize > (count - total, zero.size()));
+                if (res <= 0)
+                    return false;
+                total += res;
+            }
+            return true;
         }
 
-        std::streampos BlockStream::tellp()
+        std::streampos BlockStream::size()
         {
-            ENTER_CRITICAL();
-
-            if (this->invalid || !this->opened || this->fail())
+            if (this->invalid || !this->opened)
             {
-                if (!this->fail())
-                    this->clear(std::ios::badbit | std::ios::failbit);
+                this->clear(std::ios::badbit | std::ios::failbit);
                 return 0;
             }
 
-            std::streampos pos = this->fd->tellp();
-
-            LEAVE_CRITICAL();
+            struct stat info;
+            if (::fstat(this->fd, &info) != 0)
+            {
+                this->clear(this->state | std::ios::badbit | std::ios::failbit);
+                return 0;
+            }
+            return info.st_size;
+        }
 
-            return pos;
+        bool BlockStream::isReadOnly()
+        {
+            return false;
         }
 
-        std::streampos BlockStream::tellg()
+        bool BlockStream::flush()
         {
-            ENTER_CRITICAL();
+            if (this->invalid || !this->opened || this->isReadOnly())
+                return true;
 
-            if (this->invalid || !this->opened || this->fail())
+            // Writes go straight to the file, so all that is left is
+            // to wait for the kernel to write them to the disk.
+            if (::fdatasync(this->fd) != 0)
             {
-                if (!this->fail())
-                    this->clear(std::ios::badbit | std::ios::failbit);
-                return 0;
+                Logging::showErrorW("I/O error occurred while syncing file.");
+                this->clear(this->state | std::ios::badbit);
+                return false;
             }
+            return true;
+        }
 
-            std::streampos pos = this->fd->tellg();
+        void BlockStream::prefetch(std::streampos pos, std::streamsize count)
+        {
+            if (this->invalid || !this->opened)
+                return;
 
-            LEAVE_CRITICAL();
+#ifdef POSIX_FADV_WILLNEED
+            // The kernel starts reading the range into the page cache
+            // and returns without waiting for it.
+            ::posix_fadvise(this->fd, (off_t) pos, (off_t) count, POSIX_FADV_WILLNEED);
+#endif
+        }
 
-            return pos;
+        void BlockStream::close()
+        {
+            if (this->opened)
+                ::close(this->fd);
+            this->opened = false;
         }
 
         bool BlockStream::is_open()
         {
-            return this->fd->is_open();
+            return this->opened;
         }
 
         std::ios::iostate BlockStream::rdstate()
         {
-            return this->fd->rdstate();
+            return this->state;
         }
 
         void BlockStream::clear()
         {
-            this->fd->clear();
+            this->state = std::ios::goodbit;
         }
 
         void BlockStream::clear(std::ios::iostate state)
         {
-            this->fd->clear(state);
+            this->state = state;
         }
 
         bool BlockStream::good()
         {
-            return this->fd->good();
+            return (this->state == std::ios::goodbit);
         }
 
         bool BlockStream::bad()
         {
-            return this->fd->bad();
+            return ((this->state & std::ios::badbit) != 0);
         }
 
         bool BlockStream::eof()
         {
-            return this->fd->eof();
+            return ((this->state & std::ios::eofbit) != 0);
         }
 
         bool BlockStream::fail()
         {
-            return this->fd->fail();
+            return ((this->state & std::ios::failbit) != 0);
         }
     }
 }
@@ -7,26 +7,88 @@
 
 #include <string>
 #include <iostream>
+#include <vector>
+#include <atomic>
 #include <libapp/logging.h>
 #include <libapp/lowlevel/endian.h>
+#include <libapp/lowlevel/blockstreammode.h>
 #include <errno.h>
-#include <pthread.h>
 
 namespace AppLib
 {
     namespace LowLevel
     {
+        //! Provides offset-addressed access to a package image.
+        /*!
+         * All I/O is performed with an explicit position, so there
+         * is no shared stream cursor and independent callers (or
+         * threads) may read from the image concurrently without
+         * seeking.
+         *
+         * Each call reports its own failure through its result, which
+         * is what callers should check.  The stream state is only a
+         * record that an error has occurred at some point; since it
+         * is shared by every caller, it can't tell a caller whether
+         * its own call failed.
+         */
         class BlockStream
         {
               public:
             BlockStream(std::string filename);
-            void write(const char *data, std::streamsize count);
-             std::streamsize read(char *out, std::streamsize count);
-            void close();
-            void seekp(std::streampos pos, std::ios_base::seekdir dir = std::ios_base::beg);
-            void seekg(std::streampos pos, std::ios_base::seekdir dir = std::ios_base::beg);
-             std::streampos tellp();
-             std::streampos tellg();
+            virtual ~BlockStream();
+
+            //! Opens the specified image using the requested access mode,
+            //! returning a BlockStream (or subclass) that the caller owns.
+            static BlockStream * open(std::string filename, BlockStreamMode::BlockStreamMode mode);
+
+            //! Reads up to count bytes from the absolute position pos.  The
+            //! result is the number of bytes read, which is only short when
+            //! the read extends past the end of the image, or -1 if the
+            //! read failed.
+            virtual std::streamsize readAt(std::streampos pos, char *out, std::streamsize count);
+
+            //! A single read made as part of readBatch.
+            struct ReadRequest
+            {
+                std::streampos pos;         //!< The absolute position to read from.
+                char *out;                  //!< Where to store the data.
+                std::streamsize count;      //!< The number of bytes to read.
+                std::streamsize result;     //!< Set to what readAt would have returned.
+            };
+
+            //! Performs several reads that don't depend on each other.  This
+            //! implementation makes them one after another; streams that can
+            //! have many reads in flight at once issue them all together.
+            virtual void readBatch(std::vector<ReadRequest> & reads);
+
+            //! Writes count bytes at the absolute position pos.  Writing past
+            //! the end of the image extends it, with any gap reading as zeros.
+            //! The result is count, or -1 if the write failed.
+            virtual std::streamsize writeAt(std::streampos pos, const char *data, std::streamsize count);
+
+            //! Makes count bytes from the absolute position pos read as
+            //! zeros, extending the image if they are past its end.  Where
+            //! the filesystem supports it the range is zeroed or allocated
+            //! without writing any data.  Returns false if this failed.
+            virtual bool zeroAt(std::streampos pos, std::streamsize count);
+
+            //! Returns the current size of the image in bytes.
+            virtual std::streampos size();
+
+            //! Returns whether writes to this stream are refused.
+            virtual bool isReadOnly();
+
+            //! Writes out any data buffered by the stream and waits for it
+            //! to reach the disk.  Returns false (and sets badbit) if it
+            //! couldn't be written.
+            virtual bool flush();
+
+            //! Hints that count bytes from the absolute position pos will
+            //! be read soon, so that they can be read into memory in the
+            //! background.  Does nothing if the stream can't do this.
+            virtual void prefetch(std::streampos pos, std::streamsize count);
+
+            virtual void close();
 
             // State functions.
             bool is_open();
@@ -38,11 +100,15 @@ namespace AppLib
             bool eof();
             bool fail();
 
-              private:
-             std::fstream * fd;
+              protected:
+            //! Initializes an unopened stream for use by subclasses that
+            //! open the image themselves.
+            BlockStream();
+
+            int fd;
             bool opened;
             bool invalid;
-            pthread_mutex_t * mutex;
+             std::atomic < std::ios::iostate > state;
         };
     }
 }
@@ -0,0 +1,34 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_BLOCKSTREAMMODE
+#define CLASS_LOWLEVEL_BLOCKSTREAMMODE
+
+#include <libapp/config.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        namespace BlockStreamMode
+        {
+            enum BlockStreamMode
+            {
+                // Read-write access through an in-memory block cache.
+                BSM_READWRITE,
+
+                // Read-write access using positional I/O directly.
+                BSM_READWRITE_UNCACHED,
+
+                // Read-only access to a memory-mapped image.
+                BSM_MAPPED_READONLY,
+
+                // Read-write access through an in-memory block cache, with
+                // batches of reads issued together through io_uring (or
+                // read one at a time if io_uring isn't available).
+                BSM_READWRITE_URING
+            };
+        }
+    }
+}
+
+#endif
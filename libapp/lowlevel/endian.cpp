@@ -22,63 +22,46 @@ namespace AppLib
              Endian::little_endian = (test_int_raw[0] == 1);
         }
 
-        void Endian::doR(BlockStream * fd, char *data, unsigned int size)
+        bool Endian::doRAt(BlockStream * fd, std::streampos pos, char *data, unsigned int size)
         {
+            // The stream is shared between threads, so the result of the
+            // read is checked rather than the stream state.
+            std::streamsize got;
             if (Endian::little_endian)
-                fd->read(data, size);
+                got = fd->readAt(pos, data, size);
             else
             {
                 char *dStorage = (char *) malloc(size);
-                 fd->read(dStorage, size);
+                got = fd->readAt(pos, dStorage, size);
                 for (unsigned int i = 0; i < size; i += 1)
                 {
-                    data[i] = dStorage[size - i];
+                    data[i] = dStorage[size - 1 - i];
                 }
+                free(dStorage);
             }
-            if (fd->fail() && fd->eof())
-                 fd->clear(std::ios::eofbit);
-            else if (fd->fail() && fd->bad())
-            {
+            if (got < 0)
                 Logging::showErrorW("I/O error occurred while reading from file.");
-                fd->clear();
-            }
-            else if (fd->fail())
-            {
-                Logging::showWarningW("Unexpected failure while reading from file.");
-                fd->clear();
-            }
+            return (got == (std::streamsize) size);
         }
 
-        void Endian::doW(BlockStream * fd, char *data, unsigned int size)
+        bool Endian::doWAt(BlockStream * fd, std::streampos pos, const char *data, unsigned int size)
         {
+            std::streamsize put;
             if (Endian::little_endian)
-                fd->write(data, size);
+                put = fd->writeAt(pos, data, size);
             else
             {
                 char *dStorage = (char *) malloc(size);
                 for (unsigned int i = 0; i < size; i += 1)
                 {
-                    dStorage[size - i] = data[i];
+                    dStorage[size - 1 - i] = data[i];
                 }
-                fd->write(dStorage, size);
+                put = fd->writeAt(pos, dStorage, size);
+                free(dStorage);
             }
-            if (fd->fail() && fd->eof())
-                fd->clear(std::ios::eofbit);
-            else if (fd->fail() && fd->bad())
-            {
+            if (put < 0)
                 Logging::showErrorW("I/O error occurred while writing to file.");
-                fd->clear();
-            }
-            else if (fd->fail())
-            {
-                Logging::showWarningW("Unexpected failure while writing to file.");
-                fd->clear();
-            }
-        }
-
-        void Endian::doW(BlockStream * fd, const char *data, unsigned int size)
-        {
-            Endian::doW(fd, const_cast < char *>(data), size);
+            return (put == (std::streamsize) size);
         }
 
         void Endian::doR(std::iostream * fd, char *data, unsigned int size)
@@ -20,9 +20,10 @@ namespace AppLib
             public:
                 static bool little_endian;
                 static void detectEndianness();
-                static void doR(BlockStream * fd, char * data, unsigned int size);
-                static void doW(BlockStream * fd, char * data, unsigned int size);
-                static void doW(BlockStream * fd, const char * data, unsigned int size);
+                // Reads or writes a value at pos in the stream, returning
+                // false if it couldn't be read or written in full.
+                static bool doRAt(BlockStream * fd, std::streampos pos, char * data, unsigned int size);
+                static bool doWAt(BlockStream * fd, std::streampos pos, const char * data, unsigned int size);
                 static void doR(std::iostream * fd, char * data, unsigned int size);
                 static void doW(std::iostream * fd, char * data, unsigned int size);
                 static void doW(std::iostream * fd, const char * data, unsigned int size);
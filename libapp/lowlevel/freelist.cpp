@@ -3,6 +3,8 @@
 #include <libapp/lowlevel/freelist.h>
 #include <libapp/lowlevel/fs.h>
 #include <math.h>
+#include <string.h>
+#include <algorithm>
 
 namespace AppLib
 {
@@ -12,285 +14,380 @@ namespace AppLib
         {
             this->filesystem = filesystem;
             this->fd = fd;
+            this->free_count = 0;
+            this->last_list_block = 0;
 
             // Make a cache out of the on-disk data.
             this->syncronizeCache();
         }
 
-        uint32_t FreeList::allocateBlock()
+        uint32_t FreeList::allocateBlock(uint32_t hint)
         {
-            // Check to see if the size of the position cache is 0, in which case
+            // Check to see if there are no free blocks, in which case
             // we need to actually allocate a new block at the end of the file.
-            if (this->position_cache.size() == 0)
+            if (this->free_count == 0)
             {
-                // Get the filesize.
-                std::streampos oldg = this->fd->tellg();
-                this->fd->seekg(0, std::ios::end);
-                uint32_t fsize = (uint32_t) this->fd->tellg();
-                 this->fd->seekg(oldg);
-
-                // Align the position on the upper 4096 boundary.
-                double fblocks = fsize / 4096.0f;
-                uint32_t alignedpos = ceil(fblocks) * 4096;
-
-                // Force the block to be consumed so that the next time
-                // we try to allocate a block, the seek-to-end-of-file
-                // will work as expected.
-                std::streampos oldp = this->fd->tellp();
-                const char* zero = "\0";
-                this->fd->seekp(alignedpos);
-                for (int i = 0; i < 4096; i += 1)
-                    this->fd->write(zero, 1);
-                this->fd->seekp(oldp);
-
-                Logging::showDebugW("FREELIST: Allocate (  new   ) block at %u.", alignedpos);
-
-                 return alignedpos;
+                uint32_t pos = this->allocateAtEnd(1);
+                Logging::showDebugW("FREELIST: Allocate (  new   ) block at %u.", pos);
+                return pos;
             }
 
-            // Get the first unallocated block.
-            std::map < uint32_t, uint32_t >::iterator i = this->position_cache.begin();
-
-            // Update the position in the free block allocation table
-            // to be equal to 0 to indicate that the free block is taken.
-            std::streampos oldp = this->fd->tellp();
-            this->fd->seekp(i->first);
-            Endian::doW(this->fd, reinterpret_cast < char *>(&i->second), 4);
-            this->fd->seekp(oldp);
-            uint32_t res = i->second;
+            // Find the extent to allocate from.  Without a hint we take
+            // the lowest free block; with a hint we take the hinted block
+            // if it is free, otherwise the next free block after it.
+            std::map < uint32_t, uint32_t >::iterator i = this->extents.begin();
+            uint32_t pos = i->first;
+            if (hint != 0)
+            {
+                hint -= hint % BSIZE_FILE;
+                std::map < uint32_t, uint32_t >::iterator next = this->extents.upper_bound(hint);
+                if (next != this->extents.begin())
+                {
+                    std::map < uint32_t, uint32_t >::iterator prev = next;
+                    prev--;
+                    if (hint < prev->first + prev->second * BSIZE_FILE)
+                    {
+                        i = prev;
+                        pos = hint;
+                    }
+                    else if (next != this->extents.end())
+                    {
+                        i = next;
+                        pos = next->first;
+                    }
+                }
+                else if (next != this->extents.end())
+                {
+                    i = next;
+                    pos = next->first;
+                }
+            }
 
-            Logging::showDebugW("FREELIST: Allocate (existing) block at %u.", res);
+            this->takeFromExtent(i, pos, 1);
 
-            // Remove the entry from the position cache.
-            this->position_cache.erase(i);
+            Logging::showDebugW("FREELIST: Allocate (existing) block at %u.", pos);
 
             // Return the new writable position.
-            return res;
+            return pos;
         }
 
-        void FreeList::freeBlock(uint32_t pos)
+        uint32_t FreeList::allocateBlocks(uint32_t count, uint32_t hint, uint32_t & allocated)
         {
-            // Get a new, blank writable index on the disk (and if
-            // we need to allocate a new block on disk for the freelist
-            // tell it to use the one we are free'ing).
-            uint32_t dpos = this->getIndexInList(0, pos);
-
-            // Although hacky, getIndexInList returns 1 to indicate that
-            // it used the provided availPos argument for it's new block.
-            // In that case, since getIndexInList immediately reallocated
-            // the new block, we're no longer actually going to free it
-            // (since it is now used).
-            if (dpos == 1)
+            allocated = count;
+            if (count == 0)
+                return 0;
+            if (count == 1)
             {
-                Logging::showDebugW("FREELIST: Reallocated block at %u for list use.", pos);
-                return;
+                uint32_t pos = this->allocateBlock(hint);
+                if (pos == 0)
+                    return 0;
+                return this->zeroAllocated(pos, 1);
             }
 
-            // If we can actually store the free'd block on disk, do so.
-            if (dpos != 0)
+            // Find the first extent large enough, starting from the
+            // extent containing (or following) the hint and wrapping
+            // around to the start of the package.
+            std::map < uint32_t, uint32_t >::iterator start = this->extents.begin();
+            if (hint != 0)
             {
-                // Store the current position of the file descriptor.
-                std::streampos oldg = this->fd->tellg();
-
-                // Write to disk.
-                this->fd->seekp(dpos);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&pos), 4);
-
-                // Restore the position of the file descriptor.
-                this->fd->seekg(oldg);
-
-                Logging::showDebugW("FREELIST: Free block at %u.", pos);
+                hint -= hint % BSIZE_FILE;
+                start = this->extents.upper_bound(hint);
+                if (start != this->extents.begin())
+                    start--;
+
+                // If the blocks starting at the hint are free, use them.
+                if (start != this->extents.end() && hint >= start->first &&
+                    hint + count * BSIZE_FILE <= start->first + start->second * BSIZE_FILE)
+                {
+                    this->takeFromExtent(start, hint, count);
+                    Logging::showDebugW("FREELIST: Allocate (existing) %u blocks at %u.", count, hint);
+                    return this->zeroAllocated(hint, count);
+                }
+            }
+            std::map < uint32_t, uint32_t >::iterator i = start;
+            std::map < uint32_t, uint32_t >::iterator largest = this->extents.end();
+            for (uint32_t n = 0; n < this->extents.size(); n += 1)
+            {
+                if (i == this->extents.end())
+                    i = this->extents.begin();
+                if (i->second >= count)
+                {
+                    uint32_t pos = i->first;
+                    this->takeFromExtent(i, pos, count);
+                    Logging::showDebugW("FREELIST: Allocate (existing) %u blocks at %u.", count, pos);
+                    return this->zeroAllocated(pos, count);
+                }
+                if (largest == this->extents.end() || i->second > largest->second)
+                    largest = i;
+                i++;
             }
-            else
-                Logging::showDebugW("FREELIST: Unable to record free'd block %u on disk.", pos);
 
-            // Add the new free position to the cache.
-            this->position_cache.insert(std::map < uint32_t, uint32_t >::value_type(dpos, pos));
-        }
+            // Free space is too fragmented for a single run, so reuse
+            // the largest part of it rather than growing the package.
+            if (largest != this->extents.end())
+            {
+                uint32_t pos = largest->first;
+                allocated = largest->second;
+                this->takeFromExtent(largest, pos, allocated);
+                Logging::showDebugW("FREELIST: Allocate (existing) %u of %u blocks at %u.", allocated, count, pos);
+                return this->zeroAllocated(pos, allocated);
+            }
 
-        uint32_t FreeList::getIndexInList(uint32_t pos)
-        {
-            return this->getIndexInList(pos, 0);
+            uint32_t pos = this->allocateAtEnd(count);
+            Logging::showDebugW("FREELIST: Allocate (  new   ) %u blocks at %u.", count, pos);
+            return pos;
         }
 
-        uint32_t FreeList::getIndexInList(uint32_t pos, uint32_t availPos)
+        void FreeList::freeBlock(uint32_t pos)
         {
-            // Get the FSInfo inode by position.
-            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
-
-            // Get the position of the first FreeList inode.
-            uint32_t fpos = fsinfo.pos_freelist;
-            uint32_t ipos = 0;
-            uint32_t tpos = 0;
-
-            // Store the current position of the file descriptor.
-            std::streampos oldg = this->fd->tellg();
+            if (this->isBlockFree(pos))
+            {
+                Logging::showDebugW("FREELIST: Block at %u is already free.", pos);
+                return;
+            }
 
-            // Loop through the FreeList inodes, searching for
-            // correct index.
-            while (fpos != 0)
+            // If there are no empty slots left in the on-disk table, use
+            // the block we are free'ing as a new FreeList block.  In that
+            // case the block is now in use and we're no longer actually
+            // going to free it.
+            if (this->empty_slots.size() == 0)
             {
-                for (int i = 8; i < 4096; i += 4)
+                if (this->appendListBlock(pos))
                 {
-                    this->fd->seekg(fpos + i);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&tpos), 4);
-                    if (tpos == pos)
-                    {
-                        // Success, we've matched correctly.
-                        // Seek back to the original position.
-                        this->fd->seekg(oldg);
-
-                        // Return the correct position.
-                        return fpos + i;
-                    }
+                    Logging::showDebugW("FREELIST: Reallocated block at %u for list use.", pos);
+                    return;
                 }
+                Logging::showDebugW("FREELIST: Unable to record free'd block %u on disk.", pos);
+            }
+            else
+            {
+                // Write to disk.
+                uint32_t slot = this->empty_slots.back();
+                this->empty_slots.pop_back();
+                Endian::doWAt(this->fd, slot, reinterpret_cast < char *>(&pos), 4);
+                this->slots[pos] = slot;
 
-                // Once we have scanned all the entries in our current FreeList block, we need
-                // to move onto the next one.
-                this->fd->seekg(fpos + 4);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&fpos), 4);
+                Logging::showDebugW("FREELIST: Free block at %u.", pos);
             }
 
-            // Special condition: If the pos is 0, and ipos is 0,
-            // then we need to allocate a new FreeList block for
-            // storing a new value.
-            if (pos == 0 && ipos == 0)
+            // Add the block to the extents, merging it with the
+            // extents immediately before and after it.
+            uint32_t start = pos;
+            uint32_t length = 1;
+            std::map < uint32_t, uint32_t >::iterator next = this->extents.lower_bound(pos);
+            if (next != this->extents.begin())
             {
-                // Create a new FreeList block.
-                uint32_t fpos = availPos;
-                if (fpos == 0)
-                    fpos = this->allocateBlock();
-                if (fpos == 0)
+                std::map < uint32_t, uint32_t >::iterator prev = next;
+                prev--;
+                if (prev->first + prev->second * BSIZE_FILE == pos)
                 {
-                    this->fd->seekg(oldg);
-                    return 0;
-                }
-                INode fnode(0, "", INodeType::INT_FREELIST);
-                FSResult::FSResult res = this->filesystem->writeINode(fpos, fnode);
-                if (res != FSResult::E_SUCCESS)
-                {
-                    this->fd->seekg(oldg);
-                    return 0;
+                    start = prev->first;
+                    length += prev->second;
+                    this->extents.erase(prev);
                 }
+            }
+            if (next != this->extents.end() && next->first == pos + BSIZE_FILE)
+            {
+                length += next->second;
+                this->extents.erase(next);
+            }
+            this->extents.insert(std::map < uint32_t, uint32_t >::value_type(start, length));
+            this->free_count += 1;
+        }
 
-                // Now assign the new FreeList block as the next one in
-                // the list for the current last FreeList block.
-                uint32_t lpos = fsinfo.pos_freelist;
-                uint32_t llpos = lpos;
-                if (lpos == 0)
-                {
-                    // Update FSInfo inode.
-                    fsinfo.pos_freelist = fpos;
+        bool FreeList::isBlockFree(uint32_t pos)
+        {
+            // Find the last extent starting at or before pos.
+            std::map < uint32_t, uint32_t >::iterator i = this->extents.upper_bound(pos);
+            if (i == this->extents.begin())
+                return false;
+            i--;
+            return (pos < i->first + i->second * BSIZE_FILE);
+        }
 
-                    this->fd->seekp(OFFSET_FSINFO);
-                    try
-                    {
-                        std::string data = fsinfo.getBinaryRepresentation();
-                        this->fd->write(data.c_str(), data.size());
-                    }
-                    catch(std::ifstream::failure e)
-                    {
-                        // End-of-file.
-                        this->fd->clear();
-                        this->fd->seekg(oldg);
-                        return 0;
-                    }
-                }
-                else
-                {
-                    while (lpos != 0)
-                    {
-                        llpos = lpos;
+        uint32_t FreeList::getFreeBlockCount()
+        {
+            return this->free_count;
+        }
 
-                        // Get the next position.
-                        INode node = this->filesystem->getINodeByPosition(lpos);
-                        lpos = node.flst_next;
-                    }
+        INodeType::INodeType FreeList::getBlockType(uint32_t pos)
+        {
+            return INodeType::INT_INVALID;
+        }
 
-                    // Update FreeList inode.
-                    INode onode = this->filesystem->getINodeByPosition(llpos);
-                    onode.flst_next = fpos;
-                    FSResult::FSResult res = this->filesystem->updateRawINode(onode, llpos);
-                    if (res != FSResult::E_SUCCESS)
-                    {
-                        this->fd->seekg(oldg);
-                        return 0;
-                    }
-                }
+        void FreeList::takeFromExtent(std::map < uint32_t, uint32_t >::iterator extent, uint32_t pos, uint32_t count)
+        {
+            uint32_t start = extent->first;
+            uint32_t end = start + extent->second * BSIZE_FILE;
+            uint32_t after = pos + count * BSIZE_FILE;
+            this->extents.erase(extent);
+            if (pos > start)
+                this->extents.insert(std::map < uint32_t, uint32_t >::value_type(start, (pos - start) / BSIZE_FILE));
+            if (after < end)
+                this->extents.insert(std::map < uint32_t, uint32_t >::value_type(after, (end - after) / BSIZE_FILE));
+            this->free_count -= count;
+
+            // Update the positions in the free block allocation table
+            // to be equal to 0 to indicate that the free blocks are taken.
+            for (uint32_t i = 0; i < count; i += 1)
+                this->clearSlot(pos + i * BSIZE_FILE);
+        }
 
-                // Seek back to the original position.
-                this->fd->seekg(oldg);
+        void FreeList::clearSlot(uint32_t pos)
+        {
+            std::unordered_map < uint32_t, uint32_t >::iterator i = this->slots.find(pos);
+            if (i == this->slots.end())
+                return;
+            uint32_t zero = 0;
+            Endian::doWAt(this->fd, i->second, reinterpret_cast < char *>(&zero), 4);
+            this->empty_slots.insert(this->empty_slots.end(), i->second);
+            this->slots.erase(i);
+        }
 
-                // If we used the availPos as our new freelist index,
-                // return 1 instead of the normal value.
-                if (fpos == availPos)
-                    return 1;
-                else
-                    return fpos + HSIZE_FREELIST;
+        uint32_t FreeList::allocateAtEnd(uint32_t count)
+        {
+            // Get the filesize.
+            uint32_t fsize = (uint32_t) this->fd->size();
+
+            // Align the position on the upper 4096 boundary.
+            double fblocks = fsize / 4096.0f;
+            uint32_t alignedpos = ceil(fblocks) * 4096;
+
+            // Force the blocks to be consumed so that the next time
+            // we try to allocate a block, the end-of-file size query
+            // will work as expected.  The filesystem allocates them
+            // rather than us writing zeros over them.  If the package
+            // can't grow (because the disk is full), the next allocation
+            // would be given the same position, so nothing is allocated.
+            if (!this->fd->zeroAt(alignedpos, (std::streamsize) count * BSIZE_FILE))
+            {
+                Logging::showErrorW("Unable to extend the package by %u blocks at %u.", count, alignedpos);
+                return 0;
             }
 
-            // Seek back to the original position.
-            this->fd->seekg(oldg);
+            return alignedpos;
+        }
 
+        uint32_t FreeList::zeroAllocated(uint32_t pos, uint32_t count)
+        {
+            if (this->fd->zeroAt(pos, (std::streamsize) count * BSIZE_FILE))
+                return pos;
+
+            // Data blocks must read back as zeros until they are written,
+            // so blocks that couldn't be zeroed are given back.
+            Logging::showErrorW("Unable to zero %u allocated blocks at %u.", count, pos);
+            for (uint32_t i = 0; i < count; i += 1)
+                this->freeBlock(pos + i * BSIZE_FILE);
             return 0;
         }
 
-        bool FreeList::isBlockFree(uint32_t pos)
+        bool FreeList::appendListBlock(uint32_t pos)
         {
-            for (std::map < uint32_t, uint32_t >::iterator i = this->position_cache.begin(); i != this->position_cache.end(); i++)
+            // Create a new FreeList block.
+            INode fnode(0, "", INodeType::INT_FREELIST);
+            FSResult::FSResult res = this->filesystem->writeINode(pos, fnode);
+            if (res != FSResult::E_SUCCESS)
+                return false;
+
+            // Now assign the new FreeList block as the next one in
+            // the list for the current last FreeList block.
+            if (this->last_list_block == 0)
             {
-                if (i->first == pos)
-                    return true;
+                // Update FSInfo inode.
+                FSInfo fsinfo = this->filesystem->getFSInfo();
+                fsinfo.pos_freelist = pos;
+                if (this->filesystem->updateFSInfo(fsinfo) != FSResult::E_SUCCESS)
+                    return false;
             }
+            else
+            {
+                // Update FreeList inode.
+                INode onode = this->filesystem->getINodeByPosition(this->last_list_block);
+                onode.flst_next = pos;
+                res = this->filesystem->updateRawINode(onode, this->last_list_block);
+                if (res != FSResult::E_SUCCESS)
+                    return false;
+            }
+            this->last_list_block = pos;
 
-            return false;
-        }
-
-        INodeType::INodeType FreeList::getBlockType(uint32_t pos)
-        {
-            return INodeType::INT_INVALID;
+            // All of the slots in the new block are empty.  Push them in
+            // reverse so the lowest slot is used first.
+            for (int i = BSIZE_FILE - 4; i >= HSIZE_FREELIST; i -= 4)
+                this->empty_slots.insert(this->empty_slots.end(), pos + i);
+            return true;
         }
 
         void FreeList::syncronizeCache()
         {
             // Clear the cache.
-            this->position_cache.clear();
+            this->extents.clear();
+            this->slots.clear();
+            this->empty_slots.clear();
+            this->free_count = 0;
+            this->last_list_block = 0;
 
             // Get the FSInfo inode by position.
-            INode fsinfo = this->filesystem->getINodeByPosition(OFFSET_FSINFO);
+            FSInfo fsinfo = this->filesystem->getFSInfo();
 
             // Get the position of the first FreeList inode.
             uint32_t fpos = fsinfo.pos_freelist;
-            uint32_t ipos = 0;
-            uint32_t tpos = 0;
 
-            // Check to make sure there is at least one freelist block.
-            if (fpos == 0)
-                return;
-
-            // Store the current position of the file descriptor.
-            std::streampos oldg = this->fd->tellg();
-
-            // Loop through the FreeList inodes, adding non-zero values
-            // to the cache.
+            // Loop through the FreeList inodes, recording every non-zero
+            // slot as a free block and every zero slot as available.  Each
+            // FreeList block is read in a single call.
+            std::vector < uint32_t > free_positions;
+            char block[BSIZE_FILE];
             while (fpos != 0)
             {
-                for (int i = 8; i < 4096; i += 4)
+                this->last_list_block = fpos;
+                if (this->fd->readAt(fpos, block, BSIZE_FILE) != BSIZE_FILE)
+                {
+                    Logging::showErrorW("Unable to read FreeList block at %u.", fpos);
+                    break;
+                }
+
+                for (int i = BSIZE_FILE - 4; i >= HSIZE_FREELIST; i -= 4)
                 {
-                    this->fd->seekg(fpos + i);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&tpos), 4);
-                    if (tpos != 0)
+                    uint32_t tpos = 0;
+                    memcpy(&tpos, block + i, 4);
+                    if (!Endian::little_endian)
+                        tpos = __builtin_bswap32(tpos);
+                    if (tpos == 0)
+                        this->empty_slots.insert(this->empty_slots.end(), fpos + i);
+                    else if (this->slots.find(tpos) != this->slots.end())
+                    {
+                        // The same block is recorded twice; drop the
+                        // duplicate record.
+                        uint32_t zero = 0;
+                        Endian::doWAt(this->fd, fpos + i, reinterpret_cast < char *>(&zero), 4);
+                        this->empty_slots.insert(this->empty_slots.end(), fpos + i);
+                    }
+                    else
                     {
-                        this->position_cache.insert(std::pair < uint32_t, uint32_t > (fpos + i, tpos));
+                        this->slots[tpos] = fpos + i;
+                        free_positions.insert(free_positions.end(), tpos);
                     }
                 }
 
                 // Get the next position.
-                fpos = this->filesystem->getINodeByPosition(fpos).flst_next;
+                uint32_t next = 0;
+                memcpy(&next, block + 4, 4);
+                if (!Endian::little_endian)
+                    next = __builtin_bswap32(next);
+                fpos = next;
             }
 
-            // Seek back to the original position.
-            this->fd->seekg(oldg);
+            // Build the extents from the sorted list of free positions.
+            std::sort(free_positions.begin(), free_positions.end());
+            std::map < uint32_t, uint32_t >::iterator last = this->extents.end();
+            for (std::vector < uint32_t >::iterator i = free_positions.begin(); i != free_positions.end(); i++)
+            {
+                if (last != this->extents.end() && last->first + last->second * BSIZE_FILE == *i)
+                    last->second += 1;
+                else
+                    last = this->extents.insert(std::map < uint32_t, uint32_t >::value_type(*i, 1)).first;
+                this->free_count += 1;
+            }
 
             // The cache has now been (re)built.
         }
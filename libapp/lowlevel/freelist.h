@@ -17,6 +17,8 @@ namespace AppLib
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <vector>
+#include <unordered_map>
 #include <libapp/lowlevel/endian.h>
 #include <libapp/lowlevel/fs.h>
 
@@ -31,8 +33,23 @@ namespace AppLib
 
             // Finds a free block, marks it as allocated in the free
             // space allocation table, and returns it's position for
-            // writing.
-            uint32_t allocateBlock();
+            // writing.  If hint is non-zero, the free block closest
+            // after hint is preferred so that related blocks stay
+            // together on disk.  Returns 0 if the package couldn't be
+            // extended to make room.
+            uint32_t allocateBlock(uint32_t hint = 0);
+
+            // Finds up to count contiguous free blocks, marks them as
+            // allocated, stores how many there are in allocated and
+            // returns the position of the first one.  If there is no
+            // free extent large enough, all of the largest one is taken
+            // instead (and the caller must allocate the rest); only if
+            // there are no free blocks at all are the blocks allocated
+            // at the end of the package.  The blocks are zeroed, since
+            // they are used for file data that must read back as zeros
+            // until it is written.  Returns 0 if the blocks couldn't be
+            // allocated or zeroed.
+            uint32_t allocateBlocks(uint32_t count, uint32_t hint, uint32_t & allocated);
 
             // Frees a specified block, marking it as unallocated in
             // the free space allocation table.
@@ -41,6 +58,9 @@ namespace AppLib
             // Returns whether a specified position is free.
             bool isBlockFree(uint32_t pos);
 
+            // Returns the number of blocks that are currently free.
+            uint32_t getFreeBlockCount();
+
             // Returns the specified type of an inode at the specified
             // position, returning INT_FREEBLOCK and INT_DATA in appropriate
             // circumstances.
@@ -50,30 +70,46 @@ namespace AppLib
             FS * filesystem;
             BlockStream *fd;
 
-            // Returns the position in the free space allocation table
-            // where a 32-bit position integer can be written, that
-            // currently matches pos.
-            uint32_t getIndexInList(uint32_t pos);
-
-            // Returns the position in the free space allocation table
-            // where a 32-bit position integer can be written, that
-            // currently matches pos.  Optionally providing an availPos
-            // which is free space that has not yet been marked as free
-            // (used as part of freeBlock to immediately repurpose free'd
-            // blocks for use as part of the FreeList structure).  In the
-            // event that this function reuses availPos for the freelist,
-            // it returns 1.
-            uint32_t getIndexInList(uint32_t pos, uint32_t availPos);
-
-            // An in-memory cache of the free space allocation table, so
-            // that fast lookups can be done to determine whether or not
-            // a block is free or not (without having to cycle through the
-            // entire free block allocation table).
-            //
-            // The first (key) value is the position that's free, the second
-            // value is the position on disk of the free allocation index
-            // (i.e. the result of getIndexInList for the specified position).
-            std::map < uint32_t, uint32_t > position_cache;
+            // The free space in the package as a set of extents.  The
+            // key is the position of the first free block in the extent
+            // and the value is the number of blocks in it.  Adjacent
+            // extents are always merged.
+            std::map < uint32_t, uint32_t > extents;
+
+            // The total number of blocks in extents.
+            uint32_t free_count;
+
+            // The position of the slot in the on-disk free space
+            // allocation table that records each free block, keyed by
+            // the free block's position.
+            std::unordered_map < uint32_t, uint32_t > slots;
+
+            // Positions of slots in the on-disk table that are empty
+            // and can record a newly freed block.
+            std::vector < uint32_t > empty_slots;
+
+            // The position of the last FreeList block in the on-disk
+            // chain (or 0 if there are none yet).
+            uint32_t last_list_block;
+
+            // Removes the block at pos from the extent that starts at
+            // the provided iterator, splitting the extent if required.
+            void takeFromExtent(std::map < uint32_t, uint32_t >::iterator extent, uint32_t pos, uint32_t count);
+
+            // Clears the on-disk record of a block that is no longer free.
+            void clearSlot(uint32_t pos);
+
+            // Extends the package by count blocks and returns the position
+            // of the first new block, or 0 if the package couldn't grow.
+            uint32_t allocateAtEnd(uint32_t count);
+
+            // Zeroes count newly allocated blocks at pos, returning pos,
+            // or frees them again and returns 0 if they can't be zeroed.
+            uint32_t zeroAllocated(uint32_t pos, uint32_t count);
+
+            // Turns the block at pos into a new FreeList block on the end
+            // of the on-disk chain, making its slots available.
+            bool appendListBlock(uint32_t pos);
 
             // Resyncronizes the cache based on what is on disk.
             void syncronizeCache();
@@ -14,7 +14,10 @@
 #include <errno.h>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
+#include <stdint.h>
 #include <vector>
+#include <unordered_set>
 
 namespace AppLib
 {
@@ -31,8 +34,22 @@ namespace AppLib
             Endian::detectEndianness();
 
             this->fd = fd;
+            this->inodesCapacity = ICACHE_INODES;
+            this->preallocationLimit = PREALLOC_BLOCKS_MAX;
+            this->readaheadLimit = READAHEAD_BYTES;
+            this->bufferedBytes = 0;
+            this->bufferedLimit = 0;
+            this->loadINodeLookupTable();
             this->freelist = new FreeList(this, fd);
 
+            // Work out how file data is laid out from the format version.
+            FSInfo fsinfo = this->getFSInfo();
+            this->extentLayout = (fsinfo.ver_major > 0 || fsinfo.ver_minor >= 2);
+            this->directoryLists = (fsinfo.features & FEATURE_DIRECTORY_LISTS) != 0;
+            this->unsupportedFeatures = (fsinfo.features & ~FEATURE_DIRECTORY_LISTS) != 0;
+            if (this->unsupportedFeatures)
+                Logging::showWarningW("Package uses features that this version does not support; it can only be opened read-only.");
+
 #if 0 == 1
             // Check for text-mode stream, which will break binary packages.
             uint32_t tpos = this->getTemporaryBlock();
@@ -47,10 +64,8 @@ namespace AppLib
                  msg[4] = 0;
                 for (int i = 0; i < 5; i++)
                      omsg[i] = 0;
-                 Util::seekp_ex(this->fd, tpos);
-                 this->fd->write(&msg[0], 3);
-                 this->fd->seekg(tpos + 2);
-                 this->fd->read(&omsg[2], 3);
+                 this->fd->writeAt(tpos, &msg[0], 3);
+                 this->fd->readAt(tpos + 2, &omsg[2], 3);
                  omsg[0] = 'm';
                  omsg[1] = '\n';
                 if (strcmp(&omsg[0], &msg[0]) != 0)
@@ -69,7 +84,12 @@ namespace AppLib
             return (this->fd != NULL);
         }
 
-        INode FS::getINodeByID(uint16_t id)
+        bool FS::hasUnsupportedFeatures()
+        {
+            return this->unsupportedFeatures;
+        }
+
+        INode FS::getINodeByID(uint16_t id, bool children)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
@@ -78,7 +98,7 @@ namespace AppLib
             uint32_t ipos = this->getINodePositionByID(id);
             if (ipos == 0 || ipos < OFFSET_FSINFO)
                 return INode(0, "", INodeType::INT_INVALID);
-            return this->getINodeByPosition(ipos);
+            return this->getINodeByPosition(ipos, children);
         }
 
         INode FS::getRealINodeByID(uint16_t id)
@@ -93,11 +113,11 @@ namespace AppLib
             return this->getINodeByRealPosition(ipos);
         }
 
-        INode FS::getINodeByPosition(uint32_t ipos)
+        INode FS::getINodeByPosition(uint32_t ipos, bool children)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
             
-            INode node = this->getINodeByRealPosition(ipos);
+            INode node = this->getINodeByRealPosition(ipos, children);
             
             // If this is a hardlink, resolve it automatically.
             if (node.type == INodeType::INT_HARDLINK)
@@ -106,92 +126,162 @@ namespace AppLib
             return node;
         }
 
-        INode FS::getINodeByRealPosition(uint32_t ipos)
+        INode FS::getINodeByRealPosition(uint32_t ipos, bool children)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
+            // The cache only holds headers, so it can't be used when a
+            // directory's child table is wanted.
+            {
+                std::lock_guard < std::mutex > guard(this->inodesLock);
+                std::unordered_map < uint32_t, CachedINode >::iterator i = this->inodes.find(ipos);
+                if (i != this->inodes.end() && (!children || i->second.node->type != INodeType::INT_DIRECTORY))
+                {
+                    this->inodesLRU.splice(this->inodesLRU.begin(), this->inodesLRU, i->second.lru);
+                    return *i->second.node;
+                }
+            }
+
             INode node(0, "", INodeType::INT_INVALID);
 
-            // Seek to the inode position
-            std::streampos old = this->fd->tellg();
-            this->fd->seekg(ipos);
+            // Read the whole header (and the child table, if it is
+            // wanted) in a single call and decode it from memory.
+            char data[BSIZE_DIRECTORY];
+            uint32_t length = children ? BSIZE_DIRECTORY : INodeLayout::HSIZE_MAX;
+            std::streamsize got = this->fd->readAt(ipos, data, length);
+            if (got < 0)
+                Logging::showWarningW("Unexpected failure while reading INode at %u.", ipos);
+            if (got < 0 || !node.setBinaryRepresentation(data, got, children))
+                return INode(0, "", INodeType::INT_INVALID);
 
-            // Read the data.
-            Endian::doR(this->fd, reinterpret_cast < char *>(&node.inodeid), 2);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&node.type), 2);
-            if (node.type == INodeType::INT_SEGINFO)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.info_next), 4);
+            // Ensure that if our node data is invalid, we return an invalid
+            // INode instead of partial data.
+            if (!node.verify())
+                return INode(0, "", INodeType::INT_INVALID);
 
-                // Seek back to the original reading position.
-                this->fd->seekg(old);
+            this->cacheINode(ipos, node);
+            return node;
+        }
 
-                return node;
-            }
-            else if (node.type == INodeType::INT_FREELIST)
+        void FS::setINodeCacheSize(uint32_t capacity)
+        {
+            std::lock_guard < std::mutex > guard(this->inodesLock);
+            this->inodesCapacity = capacity;
+            while (this->inodes.size() > this->inodesCapacity)
             {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.flst_next), 4);
+                this->inodes.erase(this->inodesLRU.back());
+                this->inodesLRU.pop_back();
+            }
+        }
 
-                // Seek back to the original reading position.
-                this->fd->seekg(old);
+        void FS::cacheINode(uint32_t pos, const INode & node)
+        {
+            // Only inodes that are looked up by ID are worth keeping;
+            // the other kinds of block are read by position once.
+            if (node.type != INodeType::INT_FILEINFO && node.type != INodeType::INT_DIRECTORY &&
+                node.type != INodeType::INT_SYMLINK && node.type != INodeType::INT_DEVICE &&
+                node.type != INodeType::INT_HARDLINK)
+                return;
 
-                return node;
+            std::lock_guard < std::mutex > guard(this->inodesLock);
+            if (this->inodesCapacity == 0)
+                return;
+            std::unordered_map < uint32_t, CachedINode >::iterator i = this->inodes.find(pos);
+            if (i != this->inodes.end())
+            {
+                *i->second.node = node;
+                i->second.node->children.clear();
+                this->inodesLRU.splice(this->inodesLRU.begin(), this->inodesLRU, i->second.lru);
+                return;
             }
-            else if (node.type == INodeType::INT_FSINFO)
+            while (this->inodes.size() >= this->inodesCapacity)
             {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.fs_name), 10);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ver_major), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ver_minor), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ver_revision), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_name), 256);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_ver), 32);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_desc), 1024);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.app_author), 256);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.pos_root), 4);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.pos_freelist), 4);
-
-                // Seek back to the original reading position.
-                this->fd->seekg(old);
-
-                return node;
+                this->inodes.erase(this->inodesLRU.back());
+                this->inodesLRU.pop_back();
             }
-            Endian::doR(this->fd, reinterpret_cast < char *>(&node.filename), 256);
-            if (node.type != INodeType::INT_HARDLINK)
+            this->inodesLRU.push_front(pos);
+            CachedINode entry = { std::make_shared < INode > (node), this->inodesLRU.begin() };
+            entry.node->children.clear();
+            this->inodes.insert(std::unordered_map < uint32_t, CachedINode >::value_type(pos, entry));
+        }
+
+        void FS::loadINodes(const std::vector<uint16_t> & ids)
+        {
+            std::vector < uint32_t > wanted;
             {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.uid), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.gid), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.mask), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.atime), 8);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.mtime), 8);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.ctime), 8);
+                std::lock_guard < std::mutex > guard(this->inodesLock);
+                for (std::vector < uint16_t >::const_iterator i = ids.begin(); i != ids.end() && wanted.size() < this->inodesCapacity; i++)
+                {
+                    uint32_t ipos = this->getINodePositionByID(*i);
+                    if (ipos != 0 && ipos >= OFFSET_FSINFO && this->inodes.find(ipos) == this->inodes.end())
+                        wanted.insert(wanted.end(), ipos);
+                }
             }
-            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_DEVICE)
+            if (wanted.size() < 2)
+                return;
+
+            std::vector < char > data(wanted.size() * INodeLayout::HSIZE_MAX);
+            std::vector < BlockStream::ReadRequest > reads(wanted.size());
+            for (size_t i = 0; i < wanted.size(); i += 1)
             {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.dev), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.rdev), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.nlink), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.blocks), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.dat_len), 4);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.info_next), 4);
+                BlockStream::ReadRequest read = { wanted[i], &data[i * INodeLayout::HSIZE_MAX], INodeLayout::HSIZE_MAX, 0 };
+                reads[i] = read;
             }
-            else if (node.type == INodeType::INT_DIRECTORY)
+            this->fd->readBatch(reads);
+
+            // Inodes that couldn't be read are left to be read one at a
+            // time, which warns about them.
+            for (size_t i = 0; i < wanted.size(); i += 1)
             {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.parent), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.children_count), 2);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.children), DIRECTORY_CHILDREN_MAX * 2);
+                INode node(0, "", INodeType::INT_INVALID);
+                if (reads[i].result > 0 && node.setBinaryRepresentation(reads[i].out, reads[i].result, false) && node.verify())
+                    this->cacheINode(wanted[i], node);
             }
-            else if (node.type == INodeType::INT_HARDLINK)
-                Endian::doR(this->fd, reinterpret_cast < char *>(&node.realid), 2);
+        }
 
-            // Seek back to the original reading position.
-            this->fd->seekg(old);
-    
-            // Ensure that if our node data is invalid, we return an invalid
-            // INode instead of partial data.
-            if (!node.verify())
-                return INode(0, "", INodeType::INT_INVALID);
+        void FS::patchCachedINode(uint32_t pos, const std::function<void(INode &)> & change)
+        {
+            std::lock_guard < std::mutex > guard(this->inodesLock);
+            std::unordered_map < uint32_t, CachedINode >::iterator i = this->inodes.find(pos);
+            if (i != this->inodes.end())
+                change(*i->second.node);
+        }
 
-            return node;
+        void FS::invalidateCachedINode(uint32_t pos)
+        {
+            std::lock_guard < std::mutex > guard(this->inodesLock);
+            std::unordered_map < uint32_t, CachedINode >::iterator i = this->inodes.find(pos);
+            if (i == this->inodes.end())
+                return;
+            this->inodesLRU.erase(i->second.lru);
+            this->inodes.erase(i);
+        }
+
+        FSInfo FS::getFSInfo()
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            FSInfo info;
+            char data[HSIZE_FSINFO];
+            std::streamsize got = this->fd->readAt(OFFSET_FSINFO, data, HSIZE_FSINFO);
+            if (got < 0)
+                Logging::showErrorW("Unable to read filesystem information block.");
+            if (got < 0 || !info.setBinaryRepresentation(data, got))
+                Logging::showErrorW("Filesystem information block is not valid.");
+            return info;
+        }
+
+        FSResult::FSResult FS::updateFSInfo(FSInfo info)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            if (info.type != INodeType::INT_FSINFO)
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+
+            std::string data = info.getBinaryRepresentation();
+            if (this->fd->writeAt(OFFSET_FSINFO, data.c_str(), data.length()) < 0)
+                return FSResult::E_FAILURE_GENERAL;
+            return FSResult::E_SUCCESS;
         }
 
         FSResult::FSResult FS::writeINode(uint32_t pos, INode node)
@@ -213,42 +303,39 @@ namespace AppLib
             if (!node.verify())
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
-            std::streampos old = this->fd->tellp();
+            // Any segment map or cached inode for a file that used to be
+            // here is stale.
+            this->invalidateSegmentMap(pos);
+            this->invalidateCachedINode(pos);
+
+            // Pad the header out to the full block size so the whole
+            // block is written with a single call.
             std::string data = node.getBinaryRepresentation();
-            Util::seekp_ex(this->fd, pos);
-            this->fd->write(data.c_str(), data.length());
-            if (this->fd->fail())
-                Logging::showErrorW("Write failure on write of new INode.");
-            if (this->fd->bad())
-                Logging::showErrorW("Write bad on write of new INode.");
-            if (this->fd->eof())
-                Logging::showErrorW("Write EOF on write of new INode.");
-            // TODO: Should we return with failure if any of the above if
-            // statements execute?
-
-            const char *z = "";	// a const char* always has a \0 terminator, which we use to write into the file.
             // TODO: This needs to be updated with a full list of inode types.
             if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SEGINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_FREELIST || node.type == INodeType::INT_DEVICE || node.type == INodeType::INT_HARDLINK)
-            {
-                for (int i = 0; i < BSIZE_FILE - data.length(); i += 1)
-                    Endian::doW(this->fd, z, 1);
-            }
+                data.resize(BSIZE_FILE, '\0');
             else if (node.type == INodeType::INT_DIRECTORY)
-            {
-                int target = BSIZE_DIRECTORY - data.length();
-                for (int i = 0; i < target; i += 1)
-                    Endian::doW(this->fd, z, 1);
-            }
+                data.resize(BSIZE_DIRECTORY, '\0');
             else
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
+
+            if (this->fd->writeAt(pos, data.c_str(), data.length()) < 0)
+                Logging::showErrorW("Write failure on write of new INode.");
+            // TODO: Should we return with failure if the write above
+            // fails?
             if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK || node.type == INodeType::INT_DIRECTORY || node.type == INodeType::INT_DEVICE || node.type == INodeType::INT_HARDLINK)
             {
+                // Cache the inode as it would be read back (the child
+                // table of a new directory is empty).
+                INode written(0, "", INodeType::INT_INVALID);
+                if (written.setBinaryRepresentation(data.c_str(), data.length(), false))
+                    this->cacheINode(pos, written);
+
                 LowLevel::FSResult::FSResult sres = this->setINodePositionByID(node.inodeid, pos);
                 if (sres != LowLevel::FSResult::E_SUCCESS)
                     return sres;
             }
             this->unreserveINodeID(node.inodeid);
-            Util::seekp_ex(this->fd, old);
             return FSResult::E_SUCCESS;
         }
 
@@ -271,11 +358,9 @@ namespace AppLib
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
             // Do a very simple update of the data.
-            std::streampos old = this->fd->tellp();
             std::string data = node.getBinaryRepresentation();
-            Util::seekp_ex(this->fd, pos);
-            this->fd->write(data.c_str(), data.length());
-            Util::seekp_ex(this->fd, old);
+            this->fd->writeAt(pos, data.c_str(), data.length());
+            this->invalidateCachedINode(pos);
             return FSResult::E_SUCCESS;
 
         }
@@ -305,17 +390,40 @@ namespace AppLib
             if (!node.verify())
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
-            std::streampos old = this->fd->tellp();
+            // The children of a directory are only changed through
+            // addChildToDirectoryINode and removeChildFromDirectoryINode,
+            // so only the header is written back.
             std::string data = node.getBinaryRepresentation();
-            Util::seekp_ex(this->fd, pos);
-            this->fd->write(data.c_str(), data.length());
+            if (node.type == INodeType::INT_DIRECTORY)
+                data.resize(HSIZE_DIRECTORY);
+            this->fd->writeAt(pos, data.c_str(), data.length());
+
+            // Write the header through to the inode cache in the form it
+            // has on disk (which, for a file resolved through a hardlink,
+            // isn't the form it was passed in).
+            INode written(0, "", INodeType::INT_INVALID);
+            if (written.setBinaryRepresentation(data.c_str(), data.length(), false))
+                this->cacheINode(pos, written);
+            else
+                this->invalidateCachedINode(pos);
+
+            // Keep the name index of the directory the node is in up to
+            // date.  A file that was resolved through a hardlink keeps
+            // the name it was created with on disk.
+            FSResult::FSResult rres;
+            if ((node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_DEVICE) && node.realid != 0)
+                rres = this->renameInDirectoryIndex(node.inodeid, node.realfilename);
+            else
+                rres = this->renameInDirectoryIndex(node.inodeid, node.filename);
+            if (rres != FSResult::E_SUCCESS)
+                return rres;
+
             // We do not write out the file data with zeros
             // as in writeINode because we want to keep the
             // content.
             LowLevel::FSResult::FSResult sres = this->setINodePositionByID(node.inodeid, pos);
             if (sres != LowLevel::FSResult::E_SUCCESS)
                 return sres;
-            Util::seekp_ex(this->fd, old);
             return FSResult::E_SUCCESS;
         }
 
@@ -323,38 +431,25 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            this->fd->clear();
-            std::streampos old = this->fd->tellg();
-            uint32_t newp = OFFSET_LOOKUP + (id * 4);
-            this->fd->seekg(newp);
-            uint32_t ipos = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ipos), 4);
-            this->fd->seekg(old);
-            return ipos;
+            return this->positions[id];
         }
 
         uint16_t FS::getFirstFreeINodeNumber()
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            this->fd->clear();
-            std::streampos old = this->fd->tellg();
-            this->fd->seekg(OFFSET_LOOKUP);
-            uint32_t ipos = 0;
-            uint16_t count = 0;
-            uint16_t ret = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ipos), 4);
-            while ((ipos != 0 && count < 65535) || std::find(this->reservedINodes.begin(), this->reservedINodes.end(), count) != this->reservedINodes.end())
+            // Skip over full words of the bitmap, then find the lowest
+            // clear bit in the first word that has one.
+            for (uint32_t i = this->usedINodesHint; i < this->usedINodes.size(); i += 1)
             {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&ipos), 4);
-                count += 1;
+                if (this->usedINodes[i] != ~(uint64_t) 0)
+                {
+                    this->usedINodesHint = i;
+                    return i * 64 + __builtin_ctzll(~this->usedINodes[i]);
+                }
             }
-            if (count == 65535 && ipos != 0)
-                ret = 0;
-            else
-                ret = count;
-            this->fd->seekg(old);
-            return ret;
+            this->usedINodesHint = this->usedINodes.size();
+            return 0;
         }
 
         FSResult::FSResult FS::setINodePositionByID(uint16_t id, uint32_t pos)
@@ -369,10 +464,14 @@ namespace AppLib
                     return res;
             }
 
-            std::streampos old = this->fd->tellp();
-            Util::seekp_ex(this->fd, OFFSET_LOOKUP + (id * 4));
-            Endian::doW(this->fd, reinterpret_cast < char *>(&pos), 4);
-            Util::seekp_ex(this->fd, old);
+            if (this->positions[id] != pos)
+            {
+                this->invalidateSegmentMap(this->positions[id]);
+                this->invalidateDirectoryIndex(id);
+            }
+            Endian::doWAt(this->fd, OFFSET_LOOKUP + (id * 4), reinterpret_cast < char *>(&pos), 4);
+            this->positions[id] = pos;
+            this->setINodeIDUsed(id, pos != 0);
             return FSResult::E_SUCCESS;
         }
 
@@ -384,6 +483,13 @@ namespace AppLib
             return this->freelist->allocateBlock();
         }
 
+        uint32_t FS::getFreeBlockCount()
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            return this->freelist->getFreeBlockCount();
+        }
+
         bool FS::isBlockFree(uint32_t pos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
@@ -399,174 +505,185 @@ namespace AppLib
             if (parentid == childid)
                 return FSResult::E_FAILURE_GENERAL;
 
-            signed int type_offset = 2;
-            signed int children_count_offset = 292;
-            signed int children_offset = 294;
+            signed int children_count_offset = INodeLayout::DIRECTORY_CHILDREN_COUNT_OFFSET;
+            signed int children_offset = INodeLayout::DIRECTORY_CHILDREN_OFFSET;
             uint32_t pos = this->getINodePositionByID(parentid);
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
 
-            // Read to make sure it's a directory.
-            uint16_t parent_type = (uint16_t) INodeType::INT_UNSET;
-            this->fd->seekg(pos + type_offset);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&parent_type), 2);
-            if (parent_type != INodeType::INT_DIRECTORY)
-            {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+            // Make sure it's a directory.
+            DirectoryIndex * index = this->getDirectoryIndex(parentid);
+            if (index == NULL)
                 return FSResult::E_FAILURE_NOT_A_DIRECTORY;
-            }
 
-            // Now seek to the start of the list of directory children.
-            this->fd->seekg(pos + children_offset);
-            Util::seekp_ex(this->fd, pos + children_offset);
+            uint16_t children_count_current = 0;
+            Endian::doRAt(this->fd, pos + children_count_offset, reinterpret_cast < char *>(&children_count_current), 2);
+            INode cnode = this->getINodeByID(childid, false);
 
-            // Find the first available child slot.
-            uint16_t ccinode = 0;
-            uint16_t count = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
-            while (ccinode != 0 && count < DIRECTORY_CHILDREN_MAX - 1)
+            if (this->directoryLists)
             {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
-                count += 1;
-            }
-            if (count == DIRECTORY_CHILDREN_MAX - 1 && ccinode != 0)
-            {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
-                return FSResult::E_FAILURE_MAXIMUM_CHILDREN_REACHED;
+                // Directory lists grow as needed, so the only limit is
+                // the number of children that can be counted.
+                if (children_count_current == UINT16_MAX)
+                    return FSResult::E_FAILURE_MAXIMUM_CHILDREN_REACHED;
+
+                std::lock_guard < std::mutex > guard(this->directoriesLock);
+                uint64_t key = FS::getDirectoryListKey(cnode.filename, childid);
+                FSResult::FSResult res = this->insertIntoDirectoryList(*index, parentid, key);
+                if (res != FSResult::E_SUCCESS)
+                    return res;
+                this->indexChild(*index, parentid, key + 1, childid, cnode);
             }
             else
             {
-                uint32_t writeg = this->fd->tellg();
-                Util::seekp_ex(this->fd, writeg - 2);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&childid), 2);
+                // Find the first available child slot.
+                uint16_t slot = index->firstFree;
+                while (slot < DIRECTORY_CHILDREN_MAX && index->used[slot])
+                    slot += 1;
+                index->firstFree = slot;
+                if (slot == DIRECTORY_CHILDREN_MAX)
+                    return FSResult::E_FAILURE_MAXIMUM_CHILDREN_REACHED;
+
+                Endian::doWAt(this->fd, pos + children_offset + slot * 2, reinterpret_cast < char *>(&childid), 2);
+
+                std::lock_guard < std::mutex > guard(this->directoriesLock);
+                index->used[slot] = true;
+                index->firstFree = slot + 1;
+                this->indexChild(*index, parentid, slot + 1, childid, cnode);
+            }
 
-                uint16_t children_count_current = 0;
-                this->fd->seekg(pos + children_count_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
-                children_count_current += 1;
-                Util::seekp_ex(this->fd, pos + children_count_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+            children_count_current += 1;
+            Endian::doWAt(this->fd, pos + children_count_offset, reinterpret_cast < char *>(&children_count_current), 2);
+            this->patchCachedINode(pos, [&](INode & node) { node.children_count = children_count_current; });
 
-                // Update times.
-                this->updateTimes(parentid, false, true, true);
+            // Update times.
+            this->updateTimes(parentid, false, true, true);
 
-                return FSResult::E_SUCCESS;
-            }
+            return FSResult::E_SUCCESS;
         }
 
         FSResult::FSResult FS::removeChildFromDirectoryINode(uint16_t parentid, uint16_t childid)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int type_offset = 2;
-            signed int children_count_offset = 292;
-            signed int children_offset = 294;
+            signed int children_count_offset = INodeLayout::DIRECTORY_CHILDREN_COUNT_OFFSET;
+            signed int children_offset = INodeLayout::DIRECTORY_CHILDREN_OFFSET;
             uint32_t pos = this->getINodePositionByID(parentid);
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
 
-            // Read to make sure it's a directory.
-            uint16_t parent_type = (uint16_t) INodeType::INT_UNSET;
-            this->fd->seekg(pos + type_offset);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&parent_type), 2);
-            if (parent_type != INodeType::INT_DIRECTORY)
-            {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+            // Make sure it's a directory.
+            DirectoryIndex * index = this->getDirectoryIndex(parentid);
+            if (index == NULL)
                 return FSResult::E_FAILURE_NOT_A_DIRECTORY;
-            }
 
-            // Now seek to the start of the list of directory children.
-            this->fd->seekg(pos + children_offset);
-            Util::seekp_ex(this->fd, pos + children_offset);
+            // Find where the child inode is.
+            std::unordered_map < uint16_t, DirectoryIndex::Entry >::iterator i = index->entries.find(childid);
+            if (i == index->entries.end())
+                return FSResult::E_FAILURE_INVALID_FILENAME;
+            uint64_t offset = i->second.offset;
 
-            // Find the slot that the child inode is in.
-            uint16_t ccinode = 0;
-            uint16_t count = 0;
-            Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
-            while (ccinode != childid && count < DIRECTORY_CHILDREN_MAX - 1)
-            {
-                Endian::doR(this->fd, reinterpret_cast < char *>(&ccinode), 2);
-                count += 1;
-            }
-            if (count == DIRECTORY_CHILDREN_MAX - 1 && ccinode != childid)
+            bool duplicates;
             {
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
-                return FSResult::E_FAILURE_INVALID_FILENAME;
+                std::lock_guard < std::mutex > guard(this->directoriesLock);
+                if (this->directoryLists)
+                {
+                    FSResult::FSResult res = this->removeFromDirectoryList(*index, parentid, offset - 1);
+                    if (res != FSResult::E_SUCCESS)
+                        return res;
+                }
+                else
+                {
+                    uint16_t zeroid = 0;
+                    uint16_t slot = offset - 1;
+                    Endian::doWAt(this->fd, pos + children_offset + slot * 2, reinterpret_cast < char *>(&zeroid), 2);
+                    index->used[slot] = false;
+                    if (slot < index->firstFree)
+                        index->firstFree = slot;
+                }
+
+                if (i->second.named)
+                {
+                    std::unordered_map < std::string, uint16_t >::iterator n = index->names.find(i->second.name);
+                    if (n != index->names.end() && n->second == childid)
+                        index->names.erase(n);
+                }
+                index->order.erase(offset);
+                index->entries.erase(i);
+                std::unordered_map < uint16_t, uint16_t >::iterator p = this->parents.find(childid);
+                if (p != this->parents.end() && p->second == parentid)
+                    this->parents.erase(p);
+                duplicates = index->duplicates;
             }
-            else
-            {
-                uint32_t writeg = this->fd->tellg();
-                Util::seekp_ex(this->fd, writeg - 2);
-                uint16_t zeroid = 0;
-                Endian::doW(this->fd, reinterpret_cast < char *>(&zeroid), 2);
 
-                uint16_t children_count_current = 0;
-                this->fd->seekg(pos + children_count_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
-                children_count_current -= 1;
-                Util::seekp_ex(this->fd, pos + children_count_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&children_count_current), 2);
-                this->fd->seekg(oldg);
-                Util::seekp_ex(this->fd, oldp);
+            uint16_t children_count_current = 0;
+            Endian::doRAt(this->fd, pos + children_count_offset, reinterpret_cast < char *>(&children_count_current), 2);
+            children_count_current -= 1;
+            Endian::doWAt(this->fd, pos + children_count_offset, reinterpret_cast < char *>(&children_count_current), 2);
+            this->patchCachedINode(pos, [&](INode & node) { node.children_count = children_count_current; });
 
-                // Update times.
-                this->updateTimes(parentid, false, true, true);
+            // If the child was in the directory more than once, the index
+            // no longer knows where it is; work it out again next time.
+            if (duplicates)
+                this->invalidateDirectoryIndex(parentid);
 
-                return FSResult::E_SUCCESS;
-            }
+            // Update times.
+            this->updateTimes(parentid, false, true, true);
+
+            return FSResult::E_SUCCESS;
         }
 
         FSResult::FSResult FS::filenameIsUnique(uint16_t parentid, std::string filename)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            std::vector < INode > inodechildren = this->getChildrenOfDirectory(parentid);
-            for (unsigned int i = 0; i < inodechildren.size(); i += 1)
-            {
-                if (filename == inodechildren[i].filename)
-                {
-                    return FSResult::E_FAILURE_NOT_UNIQUE;
-                }
-            }
+            DirectoryIndex * index = this->getDirectoryIndex(parentid);
+            if (index != NULL && index->names.find(filename) != index->names.end())
+                return FSResult::E_FAILURE_NOT_UNIQUE;
             return FSResult::E_SUCCESS;	// Indicates unique.
         }
 
         std::vector < INode > FS::getChildrenOfDirectory(uint16_t parentid)
+        {
+            std::vector < uint64_t > offsets;
+            return this->getChildrenOfDirectory(parentid, 0, SIZE_MAX, offsets);
+        }
+
+        std::vector < INode > FS::getChildrenOfDirectory(uint16_t parentid, uint64_t offset, size_t count, std::vector < uint64_t > & offsets)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
             std::vector < INode > inodechildren;
-            INode node = this->getINodeByID(parentid);
-            if (node.type != INodeType::INT_DIRECTORY)
-            {
+            offsets.clear();
+            DirectoryIndex * index = this->getDirectoryIndex(parentid);
+            if (index == NULL)
                 return inodechildren;
-            }
 
-            uint16_t children_looped = 0;
-            uint16_t total_looped = 0;
-            while (children_looped < node.children_count && total_looped < DIRECTORY_CHILDREN_MAX)
+            // Take the children from the index a page at a time, since
+            // some of them may not be valid and so have to be skipped.
+            std::vector < std::pair < uint64_t, uint16_t > > page;
+            while (inodechildren.size() < count)
             {
-                uint16_t cinode = node.children[total_looped];
-                total_looped += 1;
-                if (cinode == 0)
+                page.clear();
                 {
-                    continue;
+                    std::lock_guard < std::mutex > guard(this->directoriesLock);
+                    std::map < uint64_t, uint16_t >::iterator i = index->order.upper_bound(offset);
+                    for (; i != index->order.end() && page.size() < count - inodechildren.size(); i++)
+                        page.push_back(*i);
                 }
-                else
+                if (page.size() == 0)
+                    break;
+
+                std::vector < uint16_t > ids;
+                for (size_t i = 0; i < page.size(); i += 1)
+                    ids.insert(ids.end(), page[i].second);
+                this->loadINodes(ids);
+                for (size_t i = 0; i < page.size(); i += 1)
                 {
-                    children_looped += 1;
-                    INode cnode = this->getINodeByID(cinode);
+                    INode cnode = this->getINodeByID(page[i].second, false);
                     if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
                     {
-                        inodechildren.insert(inodechildren.end(), cnode);
+                        inodechildren.push_back(std::move(cnode));
+                        offsets.push_back(page[i].first);
                     }
                 }
+                offset = page.back().first;
             }
 
             return inodechildren;
@@ -576,68 +693,390 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            INode node = this->getINodeByID(parentid);
-            if (node.type == INodeType::INT_INVALID)
-            {
+            DirectoryIndex * index = this->getDirectoryIndex(parentid);
+            if (index == NULL)
+                return INode(0, "", INodeType::INT_INVALID);
+
+            std::unordered_map < uint16_t, DirectoryIndex::Entry >::iterator i = index->entries.find(childid);
+            if (i == index->entries.end() || !i->second.named)
+                return INode(0, "", INodeType::INT_INVALID);
+            return this->getINodeByID(childid, false);
+        }
+
+        INode FS::getChildOfDirectory(uint16_t parentid, const std::string & filename)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            int32_t id = this->getChildIDOfDirectory(parentid, filename);
+            if (id < 0)
                 return INode(0, "", INodeType::INT_INVALID);
+            return this->getINodeByID(id, false);
+        }
+
+        int32_t FS::getChildIDOfDirectory(uint16_t parentid, const std::string & filename)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            DirectoryIndex * index = this->getDirectoryIndex(parentid);
+            if (index == NULL)
+                return -ENOENT;
+
+            std::unordered_map < std::string, uint16_t >::iterator i = index->names.find(filename);
+            if (i == index->names.end())
+                return -ENOENT;
+            return i->second;
+        }
+
+        FS::DirectoryIndex * FS::getDirectoryIndex(uint16_t parentid)
+        {
+            // Pointers to the index stay valid after the lock is released
+            // because indexes are only erased while the metadata lock is
+            // held for writing.
+            std::lock_guard < std::mutex > guard(this->directoriesLock);
+            std::unordered_map < uint16_t, DirectoryIndex >::iterator i = this->directories.find(parentid);
+            if (i != this->directories.end())
+                return &i->second;
+
+            INode node = this->getINodeByID(parentid, !this->directoryLists);
+            if (node.type != INodeType::INT_DIRECTORY)
+                return NULL;
+            if (!this->directoryLists && node.children.size() != DIRECTORY_CHILDREN_MAX)
+                return NULL;
+
+            // Read the header of every child once to learn its name.
+            DirectoryIndex & index = this->directories[parentid];
+            index.firstFree = DIRECTORY_CHILDREN_MAX;
+            index.duplicates = false;
+            if (this->directoryLists)
+            {
+                // Walk the list, which can't be longer than one block for
+                // each child the directory could have.  A damaged next
+                // pointer could send us around a loop, so every block may
+                // only be visited once.
+                uint32_t lpos = this->getDirectoryListHead(this->getINodePositionByID(parentid));
+                DirectoryList list;
+                std::unordered_set < uint32_t > visited;
+                while (lpos != 0)
+                {
+                    if (!visited.insert(lpos).second || visited.size() > (size_t) UINT16_MAX + 1)
+                    {
+                        Logging::showErrorW("Directory list of inode %u loops back to %u.", parentid, lpos);
+                        break;
+                    }
+                    if (!this->readDirectoryList(lpos, list))
+                    {
+                        Logging::showErrorW("Directory list of inode %u is not valid at %u.", parentid, lpos);
+                        break;
+                    }
+                    if (list.keys.size() > 0)
+                        index.blocks[list.keys[0]] = lpos;
+                    std::vector < uint16_t > ids;
+                    for (size_t k = 0; k < list.keys.size(); k += 1)
+                        ids.insert(ids.end(), list.keys[k] & 0xFFFF);
+                    this->loadINodes(ids);
+                    for (size_t k = 0; k < list.keys.size(); k += 1)
+                    {
+                        uint16_t childid = list.keys[k] & 0xFFFF;
+                        INode cnode = this->getINodeByID(childid, false);
+                        this->indexChild(index, parentid, list.keys[k] + 1, childid, cnode);
+                    }
+                    lpos = list.next;
+                }
+                return &index;
+            }
+
+            std::vector < uint16_t > ids;
+            for (uint16_t slot = 0; slot < DIRECTORY_CHILDREN_MAX; slot += 1)
+            {
+                if (node.children[slot] != 0)
+                    ids.insert(ids.end(), node.children[slot]);
             }
+            this->loadINodes(ids);
 
-            uint16_t children_looped = 0;
-            uint16_t total_looped = 0;
-            while (children_looped < node.children_count && total_looped < DIRECTORY_CHILDREN_MAX)
+            index.used.assign(DIRECTORY_CHILDREN_MAX, false);
+            for (uint16_t slot = 0; slot < DIRECTORY_CHILDREN_MAX; slot += 1)
             {
-                uint16_t cinode = node.children[total_looped];
-                total_looped += 1;
-                if (cinode == 0)
+                if (node.children[slot] == 0)
                 {
+                    if (slot < index.firstFree)
+                        index.firstFree = slot;
                     continue;
                 }
-                else
+                index.used[slot] = true;
+                INode cnode = this->getINodeByID(node.children[slot], false);
+                this->indexChild(index, parentid, slot + 1, node.children[slot], cnode);
+            }
+            return &index;
+        }
+
+        void FS::indexChild(DirectoryIndex & index, uint16_t parentid, uint64_t offset, uint16_t childid, const INode & child)
+        {
+            // Children that are in the directory more than once are
+            // listed each time, but only indexed by the first.
+            index.order[offset] = childid;
+            if (index.entries.find(childid) != index.entries.end())
+            {
+                index.duplicates = true;
+                return;
+            }
+
+            DirectoryIndex::Entry & entry = index.entries[childid];
+            entry.offset = offset;
+            entry.named = (child.type == INodeType::INT_FILEINFO || child.type == INodeType::INT_DIRECTORY || child.type == INodeType::INT_SYMLINK || child.type == INodeType::INT_DEVICE || child.type == INodeType::INT_HARDLINK);
+            if (entry.named)
+            {
+                // If two children share a name, the one listed first is
+                // the one that is found.
+                entry.name = child.filename;
+                index.names.insert(std::pair < std::string, uint16_t >(entry.name, childid));
+            }
+            this->parents[childid] = parentid;
+        }
+
+        void FS::invalidateDirectoryIndex(uint16_t parentid)
+        {
+            std::lock_guard < std::mutex > guard(this->directoriesLock);
+            std::unordered_map < uint16_t, DirectoryIndex >::iterator i = this->directories.find(parentid);
+            if (i == this->directories.end())
+                return;
+            for (std::unordered_map < uint16_t, DirectoryIndex::Entry >::iterator e = i->second.entries.begin(); e != i->second.entries.end(); e++)
+            {
+                std::unordered_map < uint16_t, uint16_t >::iterator p = this->parents.find(e->first);
+                if (p != this->parents.end() && p->second == parentid)
+                    this->parents.erase(p);
+            }
+            this->directories.erase(i);
+        }
+
+        FSResult::FSResult FS::renameInDirectoryIndex(uint16_t id, const std::string& name)
+        {
+            std::lock_guard < std::mutex > guard(this->directoriesLock);
+            std::unordered_map < uint16_t, uint16_t >::iterator p = this->parents.find(id);
+            if (p == this->parents.end())
+                return FSResult::E_SUCCESS;
+            uint16_t parentid = p->second;
+            std::unordered_map < uint16_t, DirectoryIndex >::iterator i = this->directories.find(parentid);
+            if (i == this->directories.end())
+                return FSResult::E_SUCCESS;
+            DirectoryIndex & index = i->second;
+            std::unordered_map < uint16_t, DirectoryIndex::Entry >::iterator e = index.entries.find(id);
+            if (e == index.entries.end() || !e->second.named || e->second.name == name)
+                return FSResult::E_SUCCESS;
+
+            // Directory lists are ordered by name, so the child has to
+            // be moved to where its new name belongs.
+            if (this->directoryLists)
+            {
+                uint64_t key = FS::getDirectoryListKey(name, id);
+                if (key + 1 != e->second.offset)
                 {
-                    children_looped += 1;
-                    INode cnode = this->getINodeByID(cinode);
-                    if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
-                    {
-                        if (cnode.inodeid == childid)
-                        {
-                            return cnode;
-                        }
-                    }
+                    FSResult::FSResult res = this->removeFromDirectoryList(index, parentid, e->second.offset - 1);
+                    if (res == FSResult::E_SUCCESS)
+                        res = this->insertIntoDirectoryList(index, parentid, key);
+                    if (res != FSResult::E_SUCCESS)
+                        return res;
+                    index.order.erase(e->second.offset);
+                    index.order[key + 1] = id;
+                    e->second.offset = key + 1;
                 }
             }
 
-            return INode(0, "", INodeType::INT_INVALID);
+            std::unordered_map < std::string, uint16_t >::iterator n = index.names.find(e->second.name);
+            if (n != index.names.end() && n->second == id)
+                index.names.erase(n);
+            e->second.name = name;
+            index.names.insert(std::pair < std::string, uint16_t >(name, id));
+            return FSResult::E_SUCCESS;
         }
 
-        INode FS::getChildOfDirectory(uint16_t parentid, std::string filename)
+        uint64_t FS::getDirectoryListKey(const std::string& name, uint16_t id)
         {
-            assert( /* Check the stream is not in text-mode. */ this->isValid());
+            // 32-bit FNV-1a.
+            uint32_t hash = 2166136261u;
+            for (size_t i = 0; i < name.length(); i += 1)
+            {
+                hash ^= (unsigned char) name[i];
+                hash *= 16777619u;
+            }
+            return ((uint64_t) hash << 16) | id;
+        }
 
-            INode node = this->getINodeByID(parentid);
-            if (node.type == INodeType::INT_INVALID)
-                return INode(0, "", INodeType::INT_INVALID);
+        uint32_t FS::getDirectoryListHead(uint32_t pos)
+        {
+            uint32_t head = 0;
+            Endian::doRAt(this->fd, pos + INodeLayout::DIRECTORY_LIST_OFFSET, reinterpret_cast < char *>(&head), 4);
+            return head;
+        }
+
+        void FS::setDirectoryListHead(uint32_t pos, uint32_t head)
+        {
+            Endian::doWAt(this->fd, pos + INodeLayout::DIRECTORY_LIST_OFFSET, reinterpret_cast < char *>(&head), 4);
+        }
+
+        bool FS::readDirectoryList(uint32_t pos, DirectoryList & list)
+        {
+            char data[BSIZE_FILE];
+            std::streamsize got = this->fd->readAt(pos, data, BSIZE_FILE);
+            if (got < 0)
+                Logging::showWarningW("Unexpected failure while reading directory list at %u.", pos);
+
+            INode header(0, "", INodeType::INT_INVALID);
+            if (got < HSIZE_DIRLIST || !header.setBinaryRepresentation(data, got, false))
+                return false;
+            if (header.type != INodeType::INT_DIRLIST || header.children_count > INodeLayout::DIRLIST_ENTRIES_MAX)
+                return false;
+
+            list.pos = pos;
+            list.next = header.info_next;
+            list.keys.resize(header.children_count);
+            for (uint16_t i = 0; i < header.children_count; i += 1)
+            {
+                uint32_t hash;
+                uint16_t id;
+                memcpy(&hash, data + HSIZE_DIRLIST + i * RSIZE_DIRENT, 4);
+                memcpy(&id, data + HSIZE_DIRLIST + i * RSIZE_DIRENT + 4, 2);
+                if (!Endian::little_endian)
+                {
+                    hash = __builtin_bswap32(hash);
+                    id = __builtin_bswap16(id);
+                }
+                list.keys[i] = ((uint64_t) hash << 16) | id;
+            }
+            return true;
+        }
 
-            uint16_t children_looped = 0;
-            uint16_t total_looped = 0;
-            while (children_looped < node.children_count && total_looped < DIRECTORY_CHILDREN_MAX)
+        FSResult::FSResult FS::writeDirectoryList(uint16_t parentid, DirectoryList & list)
+        {
+            INode header(parentid, "", INodeType::INT_DIRLIST);
+            header.info_next = list.next;
+            header.children_count = list.keys.size();
+            std::string data = header.getBinaryRepresentation();
+            data.resize(HSIZE_DIRLIST + list.keys.size() * RSIZE_DIRENT, '\0');
+            for (size_t i = 0; i < list.keys.size(); i += 1)
             {
-                uint16_t cinode = node.children[total_looped];
-                total_looped += 1;
-                if (cinode == 0)
+                uint32_t hash = list.keys[i] >> 16;
+                uint16_t id = list.keys[i] & 0xFFFF;
+                if (!Endian::little_endian)
                 {
-                    continue;
+                    hash = __builtin_bswap32(hash);
+                    id = __builtin_bswap16(id);
                 }
+                memcpy(&data[HSIZE_DIRLIST + i * RSIZE_DIRENT], &hash, 4);
+                memcpy(&data[HSIZE_DIRLIST + i * RSIZE_DIRENT + 4], &id, 2);
+            }
+
+            if (this->fd->writeAt(list.pos, data.c_str(), data.length()) < 0)
+            {
+                Logging::showErrorW("Write failure on write of directory list at %u.", list.pos);
+                return FSResult::E_FAILURE_GENERAL;
+            }
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult FS::insertIntoDirectoryList(DirectoryIndex & index, uint16_t parentid, uint64_t key)
+        {
+            uint32_t pos = this->getINodePositionByID(parentid);
+            DirectoryList list;
+
+            // Start the list if the directory is empty.
+            if (index.blocks.size() == 0)
+            {
+                list.pos = this->freelist->allocateBlock(pos);
+                if (list.pos == 0)
+                    return FSResult::E_FAILURE_GENERAL;
+                list.next = 0;
+                list.keys.push_back(key);
+                FSResult::FSResult res = this->writeDirectoryList(parentid, list);
+                if (res != FSResult::E_SUCCESS)
+                    return res;
+                this->setDirectoryListHead(pos, list.pos);
+                index.blocks[key] = list.pos;
+                return FSResult::E_SUCCESS;
+            }
+
+            // Keys are sorted across the whole list, so the key belongs
+            // in the last block that starts before it (or the first).
+            std::map < uint64_t, uint32_t >::iterator b = index.blocks.upper_bound(key);
+            if (b != index.blocks.begin())
+                b--;
+            if (!this->readDirectoryList(b->second, list))
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            list.keys.insert(std::upper_bound(list.keys.begin(), list.keys.end(), key), key);
+
+            // Split full blocks in half, so that a block is always
+            // left with room for children added near it.
+            if (list.keys.size() > INodeLayout::DIRLIST_ENTRIES_MAX)
+            {
+                DirectoryList split;
+                split.pos = this->freelist->allocateBlock(list.pos);
+                if (split.pos == 0)
+                    return FSResult::E_FAILURE_GENERAL;
+                split.next = list.next;
+                split.keys.assign(list.keys.begin() + list.keys.size() / 2, list.keys.end());
+                list.keys.resize(list.keys.size() / 2);
+                list.next = split.pos;
+                FSResult::FSResult res = this->writeDirectoryList(parentid, split);
+                if (res != FSResult::E_SUCCESS)
+                    return res;
+                index.blocks[split.keys[0]] = split.pos;
+            }
+
+            FSResult::FSResult res = this->writeDirectoryList(parentid, list);
+            if (res != FSResult::E_SUCCESS)
+                return res;
+            if (list.keys[0] != b->first)
+            {
+                index.blocks.erase(b);
+                index.blocks[list.keys[0]] = list.pos;
+            }
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult FS::removeFromDirectoryList(DirectoryIndex & index, uint16_t parentid, uint64_t key)
+        {
+            std::map < uint64_t, uint32_t >::iterator b = index.blocks.upper_bound(key);
+            if (b == index.blocks.begin())
+                return FSResult::E_FAILURE_INVALID_FILENAME;
+            b--;
+
+            DirectoryList list;
+            if (!this->readDirectoryList(b->second, list))
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
+            std::vector < uint64_t >::iterator k = std::lower_bound(list.keys.begin(), list.keys.end(), key);
+            if (k == list.keys.end() || *k != key)
+                return FSResult::E_FAILURE_INVALID_FILENAME;
+            list.keys.erase(k);
+
+            // Unlink blocks that become empty and free them.
+            if (list.keys.size() == 0)
+            {
+                if (b == index.blocks.begin())
+                    this->setDirectoryListHead(this->getINodePositionByID(parentid), list.next);
                 else
                 {
-                    children_looped += 1;
-                    INode cnode = this->getINodeByID(cinode);
-                    if (cnode.type == INodeType::INT_FILEINFO || cnode.type == INodeType::INT_DIRECTORY || cnode.type == INodeType::INT_SYMLINK || cnode.type == INodeType::INT_DEVICE || cnode.type == INodeType::INT_HARDLINK)
-                        if (filename == cnode.filename)
-                            return cnode;
+                    DirectoryList previous;
+                    std::map < uint64_t, uint32_t >::iterator a = b;
+                    a--;
+                    if (!this->readDirectoryList(a->second, previous))
+                        return FSResult::E_FAILURE_INODE_NOT_VALID;
+                    previous.next = list.next;
+                    FSResult::FSResult res = this->writeDirectoryList(parentid, previous);
+                    if (res != FSResult::E_SUCCESS)
+                        return res;
                 }
+                index.blocks.erase(b);
+                return this->resetBlock(list.pos);
             }
 
-            return INode(0, "", INodeType::INT_INVALID);
+            FSResult::FSResult res = this->writeDirectoryList(parentid, list);
+            if (res != FSResult::E_SUCCESS)
+                return res;
+            if (list.keys[0] != b->first)
+            {
+                index.blocks.erase(b);
+                index.blocks[list.keys[0]] = list.pos;
+            }
+            return FSResult::E_SUCCESS;
         }
 
         FSResult::FSResult FS::setFileContents(uint16_t id, const char *data, uint32_t len)
@@ -699,47 +1138,34 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int file_blocks_offset = 296;
-            signed int file_len_offset = 298;
-
-            this->fd->clear();
-
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            signed int file_blocks_offset = INodeLayout::FILE_BLOCKS_OFFSET;
+            signed int file_len_offset = INodeLayout::FILE_DAT_LEN_OFFSET;
 
             // Get the type directly.
             uint16_t type_raw = (uint16_t) INodeType::INT_INVALID;
-            this->fd->seekg(pos + 2);
-            Endian::doR(this->fd, reinterpret_cast < char *>(&type_raw), 2);
+            Endian::doRAt(this->fd, pos + 2, reinterpret_cast < char *>(&type_raw), 2);
 
             if (type_raw == INodeType::INT_FILEINFO || type_raw == INodeType::INT_SYMLINK)
             {
-                Util::seekp_ex(this->fd, pos + file_len_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&len), 4);
-                Util::seekp_ex(this->fd, pos + file_blocks_offset);
+                Endian::doWAt(this->fd, pos + file_len_offset, reinterpret_cast < char *>(&len), 4);
                 uint16_t blocks = ceil(len / (double) BSIZE_FILE);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&blocks), 2);
-                Util::seekp_ex(this->fd, oldp);
-                this->fd->seekg(oldg);
-                this->fd->seekp(oldp);
+                Endian::doWAt(this->fd, pos + file_blocks_offset, reinterpret_cast < char *>(&blocks), 2);
+                this->patchCachedINode(pos, [&](INode & node)
+                {
+                    node.dat_len = len;
+                    node.blocks = blocks;
+                });
                 return FSResult::E_SUCCESS;
             }
             else
-            {
-                this->fd->seekg(oldg);
                 return FSResult::E_FAILURE_INVALID_POSITION;
-            }
         }
 
         FSResult::FSResult FS::setFileNextSegmentDirect(uint16_t id, uint32_t pos, uint32_t seg_next)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int file_info_next_offset = 302;
-
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            signed int file_info_next_offset = INodeLayout::FILE_INFO_NEXT_OFFSET;
 
             // Get the base position of the specified inode.
             uint32_t bpos = this->getINodePositionByID(id);
@@ -752,112 +1178,44 @@ namespace AppLib
             {
                 // We're setting the position of the first segment
                 // in the file.
-                std::streampos oldp = this->fd->tellp();
-                this->fd->seekg(bpos + file_info_next_offset);
-                Endian::doW(this->fd, reinterpret_cast < char *>(&seg_next), 4);
-                this->fd->seekp(oldp);
-                this->fd->seekg(oldg);
+                Endian::doWAt(this->fd, bpos + file_info_next_offset, reinterpret_cast < char *>(&seg_next), 4);
+                this->patchCachedINode(bpos, [&](INode & node) { node.info_next = seg_next; });
+                this->invalidateSegmentMap(bpos);
                 return FSResult::E_SUCCESS;
             }
 
-            // Now loop through all of the segment positions.
-            bool gnext = false;
-            uint32_t spos = 0;
-            uint32_t ipos = bpos;
-            uint32_t hsize = HSIZE_FILE;
-            while (ipos != 0)
+            // Find the current segment and replace the one after it.
+            SegmentMap & map = this->getSegmentMap(bpos);
+            std::vector < uint32_t >::iterator i = std::find(map.blocks.begin(), map.blocks.end(), pos);
+            if (i == map.blocks.end() || i + 1 == map.blocks.end())
             {
-                for (int i = hsize; i < BSIZE_FILE; i += 4)
-                {
-                    this->fd->seekg(bpos + i);
-                    spos = 0;
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-                    if (spos == 0)
-                    {
-                        // End of segment list.  Return 0.
-                        return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
-                    }
-                    else if (spos == pos)
-                    {
-                        // Matched, we need to fetch the next one.
-                        gnext = true;
-                    }
-                    else if (gnext)
-                    {
-                        // Replace the segment value.
-                        std::streampos oldp = this->fd->tellp();
-                        this->fd->seekp(bpos + i);
-                        Endian::doW(this->fd, reinterpret_cast < char *>(&seg_next), 4);
-                        this->fd->seekp(oldp);
-                        this->fd->seekg(oldg);
-                        return FSResult::E_SUCCESS;
-                    }
-                }
-                hsize = HSIZE_SEGINFO;
-                INode inode = this->getINodeByPosition(ipos);
-                if (inode.type != INodeType::INT_SEGINFO)
-                    break;
-                ipos = inode.info_next;
+                // Unable to locate the current segment within the
+                // specified file ID.
+                return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
             }
-
-            // Unable to locate the current segment within the
-            // specified file ID.
-            this->fd->seekg(oldg);
-            return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
+            uint32_t index = (i - map.blocks.begin()) + 1;
+            map.blocks[index] = seg_next;
+            if (this->extentLayout)
+                return this->writeExtents(bpos, map);
+            Endian::doWAt(this->fd, this->getSegmentSlotPosition(map, index), reinterpret_cast < char *>(&seg_next), 4);
+            return FSResult::E_SUCCESS;
         }
 
         uint32_t FS::getFileNextBlock(uint16_t id, uint32_t pos)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
-
             // Get the base position of the specified inode.
             uint32_t bpos = this->getINodePositionByID(id);
+            if (bpos == 0)
+                return 0;
 
-            // Now loop through all of the segment positions.
-            bool gnext = false;
-            uint32_t spos = 0;
-            uint32_t ipos = bpos;
-            uint32_t hsize = HSIZE_FILE;
-            while (ipos != 0)
-            {
-                for (int i = hsize; i < BSIZE_FILE; i += 4)
-                {
-                    this->fd->seekg(bpos + i);
-                    spos = 0;
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-                    if (spos == 0)
-                    {
-                        // End of segment list.  Return 0.
-                        this->fd->seekg(oldg);
-                        return 0;
-                    }
-                    else if (spos == pos)
-                    {
-                        // Matched, we need to fetch the next one.
-                        gnext = true;
-                    }
-                    else if (gnext)
-                    {
-                        // Return the next segment value.
-                        this->fd->seekg(oldg);
-                        return spos;
-                    }
-                }
-                hsize = HSIZE_SEGINFO;
-                INode inode = this->getINodeByPosition(ipos);
-                if (inode.type != INodeType::INT_SEGINFO)
-                    break;
-                ipos = inode.info_next;
-            }
-
-            // Unable to locate the current segment within the
-            // specified file ID.
-            this->fd->seekg(oldg);
-            return 0;
+            // Find the current segment and return the one after it.
+            SegmentMap & map = this->getSegmentMap(bpos);
+            std::vector < uint32_t >::iterator i = std::find(map.blocks.begin(), map.blocks.end(), pos);
+            if (i == map.blocks.end() || i + 1 == map.blocks.end())
+                return 0;
+            return *(i + 1);
         }
 
         FSResult::FSResult FS::resetBlock(uint32_t pos)
@@ -870,18 +1228,15 @@ namespace AppLib
             }
 
             /*
-             * std::streampos oldp = this->fd->tellp();
-             * Util::seekp_ex(this->fd, pos);
-             * const char * zero = "\0";
-             * for (int i = 0; i < BSIZE_FILE; i += 1)
-             * {
-             * this->fd->write(zero, 1);
-             * }
-             * Util::seekp_ex(this->fd, oldp);
+             * char zero[BSIZE_FILE];
+             * memset(zero, 0, BSIZE_FILE);
+             * this->fd->writeAt(pos, zero, BSIZE_FILE);
              */
 
             // Block must be marked as unused through the
             // free list allocation class.
+            this->invalidateSegmentMap(pos);
+            this->invalidateCachedINode(pos);
             this->freelist->freeBlock(pos);
 
             return FSResult::E_SUCCESS;
@@ -891,97 +1246,115 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
-
             // Get the base position of the specified inode.
             uint32_t bpos = this->getINodePositionByID(inodeid);
+            if (bpos == 0)
+                return 0;
 
-            // Now loop through all of the segment positions.
-            uint32_t bcount = 0;
-            uint32_t spos = 0;
-            uint32_t ipos = bpos;
-            uint32_t hsize = HSIZE_FILE;
-            while (ipos != 0)
+            // Look up the block containing the position.  A return
+            // value of 0 indicates the position is past the last
+            // segment in the file.
+            SegmentMap & map = this->getSegmentMap(bpos);
+            uint32_t index = pos / BSIZE_FILE;
+            if (index >= map.blocks.size())
+                return 0;
+            return map.blocks[index] + (pos % BSIZE_FILE);
+        }
+
+        std::vector < FS::FileRun > FS::planFileRange(uint16_t inodeid, uint32_t pos, uint32_t count)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            std::vector < FileRun > runs;
+            uint32_t bpos = this->getINodePositionByID(inodeid);
+            if (bpos == 0)
+                return runs;
+
+            // Walk the blocks the range covers, extending the last run
+            // for as long as each block follows on from the one before.
+            SegmentMap & map = this->getSegmentMap(bpos);
+            uint32_t done = 0;
+            while (done < count)
             {
-                for (int i = hsize; i < BSIZE_FILE; i += 4)
+                uint32_t index = (pos + done) / BSIZE_FILE;
+                if (index >= map.blocks.size())
+                    break;
+                uint32_t soff = (pos + done) % BSIZE_FILE;
+                uint32_t amount = std::min < uint32_t > (count - done, BSIZE_FILE - soff);
+                if (!runs.empty() && runs.back().pos + runs.back().length == map.blocks[index] + soff)
+                    runs.back().length += amount;
+                else
                 {
-                    this->fd->seekg(bpos + i);
-                    spos = 0;
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-                    if (spos == 0)
-                    {
-                        // Invalid segment position (i.e. there are
-                        // no more segments available).
-                        this->fd->seekg(oldg);
-                        return 0;
-                    }
-
-                    if (bcount < pos && bcount + 4096 < pos)
-                    {
-                        // We haven't reached our target block yet.
-                        bcount += 4096;
-                        continue;
-                    }
-                    else if (bcount < pos && bcount + 4096 > pos)
-                    {
-                        // This is our target block.
-                        this->fd->seekg(oldg);
-                        return spos + (pos - bcount);
-                    }
-                    else
-                    {
-                        // We're past our target block.
-                        this->fd->seekg(oldg);
-                        return 0;
-                    }
+                    FileRun run = { map.blocks[index] + soff, amount };
+                    runs.insert(runs.end(), run);
                 }
-                hsize = HSIZE_SEGINFO;
-                INode inode = this->getINodeByPosition(ipos);
-                if (inode.type != INodeType::INT_SEGINFO)
-                    break;
-                ipos = inode.info_next;
+                done += amount;
             }
-
-            // Unable to locate the position within the file.
-            this->fd->seekg(oldg);
-            return 0;
+            return runs;
         }
 
-        int32_t FS::resolvePathnameToINodeID(std::string path)
+        uint32_t FS::readFileData(uint16_t inodeid, uint32_t pos, char * out, uint32_t count)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            std::vector < std::string > components;
-            std::string buf = "";
-            for (int i = 0; i < path.length(); i += 1)
+            // The runs don't depend on each other, so they are read as
+            // one batch (which the stream may have in flight together).
+            std::vector < FileRun > runs = this->planFileRange(inodeid, pos, count);
+            std::vector < BlockStream::ReadRequest > reads(runs.size());
+            uint32_t doff = 0;
+            for (size_t i = 0; i < runs.size(); i += 1)
             {
-                if (path[i] == '/')
-                {
-                    if (buf != "")
-                    {
-                        components.insert(components.end(), buf);
-                        buf = "";
-                    }
-                }
-                else
-                {
-                    buf += path[i];
-                }
+                BlockStream::ReadRequest read = { runs[i].pos, out + doff, runs[i].length, 0 };
+                reads[i] = read;
+                doff += runs[i].length;
             }
-            if (buf.length() > 0)
+            this->fd->readBatch(reads);
+
+            doff = 0;
+            for (std::vector < BlockStream::ReadRequest >::iterator i = reads.begin(); i != reads.end(); i++)
             {
-                components.insert(components.end(), buf);
-                buf = "";
+                if (i->result <= 0)
+                    break;
+                doff += i->result;
+                if (i->result < i->count)
+                    break;
             }
+            return doff;
+        }
 
+        void FS::prefetchFileData(uint16_t inodeid, uint32_t pos, uint32_t count)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            std::vector < FileRun > runs = this->planFileRange(inodeid, pos, count);
+            for (std::vector < FileRun >::iterator i = runs.begin(); i != runs.end(); i++)
+                this->fd->prefetch(i->pos, i->length);
+        }
+
+        void FS::setReadaheadLimit(uint32_t bytes)
+        {
+            this->readaheadLimit = bytes;
+        }
+
+        uint32_t FS::getReadaheadLimit()
+        {
+            return this->readaheadLimit;
+        }
+
+        int32_t FS::resolvePathnameToINodeID(const std::string & path)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            // Walk the components in place; only the names that have to
+            // be looked up are copied (into a buffer that is reused).
             uint16_t id = 0;
-            for (int i = 0; i < components.size(); i += 1)
+            std::string name;
+            size_t offset = 0, start, length;
+            while (Util::nextPathComponent(path, offset, start, length))
             {
-                if (components[i] == ".")
-                    id = id;
-                else if (components[i] == "..")
+                if (length == 1 && path[start] == '.')
+                    continue;
+                else if (length == 2 && path[start] == '.' && path[start + 1] == '.')
                 {
                     INode node = this->getINodeByID(id);
                     if (node.type == INodeType::INT_INVALID)
@@ -990,7 +1363,8 @@ namespace AppLib
                 }
                 else
                 {
-                    INode node = this->getChildOfDirectory(id, components[i].c_str());
+                    name.assign(path, start, length);
+                    INode node = this->getChildOfDirectory(id, name);
                     if (node.type == INodeType::INT_INVALID)
                         return -ENOENT;
                     id = node.inodeid;
@@ -999,14 +1373,10 @@ namespace AppLib
             return id;
         }
 
-        FSResult::FSResult FS::truncateFile(uint16_t inodeid, uint32_t len)
+        FSResult::FSResult FS::truncateFile(uint16_t inodeid, uint32_t len, bool preallocate)
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
-
             // Get the base position of the specified inode.
             uint32_t bpos = this->getINodePositionByID(inodeid);
 
@@ -1016,60 +1386,50 @@ namespace AppLib
                 node.type != INodeType::INT_SYMLINK)
                 return FSResult::E_FAILURE_INODE_NOT_VALID;
 
-            if (node.dat_len == len)
-                return FSResult::E_SUCCESS;
-            else if (node.dat_len > len)
-            {
-                // We need to delete blocks at the end of the file.
-                // Calculate the number of blocks to delete.
-                uint16_t blocks_to_delete = node.blocks - ceil(len / (double) BSIZE_FILE);
-
-                // Now loop through all of the segment positions.
-                uint32_t bcount = 0;
-                uint32_t spos = 0;
-                uint32_t ipos = bpos;
-                uint32_t hsize = HSIZE_FILE;
-                while (ipos != 0)
-                {
-                    for (int i = hsize; i < BSIZE_FILE; i += 4)
-                    {
-                        this->fd->seekg(bpos + i);
-                        spos = 0;
-                        Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-                        if (spos == 0)
-                        {
-                            // We've run out of segments to erase.
-                            ipos = 0;	// Make it jump out of the while() loop.
-                            break;
-                        }
+            // Data held in memory past the new end is discarded too.
+            this->truncateBufferedData(inodeid, len);
 
-                        if (bcount >= node.blocks - blocks_to_delete)
-                        {
-                            // First remove the block from the file segment list.
-                            uint32_t zeropos = 0;
-                            this->fd->seekp(bpos + i);
-                            Endian::doW(this->fd, reinterpret_cast < char *>(&zeropos), 4);
-
-                            // Next use resetBlock to erase the data in it (this also
-                            // frees it in the FreeList).
-                            this->resetBlock(spos);
-                        }
+            SegmentMap & map = this->getSegmentMap(bpos);
+            if (node.dat_len == len && map.preallocated == 0)
+                return FSResult::E_SUCCESS;
 
-                        bcount += 1;
-                    }
-                    if (ipos != 0)
+            uint32_t blocks = ceil(len / (double) BSIZE_FILE);
+            if (node.dat_len >= len)
+            {
+                // We need to delete blocks at the end of the file (which
+                // also frees any that were reserved past the end).
+                while (this->extentLayout && map.blocks.size() > blocks)
+                {
+                    // Shorten (or remove) the last extent.
+                    uint32_t last = map.extents.size() - 1;
+                    uint32_t count = std::min < uint32_t > (map.extents[last].count, map.blocks.size() - blocks);
+                    map.extents[last].count -= count;
+                    if (map.extents[last].count == 0)
+                        map.extents.pop_back();
+                    this->writeExtent(map, last);
+
+                    // Then free the blocks that were in it.
+                    for (uint32_t i = 0; i < count; i += 1)
                     {
-                        hsize = HSIZE_SEGINFO;
-                        INode inode = this->getINodeByPosition(ipos);
-                        if (inode.type != INodeType::INT_SEGINFO)
-                        {
-                            this->fd->seekg(oldg);
-                            this->fd->seekp(oldp);
-                            return FSResult::E_FAILURE_INODE_NOT_VALID;
-                        }
-                        ipos = inode.info_next;
+                        uint32_t spos = map.blocks.back();
+                        map.blocks.pop_back();
+                        this->resetBlock(spos);
                     }
                 }
+                while (map.blocks.size() > blocks)
+                {
+                    // First remove the block from the file segment list.
+                    uint32_t spos = map.blocks.back();
+                    uint32_t zeropos = 0;
+                    Endian::doWAt(this->fd, this->getSegmentSlotPosition(map, map.blocks.size() - 1), reinterpret_cast < char *>(&zeropos), 4);
+                    map.blocks.pop_back();
+
+                    // Next use resetBlock to erase the data in it (this also
+                    // frees it in the FreeList).
+                    this->resetBlock(spos);
+                }
+
+                map.preallocated = 0;
 
                 // Now set the file's data length.
                 FSResult::FSResult res = this->setFileLengthDirect(bpos, len);
@@ -1082,71 +1442,104 @@ namespace AppLib
                     return res;
 
                 // We successfully truncated the file.
-                this->fd->seekg(oldg);
-                this->fd->seekp(oldp);
                 return FSResult::E_SUCCESS;
             }
             else if (node.dat_len < len)
             {
+                // Work out how many blocks the file will have, including
+                // those reserved past its end.  Blocks that are already
+                // reserved are used first; once they run out, a write
+                // reserves as many again as the file has (up to the
+                // limit) so that the reservation grows geometrically.
+                uint32_t target = std::max < uint32_t > (blocks, map.blocks.size());
+                if (preallocate && map.blocks.size() < blocks)
+                {
+                    target = blocks + std::min < uint32_t > (blocks, this->preallocationLimit);
+                    if (target > MSIZE_FILE / BSIZE_FILE)
+                        target = std::max < uint32_t > (blocks, MSIZE_FILE / BSIZE_FILE);
+                }
+                uint32_t tlen = std::max < uint32_t > (len, target * BSIZE_FILE);
+
+                // If we run out of space part of the way, the blocks that
+                // were added are kept as the file's reservation.
+                uint32_t current = ceil(node.dat_len / (double) BSIZE_FILE);
+
                 // Allocate new segment list blocks before we
                 // attempt to cycle through / store data in them.
-                FSResult::FSResult res = this->allocateInfoListBlocks(bpos, len);
+                FSResult::FSResult res = this->allocateInfoListBlocks(bpos, tlen);
                 if (res != FSResult::E_SUCCESS)
                     return res;
 
                 // We need to add blocks at the end of the file.
-                // Calculate the number of blocks to add.
-                uint16_t blocks_to_add = ceil(len / (double) BSIZE_FILE) - node.blocks;
-
-                // Now loop through all of the segment positions.
-                uint32_t bcount = 0;
-                uint32_t spos = 0;
-                uint32_t ipos = bpos;
-                uint32_t hsize = HSIZE_FILE;
-                while (ipos != 0)
+                while (this->extentLayout && map.blocks.size() < target)
                 {
-                    for (int i = hsize; i < BSIZE_FILE; i += 4)
+                    // Allocate the new blocks as a single run if we can,
+                    // preferably straight after the last block in the
+                    // file so that the last extent can be extended.  If
+                    // the free space is too fragmented, they are taken
+                    // from the largest free runs in turn, each becoming
+                    // an extent of its own.
+                    uint32_t count;
+                    uint32_t lpos = (map.blocks.size() > 0) ? map.blocks.back() + BSIZE_FILE : 0;
+                    uint32_t npos = this->freelist->allocateBlocks(target - map.blocks.size(), lpos, count);
+                    if (npos == 0 && target > blocks && map.blocks.size() < blocks)
                     {
-                        this->fd->seekg(bpos + i);
-                        spos = 0;
-                        Endian::doR(this->fd, reinterpret_cast < char *>(&spos), 4);
-                        if (spos != 0)
-                        {
-                            // We don't want to touch this position since it already
-                            // points to an existing segment.
-                            continue;
-                        }
-
-                        if (bcount < blocks_to_add)
-                        {
-                            // Allocate a new block.
-                            uint32_t npos = this->freelist->allocateBlock();
-
-                            // Now add it to the file segment list.
-                            this->fd->seekp(bpos + i);
-                            Endian::doW(this->fd, reinterpret_cast < char *>(&npos), 4);
-                        }
-                        else
-                        {
-                            ipos = 0;
-                            break;
-                        }
-
-                        bcount += 1;
+                        // There isn't room for the reservation, but there
+                        // may still be room for the data itself.
+                        target = blocks;
+                        continue;
                     }
-                    if (ipos != 0)
+                    if (npos == 0)
                     {
-                        hsize = HSIZE_SEGINFO;
-                        INode inode = this->getINodeByPosition(ipos);
-                        if (inode.type != INodeType::INT_SEGINFO)
+                        map.preallocated = map.blocks.size() - current;
+                        return FSResult::E_FAILURE_GENERAL;
+                    }
+                    if (map.extents.size() > 0 && npos == lpos)
+                        map.extents.back().count += count;
+                    else
+                    {
+                        Extent extent;
+                        extent.start = npos;
+                        extent.count = count;
+                        map.extents.insert(map.extents.end(), extent);
+
+                        // Make sure there is a slot for the new extent.
+                        res = this->allocateInfoListBlocks(bpos, tlen);
+                        if (res != FSResult::E_SUCCESS)
                         {
-                            this->fd->seekg(oldg);
-                            this->fd->seekp(oldp);
-                            return FSResult::E_FAILURE_INODE_NOT_VALID;
+                            map.extents.pop_back();
+                            for (uint32_t i = 0; i < count; i += 1)
+                                this->freelist->freeBlock(npos + i * BSIZE_FILE);
+                            map.preallocated = map.blocks.size() - current;
+                            return res;
                         }
-                        ipos = inode.info_next;
                     }
+                    this->writeExtent(map, map.extents.size() - 1);
+                    for (uint32_t i = 0; i < count; i += 1)
+                        map.blocks.insert(map.blocks.end(), npos + i * BSIZE_FILE);
                 }
+                while (map.blocks.size() < target)
+                {
+                    // Allocate a new block, preferably straight after
+                    // the last block in the file.
+                    uint32_t lpos = (map.blocks.size() > 0) ? map.blocks.back() + BSIZE_FILE : 0;
+                    uint32_t npos = this->freelist->allocateBlock(lpos);
+                    if (npos == 0 && target > blocks && map.blocks.size() < blocks)
+                    {
+                        target = blocks;
+                        continue;
+                    }
+                    if (npos == 0)
+                    {
+                        map.preallocated = map.blocks.size() - current;
+                        return FSResult::E_FAILURE_GENERAL;
+                    }
+
+                    // Now add it to the file segment list.
+                    Endian::doWAt(this->fd, this->getSegmentSlotPosition(map, map.blocks.size()), reinterpret_cast < char *>(&npos), 4);
+                    map.blocks.insert(map.blocks.end(), npos);
+                }
+                map.preallocated = map.blocks.size() - blocks;
 
                 // Now set the file's data length.
                 res = this->setFileLengthDirect(bpos, len);
@@ -1154,8 +1547,6 @@ namespace AppLib
                     return res;
 
                 // We successfully truncated the file.
-                this->fd->seekg(oldg);
-                this->fd->seekp(oldp);
                 return FSResult::E_SUCCESS;
             }
 
@@ -1163,26 +1554,323 @@ namespace AppLib
             return FSResult::E_FAILURE_UNKNOWN;
         }
 
-        FSResult::FSResult FS::allocateInfoListBlocks(uint32_t pos, uint32_t len)
+        FSResult::FSResult FS::releasePreallocation(uint16_t inodeid)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            uint32_t bpos = this->getINodePositionByID(inodeid);
+            if (bpos == 0)
+                return FSResult::E_FAILURE_INODE_NOT_ASSIGNED;
+            return this->releasePreallocationAt(bpos);
+        }
+
+        void FS::releasePreallocations()
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            signed int file_info_next_offset = 302;
-            signed int info_info_next_offset = 4;
-            signed int segments_in_file_block = (BSIZE_FILE - HSIZE_FILE) / 4;
-            signed int segments_in_info_block = (BSIZE_FILE - HSIZE_SEGINFO) / 4;
+            std::vector < uint32_t > files;
+            {
+                std::lock_guard < std::mutex > guard(this->segmentsLock);
+                for (std::unordered_map < uint32_t, SegmentMap >::iterator i = this->segments.begin(); i != this->segments.end(); i++)
+                    if (i->second.preallocated != 0)
+                        files.insert(files.end(), i->first);
+            }
+            for (std::vector < uint32_t >::iterator i = files.begin(); i != files.end(); i++)
+                this->releasePreallocationAt(*i);
+        }
+
+        FSResult::FSResult FS::releasePreallocationAt(uint32_t pos)
+        {
+            // Only files whose segment map is loaded can have blocks
+            // reserved, so don't load it just to find out.
+            {
+                std::lock_guard < std::mutex > guard(this->segmentsLock);
+                std::unordered_map < uint32_t, SegmentMap >::iterator i = this->segments.find(pos);
+                if (i == this->segments.end() || i->second.preallocated == 0)
+                    return FSResult::E_SUCCESS;
+            }
+
+            // A file with data still held in memory keeps them until
+            // that data is written out into them.
+            INode node = this->getINodeByRealPosition(pos);
+            uint32_t len;
+            if (node.type != INodeType::INT_INVALID && this->getBufferedFileLength(node.inodeid, len))
+                return FSResult::E_SUCCESS;
+
+            // Truncating the file to its own length frees them along
+            // with any segment list blocks that addressed them.  If the
+            // inode can't be truncated (it may have been damaged since),
+            // dropping the map still frees the blocks themselves.
+            FSResult::FSResult res = FSResult::E_FAILURE_INODE_NOT_VALID;
+            if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK)
+                res = this->truncateFile(node.inodeid, node.dat_len);
+            if (res != FSResult::E_SUCCESS)
+                this->invalidateSegmentMap(pos);
+            return res;
+        }
+
+        void FS::setPreallocationLimit(uint32_t blocks)
+        {
+            this->preallocationLimit = blocks;
+        }
+
+        bool FS::bufferFileData(uint16_t inodeid, uint32_t pos, const char * data, uint32_t count)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            if (count == 0 || this->bufferedLimit == 0)
+                return false;
+
+            std::lock_guard < std::mutex > guard(this->bufferedLock);
+            std::unordered_map < uint16_t, BufferedFile >::iterator f = this->buffered.find(inodeid);
+            if (f == this->buffered.end())
+            {
+                // Only hold data for inodes that truncateFile can give
+                // blocks to when it's written out.
+                INode node = this->getINodeByPosition(this->getINodePositionByID(inodeid));
+                if (node.type != INodeType::INT_FILEINFO &&
+                    node.type != INodeType::INT_SYMLINK)
+                    return false;
+                if (count > this->bufferedLimit - std::min(this->bufferedLimit, this->bufferedBytes))
+                    return false;
+                f = this->buffered.insert(std::make_pair(inodeid, BufferedFile())).first;
+                f->second.length = node.dat_len;
+                f->second.bytes = 0;
+            }
+            BufferedFile & file = f->second;
+            std::map < uint32_t, std::string > & ranges = file.ranges;
+            uint32_t end = pos + count;
+
+            // Find the ranges that the new data overlaps or touches, which
+            // are merged with it into a single range.
+            std::map < uint32_t, std::string >::iterator first = ranges.upper_bound(pos);
+            if (first != ranges.begin())
+            {
+                first--;
+                if (first->first + first->second.length() < pos)
+                    first++;
+            }
+            std::map < uint32_t, std::string >::iterator last = first;
+            uint32_t start = pos;
+            uint32_t finish = end;
+            size_t merged = 0;
+            for (; last != ranges.end() && last->first <= end; last++)
+            {
+                start = std::min < uint32_t > (start, last->first);
+                finish = std::max < uint32_t > (finish, last->first + last->second.length());
+                merged += last->second.length();
+            }
+            size_t growth = (finish - start) - merged;
+            if (growth > this->bufferedLimit - std::min(this->bufferedLimit, this->bufferedBytes))
+            {
+                if (file.ranges.empty())
+                    this->buffered.erase(f);
+                return false;
+            }
 
-            // Store the current positions.
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            // Build the merged range, reusing the string of the first range
+            // if the new data doesn't start before it (as when appending).
+            std::string range;
+            if (first != last && first->first == start)
+            {
+                range.swap(first->second);
+                first = ranges.erase(first);
+            }
+            if (range.length() < end - start)
+                range.resize(end - start);
+            for (; first != last; first = ranges.erase(first))
+            {
+                // Only the parts of later ranges that the new data
+                // doesn't replace are kept.
+                uint32_t rend = first->first + first->second.length();
+                if (rend > end)
+                    range.append(first->second, end - first->first, rend - end);
+            }
+            range.replace(pos - start, count, data, count);
+            ranges[start] = std::move(range);
+
+            file.bytes += growth;
+            file.length = std::max < uint32_t > (file.length, end);
+            this->bufferedBytes += growth;
+            return true;
+        }
+
+        void FS::readBufferedFileData(uint16_t inodeid, uint32_t pos, char * out, uint32_t count)
+        {
+            std::lock_guard < std::mutex > guard(this->bufferedLock);
+            std::unordered_map < uint16_t, BufferedFile >::iterator f = this->buffered.find(inodeid);
+            if (f == this->buffered.end())
+                return;
+
+            std::map < uint32_t, std::string > & ranges = f->second.ranges;
+            std::map < uint32_t, std::string >::iterator i = ranges.upper_bound(pos);
+            if (i != ranges.begin())
+                i--;
+            for (; i != ranges.end() && i->first < pos + count; i++)
+            {
+                uint32_t from = std::max < uint32_t > (pos, i->first);
+                uint32_t to = std::min < uint32_t > (pos + count, i->first + i->second.length());
+                if (from < to)
+                    memcpy(out + (from - pos), i->second.data() + (from - i->first), to - from);
+            }
+        }
+
+        bool FS::getBufferedFileLength(uint16_t inodeid, uint32_t & len)
+        {
+            std::lock_guard < std::mutex > guard(this->bufferedLock);
+            std::unordered_map < uint16_t, BufferedFile >::iterator f = this->buffered.find(inodeid);
+            if (f == this->buffered.end())
+                return false;
+            len = f->second.length;
+            return true;
+        }
+
+        FSResult::FSResult FS::flushBufferedData(uint16_t inodeid)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            BufferedFile file;
+            {
+                std::lock_guard < std::mutex > guard(this->bufferedLock);
+                std::unordered_map < uint16_t, BufferedFile >::iterator f = this->buffered.find(inodeid);
+                if (f == this->buffered.end())
+                    return FSResult::E_SUCCESS;
+                file = std::move(f->second);
+                this->bufferedBytes -= file.bytes;
+                this->buffered.erase(f);
+            }
+
+            // Allocate all of the blocks the data needs at once, so
+            // that they can be placed together.
+            INode node = this->getINodeByID(inodeid);
+            FSResult::FSResult res = FSResult::E_SUCCESS;
+            if (node.dat_len != file.length)
+                res = this->truncateFile(inodeid, file.length);
+            for (std::map < uint32_t, std::string >::iterator i = file.ranges.begin(); i != file.ranges.end() && res == FSResult::E_SUCCESS; i++)
+                res = this->writeFileData(inodeid, i->first, i->second.data(), i->second.length());
+            if (res != FSResult::E_SUCCESS)
+            {
+                // Hold on to the data so that it isn't lost and the
+                // flush can be retried.  Ranges that were written out
+                // are simply written again.  Nothing else can have been
+                // held for the file meanwhile, since callers hold the
+                // metadata lock for writing.
+                Logging::showErrorW("Unable to write out data held for inode %u.", inodeid);
+                std::lock_guard < std::mutex > guard(this->bufferedLock);
+                this->bufferedBytes += file.bytes;
+                this->buffered.insert(std::make_pair(inodeid, std::move(file)));
+            }
+            return res;
+        }
+
+        FSResult::FSResult FS::flushBufferedData()
+        {
+            // Write the files out in order of inode ID, which tends to be
+            // the order they were created in.
+            std::vector < uint16_t > files;
+            {
+                std::lock_guard < std::mutex > guard(this->bufferedLock);
+                for (std::unordered_map < uint16_t, BufferedFile >::iterator i = this->buffered.begin(); i != this->buffered.end(); i++)
+                    files.insert(files.end(), i->first);
+            }
+            std::sort(files.begin(), files.end());
+
+            FSResult::FSResult result = FSResult::E_SUCCESS;
+            for (std::vector < uint16_t >::iterator i = files.begin(); i != files.end(); i++)
+            {
+                FSResult::FSResult res = this->flushBufferedData(*i);
+                if (res != FSResult::E_SUCCESS)
+                    result = res;
+            }
+            return result;
+        }
+
+        void FS::setWriteBehindLimit(size_t bytes)
+        {
+            this->bufferedLimit = bytes;
+        }
+
+        void FS::truncateBufferedData(uint16_t inodeid, uint32_t len)
+        {
+            std::lock_guard < std::mutex > guard(this->bufferedLock);
+            std::unordered_map < uint16_t, BufferedFile >::iterator f = this->buffered.find(inodeid);
+            if (f == this->buffered.end())
+                return;
+
+            BufferedFile & file = f->second;
+            std::map < uint32_t, std::string >::iterator i = file.ranges.lower_bound(len);
+            if (i != file.ranges.begin())
+            {
+                i--;
+                if (i->first + i->second.length() > len)
+                {
+                    size_t cut = i->first + i->second.length() - len;
+                    i->second.resize(len - i->first);
+                    file.bytes -= cut;
+                    this->bufferedBytes -= cut;
+                }
+                i++;
+            }
+            while (i != file.ranges.end())
+            {
+                file.bytes -= i->second.length();
+                this->bufferedBytes -= i->second.length();
+                i = file.ranges.erase(i);
+            }
+
+            // The file's length is changed in the package as well, so
+            // there is nothing left to write out if no data is held.
+            if (file.ranges.empty())
+                this->buffered.erase(f);
+            else
+                file.length = len;
+        }
+
+        FSResult::FSResult FS::writeFileData(uint16_t inodeid, uint32_t pos, const char * data, uint32_t count)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            std::vector < FileRun > runs = this->planFileRange(inodeid, pos, count);
+            uint32_t doff = 0;
+            for (std::vector < FileRun >::iterator i = runs.begin(); i != runs.end(); i++)
+            {
+                // The stream is shared with other threads writing to
+                // other files, so only the result of our own write says
+                // whether it failed.
+                if (this->fd->writeAt(i->pos, data + doff, i->length) < 0)
+                    return FSResult::E_FAILURE_GENERAL;
+                doff += i->length;
+            }
+
+            // We've run out of blocks to write to.
+            if (doff < count)
+                return FSResult::E_FAILURE_INVALID_POSITION;
+            return FSResult::E_SUCCESS;
+        }
+
+        FSResult::FSResult FS::allocateInfoListBlocks(uint32_t pos, uint32_t len)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            signed int file_info_next_offset = INodeLayout::FILE_INFO_NEXT_OFFSET;
+            signed int info_info_next_offset = INodeLayout::SEGINFO_INFO_NEXT_OFFSET;
+            uint32_t rsize = this->extentLayout ? RSIZE_EXTENT : RSIZE_SEGMENT;
+            uint32_t segments_in_file_block = (BSIZE_FILE - HSIZE_FILE) / rsize;
+            uint32_t segments_in_info_block = (BSIZE_FILE - HSIZE_SEGINFO) / rsize;
 
             // Get the INode.
             INode node = this->getINodeByPosition(pos);
-            // TODO: Verify type of INode.
+            if (node.type != INodeType::INT_FILEINFO &&
+                node.type != INodeType::INT_SYMLINK)
+                return FSResult::E_FAILURE_INODE_NOT_VALID;
 
             // First calculate the number of segment info 'markers' we need to
-            // address data in the entire file.
-            uint32_t mcount = len / BSIZE_FILE;
+            // address data in the entire file.  With the extent layout this is
+            // the number of extents the file currently has.
+            SegmentMap & map = this->getSegmentMap(pos);
+            uint32_t mcount = ceil(len / (double) BSIZE_FILE);
+            if (this->extentLayout)
+                mcount = map.extents.size();
 
             // Subtract the number that can be addressed in the file block as we're
             // only interested in the number of additional blocks.
@@ -1191,116 +1879,199 @@ namespace AppLib
             else
                 mcount = 0;
 
-            // Do the same for the current number of segment allocated.
-            uint32_t ccount = node.blocks;
-            if (ccount > segments_in_file_block)
-                ccount -= segments_in_file_block;
-            else
-                ccount = 0;
-
             // Calculate how many *additional* info list blocks we'd need to
-            // index all of the file, as well as how many info blocks are
-            // currently being used.
-            uint32_t tilcount = 0;
-            uint32_t cilcount = 0;
-            for (uint32_t i = 0; i < mcount; i += segments_in_info_block)
-                tilcount += 1;
-            for (uint32_t i = 0; i < ccount; i += segments_in_file_block)
-                cilcount += 1;
+            // index all of the file.  The number currently in use is known
+            // from the segment map (which also records where they are).
+            uint32_t tilcount = (mcount + segments_in_info_block - 1) / segments_in_info_block;
+            uint32_t cilcount = map.lists.size() - 1;
 
-            // Determine whether we need to increase, decrease or leave the
-            // number of allocated blocks the same.
-            if (tilcount == cilcount)
-                return FSResult::E_SUCCESS;
-            else if (tilcount < cilcount)
-            {
-                // Free up some blocks.  First loop through and build
-                // a vector list of all of the positions of the info
-                // list blocks (as there is no way to reverse through
-                // the list using I/O).
-                std::vector < uint32_t > list_positions;
-                uint32_t lpos = 0;
-                this->fd->seekg(pos + file_info_next_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
-                while (lpos != 0)
+            // Free up blocks from the end of the list.
+            while (tilcount < cilcount)
+            {
+                uint32_t dpos = map.lists.back();
+                uint32_t ppos = map.lists[map.lists.size() - 2];
+                uint32_t poff = (ppos == pos) ? file_info_next_offset : info_info_next_offset;
+
+                // Erase the link from the previous info block to this one.
+                uint32_t zeropos = 0;
+                Endian::doWAt(this->fd, ppos + poff, reinterpret_cast < char *>(&zeropos), 4);
+                if (ppos == pos)
+                    this->patchCachedINode(pos, [&](INode & node) { node.info_next = 0; });
+                map.lists.pop_back();
+
+                // Now erase the block.
+                this->resetBlock(dpos);
+
+                cilcount -= 1;
+            }
+
+            // Allocate as many blocks as we need on the end of the list.
+            while (tilcount > cilcount)
+            {
+                // Get a new block and give it a segment info header;
+                // this also clears out all of its segment slots.
+                uint32_t ppos = map.lists.back();
+                uint32_t npos = this->freelist->allocateBlock(ppos);
+                if (npos == 0)
+                    return FSResult::E_FAILURE_GENERAL;
+                FSResult::FSResult res = this->writeINode(npos, INode(0, "", INodeType::INT_SEGINFO));
+                if (res != FSResult::E_SUCCESS)
                 {
-                    list_positions.insert(list_positions.begin(), lpos);
-                    this->fd->seekg(lpos + info_info_next_offset);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
+                    this->freelist->freeBlock(npos);
+                    return res;
                 }
 
-                // Now delete the info list blocks.
-                while (tilcount < cilcount)
+                // Set a link from the previous block to the new one.
+                uint32_t poff = (ppos == pos) ? file_info_next_offset : info_info_next_offset;
+                Endian::doWAt(this->fd, ppos + poff, reinterpret_cast < char *>(&npos), 4);
+                if (ppos == pos)
+                    this->patchCachedINode(pos, [&](INode & node) { node.info_next = npos; });
+                map.lists.insert(map.lists.end(), npos);
+
+                cilcount += 1;
+            }
+
+            return FSResult::E_SUCCESS;
+        }
+
+        std::vector < uint32_t > FS::getFileBlockPositions(uint16_t id)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            uint32_t bpos = this->getINodePositionByID(id);
+            if (bpos == 0)
+                return std::vector < uint32_t > ();
+            SegmentMap & map = this->getSegmentMap(bpos);
+            return std::vector < uint32_t > (map.blocks.begin(), map.blocks.end() - map.preallocated);
+        }
+
+        FSResult::FSResult FS::freeUnownedBlocks(uint32_t & freed, uint32_t & conflicts)
+        {
+            assert( /* Check the stream is not in text-mode. */ this->isValid());
+
+            freed = 0;
+            conflicts = 0;
+            if (this->fd->isReadOnly() || this->unsupportedFeatures)
+            {
+                Logging::showErrorW("Unowned blocks can only be freed in a writable package with no unknown features.");
+                return FSResult::E_FAILURE_GENERAL;
+            }
+
+            // Count the owners of every block.  Only what the package
+            // records is trusted; segment lists are cut off at the file's
+            // length, so entries past it don't make a block the file's.
+            // If any list can't be followed to its end, the blocks it
+            // leads to would look unowned, so nothing is freed.
+            std::unordered_map < uint32_t, uint32_t > owners;
+            std::unordered_set < uint32_t > inodes;
+            bool complete = true;
+            for (uint32_t id = 0; id < this->positions.size(); id += 1)
+            {
+                uint32_t ipos = this->positions[id];
+                if (ipos < OFFSET_DATA || !inodes.insert(ipos).second)
+                    continue;
+                owners[ipos] += 1;
+
+                INode node = this->getINodeByRealPosition(ipos);
+                if (node.type == INodeType::INT_FILEINFO || node.type == INodeType::INT_SYMLINK)
                 {
-                    uint32_t dpos = list_positions[list_positions.size() - 1];
-                    uint32_t ppos = 0;
-                    uint32_t poff = 0;
-                    if (list_positions.size() == 1)
+                    SegmentMap & map = this->getSegmentMap(ipos);
+                    if (map.blocks.size() - map.preallocated < ceil(node.dat_len / (double) BSIZE_FILE))
                     {
-                        ppos = pos;
-                        poff = file_info_next_offset;
+                        Logging::showErrorW("Segment list of the file at %u is shorter than the file.", ipos);
+                        complete = false;
                     }
-                    else
+                    for (size_t i = 1; i < map.lists.size(); i += 1)
+                        owners[map.lists[i]] += 1;
+                    for (size_t i = 0; i < map.blocks.size(); i += 1)
+                        owners[map.blocks[i]] += 1;
+                }
+                else if (node.type == INodeType::INT_DIRECTORY && this->directoryLists)
+                {
+                    uint32_t lpos = this->getDirectoryListHead(ipos);
+                    DirectoryList list;
+                    std::unordered_set < uint32_t > visited;
+                    while (lpos != 0)
                     {
-                        ppos = list_positions[list_positions.size() - 2];
-                        poff = info_info_next_offset;
+                        if (!visited.insert(lpos).second || !this->readDirectoryList(lpos, list))
+                        {
+                            Logging::showErrorW("Directory list of the directory at %u is not valid at %u.", ipos, lpos);
+                            complete = false;
+                            break;
+                        }
+                        owners[lpos] += 1;
+                        lpos = list.next;
                     }
-
-                    // Erase the link from the previous info block to this one.
-                    this->fd->seekp(ppos + poff);
-                    uint32_t zeropos = 0;
-                    Endian::doW(this->fd, reinterpret_cast < char *>(&zeropos), 4);
-
-                    // Now erase the block.
-                    this->resetBlock(dpos);
-
-                    cilcount -= 1;
                 }
-
-                return FSResult::E_SUCCESS;
             }
-            else if (tilcount > cilcount)
+            uint32_t fpos = this->getFSInfo().pos_freelist;
+            std::unordered_set < uint32_t > visited;
+            while (fpos != 0)
             {
-                // Allocate some blocks.  Fetch the position of the last
-                // allocated block.
-                uint32_t lpos = 0;
-                uint32_t ppos = 0;
-                this->fd->seekg(pos + file_info_next_offset);
-                Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
-                while (lpos != 0)
+                uint32_t next = 0;
+                if (!visited.insert(fpos).second || !Endian::doRAt(this->fd, fpos + 4, reinterpret_cast < char *>(&next), 4))
                 {
-                    ppos = lpos;
-                    this->fd->seekg(lpos + info_info_next_offset);
-                    Endian::doR(this->fd, reinterpret_cast < char *>(&lpos), 4);
+                    Logging::showErrorW("Free list is not valid at %u.", fpos);
+                    complete = false;
+                    break;
                 }
+                owners[fpos] += 1;
+                fpos = next;
+            }
+            if (!complete)
+                return FSResult::E_FAILURE_GENERAL;
 
-                // Now allocate as many blocks as we need.
-                while (tilcount > cilcount)
+            uint32_t end = this->fd->size();
+            for (std::unordered_map < uint32_t, uint32_t >::iterator i = owners.begin(); i != owners.end(); i++)
+            {
+                if (i->first >= OFFSET_DATA && i->first < end && (i->first - OFFSET_DATA) % BSIZE_FILE == 0)
+                    continue;
+                Logging::showWarningW("Block at %u is owned but isn't a data block in the package.", i->first);
+                conflicts += 1;
+            }
+            for (uint32_t pos = OFFSET_DATA; pos + BSIZE_FILE <= end; pos += BSIZE_FILE)
+            {
+                std::unordered_map < uint32_t, uint32_t >::iterator i = owners.find(pos);
+                uint32_t count = (i == owners.end()) ? 0 : i->second;
+                bool unused = this->freelist->isBlockFree(pos);
+                if (count == 0 && !unused)
+                {
+                    if (this->resetBlock(pos) == FSResult::E_SUCCESS)
+                        freed += 1;
+                }
+                else if (count > 1)
                 {
-                    // Get a new block.
-                    uint32_t npos = this->freelist->allocateBlock();
+                    Logging::showWarningW("Block at %u has %u owners.", pos, count);
+                    conflicts += 1;
+                }
+                else if (count == 1 && unused)
+                {
+                    Logging::showWarningW("Block at %u is owned but is on the free list.", pos);
+                    conflicts += 1;
+                }
+            }
 
-                    // Set a link from the previous block to the new one.
-                    uint32_t poff = 0;
-                    if (ppos == 0)
-                    {
-                        ppos = pos;
-                        poff = file_info_next_offset;
-                    }
-                    else
-                        poff = info_info_next_offset;
+            return FSResult::E_SUCCESS;
+        }
 
-                    this->fd->seekp(ppos + poff);
-                    Endian::doW(this->fd, reinterpret_cast < char *>(&npos), 4);
+        bool FS::usesExtentLayout()
+        {
+            return this->extentLayout;
+        }
 
-                    ppos = npos;
-                    cilcount += 1;
-                }
+        bool FS::usesDirectoryLists()
+        {
+            return this->directoryLists;
+        }
 
-                return FSResult::E_SUCCESS;
-            }
+        RWLock & FS::getMetadataLock()
+        {
+            return this->metadataLock;
+        }
 
-            return FSResult::E_FAILURE_UNKNOWN;
+        RWLock & FS::getINodeLock(uint16_t id)
+        {
+            return this->inodeLocks[id % INODE_LOCK_STRIPES];
         }
 
         FSFile FS::getFile(uint16_t inodeid)
@@ -1322,55 +2093,44 @@ namespace AppLib
                 return temporary_position;
 
             uint32_t block_position = OFFSET_DATA + 2;
-            std::streampos oldg = this->fd->tellg();
-            std::streampos oldp = this->fd->tellp();
+            std::streampos fsize = this->fd->size();
 
             // Run through each of the blocks and check to see whether
             // they are a temporary block or not.
-            this->fd->seekg(block_position);
             uint16_t type_stor = INodeType::INT_UNSET;
-            uint32_t cpos = this->fd->tellg();
-            while (!this->fd->eof() && cpos == block_position && !this->freelist->isBlockFree(cpos))
+            while (block_position < fsize && !this->freelist->isBlockFree(block_position))
             {
                 // FIXME: What the hell is this doing??!?!
-                Endian::doR(this->fd, reinterpret_cast < char *>(&type_stor), 2);
+                Endian::doRAt(this->fd, block_position, reinterpret_cast < char *>(&type_stor), 2);
                 switch (type_stor)
                 {
                     case INodeType::INT_DIRECTORY:
                         block_position += BSIZE_DIRECTORY;
-                        this->fd->seekg(block_position);
                         break;
                     case INodeType::INT_FILEINFO:
                     case INodeType::INT_SEGINFO:
                         block_position += BSIZE_FILE;
-                        this->fd->seekg(block_position);
                         break;
                     case INodeType::INT_INVALID:
-                        this->fd->seekg(oldg);
                         return 0;
                     case INodeType::INT_TEMPORARY:
-                        this->fd->seekg(oldg);
                         temporary_position = block_position + 2;
                         return block_position + 2;
                     case INodeType::INT_UNSET:
                         break;
                     default:
-                        this->fd->seekg(oldg);
                         return 0;
                 }
             }
-            this->fd->seekg(oldg);
 
             // No temporary block allocated; allocate a new one.
             uint32_t newpos = this->getFirstFreeBlock(INodeType::INT_FILEINFO);
             if (newpos == 0)
                 return 0;
-            Util::seekp_ex(this->fd, newpos);
             uint16_t zeroid = 0;
             uint16_t tempid = INodeType::INT_TEMPORARY;
-            Endian::doW(this->fd, reinterpret_cast < char *>(&zeroid), 2);
-            Endian::doW(this->fd, reinterpret_cast < char *>(&tempid), 2);
-            Util::seekp_ex(this->fd, oldp);
+            Endian::doWAt(this->fd, newpos, reinterpret_cast < char *>(&zeroid), 2);
+            Endian::doWAt(this->fd, newpos + 2, reinterpret_cast < char *>(&tempid), 2);
             newpos += 4;
             temporary_position = newpos;
             return newpos;
@@ -1380,21 +2140,65 @@ namespace AppLib
         {
             assert( /* Check the stream is not in text-mode. */ this->isValid());
 
-            // Close the file stream.
+            // Write out any data still held in memory, then close the
+            // file stream.
+            this->flushBufferedData();
             this->fd->close();
         }
 
         void FS::reserveINodeID(uint16_t id)
         {
-            this->reservedINodes.insert(this->reservedINodes.end(), id);
+            this->setINodeIDUsed(id, true);
         }
 
         void FS::unreserveINodeID(uint16_t id)
         {
-            std::vector<uint16_t>::iterator it =
-                std::find(this->reservedINodes.begin(), this->reservedINodes.end(), id);
-            if (it != this->reservedINodes.end())
-                this->reservedINodes.erase(it);
+            // IDs that have since been written to the lookup table
+            // remain in use.
+            if (this->positions[id] == 0)
+                this->setINodeIDUsed(id, false);
+        }
+
+        void FS::loadINodeLookupTable()
+        {
+            this->positions.assign(LENGTH_LOOKUP / 4, 0);
+            this->usedINodes.assign(LENGTH_LOOKUP / 4 / 64, 0);
+            this->usedINodesHint = 0;
+            if (this->fd == NULL)
+                return;
+
+            // Read the entire table in one go and then convert it from
+            // the on-disk (little endian) byte order.
+            char *raw = reinterpret_cast < char *>(&this->positions[0]);
+            std::streamsize bread = this->fd->readAt(OFFSET_LOOKUP, raw, LENGTH_LOOKUP);
+            if (bread != LENGTH_LOOKUP)
+                Logging::showErrorW("Unable to read inode lookup table.");
+            if (!Endian::little_endian)
+            {
+                for (uint32_t i = 0; i < LENGTH_LOOKUP; i += 4)
+                {
+                    std::swap(raw[i], raw[i + 3]);
+                    std::swap(raw[i + 1], raw[i + 2]);
+                }
+            }
+
+            for (uint32_t i = 0; i < this->positions.size(); i += 1)
+            {
+                if (this->positions[i] != 0)
+                    this->usedINodes[i / 64] |= ((uint64_t) 1 << (i % 64));
+            }
+        }
+
+        void FS::setINodeIDUsed(uint16_t id, bool used)
+        {
+            if (used)
+                this->usedINodes[id / 64] |= ((uint64_t) 1 << (id % 64));
+            else
+            {
+                this->usedINodes[id / 64] &= ~((uint64_t) 1 << (id % 64));
+                if (id / 64 < this->usedINodesHint)
+                    this->usedINodesHint = id / 64;
+            }
         }
 
         LowLevel::FSResult::FSResult FS::checkINodePositionIsValid(int pos)
@@ -1420,6 +2224,181 @@ namespace AppLib
             return AppLib::LowLevel::FSResult::E_SUCCESS;
         }
 
+        FS::SegmentMap & FS::getSegmentMap(uint32_t pos)
+        {
+            // References to the map stay valid after the lock is released
+            // because maps are only erased while the metadata lock is held
+            // for writing.
+            std::lock_guard < std::mutex > guard(this->segmentsLock);
+            std::unordered_map < uint32_t, SegmentMap >::iterator i = this->segments.find(pos);
+            if (i != this->segments.end())
+                return i->second;
+
+            signed int file_len_offset = INodeLayout::FILE_DAT_LEN_OFFSET;
+            signed int file_info_next_offset = INodeLayout::FILE_INFO_NEXT_OFFSET;
+            signed int info_info_next_offset = INodeLayout::SEGINFO_INFO_NEXT_OFFSET;
+
+            // Decode the segment list, reading each block of it in a
+            // single call.  We stop after the number of blocks that the
+            // file length requires so that stale data can't extend the
+            // map (or send us around a loop).
+            SegmentMap & map = this->segments[pos];
+            map.preallocated = 0;
+            char block[BSIZE_FILE];
+            uint32_t blocks = 0;
+            uint32_t ipos = pos;
+            uint32_t hsize = HSIZE_FILE;
+            uint32_t noff = file_info_next_offset;
+            while (ipos != 0)
+            {
+                map.lists.insert(map.lists.end(), ipos);
+                if (this->fd->readAt(ipos, block, BSIZE_FILE) != BSIZE_FILE)
+                {
+                    Logging::showErrorW("Unable to read segment list block at %u.", ipos);
+                    break;
+                }
+                if (ipos == pos)
+                {
+                    uint32_t len = 0;
+                    memcpy(&len, block + file_len_offset, 4);
+                    if (!Endian::little_endian)
+                        len = __builtin_bswap32(len);
+                    blocks = ceil(len / (double) BSIZE_FILE);
+                    map.blocks.reserve(blocks);
+                }
+
+                for (int i = hsize; this->extentLayout && i + RSIZE_EXTENT <= BSIZE_FILE && map.blocks.size() < blocks; i += RSIZE_EXTENT)
+                {
+                    Extent extent;
+                    memcpy(&extent.start, block + i, 4);
+                    memcpy(&extent.count, block + i + 4, 4);
+                    if (!Endian::little_endian)
+                    {
+                        extent.start = __builtin_bswap32(extent.start);
+                        extent.count = __builtin_bswap32(extent.count);
+                    }
+                    if (extent.start == 0 || extent.count == 0)
+                    {
+                        // We've run out of extents.
+                        blocks = map.blocks.size();
+                        break;
+                    }
+                    extent.count = std::min < uint32_t > (extent.count, blocks - map.blocks.size());
+                    map.extents.insert(map.extents.end(), extent);
+                    for (uint32_t b = 0; b < extent.count; b += 1)
+                        map.blocks.insert(map.blocks.end(), extent.start + b * BSIZE_FILE);
+                }
+                for (int i = hsize; !this->extentLayout && i < BSIZE_FILE && map.blocks.size() < blocks; i += RSIZE_SEGMENT)
+                {
+                    uint32_t spos = 0;
+                    memcpy(&spos, block + i, 4);
+                    if (!Endian::little_endian)
+                        spos = __builtin_bswap32(spos);
+                    if (spos == 0)
+                    {
+                        // We've run out of segments.
+                        blocks = map.blocks.size();
+                        break;
+                    }
+                    map.blocks.insert(map.blocks.end(), spos);
+                }
+
+                // Get the next position.
+                uint32_t next = 0;
+                memcpy(&next, block + noff, 4);
+                if (!Endian::little_endian)
+                    next = __builtin_bswap32(next);
+                ipos = next;
+                hsize = HSIZE_SEGINFO;
+                noff = info_info_next_offset;
+            }
+
+            return map;
+        }
+
+        void FS::invalidateSegmentMap(uint32_t pos)
+        {
+            std::vector < uint32_t > reserved;
+            {
+                std::lock_guard < std::mutex > guard(this->segmentsLock);
+                std::unordered_map < uint32_t, SegmentMap >::iterator i = this->segments.find(pos);
+                if (i == this->segments.end())
+                    return;
+                reserved.assign(i->second.blocks.end() - i->second.preallocated, i->second.blocks.end());
+                this->segments.erase(i);
+            }
+
+            // Blocks reserved past the end of the file aren't recorded
+            // anywhere else, so they would be lost along with the map.
+            for (std::vector < uint32_t >::iterator i = reserved.begin(); i != reserved.end(); i++)
+                this->freelist->freeBlock(*i);
+        }
+
+        uint32_t FS::getSegmentSlotPosition(SegmentMap & map, uint32_t index)
+        {
+            uint32_t rsize = this->extentLayout ? RSIZE_EXTENT : RSIZE_SEGMENT;
+            uint32_t segments_in_file_block = (BSIZE_FILE - HSIZE_FILE) / rsize;
+            uint32_t segments_in_info_block = (BSIZE_FILE - HSIZE_SEGINFO) / rsize;
+
+            if (index < segments_in_file_block)
+                return map.lists[0] + HSIZE_FILE + index * rsize;
+            index -= segments_in_file_block;
+            return map.lists[1 + index / segments_in_info_block] + HSIZE_SEGINFO + (index % segments_in_info_block) * rsize;
+        }
+
+        void FS::writeExtent(SegmentMap & map, uint32_t index)
+        {
+            uint32_t start = 0;
+            uint32_t count = 0;
+            if (index < map.extents.size())
+            {
+                start = map.extents[index].start;
+                count = map.extents[index].count;
+            }
+
+            // The last record in the last list block may not exist.
+            uint32_t records = (BSIZE_FILE - HSIZE_FILE) / RSIZE_EXTENT +
+                               (map.lists.size() - 1) * ((BSIZE_FILE - HSIZE_SEGINFO) / RSIZE_EXTENT);
+            if (index >= records)
+                return;
+
+            uint32_t spos = this->getSegmentSlotPosition(map, index);
+            Endian::doWAt(this->fd, spos, reinterpret_cast < char *>(&start), 4);
+            Endian::doWAt(this->fd, spos + 4, reinterpret_cast < char *>(&count), 4);
+        }
+
+        FSResult::FSResult FS::writeExtents(uint32_t pos, SegmentMap & map)
+        {
+            // Group the blocks into runs.
+            uint32_t previous = map.extents.size();
+            map.extents.clear();
+            for (std::vector < uint32_t >::iterator i = map.blocks.begin(); i != map.blocks.end(); i++)
+            {
+                if (map.extents.size() > 0 && map.extents.back().start + map.extents.back().count * BSIZE_FILE == *i)
+                    map.extents.back().count += 1;
+                else
+                {
+                    Extent extent;
+                    extent.start = *i;
+                    extent.count = 1;
+                    map.extents.insert(map.extents.end(), extent);
+                }
+            }
+
+            // Clear out any records that are no longer used before the
+            // list blocks holding them might be freed.
+            for (uint32_t i = map.extents.size(); i < previous; i += 1)
+                this->writeExtent(map, i);
+
+            INode node = this->getINodeByPosition(pos);
+            FSResult::FSResult res = this->allocateInfoListBlocks(pos, node.dat_len);
+            if (res != FSResult::E_SUCCESS)
+                return res;
+            for (uint32_t i = 0; i < map.extents.size(); i += 1)
+                this->writeExtent(map, i);
+            return FSResult::E_SUCCESS;
+        }
+
         void FS::updateTimes(uint16_t id, bool atime, bool mtime, bool ctime)
         {
             INode node = this->getINodeByID(id);
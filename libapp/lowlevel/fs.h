@@ -18,13 +18,21 @@ namespace AppLib
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <unordered_map>
+#include <map>
 #include <algorithm>
+#include <mutex>
+#include <list>
+#include <memory>
+#include <functional>
 #include <libapp/lowlevel/endian.h>
 #include <libapp/fsfile.h>
 #include <libapp/lowlevel/blockstream.h>
 #include <libapp/lowlevel/inode.h>
+#include <libapp/lowlevel/fsinfo.h>
 #include <libapp/lowlevel/freelist.h>
 #include <libapp/lowlevel/fsresult.h>
+#include <libapp/lowlevel/rwlock.h>
 
 namespace AppLib
 {
@@ -42,6 +50,12 @@ namespace AppLib
             //! package.
             bool isValid();
 
+            //! Returns whether the package uses features that this
+            //! version does not support.  Such a package can be read,
+            //! but must not be changed, since we would not keep the
+            //! parts of it we don't understand consistent.
+            bool hasUnsupportedFeatures();
+
             //! Writes an INode to the specified position and then
             //! updates the inode lookup table.
             FSResult::FSResult writeINode(uint32_t pos, INode node);
@@ -53,18 +67,29 @@ namespace AppLib
             //! Updates a raw INode (such as a freelist block).
             FSResult::FSResult updateRawINode(INode node, uint32_t pos);
 
-            //! Retrieves an INode by an ID.
-            INode getINodeByID(uint16_t id);
+            //! Retrieves an INode by an ID.  The child table of a
+            //! directory is only read if children is true; nodes read
+            //! without it can still be updated, leaving the table as is.
+            //! Packages with directory lists don't have child tables, so
+            //! use getChildrenOfDirectory to find children instead.
+            INode getINodeByID(uint16_t id, bool children = false);
 
             //! Retrieves an INode by an ID, without performing hardlink
             //! resolution.
             INode getRealINodeByID(uint16_t id);
 
             //! Retrieves an INode by position.
-            INode getINodeByPosition(uint32_t pos);
+            INode getINodeByPosition(uint32_t pos, bool children = false);
 
             //! Retrieves the real INode by position (in the case of hardlinks).
-            INode getINodeByRealPosition(uint32_t rpos);
+            //! Inodes are served from the inode cache when they can be.
+            INode getINodeByRealPosition(uint32_t rpos, bool children = false);
+
+            //! Retrieves the filesystem information block.
+            FSInfo getFSInfo();
+
+            //! Writes the filesystem information block.
+            FSResult::FSResult updateFSInfo(FSInfo info);
 
             //! A return value of 0 indicates that the specified INode
             //! does not exist.  Underlyingly calls getINodePositionByID(id, true);
@@ -93,6 +118,10 @@ namespace AppLib
             //! Returns whether the specified block is free according to the freelist.
             bool isBlockFree(uint32_t pos);
 
+            //! Returns the number of free blocks inside the package (not counting
+            //! space that could be gained by growing the package).
+            uint32_t getFreeBlockCount();
+
             //! Adds a child inode to a parent (directory) inode.  Please note that it doesn't
             //! check to see whether or not the child is already attached to the parent, but
             //! it will add the child reference in the lowest available slot.
@@ -102,22 +131,38 @@ namespace AppLib
             FSResult::FSResult removeChildFromDirectoryINode(uint16_t parentid, uint16_t childid);
 
             //! Returns whether or not a specified filename is unique
-            //! inside a directory.  E_SUCCESS indicates unique, E_FAILURE_NOT_UNIQUE
+            //! inside a directory (using the directory's name index).  E_SUCCESS indicates unique, E_FAILURE_NOT_UNIQUE
             //! indicates not unique.
             FSResult::FSResult filenameIsUnique(uint16_t parentid, std::string filename);
 
             //! Returns an std::vector<INode> list of children within
-            //! the specified directory.
+            //! the specified directory.  The child tables of any
+            //! directories in the list are not read.
             std::vector < INode > getChildrenOfDirectory(uint16_t parentid);
 
+            //! Returns up to count children of the specified directory,
+            //! starting after the child at the specified offset (or at
+            //! the first child if offset is 0).  The offset of each child
+            //! is stored in offsets; offsets are above 0 and stay the
+            //! same while the child remains in the directory, so a listing
+            //! can be continued after the directory has been changed.
+            std::vector < INode > getChildrenOfDirectory(uint16_t parentid, uint64_t offset, size_t count, std::vector < uint64_t > & offsets);
+
             /*! Returns an INode for the child with the specified
              * INode id (or filename) within the specified directory.  Returns an
              * inode with type INodeType::INT_INVALID if it is unable to find
              * the specified child, or if the parent inode is invalid (i.e. not
-             * a directory).
+             * a directory).  The child table of the result is not read.
              */
             INode getChildOfDirectory(uint16_t parentid, uint16_t childid);
-            INode getChildOfDirectory(uint16_t parentid, std::string filename);
+            INode getChildOfDirectory(uint16_t parentid, const std::string & filename);
+
+            //! Returns the inode ID that is stored under the specified
+            //! filename in a directory (without resolving hardlinks), or
+            //! -ENOENT if there is none or the parent isn't a directory.
+            //! getINodeByID(id, false) returns the same inode that
+            //! getChildOfDirectory does.
+            int32_t getChildIDOfDirectory(uint16_t parentid, const std::string & filename);
 
             //! Sets a file's contents (replacing the current contents).
             FSResult::FSResult setFileContents(uint16_t id, const char *data, uint32_t len);
@@ -148,11 +193,101 @@ namespace AppLib
             //! Resolves a position in a file to a position in the disk image.
             uint32_t resolvePositionInFile(uint16_t inodeid, uint32_t pos);
 
+            //! A run of a file's data that is contiguous in the disk image.
+            struct FileRun
+            {
+                uint32_t pos;       //!< The position of the run in the disk image.
+                uint32_t length;    //!< The number of bytes in the run.
+            };
+
+            //! Splits part of a file into the fewest runs that are each
+            //! contiguous in the disk image, so that each can be read or
+            //! written with a single call.  The runs stop early if the
+            //! file's blocks run out.
+            std::vector<FileRun> planFileRange(uint16_t inodeid, uint32_t pos, uint32_t count);
+
+            //! Reads part of a file that has blocks, reading each run from
+            //! planFileRange straight into out.  Returns the number of bytes
+            //! read.
+            uint32_t readFileData(uint16_t inodeid, uint32_t pos, char * out, uint32_t count);
+
+            //! Asks the stream to read part of a file into memory in the
+            //! background, one request per run from planFileRange.
+            void prefetchFileData(uint16_t inodeid, uint32_t pos, uint32_t count);
+
+            //! Sets the largest number of bytes that are read ahead of a
+            //! file that is being read sequentially.  A limit of 0
+            //! disables readahead.
+            void setReadaheadLimit(uint32_t bytes);
+            uint32_t getReadaheadLimit();
+
             //! Resolve a pathname into an inode id.
-            int32_t resolvePathnameToINodeID(std::string path);
+            int32_t resolvePathnameToINodeID(const std::string & path);
 
             //! Sets the length of a file, allocating or erasing blocks / data where necessary.
-            FSResult::FSResult truncateFile(uint16_t inodeid, uint32_t len);
+            /*!
+             * If preallocate is true (because the file is being written
+             * past its end) and new blocks are needed, extra blocks are
+             * reserved after the new end of the file so that the writes
+             * that follow don't have to allocate.  The reservation grows
+             * with the file, up to the preallocation limit, and is kept
+             * until releasePreallocation is called or the file is
+             * shrunk.
+             */
+            FSResult::FSResult truncateFile(uint16_t inodeid, uint32_t len, bool preallocate = false);
+
+            //! Frees any blocks reserved past the end of a file by
+            //! truncateFile.
+            FSResult::FSResult releasePreallocation(uint16_t inodeid);
+
+            //! Frees the blocks reserved past the end of every file.
+            void releasePreallocations();
+
+            //! Sets the largest number of blocks that truncateFile will
+            //! reserve past the end of a file.  A limit of 0 disables
+            //! preallocation.
+            void setPreallocationLimit(uint32_t blocks);
+
+            //! Holds data written to a file in memory rather than writing
+            //! it to the package.
+            /*!
+             * The data is only given blocks when it is written out by
+             * flushBufferedData, so a file that is written in many small
+             * pieces is allocated all at once, and overlapping writes are
+             * merged before they reach the package.  Returns false, and
+             * holds nothing, if write-behind is disabled, the inode is not
+             * a file or the data would take the buffers over the limit; the
+             * caller must then write the data itself, after writing out any
+             * data that is still held for the file.
+             */
+            bool bufferFileData(uint16_t inodeid, uint32_t pos, const char * data, uint32_t count);
+
+            //! Copies the data held in memory for part of a file over the
+            //! data that was read for it from the package.
+            void readBufferedFileData(uint16_t inodeid, uint32_t pos, char * out, uint32_t count);
+
+            //! Returns whether data is held in memory for a file, storing
+            //! the length the file will have once it is written out in len.
+            bool getBufferedFileLength(uint16_t inodeid, uint32_t & len);
+
+            //! Writes out the data held in memory for a file, allocating
+            //! the blocks it needs.  Like truncateFile, this changes the
+            //! file's segment list.  If the data can't be written out it
+            //! stays held, so the flush can be retried.
+            FSResult::FSResult flushBufferedData(uint16_t inodeid);
+
+            //! Writes out the data held in memory for every file.
+            FSResult::FSResult flushBufferedData();
+
+            //! Sets the number of bytes of file data that bufferFileData
+            //! may hold in memory.  A limit of 0 (the default) disables
+            //! write-behind; data that is already held stays until it is
+            //! flushed.
+            void setWriteBehindLimit(size_t bytes);
+
+            //! Writes data to part of a file that already has blocks,
+            //! writing each run from planFileRange with a single call.
+            FSResult::FSResult writeFileData(uint16_t inodeid, uint32_t pos, const char * data, uint32_t count);
 
             //! Allocates or frees enough blocks so that there is enough segment list blocks
             //! available to address all of the segments.
@@ -162,6 +297,37 @@ namespace AppLib
              */
             FSResult::FSResult allocateInfoListBlocks(uint32_t pos, uint32_t len);
 
+            //! Returns the positions of the data blocks of a file, in order
+            //! (not including any blocks reserved past its end).
+            std::vector < uint32_t > getFileBlockPositions(uint16_t id);
+
+            //! Frees every data block that the free list says is in use
+            //! but that nothing in the package owns, such as blocks that
+            //! were reserved past the end of a file when the package
+            //! wasn't unmounted cleanly.
+            /*!
+             * The owners are found by walking every inode in the lookup
+             * table, its segment list or directory list, and the free list
+             * chain; if any of them can't be followed to its end, nothing is
+             * freed.  Blocks with more than one owner, and owned blocks that
+             * are free, are reported and left alone; they are counted in
+             * conflicts.  The package must not be in use anywhere else.
+             *
+             * @param freed The number of blocks that were freed.
+             * @param conflicts The number of blocks that were reported.
+             */
+            FSResult::FSResult freeUnownedBlocks(uint32_t & freed, uint32_t & conflicts);
+
+            //! Returns whether files in this package store their data blocks
+            //! as extents (format version 0.2 and later) rather than as a list
+            //! of individual block positions.
+            bool usesExtentLayout();
+
+            //! Returns whether directories in this package keep their children
+            //! in directory lists (FEATURE_DIRECTORY_LISTS) rather than in the
+            //! child table of the directory block.
+            bool usesDirectoryLists();
+
             //! Returns a FSFile object for interacting with the specified file at
             //! the specified inode.
             FSFile getFile(uint16_t inodeid);
@@ -186,7 +352,7 @@ namespace AppLib
             void close();
 
             //! Reserves an INode ID for future use without require the INode to actually be
-            //! written to disk.
+            //! written to disk.  Reserved IDs are never returned by getFirstFreeINodeNumber.
             void reserveINodeID(uint16_t id);
 
             //! Removes an INode ID reservation.
@@ -195,6 +361,30 @@ namespace AppLib
             //! Update times on an inode.
             void updateTimes(uint16_t id, bool atime, bool mtime, bool ctime);
 
+            //! Sets the number of decoded inodes that are kept in memory.  A
+            //! capacity of 0 disables the inode cache.
+            void setINodeCacheSize(uint32_t capacity);
+
+            //! Returns the lock that guards the inode lookup table, the
+            //! free list and the structure of every file and directory.
+            /*!
+             * This class does not take the lock itself.  When the package is
+             * used from multiple threads, callers must hold it for reading
+             * while they only look things up or access existing file data,
+             * and for writing while they change anything else (including
+             * the size of a file).
+             */
+            RWLock & getMetadataLock();
+
+            //! Returns the lock that guards the data of the specified inode.
+            /*!
+             * Readers of a file's data hold it for reading and writers hold
+             * it for writing, in both cases while also holding the metadata
+             * lock for reading.  Locks are shared between inodes whose IDs
+             * are equal modulo INODE_LOCK_STRIPES.
+             */
+            RWLock & getINodeLock(uint16_t id);
+
             //! Checks whether the specified position is valid.
             static LowLevel::FSResult::FSResult checkINodePositionIsValid(int pos);
 
@@ -205,7 +395,263 @@ namespace AppLib
         private:
             LowLevel::BlockStream * fd;
             LowLevel::FreeList * freelist;
-            std::vector<uint16_t> reservedINodes;
+
+            //! An in-memory copy of the inode lookup table at OFFSET_LOOKUP,
+            //! indexed by inode ID.  Writes go through to disk immediately.
+            std::vector<uint32_t> positions;
+
+            //! A bitmap of the inode IDs that are in use, either because they
+            //! have a position in the lookup table or because they have been
+            //! reserved.  A set bit means the ID is taken.
+            std::vector<uint64_t> usedINodes;
+
+            //! The index of the first word in usedINodes that may contain a
+            //! clear bit; all words before it are known to be full.
+            uint32_t usedINodesHint;
+
+            //! Reads the inode lookup table into memory and builds the
+            //! used inode bitmap from it.
+            void loadINodeLookupTable();
+
+            //! Marks an inode ID as used or unused in the bitmap.
+            void setINodeIDUsed(uint16_t id, bool used);
+
+            //! Whether the package stores file data as extents.
+            bool extentLayout;
+
+            //! Whether the package has FEATURE_DIRECTORY_LISTS.
+            bool directoryLists;
+
+            //! Whether the package has features we don't know about.
+            bool unsupportedFeatures;
+
+            //! A run of contiguous data blocks in a file.
+            struct Extent
+            {
+                uint32_t start;
+                uint32_t count;
+            };
+
+            //! The decoded segment list of a file.
+            struct SegmentMap
+            {
+                //! The position of each data block in the file, in order.
+                std::vector<uint32_t> blocks;
+
+                //! The data blocks grouped into extents (only used when the
+                //! package has the extent layout).
+                std::vector<Extent> extents;
+
+                //! The positions of the blocks holding the segment list; the
+                //! file inode followed by each of its INT_SEGINFO blocks.
+                std::vector<uint32_t> lists;
+
+                //! The number of blocks at the end of blocks that are
+                //! reserved for the file to grow into, rather than holding
+                //! its data.  They are only recorded on disk by the segment
+                //! list, which is cut off at the file's length when it is
+                //! read, so they must be freed before the map is dropped.
+                //! If the package isn't unmounted cleanly they are leaked
+                //! until freeUnownedBlocks is run on it.
+                uint32_t preallocated;
+            };
+
+            //! The segment maps of files that have been accessed, keyed by
+            //! the position of the file inode.  truncateFile and
+            //! allocateInfoListBlocks keep these up-to-date as they change
+            //! the on-disk list.
+            std::unordered_map<uint32_t, SegmentMap> segments;
+
+            //! Guards the segment maps, which are filled in on lookup
+            //! while only the metadata lock is held for reading.
+            std::mutex segmentsLock;
+
+            RWLock metadataLock;
+            RWLock inodeLocks[INODE_LOCK_STRIPES];
+
+            //! Returns the segment map for the file inode at the specified
+            //! position, reading it from disk if it isn't cached.
+            SegmentMap & getSegmentMap(uint32_t pos);
+
+            //! Discards the cached segment map for the file inode at the
+            //! specified position (if any).
+            void invalidateSegmentMap(uint32_t pos);
+
+            //! A decoded inode header (without its child table) and
+            //! where it is in the least-recently-used order.  INode is
+            //! still incomplete here, so the node is held by pointer.
+            struct CachedINode
+            {
+                std::shared_ptr<INode> node;
+                std::list<uint32_t>::iterator lru;
+            };
+
+            //! Recently read inodes, keyed by position so that the changes
+            //! that are made to inodes in place (which are all addressed
+            //! by position) can be applied to them.  Every write to an
+            //! inode header updates or evicts its entry.
+            std::unordered_map<uint32_t, CachedINode> inodes;
+            std::list<uint32_t> inodesLRU;
+            uint32_t inodesCapacity;
+
+            //! Guards the inode cache, which is filled in on lookup
+            //! while only the metadata lock is held for reading.
+            std::mutex inodesLock;
+
+            //! Stores a copy of an inode that was read from or written
+            //! to the specified position in the inode cache.
+            void cacheINode(uint32_t pos, const INode & node);
+
+            //! Reads the headers of the specified inodes that aren't in
+            //! the inode cache with a single batch and caches them, so
+            //! that looking each of them up afterwards doesn't have to
+            //! wait for the disk.
+            void loadINodes(const std::vector<uint16_t> & ids);
+
+            //! Applies a change that has been written in place to the
+            //! cached copy of the inode at the specified position.
+            void patchCachedINode(uint32_t pos, const std::function<void(INode &)> & change);
+
+            //! Discards the cached inode at the specified position.
+            void invalidateCachedINode(uint32_t pos);
+
+            //! The largest number of blocks that are reserved past the
+            //! end of a file that is being written to.
+            uint32_t preallocationLimit;
+
+            //! The largest number of bytes that are read ahead of a file.
+            uint32_t readaheadLimit;
+
+            //! Frees the blocks reserved past the end of the file whose
+            //! inode is at the specified position.
+            FSResult::FSResult releasePreallocationAt(uint32_t pos);
+
+            //! The data written to a file that hasn't been written out
+            //! to the package yet.
+            struct BufferedFile
+            {
+                //! The length the file will have once it is written out.
+                uint32_t length;
+
+                //! The data, as ranges that neither overlap nor touch,
+                //! keyed by their offset in the file.
+                std::map<uint32_t, std::string> ranges;
+                size_t bytes;
+            };
+
+            //! The files with data held by bufferFileData, keyed by inode ID.
+            std::unordered_map<uint16_t, BufferedFile> buffered;
+            size_t bufferedBytes;
+            size_t bufferedLimit;
+
+            //! Guards the write-behind buffers, which are filled in while
+            //! only the metadata lock is held for reading.
+            std::mutex bufferedLock;
+
+            //! Discards the data held for a file past the specified length
+            //! and sets the length it will have when it's written out.
+            void truncateBufferedData(uint16_t inodeid, uint32_t len);
+
+            //! The names in a directory, so that children can be found
+            //! by name without reading every child inode.
+            struct DirectoryIndex
+            {
+                //! A child of the directory, keyed by inode ID.
+                struct Entry
+                {
+                    //! The child's slot in the child table plus one, or
+                    //! its key in the directory list plus one.
+                    uint64_t offset;
+                    std::string name;
+                    bool named; //!< Whether the child is in names.
+                };
+                std::unordered_map<uint16_t, Entry> entries;
+                std::unordered_map<std::string, uint16_t> names;
+
+                //! The children in the order they are listed, keyed by
+                //! their offsets.
+                std::map<uint64_t, uint16_t> order;
+
+                //! Which slots in the child table are in use, and the
+                //! lowest slot that might be free.
+                std::vector<bool> used;
+                uint16_t firstFree;
+
+                //! The blocks in the directory list, keyed by the first
+                //! key in each one.
+                std::map<uint64_t, uint32_t> blocks;
+
+                //! Set if an inode appears in more than one slot, in
+                //! which case entries only records one of them.
+                bool duplicates;
+            };
+
+            //! The indexes of directories that have been searched, keyed
+            //! by inode ID, and the directory each indexed child is in.
+            std::unordered_map<uint16_t, DirectoryIndex> directories;
+            std::unordered_map<uint16_t, uint16_t> parents;
+
+            //! Guards the directory indexes, which are built on lookup
+            //! while only the metadata lock is held for reading.
+            std::mutex directoriesLock;
+
+            //! Returns the index of the specified directory, building it
+            //! if it isn't cached, or NULL if it isn't a directory.
+            DirectoryIndex * getDirectoryIndex(uint16_t parentid);
+
+            //! Adds a child that was found at the specified offset (and
+            //! its inode, as read by getINodeByID) to a directory's
+            //! index.  The caller must hold directoriesLock.
+            void indexChild(DirectoryIndex & index, uint16_t parentid, uint64_t offset, uint16_t childid, const INode & child);
+
+            //! Discards the index of the specified directory (if any).
+            void invalidateDirectoryIndex(uint16_t parentid);
+
+            //! Records the name that an indexed child now has on disk,
+            //! moving it in the directory list if it has one.
+            FSResult::FSResult renameInDirectoryIndex(uint16_t id, const std::string& name);
+
+            //! A block of a directory list; the keys are sorted and each
+            //! one is the hash of a child's name followed by its inode ID.
+            struct DirectoryList
+            {
+                uint32_t pos;
+                uint32_t next;
+                std::vector<uint64_t> keys;
+            };
+
+            //! Returns the key that a child is stored under in a
+            //! directory list.
+            static uint64_t getDirectoryListKey(const std::string& name, uint16_t id);
+
+            //! Reads and writes the position of the first block of the
+            //! list of the directory at the specified position.
+            uint32_t getDirectoryListHead(uint32_t pos);
+            void setDirectoryListHead(uint32_t pos, uint32_t head);
+
+            //! Reads or writes a directory list block with a single call.
+            bool readDirectoryList(uint32_t pos, DirectoryList & list);
+            FSResult::FSResult writeDirectoryList(uint16_t parentid, DirectoryList & list);
+
+            //! Adds or removes a key in a directory's list, splitting
+            //! full blocks and freeing empty ones.  The caller must hold
+            //! directoriesLock.
+            FSResult::FSResult insertIntoDirectoryList(DirectoryIndex & index, uint16_t parentid, uint64_t key);
+            FSResult::FSResult removeFromDirectoryList(DirectoryIndex & index, uint16_t parentid, uint64_t key);
+
+            //! Returns the position of the on-disk slot that holds the
+            //! specified record (a block position, or an extent) of a file's
+            //! segment list.  The segment list blocks that contain the slot
+            //! must already be allocated.
+            uint32_t getSegmentSlotPosition(SegmentMap & map, uint32_t index);
+
+            //! Writes out the specified extent record, or an empty record if
+            //! the index is past the last extent.
+            void writeExtent(SegmentMap & map, uint32_t index);
+
+            //! Rebuilds the extents of a file from its block positions and
+            //! writes all of them out.
+            FSResult::FSResult writeExtents(uint32_t pos, SegmentMap & map);
         };
     }
 }
@@ -0,0 +1,106 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libapp/config.h>
+
+#include <string.h>
+#include <libapp/lowlevel/fsinfo.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        FSInfo::FSInfo()
+        {
+            this->inodeid = 0;
+            this->type = INodeType::INT_FSINFO;
+            for (uint16_t i = 0; i < 10; i += 1)
+                this->fs_name[i] = FS_NAME[i];
+            this->ver_major = 0;
+            this->ver_minor = 0;
+            this->ver_revision = 0;
+            FSInfo::copyString("", this->app_name, 256);
+            FSInfo::copyString("", this->app_ver, 32);
+            FSInfo::copyString("", this->app_desc, 1024);
+            FSInfo::copyString("", this->app_author, 256);
+            this->pos_root = 0;
+            this->pos_freelist = 0;
+            this->features = 0;
+        }
+
+        std::string FSInfo::getBinaryRepresentation()
+        {
+            std::string binary_rep(HSIZE_FSINFO, '\0');
+            uint16_t rawtype = this->type;
+            INodeLayout::encode(INodeLayout::FSINFO_FIELDS, sizeof(INodeLayout::FSINFO_FIELDS) / sizeof(INodeLayout::Field),
+                                &binary_rep[0], [&](INodeLayout::FieldID id) -> char *
+            {
+                return this->getField(id, rawtype);
+            });
+            return binary_rep;
+        }
+
+        bool FSInfo::setBinaryRepresentation(const char *data, uint32_t length)
+        {
+            if (length < HSIZE_FSINFO)
+                return false;
+            uint16_t rawtype = 0;
+            INodeLayout::decode(INodeLayout::FSINFO_FIELDS, sizeof(INodeLayout::FSINFO_FIELDS) / sizeof(INodeLayout::Field),
+                                data, [&](INodeLayout::FieldID id) -> char *
+            {
+                return this->getField(id, rawtype);
+            });
+            this->type = (INodeType::INodeType) rawtype;
+            return (this->type == INodeType::INT_FSINFO);
+        }
+
+        char * FSInfo::getField(INodeLayout::FieldID id, uint16_t& rawtype)
+        {
+            switch (id)
+            {
+                case INodeLayout::F_INODEID: return reinterpret_cast < char *>(&this->inodeid);
+                case INodeLayout::F_TYPE: return reinterpret_cast < char *>(&rawtype);
+                case INodeLayout::F_FS_NAME: return this->fs_name;
+                case INodeLayout::F_VER_MAJOR: return reinterpret_cast < char *>(&this->ver_major);
+                case INodeLayout::F_VER_MINOR: return reinterpret_cast < char *>(&this->ver_minor);
+                case INodeLayout::F_VER_REVISION: return reinterpret_cast < char *>(&this->ver_revision);
+                case INodeLayout::F_APP_NAME: return this->app_name;
+                case INodeLayout::F_APP_VER: return this->app_ver;
+                case INodeLayout::F_APP_DESC: return this->app_desc;
+                case INodeLayout::F_APP_AUTHOR: return this->app_author;
+                case INodeLayout::F_POS_ROOT: return reinterpret_cast < char *>(&this->pos_root);
+                case INodeLayout::F_POS_FREELIST: return reinterpret_cast < char *>(&this->pos_freelist);
+                case INodeLayout::F_FEATURES: return reinterpret_cast < char *>(&this->features);
+                default: return NULL;
+            }
+        }
+
+        void FSInfo::setAppName(const char *name)
+        {
+            FSInfo::copyString(name, this->app_name, 256);
+        }
+
+        void FSInfo::setAppVersion(const char *name)
+        {
+            FSInfo::copyString(name, this->app_ver, 32);
+        }
+
+        void FSInfo::setAppDesc(const char *name)
+        {
+            FSInfo::copyString(name, this->app_desc, 1024);
+        }
+
+        void FSInfo::setAppAuthor(const char *name)
+        {
+            FSInfo::copyString(name, this->app_author, 256);
+        }
+
+        void FSInfo::copyString(const char *from, char *to, uint16_t size)
+        {
+            uint16_t len = (strlen(from) < size - 1u) ? strlen(from) : size - 1;
+            for (uint16_t i = 0; i < len; i += 1)
+                to[i] = from[i];
+            for (uint16_t i = len; i < size; i += 1)
+                to[i] = '\0';
+        }
+    }
+}
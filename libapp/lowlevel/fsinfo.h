@@ -0,0 +1,61 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_FSINFO
+#define CLASS_LOWLEVEL_FSINFO
+
+#include <libapp/config.h>
+
+#include <string>
+#include <libapp/lowlevel/inodetype.h>
+#include <libapp/lowlevel/inodelayout.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! The filesystem information block stored at OFFSET_FSINFO.
+        /*!
+         * This is kept apart from INode since there is only ever one
+         * of them in a package, and its strings would otherwise make
+         * up most of the size of every INode in memory.
+         */
+        class FSInfo
+        {
+        public:
+            uint16_t inodeid;
+            INodeType::INodeType type;
+            char fs_name[10];
+            uint16_t ver_major;
+            uint16_t ver_minor;
+            uint16_t ver_revision;
+            char app_name[256];
+            char app_ver[32];
+            char app_desc[1024];
+            char app_author[256];
+            uint32_t pos_root;
+            uint32_t pos_freelist;
+            uint32_t features; //!< FEATURE_* flags.
+
+            FSInfo();
+            std::string getBinaryRepresentation();
+
+            //! Decodes the block as read from disk.  Returns false if
+            //! it is not a filesystem information block or length
+            //! does not cover it.
+            bool setBinaryRepresentation(const char *data, uint32_t length);
+            void setAppName(const char *name);
+            void setAppVersion(const char *name);
+            void setAppDesc(const char *name);
+            void setAppAuthor(const char *name);
+
+        private:
+            //! Returns where a header field is kept, or NULL if it is
+            //! not part of the block.
+            char * getField(INodeLayout::FieldID id, uint16_t& rawtype);
+
+            static void copyString(const char *from, char *to, uint16_t size);
+        };
+    }
+}
+
+#endif
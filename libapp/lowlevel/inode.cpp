@@ -2,6 +2,7 @@
 
 #include <libapp/config.h>
 
+#include <string.h>
 #include <libapp/lowlevel/inodetype.h>
 #include <libapp/lowlevel/inode.h>
 
@@ -30,67 +31,11 @@ namespace AppLib
             this->rdev = 0;
             this->nlink = 1;	// we only have one reference to this object
             this->blocks = 0;
-            for (uint16_t i = 0; i < DIRECTORY_CHILDREN_MAX; i += 1)
-                this->children[i] = 0;
-
-            // FSInfo only
-            for (uint16_t i = 0; i < 10; i += 1)
-                this->fs_name[i] = FS_NAME[i];
-            this->ver_major = 0;
-            this->ver_minor = 0;
-            this->ver_revision = 0;
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_name[i] = '\0';
-            for (uint16_t i = 0; i < 32; i += 1)
-                this->app_ver[i] = '\0';
-            for (uint16_t i = 0; i < 1024; i += 1)
-                this->app_desc[i] = '\0';
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_author[i] = '\0';
-            this->pos_root = 0;
-            this->pos_freelist = 0;
         }
 
         INode::INode(uint16_t id, const char *filename, INodeType::INodeType type)
+            : INode(id, filename, type, 0, 0, 0, 0, 0, 0)
         {
-            this->inodeid = id;
-            this->setFilename(filename, "");
-            this->type = type;
-            this->uid = 0;
-            this->gid = 0;
-            this->mask = 0;
-            this->atime = 0;
-            this->mtime = 0;
-            this->ctime = 0;
-            this->dat_len = 0;
-            this->info_next = 0;
-            this->flst_next = 0;
-            this->realid = 0;
-            this->parent = 0;
-            this->children_count = 0;
-            this->dev = 0;
-            this->rdev = 0;
-            this->nlink = 1;	// we only have one reference to this object
-            this->blocks = 0;
-            for (uint16_t i = 0; i < DIRECTORY_CHILDREN_MAX; i += 1)
-                this->children[i] = 0;
-
-            // FSInfo only
-            for (uint16_t i = 0; i < 10; i += 1)
-                this->fs_name[i] = FS_NAME[i];
-            this->ver_major = 0;
-            this->ver_minor = 0;
-            this->ver_revision = 0;
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_name[i] = '\0';
-            for (uint16_t i = 0; i < 32; i += 1)
-                this->app_ver[i] = '\0';
-            for (uint16_t i = 0; i < 1024; i += 1)
-                this->app_desc[i] = '\0';
-            for (uint16_t i = 0; i < 256; i += 1)
-                this->app_author[i] = '\0';
-            this->pos_root = 0;
-            this->pos_freelist = 0;
         }
 
         INode::~INode()
@@ -99,65 +44,109 @@ namespace AppLib
 
         std::string INode::getBinaryRepresentation()
         {
-            std::stringstream binary_rep;
-            Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->inodeid), 2);
-            Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->type), 2);
-            if (this->type == INodeType::INT_SEGINFO)
+            const INodeLayout::Field * fields;
+            size_t count;
+            if (!INodeLayout::getFields(this->type, fields, count) || this->type == INodeType::INT_FSINFO)
+                return std::string();
+
+            // Hardlinked files store the name of the original link
+            // rather than the name they were resolved through.
+            char realname[256];
+            bool linked = (this->type == INodeType::INT_FILEINFO || this->type == INodeType::INT_DEVICE) && this->realid != 0;
+            if (linked)
+                INode::copyFilename(this->realfilename.c_str(), realname);
+
+            uint32_t hsize = INodeLayout::getSize(fields, count);
+            std::string binary_rep(hsize + this->children.size() * 2, '\0');
+            uint16_t rawtype = this->type;
+            INodeLayout::encode(fields, count, &binary_rep[0], [&](INodeLayout::FieldID id) -> char *
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->info_next), 4);
-                 return binary_rep.str();
-            }
-            else if (this->type == INodeType::INT_FREELIST)
+                if (id == INodeLayout::F_FILENAME && linked)
+                    return realname;
+                return this->getField(id, rawtype);
+            });
+
+            // The child table follows the directory header.
+            if (this->type == INodeType::INT_DIRECTORY)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->flst_next), 4);
-                return binary_rep.str();
+                for (size_t i = 0; i < this->children.size(); i += 1)
+                {
+                    uint16_t child = this->children[i];
+                    if (!Endian::little_endian)
+                        child = __builtin_bswap16(child);
+                    memcpy(&binary_rep[hsize + i * 2], &child, 2);
+                }
             }
-            else if (this->type == INodeType::INT_FSINFO)
+            return binary_rep;
+        }
+
+        bool INode::setBinaryRepresentation(const char *data, uint32_t length, bool children)
+        {
+            // Every block starts with its inode ID and type.
+            uint16_t rawtype;
+            if (length < INodeLayout::TYPE_OFFSET + 2)
+                return false;
+            memcpy(&this->inodeid, data, 2);
+            memcpy(&rawtype, data + INodeLayout::TYPE_OFFSET, 2);
+            if (!Endian::little_endian)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->fs_name), 10);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ver_major), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ver_minor), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ver_revision), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_name), 256);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_ver), 32);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_desc), 1024);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->app_author), 256);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->pos_root), 4);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->pos_freelist), 4);
-                return binary_rep.str();
+                this->inodeid = __builtin_bswap16(this->inodeid);
+                rawtype = __builtin_bswap16(rawtype);
             }
-            if ((this->type == INodeType::INT_FILEINFO || this->type == INodeType::INT_DEVICE) && this->realid != 0)
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->realfilename), 256);
-            else
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->filename), 256);
+            this->type = (INodeType::INodeType) rawtype;
+            this->children.clear();
+
+            // Blocks that aren't INodes (such as FSInfo, which is read
+            // with FS::getFSInfo()) only carry their ID and type.
+            const INodeLayout::Field * fields;
+            size_t count;
+            if (!INodeLayout::getFields(this->type, fields, count) || this->type == INodeType::INT_FSINFO)
+                return true;
+            uint32_t hsize = INodeLayout::getSize(fields, count);
+            if (length < hsize)
+                return false;
 
-            if (this->type != INodeType::INT_HARDLINK)
+            INodeLayout::decode(fields, count, data, [&](INodeLayout::FieldID id) -> char *
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->uid), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->gid), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->mask), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->atime), 8);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->mtime), 8);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->ctime), 8);
-            }
-            if (this->type == INodeType::INT_FILEINFO || this->type == INodeType::INT_SYMLINK || this->type == INodeType::INT_DEVICE)
+                return this->getField(id, rawtype);
+            });
+
+            if (this->type == INodeType::INT_DIRECTORY && children && length >= hsize + DIRECTORY_CHILDREN_MAX * 2)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->dev), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->rdev), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->nlink), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->blocks), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->dat_len), 4);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->info_next), 4);
+                this->children.resize(DIRECTORY_CHILDREN_MAX);
+                memcpy(&this->children[0], data + hsize, DIRECTORY_CHILDREN_MAX * 2);
+                if (!Endian::little_endian)
+                    for (size_t i = 0; i < this->children.size(); i += 1)
+                        this->children[i] = __builtin_bswap16(this->children[i]);
             }
-            else if (this->type == INodeType::INT_DIRECTORY)
+            return true;
+        }
+
+        char * INode::getField(INodeLayout::FieldID id, uint16_t& rawtype)
+        {
+            switch (id)
             {
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->parent), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->children_count), 2);
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->children), DIRECTORY_CHILDREN_MAX * 2);
+                case INodeLayout::F_INODEID: return reinterpret_cast < char *>(&this->inodeid);
+                case INodeLayout::F_TYPE: return reinterpret_cast < char *>(&rawtype);
+                case INodeLayout::F_FILENAME: return this->filename;
+                case INodeLayout::F_UID: return reinterpret_cast < char *>(&this->uid);
+                case INodeLayout::F_GID: return reinterpret_cast < char *>(&this->gid);
+                case INodeLayout::F_MASK: return reinterpret_cast < char *>(&this->mask);
+                case INodeLayout::F_ATIME: return reinterpret_cast < char *>(&this->atime);
+                case INodeLayout::F_MTIME: return reinterpret_cast < char *>(&this->mtime);
+                case INodeLayout::F_CTIME: return reinterpret_cast < char *>(&this->ctime);
+                case INodeLayout::F_DEV: return reinterpret_cast < char *>(&this->dev);
+                case INodeLayout::F_RDEV: return reinterpret_cast < char *>(&this->rdev);
+                case INodeLayout::F_NLINK: return reinterpret_cast < char *>(&this->nlink);
+                case INodeLayout::F_BLOCKS: return reinterpret_cast < char *>(&this->blocks);
+                case INodeLayout::F_DAT_LEN: return reinterpret_cast < char *>(&this->dat_len);
+                case INodeLayout::F_INFO_NEXT: return reinterpret_cast < char *>(&this->info_next);
+                case INodeLayout::F_FLST_NEXT: return reinterpret_cast < char *>(&this->flst_next);
+                case INodeLayout::F_PARENT: return reinterpret_cast < char *>(&this->parent);
+                case INodeLayout::F_CHILDREN_COUNT: return reinterpret_cast < char *>(&this->children_count);
+                case INodeLayout::F_REALID: return reinterpret_cast < char *>(&this->realid);
+                default: return NULL;
             }
-            else if (this->type == INodeType::INT_HARDLINK)
-                Endian::doW(&binary_rep, reinterpret_cast < char *>(&this->realid), 2);
-            return binary_rep.str();
         }
 
         void INode::setFilename(const char *name, const char *real)
@@ -167,47 +156,7 @@ namespace AppLib
                 this->filename[i] = name[i];
             for (uint16_t i = size; i < 256; i += 1)
                 this->filename[i] = '\0';
-            uint16_t rsize = (strlen(real) < 255) ? strlen(real) : 255;
-            for (uint16_t i = 0; i < rsize; i += 1)
-                this->realfilename[i] = real[i];
-            for (uint16_t i = size; i < 256; i += 1)
-                this->realfilename[i] = '\0';
-        }
-
-        void INode::setAppName(const char *name)
-        {
-            uint16_t size = (strlen(name) < 255) ? strlen(name) : 255;
-            for (uint16_t i = 0; i < size; i += 1)
-                this->app_name[i] = name[i];
-            for (uint16_t i = size; i < 256; i += 1)
-                this->app_name[i] = '\0';
-        }
-
-        void INode::setAppVersion(const char *name)
-        {
-            uint16_t size = (strlen(name) < 31) ? strlen(name) : 31;
-            for (uint16_t i = 0; i < size; i += 1)
-                this->app_ver[i] = name[i];
-            for (uint16_t i = size; i < 32; i += 1)
-                this->app_ver[i] = '\0';
-        }
-
-        void INode::setAppDesc(const char *name)
-        {
-            uint16_t size = (strlen(name) < 1023) ? strlen(name) : 1023;
-            for (uint16_t i = 0; i < size; i += 1)
-                this->app_desc[i] = name[i];
-            for (uint16_t i = size; i < 1024; i += 1)
-                this->app_desc[i] = '\0';
-        }
-
-        void INode::setAppAuthor(const char *name)
-        {
-            uint16_t size = (strlen(name) < 255) ? strlen(name) : 255;
-            for (uint16_t i = 0; i < size; i += 1)
-                this->app_author[i] = name[i];
-            for (uint16_t i = size; i < 256; i += 1)
-                this->app_author[i] = '\0';
+            this->realfilename = std::string(real, (strlen(real) < 255) ? strlen(real) : 255);
         }
 
         bool INode::verify()
@@ -224,7 +173,7 @@ namespace AppLib
                 Logging::showDebugW("Resolving hardlink %u to %u.", this->inodeid, this->realid);
                 INode node = filesystem->getINodeByID(this->realid);
                 node.realid = this->inodeid;
-                INode::copyFilename(node.filename, node.realfilename);
+                node.realfilename = node.filename;
                 INode::copyFilename(this->filename, node.filename);
                 return node;
             }
@@ -233,14 +182,14 @@ namespace AppLib
                 Logging::showDebugW("Resolving fileinfo %u back to hardlink %u.", this->inodeid, this->realid);
                 INode node = filesystem->getRealINodeByID(this->realid);
                 node.realid = this->inodeid;
-                INode::copyFilename(this->filename, node.realfilename);
+                node.realfilename = this->filename;
                 return node;
             }
             else
                 return *this;
         }
 
-        void INode::copyFilename(char from[256], char to[256])
+        void INode::copyFilename(const char from[256], char to[256])
         {
             for (int i = 0; i < 256; i += 1)
                 to[i] = 0;
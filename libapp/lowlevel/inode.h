@@ -14,13 +14,24 @@ namespace AppLib
 }
 
 #include <string>
+#include <vector>
 #include <libapp/lowlevel/inodetype.h>
+#include <libapp/lowlevel/inodelayout.h>
 #include <libapp/lowlevel/fs.h>
 
 namespace AppLib
 {
     namespace LowLevel
     {
+        //! An inode header as read from (or written to) the package.
+        /*!
+         * Only the fields belonging to the node's type are meaningful.
+         * The directory child table is held on the heap and is only
+         * loaded for directories (it is empty for every other type, and
+         * for directories read without their children), so nodes are
+         * cheap to copy and move.  The filesystem information block is
+         * represented by FSInfo instead.
+         */
         class INode
         {
         public:
@@ -34,7 +45,7 @@ namespace AppLib
             uint64_t mtime;
             uint64_t ctime;
             uint16_t parent;
-            uint16_t children[DIRECTORY_CHILDREN_MAX];
+            std::vector<uint16_t> children; //!< Directories only; empty if not loaded.
             uint16_t children_count;
             uint16_t dev;
             uint16_t rdev;
@@ -44,29 +55,27 @@ namespace AppLib
             uint32_t info_next;
             uint32_t flst_next;
             uint16_t realid;
-            char realfilename[256]; //!< In-memory only (never written to disk).
-
-            // FSInfo only
-            char fs_name[10];
-            uint16_t ver_major;
-            uint16_t ver_minor;
-            uint16_t ver_revision;
-            char app_name[256];
-            char app_ver[32];
-            char app_desc[1024];
-            char app_author[256];
-            uint32_t pos_root;
-            uint32_t pos_freelist;
+            std::string realfilename; //!< In-memory only (never written to disk).
 
             INode(uint16_t id, const char *filename, INodeType::INodeType type, uint16_t uid, uint16_t gid, uint16_t mask, uint64_t atime, uint64_t mtime, uint64_t ctime);
             INode(uint16_t id = 0, const char *filename = "", INodeType::INodeType type = INodeType::INT_UNSET);
+            INode(const INode&) = default;
+            INode(INode&&) = default;
+            INode& operator=(const INode&) = default;
+            INode& operator=(INode&&) = default;
             ~INode();
+
+            //! Returns the on-disk header.  For a directory, the child
+            //! table is only included if it was loaded.
             std::string getBinaryRepresentation();
+
+            //! Decodes a header that was read from disk.  The child
+            //! table of a directory is decoded if children is true and
+            //! length covers it.  Blocks that are not INodes only have
+            //! their ID and type decoded.  Returns false if length does
+            //! not cover the header.
+            bool setBinaryRepresentation(const char *data, uint32_t length, bool children);
             void setFilename(const char *name, const char *real = "");
-            void setAppName(const char *name);
-            void setAppVersion(const char *name);
-            void setAppDesc(const char *name);
-            void setAppAuthor(const char *name);
 
             //! Ensures that the node data is valid.
             bool verify();
@@ -75,7 +84,11 @@ namespace AppLib
             INode resolve(FS* filesystem);
 
         private:
-            static void copyFilename(char from[256], char to[256]);
+            //! Returns where a header field is kept in this node, or
+            //! NULL if it is not part of an INode.
+            char * getField(INodeLayout::FieldID id, uint16_t& rawtype);
+
+            static void copyFilename(const char from[256], char to[256]);
         };
     }
 }
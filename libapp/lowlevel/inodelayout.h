@@ -0,0 +1,277 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_INODELAYOUT
+#define CLASS_LOWLEVEL_INODELAYOUT
+
+#include <libapp/config.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <libapp/lowlevel/inodetype.h>
+#include <libapp/lowlevel/endian.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! The on-disk layout of each kind of header block.
+        /*!
+         * Every header is a packed, little-endian sequence of the
+         * fields listed in its table below.  INode and FSInfo encode
+         * and decode their headers by walking these tables, and the
+         * offsets used to patch single fields in place are worked out
+         * from them, so the HSIZE_* constants are checked against the
+         * same description at compile time.
+         */
+        namespace INodeLayout
+        {
+            enum FieldID
+            {
+                F_INODEID,
+                F_TYPE,
+                F_FILENAME,
+                F_UID,
+                F_GID,
+                F_MASK,
+                F_ATIME,
+                F_MTIME,
+                F_CTIME,
+                F_DEV,
+                F_RDEV,
+                F_NLINK,
+                F_BLOCKS,
+                F_DAT_LEN,
+                F_INFO_NEXT,
+                F_FLST_NEXT,
+                F_PARENT,
+                F_CHILDREN_COUNT,
+                F_REALID,
+                F_FS_NAME,
+                F_VER_MAJOR,
+                F_VER_MINOR,
+                F_VER_REVISION,
+                F_APP_NAME,
+                F_APP_VER,
+                F_APP_DESC,
+                F_APP_AUTHOR,
+                F_POS_ROOT,
+                F_POS_FREELIST,
+                F_FEATURES,
+
+                // Unused space; written as zeros and skipped on read.
+                F_RESERVED
+            };
+
+            struct Field
+            {
+                FieldID id;
+                uint16_t size;
+
+                //! Whether the field is a number (and so needs its
+                //! bytes swapped on big-endian machines).
+                constexpr bool isScalar() const
+                {
+                    return this->size <= 8 && this->id != F_RESERVED;
+                }
+            };
+
+            // INT_FILEINFO, INT_SYMLINK and INT_DEVICE.
+            constexpr Field FILE_FIELDS[] =
+            {
+                { F_INODEID, 2 }, { F_TYPE, 2 }, { F_FILENAME, 256 },
+                { F_UID, 2 }, { F_GID, 2 }, { F_MASK, 2 },
+                { F_ATIME, 8 }, { F_MTIME, 8 }, { F_CTIME, 8 },
+                { F_DEV, 2 }, { F_RDEV, 2 }, { F_NLINK, 2 }, { F_BLOCKS, 2 },
+                { F_DAT_LEN, 4 }, { F_INFO_NEXT, 4 }, { F_RESERVED, 2 }
+            };
+
+            // INT_DIRECTORY; the child table follows the header.
+            constexpr Field DIRECTORY_FIELDS[] =
+            {
+                { F_INODEID, 2 }, { F_TYPE, 2 }, { F_FILENAME, 256 },
+                { F_UID, 2 }, { F_GID, 2 }, { F_MASK, 2 },
+                { F_ATIME, 8 }, { F_MTIME, 8 }, { F_CTIME, 8 },
+                { F_PARENT, 2 }, { F_CHILDREN_COUNT, 2 }
+            };
+
+            constexpr Field HARDLINK_FIELDS[] =
+            {
+                { F_INODEID, 2 }, { F_TYPE, 2 }, { F_FILENAME, 256 },
+                { F_REALID, 2 }
+            };
+
+            constexpr Field SEGINFO_FIELDS[] =
+            {
+                { F_INODEID, 2 }, { F_TYPE, 2 }, { F_INFO_NEXT, 4 }
+            };
+
+            constexpr Field FREELIST_FIELDS[] =
+            {
+                { F_INODEID, 2 }, { F_TYPE, 2 }, { F_FLST_NEXT, 4 }
+            };
+
+            // INT_DIRLIST; RSIZE_DIRENT sized entries follow the header.
+            constexpr Field DIRLIST_FIELDS[] =
+            {
+                { F_INODEID, 2 }, { F_TYPE, 2 }, { F_INFO_NEXT, 4 },
+                { F_CHILDREN_COUNT, 2 }
+            };
+
+            constexpr Field FSINFO_FIELDS[] =
+            {
+                { F_INODEID, 2 }, { F_TYPE, 2 }, { F_FS_NAME, 10 },
+                { F_VER_MAJOR, 2 }, { F_VER_MINOR, 2 }, { F_VER_REVISION, 2 },
+                { F_APP_NAME, 256 }, { F_APP_VER, 32 }, { F_APP_DESC, 1024 },
+                { F_APP_AUTHOR, 256 }, { F_POS_ROOT, 4 }, { F_POS_FREELIST, 4 },
+                { F_FEATURES, 4 }, { F_RESERVED, 14 }
+            };
+
+            //! Returns the total size of a table of fields.
+            template <size_t N>
+            constexpr uint32_t sizeOf(const Field (&fields)[N], size_t i = 0)
+            {
+                return (i >= N) ? 0 : fields[i].size + sizeOf(fields, i + 1);
+            }
+
+            //! Returns the offset of a field within a table of fields.
+            //! Fails to compile (or throws) if the field isn't there.
+            template <size_t N>
+            constexpr uint32_t offsetOf(const Field (&fields)[N], FieldID id, size_t i = 0)
+            {
+                return (i >= N) ? throw "field not in layout" :
+                       (fields[i].id == id) ? 0 : fields[i].size + offsetOf(fields, id, i + 1);
+            }
+
+            static_assert(sizeOf(FILE_FIELDS) == HSIZE_FILE, "HSIZE_FILE does not match the file header layout.");
+            static_assert(sizeOf(DIRECTORY_FIELDS) == HSIZE_DIRECTORY, "HSIZE_DIRECTORY does not match the directory header layout.");
+            static_assert(sizeOf(HARDLINK_FIELDS) == HSIZE_HARDLINK, "HSIZE_HARDLINK does not match the hardlink header layout.");
+            static_assert(sizeOf(SEGINFO_FIELDS) == HSIZE_SEGINFO, "HSIZE_SEGINFO does not match the segment info header layout.");
+            static_assert(sizeOf(FREELIST_FIELDS) == HSIZE_FREELIST, "HSIZE_FREELIST does not match the freelist header layout.");
+            static_assert(sizeOf(DIRLIST_FIELDS) == HSIZE_DIRLIST, "HSIZE_DIRLIST does not match the directory list header layout.");
+            static_assert(sizeOf(FSINFO_FIELDS) == HSIZE_FSINFO, "HSIZE_FSINFO does not match the filesystem info layout.");
+            static_assert(HSIZE_FSINFO <= LENGTH_FSINFO, "The filesystem info header does not fit in its block.");
+            static_assert(HSIZE_DIRECTORY + DIRECTORY_CHILDREN_MAX * 2 <= BSIZE_DIRECTORY, "The directory child table does not fit in a directory block.");
+
+            // Offsets of the fields that are patched in place.
+            constexpr uint32_t TYPE_OFFSET = offsetOf(FILE_FIELDS, F_TYPE);
+            constexpr uint32_t FILE_BLOCKS_OFFSET = offsetOf(FILE_FIELDS, F_BLOCKS);
+            constexpr uint32_t FILE_DAT_LEN_OFFSET = offsetOf(FILE_FIELDS, F_DAT_LEN);
+            constexpr uint32_t FILE_INFO_NEXT_OFFSET = offsetOf(FILE_FIELDS, F_INFO_NEXT);
+            constexpr uint32_t SEGINFO_INFO_NEXT_OFFSET = offsetOf(SEGINFO_FIELDS, F_INFO_NEXT);
+            constexpr uint32_t DIRECTORY_CHILDREN_COUNT_OFFSET = offsetOf(DIRECTORY_FIELDS, F_CHILDREN_COUNT);
+            constexpr uint32_t DIRECTORY_CHILDREN_OFFSET = HSIZE_DIRECTORY;
+            constexpr uint32_t DIRLIST_NEXT_OFFSET = offsetOf(DIRLIST_FIELDS, F_INFO_NEXT);
+            constexpr uint32_t DIRLIST_COUNT_OFFSET = offsetOf(DIRLIST_FIELDS, F_CHILDREN_COUNT);
+
+            // With FEATURE_DIRECTORY_LISTS, the start of the child table
+            // holds the position of the first directory list block.
+            constexpr uint32_t DIRECTORY_LIST_OFFSET = DIRECTORY_CHILDREN_OFFSET;
+
+            //! The number of entries that fit in a directory list block.
+            constexpr uint32_t DIRLIST_ENTRIES_MAX = (BSIZE_FILE - HSIZE_DIRLIST) / RSIZE_DIRENT;
+
+            //! The largest header other than FSInfo; reading this many
+            //! bytes is enough to decode any inode apart from a
+            //! directory's child table.
+            constexpr uint32_t HSIZE_MAX = HSIZE_FILE;
+            static_assert(HSIZE_MAX >= HSIZE_DIRECTORY && HSIZE_MAX >= HSIZE_HARDLINK &&
+                          HSIZE_MAX >= HSIZE_SEGINFO && HSIZE_MAX >= HSIZE_FREELIST, "HSIZE_MAX is too small.");
+
+            //! Looks up the table of fields for a type of inode.
+            //! Returns false if the type has no header of its own.
+            inline bool getFields(INodeType::INodeType type, const Field *& fields, size_t& count)
+            {
+                switch (type)
+                {
+                    case INodeType::INT_FILEINFO:
+                    case INodeType::INT_SYMLINK:
+                    case INodeType::INT_DEVICE:
+                        fields = FILE_FIELDS;
+                        count = sizeof(FILE_FIELDS) / sizeof(Field);
+                        return true;
+                    case INodeType::INT_DIRECTORY:
+                        fields = DIRECTORY_FIELDS;
+                        count = sizeof(DIRECTORY_FIELDS) / sizeof(Field);
+                        return true;
+                    case INodeType::INT_HARDLINK:
+                        fields = HARDLINK_FIELDS;
+                        count = sizeof(HARDLINK_FIELDS) / sizeof(Field);
+                        return true;
+                    case INodeType::INT_SEGINFO:
+                        fields = SEGINFO_FIELDS;
+                        count = sizeof(SEGINFO_FIELDS) / sizeof(Field);
+                        return true;
+                    case INodeType::INT_FREELIST:
+                        fields = FREELIST_FIELDS;
+                        count = sizeof(FREELIST_FIELDS) / sizeof(Field);
+                        return true;
+                    case INodeType::INT_DIRLIST:
+                        fields = DIRLIST_FIELDS;
+                        count = sizeof(DIRLIST_FIELDS) / sizeof(Field);
+                        return true;
+                    case INodeType::INT_FSINFO:
+                        fields = FSINFO_FIELDS;
+                        count = sizeof(FSINFO_FIELDS) / sizeof(Field);
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+
+            //! Returns the total size of a table of fields found with
+            //! getFields().
+            inline uint32_t getSize(const Field * fields, size_t count)
+            {
+                uint32_t size = 0;
+                for (size_t i = 0; i < count; i += 1)
+                    size += fields[i].size;
+                return size;
+            }
+
+            //! Decodes a header from data, storing each field at the
+            //! location that locate(id) returns (or skipping the field
+            //! if it returns NULL).  data must hold the whole header.
+            template <typename Locate>
+            void decode(const Field * fields, size_t count, const char *data, Locate locate)
+            {
+                for (size_t i = 0; i < count; i += 1)
+                {
+                    char *out = (fields[i].id == F_RESERVED) ? NULL : locate(fields[i].id);
+                    if (out != NULL)
+                    {
+                        memcpy(out, data, fields[i].size);
+                        if (!Endian::little_endian && fields[i].isScalar())
+                            std::reverse(out, out + fields[i].size);
+                    }
+                    data += fields[i].size;
+                }
+            }
+
+            //! Encodes a header into out (which must be large enough
+            //! to hold it), reading each field from the location that
+            //! locate(id) returns.  Fields it returns NULL for, and
+            //! reserved space, are written as zeros.
+            template <typename Locate>
+            void encode(const Field * fields, size_t count, char *out, Locate locate)
+            {
+                for (size_t i = 0; i < count; i += 1)
+                {
+                    const char *in = (fields[i].id == F_RESERVED) ? NULL : locate(fields[i].id);
+                    if (in == NULL)
+                        memset(out, 0, fields[i].size);
+                    else
+                    {
+                        memcpy(out, in, fields[i].size);
+                        if (!Endian::little_endian && fields[i].isScalar())
+                            std::reverse(out, out + fields[i].size);
+                    }
+                    out += fields[i].size;
+                }
+            }
+        }
+    }
+}
+
+#endif
@@ -36,6 +36,8 @@ namespace AppLib
                 INT_HARDLINK = 5,
                 // Special File (FIFO / Device)
                 INT_DEVICE = 10,
+                // Directory List Block (FEATURE_DIRECTORY_LISTS only)
+                INT_DIRLIST = 11,
 
                 // Temporary Block
                 INT_TEMPORARY = 6,
@@ -0,0 +1,141 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libapp/config.h>
+
+#include <string>
+#include <string.h>
+#include <libapp/logging.h>
+#include <libapp/lowlevel/mappedblockstream.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        MappedBlockStream::MappedBlockStream(std::string filename)
+        {
+            this->base = NULL;
+            this->length = 0;
+
+            this->fd = ::open(filename.c_str(), O_RDONLY);
+            if (this->fd < 0)
+            {
+                Logging::showErrorW("Unable to open specified file as MappedBlockStream.");
+                this->invalid = true;
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return;
+            }
+
+            struct stat info;
+            if (::fstat(this->fd, &info) != 0 || info.st_size == 0)
+            {
+                Logging::showErrorW("Unable to determine size of file for MappedBlockStream.");
+                ::close(this->fd);
+                this->invalid = true;
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return;
+            }
+
+            void *addr = ::mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, this->fd, 0);
+            if (addr == MAP_FAILED)
+            {
+                Logging::showErrorW("Unable to map specified file into memory.");
+                ::close(this->fd);
+                this->invalid = true;
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return;
+            }
+
+            // The inode tables are read in small, scattered pieces so
+            // don't let the kernel read ahead too aggressively.
+            ::madvise(addr, info.st_size, MADV_RANDOM);
+
+            this->base = static_cast < char *>(addr);
+            this->length = info.st_size;
+            this->opened = true;
+        }
+
+        MappedBlockStream::~MappedBlockStream()
+        {
+            if (this->opened)
+                this->close();
+        }
+
+        std::streamsize MappedBlockStream::readAt(std::streampos pos, char *out, std::streamsize count)
+        {
+            if (this->invalid || !this->opened)
+            {
+                this->clear(std::ios::badbit | std::ios::failbit);
+                return -1;
+            }
+
+            // Reads past the end of the image are short, the same as
+            // they are for a normal BlockStream.
+            if (pos < 0 || (std::streamsize) pos >= this->length)
+                return 0;
+            std::streamsize avail = this->length - (std::streamsize) pos;
+            if (count > avail)
+                count = avail;
+
+            memcpy(out, this->base + (std::streamsize) pos, count);
+            return count;
+        }
+
+        std::streamsize MappedBlockStream::writeAt(std::streampos, const char *, std::streamsize)
+        {
+            Logging::showErrorW("Attempted to write to a read-only package.");
+            this->clear(this->state | std::ios::badbit | std::ios::failbit);
+            return -1;
+        }
+
+        bool MappedBlockStream::zeroAt(std::streampos, std::streamsize)
+        {
+            Logging::showErrorW("Attempted to write to a read-only package.");
+            this->clear(this->state | std::ios::badbit | std::ios::failbit);
+            return false;
+        }
+
+        std::streampos MappedBlockStream::size()
+        {
+            return this->length;
+        }
+
+        bool MappedBlockStream::isReadOnly()
+        {
+            return true;
+        }
+
+        void MappedBlockStream::prefetch(std::streampos pos, std::streamsize count)
+        {
+            if (this->invalid || !this->opened)
+                return;
+            if (pos < 0 || (std::streamsize) pos >= this->length)
+                return;
+            if (count > this->length - (std::streamsize) pos)
+                count = this->length - (std::streamsize) pos;
+
+            // The image is mapped with MADV_RANDOM, so the kernel only
+            // reads ahead of ranges that we ask for.  madvise needs a
+            // page-aligned address (the mapping itself is page-aligned).
+            std::streamsize page = ::sysconf(_SC_PAGESIZE);
+            std::streamsize first = (std::streamsize) pos - (std::streamsize) pos % page;
+            ::madvise(this->base + first, (std::streamsize) pos + count - first, MADV_WILLNEED);
+        }
+
+        void MappedBlockStream::close()
+        {
+            if (this->opened)
+            {
+                ::munmap(this->base, this->length);
+                ::close(this->fd);
+            }
+            this->base = NULL;
+            this->length = 0;
+            this->opened = false;
+        }
+    }
+}
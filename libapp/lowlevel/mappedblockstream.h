@@ -0,0 +1,44 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_MAPPEDBLOCKSTREAM
+#define CLASS_MAPPEDBLOCKSTREAM
+
+#include <libapp/config.h>
+
+#include <string>
+#include <iostream>
+#include <libapp/lowlevel/blockstream.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! Provides read-only access to a memory-mapped package image.
+        /*!
+         * The whole image is mapped when the stream is opened, so reads
+         * are plain memory copies without any system calls.  This is
+         * intended for sealed packages; all writes fail and set the
+         * fail and bad bits.
+         */
+        class MappedBlockStream : public BlockStream
+        {
+              public:
+            MappedBlockStream(std::string filename);
+            virtual ~MappedBlockStream();
+
+            virtual std::streamsize readAt(std::streampos pos, char *out, std::streamsize count);
+            virtual std::streamsize writeAt(std::streampos pos, const char *data, std::streamsize count);
+            virtual bool zeroAt(std::streampos pos, std::streamsize count);
+            virtual std::streampos size();
+            virtual bool isReadOnly();
+            virtual void prefetch(std::streampos pos, std::streamsize count);
+            virtual void close();
+
+              private:
+            char *base;
+            std::streamsize length;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,80 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libapp/config.h>
+
+#include <libapp/lowlevel/rwlock.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        RWLock::RWLock()
+            : writer(std::thread::id()), depth(0)
+        {
+            pthread_rwlock_init(&this->lock, NULL);
+        }
+
+        RWLock::~RWLock()
+        {
+            pthread_rwlock_destroy(&this->lock);
+        }
+
+        void RWLock::lockRead()
+        {
+            // Only this thread can have stored its own ID, so if it
+            // matches we already hold the lock for writing.
+            if (this->writer.load() == std::this_thread::get_id())
+            {
+                this->depth += 1;
+                return;
+            }
+            pthread_rwlock_rdlock(&this->lock);
+        }
+
+        void RWLock::lockWrite()
+        {
+            if (this->writer.load() == std::this_thread::get_id())
+            {
+                this->depth += 1;
+                return;
+            }
+            pthread_rwlock_wrlock(&this->lock);
+            this->writer.store(std::this_thread::get_id());
+            this->depth = 1;
+        }
+
+        void RWLock::unlock()
+        {
+            if (this->writer.load() == std::this_thread::get_id())
+            {
+                this->depth -= 1;
+                if (this->depth > 0)
+                    return;
+                this->writer.store(std::thread::id());
+            }
+            pthread_rwlock_unlock(&this->lock);
+        }
+
+        ReadGuard::ReadGuard(RWLock & lock)
+            : lock(lock)
+        {
+            this->lock.lockRead();
+        }
+
+        ReadGuard::~ReadGuard()
+        {
+            this->lock.unlock();
+        }
+
+        WriteGuard::WriteGuard(RWLock & lock)
+            : lock(lock)
+        {
+            this->lock.lockWrite();
+        }
+
+        WriteGuard::~WriteGuard()
+        {
+            this->lock.unlock();
+        }
+    }
+}
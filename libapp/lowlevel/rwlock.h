@@ -0,0 +1,76 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_LOWLEVEL_RWLOCK
+#define CLASS_LOWLEVEL_RWLOCK
+
+#include <libapp/config.h>
+
+#include <atomic>
+#include <thread>
+#include <pthread.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! A reader/writer lock.
+        /*!
+         * Any number of threads may hold the lock for reading at
+         * once, but a thread holding it for writing excludes all
+         * others.  Use ReadGuard and WriteGuard to hold the lock for
+         * the duration of a scope.
+         *
+         * The thread holding the lock for writing may lock it again
+         * (for reading or writing); it is released when every lock
+         * has been unlocked.  A thread holding the lock for reading
+         * must not lock it for writing.
+         */
+        class RWLock
+        {
+        public:
+            RWLock();
+            ~RWLock();
+            void lockRead();
+            void lockWrite();
+            void unlock();
+
+        private:
+            RWLock(const RWLock &);
+            RWLock & operator=(const RWLock &);
+
+            pthread_rwlock_t lock;
+            std::atomic < std::thread::id > writer;
+            uint32_t depth;
+        };
+
+        //! Holds an RWLock for reading until it goes out of scope.
+        class ReadGuard
+        {
+        public:
+            ReadGuard(RWLock & lock);
+            ~ReadGuard();
+
+        private:
+            ReadGuard(const ReadGuard &);
+            ReadGuard & operator=(const ReadGuard &);
+
+            RWLock & lock;
+        };
+
+        //! Holds an RWLock for writing until it goes out of scope.
+        class WriteGuard
+        {
+        public:
+            WriteGuard(RWLock & lock);
+            ~WriteGuard();
+
+        private:
+            WriteGuard(const WriteGuard &);
+            WriteGuard & operator=(const WriteGuard &);
+
+            RWLock & lock;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,286 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libapp/config.h>
+
+#include <string>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <libapp/logging.h>
+#include <libapp/lowlevel/uringblockstream.h>
+#include <errno.h>
+#include <unistd.h>
+
+// io_uring is only used where both the kernel headers and the system
+// call numbers are available; everywhere else the ring is never set
+// up and batches are read with pread.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define APPFS_HAVE_URING 1
+#endif
+#endif
+#endif
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+#ifdef APPFS_HAVE_URING
+        namespace
+        {
+            // There is no wrapper for these in the C library, and we
+            // don't want to depend on liburing just for them.
+            int uringSetup(unsigned entries, struct io_uring_params * params)
+            {
+                return (int) ::syscall(__NR_io_uring_setup, entries, params);
+            }
+
+            int uringEnter(int ring, unsigned submit, unsigned complete, unsigned flags)
+            {
+                return (int) ::syscall(__NR_io_uring_enter, ring, submit, complete, flags, NULL, 0);
+            }
+        }
+#endif
+
+        UringBlockStream::UringBlockStream(std::string filename, uint32_t depth)
+            : BlockStream(filename)
+        {
+            this->ring = -1;
+            this->depth = depth;
+            this->sqRing = NULL;
+            this->sqRingSize = 0;
+            this->cqRing = NULL;
+            this->cqRingSize = 0;
+            this->sqes = NULL;
+            this->sqesSize = 0;
+            this->sqTail = NULL;
+            this->sqMask = NULL;
+            this->cqHead = NULL;
+            this->cqTail = NULL;
+            this->cqMask = NULL;
+            this->cqes = NULL;
+
+            if (this->opened && this->depth > 0 && !this->setupRing())
+                Logging::showDebugW("io_uring is not available; reading the package with pread.");
+        }
+
+        UringBlockStream::~UringBlockStream()
+        {
+            // The base class destructor can't call our close().
+            this->close();
+        }
+
+        void UringBlockStream::readBatch(std::vector<ReadRequest> & reads)
+        {
+            std::lock_guard < std::mutex > guard(this->lock);
+            if (this->ring < 0 || reads.size() < 2)
+            {
+                BlockStream::readBatch(reads);
+                return;
+            }
+
+            // Keep up to a queue's worth of reads in flight at a time.
+            std::vector < bool > done(reads.size(), false);
+            for (size_t first = 0; first < reads.size(); first += this->depth)
+            {
+                size_t last = std::min < size_t > (first + this->depth, reads.size());
+                if (!this->submitAndWait(reads, first, last, done))
+                {
+                    Logging::showWarningW("io_uring failed; reading the package with pread from now on.");
+                    this->teardownRing();
+                    break;
+                }
+            }
+
+            // Anything the ring didn't finish is read normally.
+            for (size_t i = 0; i < reads.size(); i += 1)
+            {
+                if (!done[i])
+                    reads[i].result = this->readAt(reads[i].pos, reads[i].out, reads[i].count);
+            }
+        }
+
+        void UringBlockStream::close()
+        {
+            std::lock_guard < std::mutex > guard(this->lock);
+            this->teardownRing();
+            BlockStream::close();
+#ifdef APPFS_HAVE_URING
+            for (std::vector < void * >::iterator i = this->stranded.begin(); i != this->stranded.end(); i++)
+                delete [] static_cast < struct iovec *>(*i);
+#endif
+            this->stranded.clear();
+        }
+
+        bool UringBlockStream::isAsync()
+        {
+            std::lock_guard < std::mutex > guard(this->lock);
+            return (this->ring >= 0);
+        }
+
+        bool UringBlockStream::setupRing()
+        {
+#ifdef APPFS_HAVE_URING
+            struct io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            int fd = uringSetup(this->depth, &params);
+            if (fd < 0)
+                return false;
+            this->ring = fd;
+
+            // Map the two queues and the submission entries separately,
+            // which works whether or not the kernel can share one mapping
+            // between the queues.
+            this->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            this->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+            this->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+            void *sq = ::mmap(NULL, this->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            void *cq = ::mmap(NULL, this->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            void *entries = ::mmap(NULL, this->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            this->sqRing = (sq == MAP_FAILED) ? NULL : sq;
+            this->cqRing = (cq == MAP_FAILED) ? NULL : cq;
+            this->sqes = (entries == MAP_FAILED) ? NULL : entries;
+            if (this->sqRing == NULL || this->cqRing == NULL || this->sqes == NULL)
+            {
+                this->teardownRing();
+                return false;
+            }
+
+            char *sqBase = static_cast < char *>(this->sqRing);
+            char *cqBase = static_cast < char *>(this->cqRing);
+            this->sqTail = reinterpret_cast < unsigned *>(sqBase + params.sq_off.tail);
+            this->sqMask = reinterpret_cast < unsigned *>(sqBase + params.sq_off.ring_mask);
+            this->cqHead = reinterpret_cast < unsigned *>(cqBase + params.cq_off.head);
+            this->cqTail = reinterpret_cast < unsigned *>(cqBase + params.cq_off.tail);
+            this->cqMask = reinterpret_cast < unsigned *>(cqBase + params.cq_off.ring_mask);
+            this->cqes = cqBase + params.cq_off.cqes;
+
+            // Each slot of the submission queue always refers to the
+            // entry with the same index.
+            unsigned *array = reinterpret_cast < unsigned *>(sqBase + params.sq_off.array);
+            for (unsigned i = 0; i < params.sq_entries; i += 1)
+                array[i] = i;
+
+            // The kernel rounds the depth up to a power of two.
+            this->depth = params.sq_entries;
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        void UringBlockStream::teardownRing()
+        {
+#ifdef APPFS_HAVE_URING
+            if (this->sqes != NULL)
+                ::munmap(this->sqes, this->sqesSize);
+            if (this->cqRing != NULL)
+                ::munmap(this->cqRing, this->cqRingSize);
+            if (this->sqRing != NULL)
+                ::munmap(this->sqRing, this->sqRingSize);
+            if (this->ring >= 0)
+                ::close(this->ring);
+#endif
+            this->sqes = NULL;
+            this->cqRing = NULL;
+            this->sqRing = NULL;
+            this->ring = -1;
+        }
+
+        bool UringBlockStream::submitAndWait(std::vector<ReadRequest> & reads, size_t first, size_t last, std::vector<bool> & done)
+        {
+#ifdef APPFS_HAVE_URING
+            // Fill in a submission entry for each read.  We are the only
+            // producer, so the tail can be read without synchronization,
+            // but the kernel must see the entries before the new tail.
+            unsigned count = last - first;
+            std::unique_ptr < struct iovec[] > iov(new struct iovec[count]);
+            struct io_uring_sqe *entries = static_cast < struct io_uring_sqe *>(this->sqes);
+            unsigned tail = *this->sqTail;
+            for (unsigned k = 0; k < count; k += 1)
+            {
+                ReadRequest & read = reads[first + k];
+                iov[k].iov_base = read.out;
+                iov[k].iov_len = read.count;
+                struct io_uring_sqe *sqe = &entries[tail & *this->sqMask];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = IORING_OP_READV;
+                sqe->fd = this->fd;
+                sqe->off = (uint64_t) (std::streamoff) read.pos;
+                sqe->addr = (uint64_t) (uintptr_t) &iov[k];
+                sqe->len = 1;
+                sqe->user_data = first + k;
+                tail += 1;
+            }
+            __atomic_store_n(this->sqTail, tail, __ATOMIC_RELEASE);
+
+            // Submit everything and then reap completions in bulk until
+            // every read has finished.  If the ring fails, the reads that
+            // were submitted are still waited for, since the kernel
+            // writes into their buffers (and reads the iovecs) until they
+            // complete.
+            unsigned submitted = 0, completed = 0;
+            bool failed = false;
+            struct io_uring_cqe *cqes = static_cast < struct io_uring_cqe *>(this->cqes);
+            while (completed < (failed ? submitted : count))
+            {
+                int res = uringEnter(this->ring, failed ? 0 : count - submitted, 1, IORING_ENTER_GETEVENTS);
+                if (res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                {
+                    if (failed)
+                    {
+                        // We can't tell when the kernel is done with the
+                        // iovecs, so keep them until the stream is closed.
+                        Logging::showErrorW("Unable to wait for %u outstanding io_uring reads.", submitted - completed);
+                        this->stranded.insert(this->stranded.end(), iov.release());
+                        return false;
+                    }
+                    failed = true;
+                    continue;
+                }
+                if (res > 0 && !failed)
+                    submitted += res;
+
+                unsigned head = *this->cqHead;
+                unsigned ctail = __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE);
+                for (; head != ctail; head += 1)
+                {
+                    struct io_uring_cqe *cqe = &cqes[head & *this->cqMask];
+                    ReadRequest & read = reads[cqe->user_data];
+                    if (cqe->res >= 0)
+                    {
+                        // Like pread, a read may come up short, in which
+                        // case the rest is read synchronously.
+                        read.result = cqe->res;
+                        if (cqe->res > 0 && read.result < read.count)
+                        {
+                            std::streamsize rest = BlockStream::readAt(read.pos + (std::streamoff) cqe->res,
+                                                                       read.out + cqe->res, read.count - cqe->res);
+                            read.result = (rest < 0) ? -1 : read.result + rest;
+                        }
+                    }
+                    else if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+                        read.result = BlockStream::readAt(read.pos, read.out, read.count);
+                    else
+                    {
+                        Logging::showErrorW("I/O error occurred while reading from file.");
+                        this->clear(this->state | std::ios::badbit | std::ios::failbit);
+                        read.result = -1;
+                    }
+                    done[cqe->user_data] = true;
+                    completed += 1;
+                }
+                __atomic_store_n(this->cqHead, head, __ATOMIC_RELEASE);
+            }
+            return !failed;
+#else
+            return false;
+#endif
+        }
+    }
+}
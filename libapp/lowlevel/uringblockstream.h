@@ -0,0 +1,85 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_URINGBLOCKSTREAM
+#define CLASS_URINGBLOCKSTREAM
+
+#include <libapp/config.h>
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <libapp/lowlevel/blockstream.h>
+
+namespace AppLib
+{
+    namespace LowLevel
+    {
+        //! Provides offset-addressed access to a package image, issuing
+        //! batches of reads through io_uring.
+        /*!
+         * readBatch puts up to the queue depth of reads in flight with
+         * a single system call and then collects their completions
+         * together, so that a device which services requests in
+         * parallel is kept busy.  Single reads and all writes use
+         * positional I/O, the same as BlockStream.
+         *
+         * If the kernel doesn't support io_uring (or it has been
+         * disabled), the ring isn't set up and readBatch falls back to
+         * reading one request at a time.  Batches are serialized by an
+         * internal mutex, since they share the ring.
+         */
+        class UringBlockStream : public BlockStream
+        {
+              public:
+            UringBlockStream(std::string filename, uint32_t depth = URING_QUEUE_DEPTH);
+            virtual ~UringBlockStream();
+
+            virtual void readBatch(std::vector<ReadRequest> & reads);
+            virtual void close();
+
+            //! Returns whether batches are issued through io_uring, rather
+            //! than falling back to positional reads.
+            bool isAsync();
+
+              private:
+            std::mutex lock;
+            int ring;
+            uint32_t depth;
+
+            // The submission and completion queues and the submission
+            // entries, which are shared with the kernel.
+            void *sqRing;
+            size_t sqRingSize;
+            void *cqRing;
+            size_t cqRingSize;
+            void *sqes;
+            size_t sqesSize;
+            unsigned *sqTail;
+            unsigned *sqMask;
+            unsigned *cqHead;
+            unsigned *cqTail;
+            unsigned *cqMask;
+            void *cqes;
+
+            // The iovecs of reads that may still have been in flight when
+            // the ring failed, which are freed when the stream is closed.
+            std::vector<void *> stranded;
+
+            // Creates the ring, returning false (with nothing to clean
+            // up) if io_uring is not available.
+            bool setupRing();
+
+            // Unmaps and closes the ring.
+            void teardownRing();
+
+            // Submits the reads from first up to (not including) last and
+            // waits for all of them to complete.  Returns false if the
+            // ring failed, in which case the caller must read whatever
+            // is left itself; reads that were already submitted are
+            // waited for first.
+            bool submitAndWait(std::vector<ReadRequest> & reads, size_t first, size_t last, std::vector<bool> & done);
+        };
+    }
+}
+
+#endif
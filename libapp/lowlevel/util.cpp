@@ -19,29 +19,6 @@ namespace AppLib
 {
     namespace LowLevel
     {
-        void Util::seekp_ex(LowLevel::BlockStream * fd, std::streampos pos)
-        {
-            fd->clear();
-            fd->seekp(pos);
-            if (fd->fail())
-            {
-                fd->clear();
-                // This means that pos is beyond the current filesize.
-                // We need to expand the file by writing NUL characters
-                // until fd->tellp is equal to pos.
-                fd->seekp(0, std::ios::end);
-                if (fd->fail())
-                {
-                    Logging::showErrorW("Unable to expand the provided file desciptor to the desired position.");
-                }
-                char zero = 0;
-                while (fd->tellp() != pos)
-                {
-                    fd->write(&zero, 1);
-                }
-            }
-        }
-
         bool Util::fileExists(std::string filename)
         {
             struct stat file_info;
@@ -111,7 +88,7 @@ namespace AppLib
         }
 
         bool Util::createPackage(std::string path, const char* appname, const char* appver,
-                            const char* appdesc, const char* appauthor)
+                            const char* appdesc, const char* appauthor, uint32_t features)
         {
             // Open the new package.
             std::fstream * nfd = new std::fstream(path.c_str(),
@@ -122,30 +99,24 @@ namespace AppLib
                 return false;
             }
 
-            // Write out 1MB for the bootstrap area.
 #if OFFSET_BOOTSTRAP != 0
 #error The createPackage() function is written under the assumption that the bootstrap
 #error offset is 0, hence the library will not operate correctly with a different offset.
 #endif
-            for (int i = 0; i < LENGTH_BOOTSTRAP; i += 1)
-            {
-                nfd->write("\0", 1);
-            }
-
-            // Write out the INode lookup table.
-            for (int i = 0; i < LENGTH_LOOKUP / 4; i += 1)
-            {
-                if (i == 0)
-                {
-                    uint32_t pos = OFFSET_DATA;
-                    nfd->write(reinterpret_cast<char *>(&pos), 4);
-                }
-                else
-                    nfd->write("\0\0\0\0", 4);
-            }
+            // The bootstrap area is left as a hole that reads as zeros;
+            // the file is extended over it once the lookup table is
+            // written after it.
+            nfd->seekp(LENGTH_BOOTSTRAP);
+
+            // Write out the INode lookup table, which is empty apart
+            // from the root inode.
+            std::vector<char> table(LENGTH_LOOKUP, '\0');
+            uint32_t pos = OFFSET_DATA;
+            memcpy(&table[0], &pos, 4);
+            nfd->write(&table[0], table.size());
 
             // Now add the FSInfo inode at OFFSET_FSINFO.
-            INode fsnode(0, "", INodeType::INT_FSINFO);
+            FSInfo fsnode;
             fsnode.ver_major = LIBRARY_VERSION_MAJOR;
             fsnode.ver_minor = LIBRARY_VERSION_MINOR;
             fsnode.ver_revision = LIBRARY_VERSION_REVISION;
@@ -156,12 +127,10 @@ namespace AppLib
             fsnode.pos_root = OFFSET_DATA;
             fsnode.pos_freelist = 0; // The first FreeList block will automatically be
                          // created when the first block is freed.
+            fsnode.features = features;
             std::string fsnode_towrite = fsnode.getBinaryRepresentation();
+            fsnode_towrite.resize(LENGTH_FSINFO, '\0');
             nfd->write(fsnode_towrite.c_str(), fsnode_towrite.size());
-            for (int i = fsnode_towrite.size(); i < LENGTH_FSINFO; i += 1)
-            {
-                nfd->write("\0", 1);
-            }
 
             time_t rtime;
             time(&rtime);
@@ -177,11 +146,8 @@ namespace AppLib
             rnode.parent = 0;
             rnode.children_count = 0;
             std::string rnode_towrite = rnode.getBinaryRepresentation();
+            rnode_towrite.resize(BSIZE_FILE, '\0');
             nfd->write(rnode_towrite.c_str(), rnode_towrite.size());
-            for (int i = rnode_towrite.size(); i < BSIZE_FILE; i += 1)
-            {
-                nfd->write("\0", 1);
-            }
 
             nfd->close();
             delete nfd;
@@ -201,48 +167,45 @@ namespace AppLib
                 throw std::exception(); // FIXME: Appropriate message.
         }
 
+        bool Util::nextPathComponent(const std::string & path, size_t & offset, size_t & start, size_t & length)
+        {
+            while (offset < path.length() && path[offset] == '/')
+                offset += 1;
+            if (offset >= path.length())
+                return false;
+            start = offset;
+            while (offset < path.length() && path[offset] != '/')
+                offset += 1;
+            length = offset - start;
+            return true;
+        }
+
         std::vector<std::string> Util::splitPathBySeperators(std::string path)
         {
             std::vector < std::string > ret;
-            while (path[0] == '/' && path.length() > 0)
-                path = path.substr(1);
-            std::string buf = "";
-            for (unsigned int i = 0; i < path.length(); i += 1)
-            {
-                if (path[i] == '/' && buf.length() > 0)
-                {
-                    ret.insert(ret.end(), buf);
-                    buf = "";
-                }
-                else if (path[i] != '/')
-                {
-                    buf += path[i];
-                }
-            }
-            if (buf.length() > 0)
-            {
-                ret.insert(ret.end(), buf);
-                buf = "";
-            }
+            size_t offset = 0, start, length;
+            while (Util::nextPathComponent(path, offset, start, length))
+                ret.insert(ret.end(), path.substr(start, length));
             return ret;
         }
 
-        FSResult::FSResult Util::verifyPath(std::string original, std::vector<std::string>& split)
+        FSResult::FSResult Util::verifyPath(const std::string & path)
         {
-            if (original.length() >= 4096 || original.find('\0') != std::string::npos)
+            if (path.length() >= 4096 || path.find('\0') != std::string::npos)
                 return FSResult::E_FAILURE_INVALID_PATH;
-            for (std::vector < std::string >::iterator i = split.begin(); i != split.end(); i++)
-                if ((*i).length() >= 256 || (*i).find('\0') != std::string::npos)
+            size_t offset = 0, start, length;
+            while (Util::nextPathComponent(path, offset, start, length))
+                if (length >= 256)
                     return FSResult::E_FAILURE_INVALID_FILENAME;
             return FSResult::E_SUCCESS;
         }
     
-        std::string Util::extractBasenameFromPath(std::string path)
+        std::string Util::extractBasenameFromPath(const std::string & path)
         {
-            std::vector<std::string> components = Util::splitPathBySeperators(path);
-            if (components.size() == 0)
-                return "";
-            return components[components.size() - 1];
+            size_t offset = 0, start = 0, length = 0;
+            while (Util::nextPathComponent(path, offset, start, length))
+                ;
+            return path.substr(start, length);
         }
     }
 }
@@ -18,26 +18,34 @@ namespace AppLib
         class Util
         {
             public:
-                static void seekp_ex(LowLevel::BlockStream * fd, std::streampos pos);
                 static bool fileExists(std::string filename);
                 static void sanitizeArguments(char ** argv, int argc, std::string & command, int start);
                 static bool extractBootstrap(std::string source, std::string dest);
                 static char* getProcessFilename();
                 static bool createPackage(std::string path, const char* appname, const char* appver,
-                            const char* appdesc, const char* appauthor);
+                            const char* appdesc, const char* appauthor, uint32_t features = 0);
                 static int translateOpenMode(std::string mode);
 
+                /*!
+                 * Finds the next component of a path, searching from
+                 * offset.  Returns false if there are no more components;
+                 * otherwise stores where the component starts and its
+                 * length, and moves offset past it.  Nothing is copied, so
+                 * paths can be walked without allocating memory.
+                 */
+                static bool nextPathComponent(const std::string & path, size_t & offset, size_t & start, size_t & length);
+
                 //! Utility function for splitting paths into their components.
                 static std::vector<std::string> splitPathBySeperators(std::string path);
 
                 //! Utility function for verifying the validity of a supplied path.
-                static FSResult::FSResult verifyPath(std::string original, std::vector<std::string>& split);
+                static FSResult::FSResult verifyPath(const std::string & path);
 
                 /*!
                  * Extracts the basename (filename) from the specified
                  * path.
                  */
-                static std::string extractBasenameFromPath(std::string path);
+                static std::string extractBasenameFromPath(const std::string & path);
         };
     }
 }
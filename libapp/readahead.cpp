@@ -0,0 +1,47 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#include <libapp/config.h>
+
+#include <libapp/readahead.h>
+#include <algorithm>
+
+namespace AppLib
+{
+    Readahead::Readahead()
+    {
+        this->next = 0;
+        this->window = 0;
+        this->end = 0;
+    }
+
+    bool Readahead::advance(uint32_t pos, uint32_t count, uint32_t limit, uint32_t& start, uint32_t& length)
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        bool sequential = (pos == this->next);
+        this->next = pos + count;
+        if (!sequential || limit == 0 || count == 0)
+        {
+            this->window = 0;
+            this->end = 0;
+            return false;
+        }
+
+        // Only ask for more once the reader has used up half of what
+        // was read ahead, so that each request is a large one.
+        if (this->window != 0 && this->end >= this->next + this->window / 2)
+            return false;
+
+        // Start with a few reads' worth and double from there.
+        if (this->window == 0)
+            this->window = std::min<uint64_t>((uint64_t) count * 4, limit);
+        else
+            this->window = std::min<uint64_t>((uint64_t) this->window * 2, limit);
+        start = std::max(this->end, this->next);
+        uint64_t target = std::min<uint64_t>((uint64_t) this->next + this->window, MSIZE_FILE);
+        if (target <= start)
+            return false;
+        length = target - start;
+        this->end = target;
+        return true;
+    }
+}
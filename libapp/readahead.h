@@ -0,0 +1,51 @@
+/* vim: set ts=4 sw=4 tw=0 et ai :*/
+
+#ifndef CLASS_READAHEAD
+#define CLASS_READAHEAD
+
+#include <libapp/config.h>
+
+#include <mutex>
+
+namespace AppLib
+{
+    //! Detects sequential reads through a file handle and decides
+    //! how far ahead of them to read.
+    /*!
+     * Each read that starts where the previous one finished extends
+     * the pattern.  Once less than half of the window is left ahead
+     * of the reader, the next window is requested, doubling it each
+     * time up to the limit.  Any other read resets the window, so
+     * random access doesn't pull in data that won't be used.
+     *
+     * The object knows nothing about the package; the caller prefetches
+     * whatever range advance() returns.  All operations are serialized
+     * by an internal mutex, since copies of a handle that are used by
+     * different threads share one object.
+     */
+    class Readahead
+    {
+    public:
+        Readahead();
+
+        //! Records a read of count bytes at pos, returning whether the
+        //! range starting at start and length bytes long should be read
+        //! ahead.  A limit of 0 disables readahead.
+        bool advance(uint32_t pos, uint32_t count, uint32_t limit, uint32_t& start, uint32_t& length);
+
+    private:
+        Readahead(const Readahead &);
+        Readahead & operator=(const Readahead &);
+
+        std::mutex lock;
+
+        // Where the next read has to start to continue the pattern,
+        // the current size of the window and the end of the data that
+        // has already been read ahead.
+        uint32_t next;
+        uint32_t window;
+        uint32_t end;
+    };
+}
+
+#endif